@@ -120,9 +120,9 @@ public class CardEdge extends Applet
     private static final byte MAX_NUM_PINS = 8;
     
     private static final byte VERSION_PROTOCOL_MAJOR = 1;
-    private static final byte VERSION_PROTOCOL_MINOR = 1;
+    private static final byte VERSION_PROTOCOL_MINOR = 2;
     private static final byte VERSION_APPLET_MAJOR = 1;
-    private static final byte VERSION_APPLET_MINOR = 4;
+    private static final byte VERSION_APPLET_MINOR = 5;
 
     private static final short BUILDID_MAJOR = (short) 0x5875;
     private static final short BUILDID_MINOR = (short) 0x5637;
@@ -206,6 +206,7 @@ public class CardEdge extends Applet
     /* public */
     private static final byte INS_VERIFY_PIN      = (byte)0x42;
     private static final byte INS_LIST_OBJECTS    = (byte)0x58;
+    private static final byte INS_LIST_OBJECTS_BULK = (byte)0x59; // protocol 1.2
     private static final byte INS_LIST_PINS       = (byte)0x48;
     private static final byte INS_LIST_KEYS       = (byte)0x3A;
     private static final byte INS_GET_STATUS      = (byte)0x3C;
@@ -1776,6 +1777,44 @@ public class CardEdge extends Applet
 	    ISOException.throwIt(SW_SEQUENCE_END);
     }
 
+    /*
+     * The ListObjects records, as many as fit in the response. P1 = 0 starts
+     * at the first object, P1 = 1 carries on after the last one returned.
+     */
+    private void ListObjectsBulk(APDU apdu, byte buffer[])
+    {
+	if (buffer[ISO7816.OFFSET_P2] != 0)
+	    ISOException.throwIt(SW_INCORRECT_P2);
+
+	short expectedBytes = Util.makeShort(ZEROB, buffer[ISO7816.OFFSET_LC]);
+
+	if (expectedBytes == 0)
+	    expectedBytes = 256;
+	if (expectedBytes > (short)buffer.length)
+	    expectedBytes = (short)buffer.length;
+	if (expectedBytes < ObjectManager.RECORD_SIZE)
+	    ISOException.throwIt(ISO7816.SW_WRONG_LENGTH);
+
+	boolean found = false;
+
+	if (buffer[ISO7816.OFFSET_P1] == 0)
+	    found = om.getFirstRecord(buffer, ZEROS);
+	else
+	if (buffer[ISO7816.OFFSET_P1] != 1)
+	    ISOException.throwIt(SW_INCORRECT_P1);
+	else
+	    found = om.getNextRecord(buffer, ZEROS);
+	if (!found)
+	    ISOException.throwIt(SW_SEQUENCE_END);
+
+	short len = ObjectManager.RECORD_SIZE;
+
+	while ((short)(len + ObjectManager.RECORD_SIZE) <= expectedBytes &&
+					om.getNextRecord(buffer, len))
+	    len += ObjectManager.RECORD_SIZE;
+	apdu.setOutgoingAndSend((short)0, len);
+    }
+
     private void ListPINs(APDU apdu, byte buffer[])
     {
 	if (buffer[ISO7816.OFFSET_P1] != 0)
@@ -3026,6 +3065,10 @@ public class CardEdge extends Applet
 	    ListObjects(apdu, buffer);
 	    break;
 
+	case INS_LIST_OBJECTS_BULK:
+	    ListObjectsBulk(apdu, buffer);
+	    break;
+
 	case INS_LIST_KEYS:
 	    ListKeys(apdu, buffer);
 	    break;
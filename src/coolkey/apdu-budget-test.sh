@@ -0,0 +1,52 @@
+#!/bin/sh
+# ***** BEGIN COPYRIGHT BLOCK *****
+# This library is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation version
+# 2.1 of the License.
+#
+# This library is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public
+# License along with this library; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+# ***** END COPYRIGHT BLOCK *****
+
+# Replay the recorded cards in apdu-fixtures through coolkey-bench and
+# hold every scenario to apdu-budgets.txt. A scenario over its budget
+# prints its APDUs as a diff against the recorded baseline.
+
+srcdir=${srcdir:-.}
+fixtures=$srcdir/apdu-fixtures
+work=`mktemp -d` || exit 1
+trap 'rm -rf "$work"' 0
+failed=0
+
+for apdu in "$fixtures"/*.apdu; do
+    card=`basename "$apdu" .apdu`
+    case $card in
+    *-ec) scenarios="init-cold init-warm slots login find attr sign derive wait" ;;
+    *) scenarios="init-cold init-warm slots login find attr sign decrypt wait" ;;
+    esac
+    rm -rf "$work/cache"
+    mkdir "$work/cache"
+    CKY_APDU_REPLAY_FILE=$apdu \
+    CKY_APDU_REPLAY_SCALE=0 \
+    CKY_APDU_RECORD_FILE=$work/$card.apdu \
+    COOL_KEY_CACHE_DIR=$work/cache \
+	./coolkey-bench -m .libs/libcoolkeypk11.so -n 3 -t 1 -p 12345678 \
+	    -b "$srcdir/apdu-budgets.txt" -c `echo $card | sed 's/-.*//'` \
+	    -B "$fixtures/$card.seq" $scenarios > "$work/$card.json"
+    status=$?
+    if [ $status -ne 0 ] || grep -q '"errors":[1-9]' "$work/$card.json"; then
+	echo "FAIL: $card (exit $status)"
+	cat "$work/$card.json"
+	failed=1
+    else
+	echo "PASS: $card"
+    fi
+done
+exit $failed
@@ -0,0 +1,123 @@
+#!/bin/sh
+# ***** BEGIN COPYRIGHT BLOCK *****
+# This library is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation version
+# 2.1 of the License.
+#
+# This library is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public
+# License along with this library; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+# ***** END COPYRIGHT BLOCK *****
+
+# Record every card in this directory against mock-pcscd, and write the
+# APDU budgets from what they sent.
+#
+#   record.sh builddir [card ...]
+#
+# builddir is the top of a configured and built tree, with mock-pcscd
+# built (make -C src/libckyapplet mock-pcscd). For each card.card this
+# writes card.apdu, the recording apdu-budget-test replays, and card.seq,
+# the baseline coolkey-bench -B diffs a failing scenario against. Then
+# ../apdu-budgets.txt is rewritten with the highest APDUs and transactions
+# per operation any card of a type sent. Rerun it and commit the result
+# whenever a change alters the APDUs a scenario sends.
+
+PIN=12345678
+ITERATIONS=3
+
+builddir=`cd "${1:?usage: record.sh builddir [card ...]}" && pwd` || exit 1
+shift
+fixtures=`cd \`dirname "$0"\` && pwd`
+bench=$builddir/src/coolkey/coolkey-bench
+module=$builddir/src/coolkey/.libs/libcoolkeypk11.so
+mock=$builddir/src/libckyapplet/mock-pcscd
+work=`mktemp -d` || exit 1
+trap 'rm -rf "$work"' 0
+
+# scenarios a card runs, EC cards derive instead of decrypting
+scenarios() {
+    case $1 in
+    *-ec) echo init-cold init-warm slots login find attr sign derive wait ;;
+    *) echo init-cold init-warm slots login find attr sign decrypt wait ;;
+    esac
+}
+
+if [ $# -eq 0 ]; then
+    set -- `cd "$fixtures" && ls *.card | sed 's/\.card$//'`
+fi
+
+for card in "$@"; do
+    rm -rf "$work/cache" "$work/sock"
+    mkdir "$work/cache"
+    "$mock" "$work/sock" "Mock Reader=$fixtures/$card.card" &
+    mockpid=$!
+    sleep 1
+    CKY_PCSCD_SOCKET=$work/sock \
+    CKY_APDU_RECORD_FILE=$fixtures/$card.apdu \
+    COOL_KEY_CACHE_DIR=$work/cache \
+	"$bench" -m "$module" -n $ITERATIONS -t 1 -p $PIN \
+	    -W "$fixtures/$card.seq" `scenarios $card` > "$work/$card.json"
+    status=$?
+    kill $mockpid
+    wait $mockpid 2>/dev/null
+    if [ $status -ne 0 ] || grep -q '"errors":[1-9]' "$work/$card.json"; then
+	echo "$card: coolkey-bench failed" >&2
+	cat "$work/$card.json" >&2
+	exit 1
+    fi
+    echo "recorded $card"
+done
+
+# the per-operation cost of each scenario that goes to the card, the most
+# any card of a type (the name up to the first -) sent
+cd "$fixtures"
+for seq in *.seq; do
+    awk -v type=`echo $seq | sed 's/[-.].*//'` \
+	'$1 == "scenario" { print type, $2, $6 / $4, $8 / $4 }' $seq
+done | awk '
+    $3 > 0 {
+	key = $1 "\t" $2
+	if (!(key in apdus) || $3 > apdus[key]) apdus[key] = $3
+	if (!(key in transactions) || $4 > transactions[key]) {
+	    transactions[key] = $4
+	}
+    }
+    END {
+	for (key in apdus) {
+	    printf "%s\t%.2f\t%.2f\n", key, apdus[key], transactions[key]
+	}
+    }' | sort > "$work/budgets"
+
+order="init-cold init-warm login sign decrypt derive"
+{
+    cat <<'EOF'
+# APDU budgets for coolkey-bench -b, per operation of each scenario.
+#
+# cardType scenario apdusPerOp transactionsPerOp
+#
+# cardType is what's passed with -c, "*" matches any card. Scenarios
+# which don't need the card (slots, find, attr, wait) must stay at zero:
+# they are answered from the objects loaded at insertion.
+#
+# Written by apdu-fixtures/record.sh from the recorded fixtures, the most
+# any card of the type sent; make check replays them against this file.
+# When a change alters the traffic for a scenario, rerun record.sh and
+# commit the new recordings with the budgets, so a saving can't quietly
+# regress and a cost is seen in review.
+
+*	slots	0	0
+*	find	0	0
+*	attr	0	0
+*	wait	0	0
+EOF
+    for scenario in $order; do
+	echo
+	awk -v s=$scenario '$2 == s' "$work/budgets"
+    done
+} > ../apdu-budgets.txt
@@ -0,0 +1,233 @@
+/* ***** BEGIN COPYRIGHT BLOCK *****
+ * Copyright (C) 2005 Red Hat, Inc.
+ * All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation version
+ * 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ * ***** END COPYRIGHT BLOCK *****/
+
+/*
+ * broker-test: exercise the coolkeyd wire protocol against a stand-in
+ * daemon, no module or card needed. Run by make check.
+ *
+ * The stand-in serves one client on a private socket and answers just
+ * the calls the checks below make.
+ */
+#include "mypkcs11.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "PKCS11Exception.h"
+#include "broker.h"
+
+static int failures;
+
+#define CHECK(cond) \
+    do { if (!(cond)) { \
+	fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond);\
+	failures++; } } while (0)
+
+// random bytes handed out so far, so the client's pieces can be checked
+// to join up
+static unsigned long randomCounter;
+static unsigned long randomCalls;
+
+static void *
+fakeDaemon(void *arg)
+{
+    int listenFd = (int)(long)arg;
+    int fd = accept(listenFd, NULL, NULL);
+    BrokerMessage request, response;
+    CK_BYTE out[BROKER_MAX_OUTPUT];
+
+    if (fd < 0) {
+	return NULL;
+    }
+    while (request.receive(fd)) {
+	response.clear();
+	try {
+	    CK_ULONG function = request.getULong();
+	    CK_ULONG present, len, i;
+
+	    switch (function) {
+	    case BrokerHello:
+		response.putULong(request.getULong() == BROKER_VERSION ?
+				CKR_OK : CKR_FUNCTION_NOT_SUPPORTED);
+		break;
+	    case BrokerGenerateRandom:
+		request.getULong(); // session
+		request.getBytes(&len);
+		present = request.getULong();
+		len = request.getULong();
+		randomCalls++;
+		if (!present || len > BROKER_MAX_OUTPUT) {
+		    response.putULong(CKR_ARGUMENTS_BAD);
+		    break;
+		}
+		for (i = 0; i < len; i++) {
+		    out[i] = (CK_BYTE)(randomCounter++ & 0xff);
+		}
+		response.putULong(CKR_OK);
+		response.putBytes(out, len);
+		response.putULong(len);
+		break;
+	    case BrokerCloseSession:
+		// a truncated answer: no return code at all
+		break;
+	    default:
+		response.putULong(CKR_OK);
+		break;
+	    }
+	} catch (PKCS11Exception &) {
+	    response.clear();
+	    response.putULong(CKR_GENERAL_ERROR);
+	}
+	if (!response.send(fd)) {
+	    break;
+	}
+    }
+    close(fd);
+    return NULL;
+}
+
+static void
+testMessage()
+{
+    BrokerMessage msg;
+    CK_BYTE bytes[] = { 1, 2, 3, 4, 5 };
+    const CK_BYTE *got;
+    CK_ULONG len;
+    CK_ATTRIBUTE attr = { CKA_LABEL, bytes, sizeof(bytes) };
+
+    msg.putULong(0x12345678);
+    msg.putULong(CK_UNAVAILABLE_INFORMATION);
+    msg.putBytes(bytes, sizeof(bytes));
+    msg.putTemplate(&attr, 1);
+
+    CHECK(msg.getULong() == 0x12345678);
+    CHECK(msg.getULong() == CK_UNAVAILABLE_INFORMATION);
+    got = msg.getBytes(&len);
+    CHECK(len == sizeof(bytes) && memcmp(got, bytes, len) == 0);
+    CHECK(msg.getULong() == 1);
+    CHECK(msg.getULong() == CKA_LABEL);
+    got = msg.getBytes(&len);
+    CHECK(len == sizeof(bytes) && memcmp(got, bytes, len) == 0);
+
+    // reading past the end must throw, not return junk
+    bool threw = false;
+    try {
+	msg.getULong();
+    } catch (PKCS11Exception &) {
+	threw = true;
+    }
+    CHECK(threw);
+}
+
+struct CloseArgs {
+    BrokerClient *client;
+    CK_RV crv;
+};
+
+static void *
+closeSession(void *arg)
+{
+    CloseArgs *args = (CloseArgs *)arg;
+
+    args->crv = args->client->closeSession(1);
+    return NULL;
+}
+
+static void
+testClient(const char *socketName)
+{
+    BrokerClient *client = BrokerClient::connect(socketName);
+    CK_ULONG size = 3 * BROKER_MAX_OUTPUT + 100;
+    CK_BYTE *buf;
+    CK_ULONG i;
+
+    CHECK(client != NULL);
+    if (!client) {
+	return;
+    }
+
+    // more than the daemon fills per call: every byte must still arrive
+    buf = (CK_BYTE *)calloc(1, size);
+    CHECK(client->generateRandom(1, buf, size) == CKR_OK);
+    CHECK(randomCalls == 4);
+    for (i = 0; i < size && buf[i] == (CK_BYTE)(i & 0xff); i++)
+	;
+    CHECK(i == size);
+    free(buf);
+
+    // a broken answer is an error return, and the client lock comes back:
+    // a second thread can still get through
+    CloseArgs args = { client, CKR_OK };
+    pthread_t thread;
+
+    closeSession(&args);
+    CHECK(args.crv == CKR_DEVICE_ERROR);
+    args.crv = CKR_OK;
+    pthread_create(&thread, NULL, closeSession, &args);
+    pthread_join(thread, NULL);
+    CHECK(args.crv == CKR_DEVICE_ERROR);
+    CHECK(client->logout(1) == CKR_OK);
+
+    delete client;
+}
+
+int
+main(int argc, char **argv)
+{
+    struct sockaddr_un addr;
+    char socketName[64];
+    pthread_t daemon;
+    int listenFd;
+
+    // a leaked lock shows up as a hang, don't wait forever for it
+    alarm(30);
+    OSLock::setThreadSafe(true);
+
+    testMessage();
+
+    snprintf(socketName, sizeof(socketName), "/tmp/broker-test-%d", 
+							(int)getpid());
+    listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socketName);
+    unlink(socketName);
+    if (listenFd < 0 || bind(listenFd, (struct sockaddr *)&addr, 
+					sizeof(addr)) < 0 ||
+					listen(listenFd, 1) < 0) {
+	perror(socketName);
+	return 1;
+    }
+    pthread_create(&daemon, NULL, fakeDaemon, (void *)(long)listenFd);
+    testClient(socketName);
+    pthread_join(daemon, NULL);
+    close(listenFd);
+    unlink(socketName);
+
+    if (failures) {
+	fprintf(stderr, "broker-test: %d failures\n", failures);
+	return 1;
+    }
+    printf("broker-test: ok\n");
+    return 0;
+}
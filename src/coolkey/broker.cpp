@@ -0,0 +1,1057 @@
+/* ***** BEGIN COPYRIGHT BLOCK *****
+ * Copyright (C) 2005 Red Hat, Inc.
+ * All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation version
+ * 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ * ***** END COPYRIGHT BLOCK *****/
+
+#include "mypkcs11.h"
+#include <string.h>
+#include <stdlib.h>
+#ifndef _WIN32
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
+#include "PKCS11Exception.h"
+#include "broker.h"
+#include "cipher.h"
+
+#define BROKER_UNAVAILABLE 0xffffffff
+
+//
+// message encoding
+//
+void
+BrokerMessage::need(CKYSize size)
+{
+    if (offset + size > CKYBuffer_Size(&data)) {
+	throw PKCS11Exception(CKR_DEVICE_ERROR, "short broker message");
+    }
+}
+
+void
+BrokerMessage::putULong(CK_ULONG val)
+{
+    CKYBuffer_AppendLongLE(&data, 
+		(val == CK_UNAVAILABLE_INFORMATION) ? BROKER_UNAVAILABLE : val);
+}
+
+void
+BrokerMessage::putBytes(const CK_BYTE *bytes, CK_ULONG len)
+{
+    putULong(len);
+    CKYBuffer_AppendData(&data, bytes, len);
+}
+
+void
+BrokerMessage::putOutput(const CK_BYTE *buf, CK_ULONG len)
+{
+    putULong(buf ? 1 : 0);
+    putULong(len);
+}
+
+void
+BrokerMessage::putTemplate(const CK_ATTRIBUTE *pTemplate, CK_ULONG count)
+{
+    CK_ULONG i;
+
+    putULong(count);
+    for (i = 0; i < count; i++) {
+	putULong(pTemplate[i].type);
+	putBytes((const CK_BYTE *)pTemplate[i].pValue, 
+				pTemplate[i].pValue ? pTemplate[i].ulValueLen : 0);
+    }
+}
+
+void
+BrokerMessage::putMechanism(const CK_MECHANISM *pMechanism)
+{
+    putULong(pMechanism->mechanism);
+    // parameters with pointers in them have to be taken apart
+    if (pMechanism->mechanism == CKM_ECDH1_DERIVE && pMechanism->pParameter) {
+	const CK_ECDH1_DERIVE_PARAMS *params = 
+			(const CK_ECDH1_DERIVE_PARAMS *)pMechanism->pParameter;
+	putULong(params->kdf);
+	putBytes(params->pSharedData, params->ulSharedDataLen);
+	putBytes(params->pPublicData, params->ulPublicDataLen);
+	return;
+    }
+    CK_GCM_PARAMS gcm;
+    if (pMechanism->mechanism == CKM_AES_GCM &&
+				getGCMParams(pMechanism, &gcm)) {
+	putBytes(gcm.pIv, gcm.ulIvLen);
+	putBytes(gcm.pAAD, gcm.ulAADLen);
+	putULong(gcm.ulTagBits);
+	return;
+    }
+    putBytes((const CK_BYTE *)pMechanism->pParameter, 
+		pMechanism->pParameter ? pMechanism->ulParameterLen : 0);
+}
+
+CK_ULONG
+BrokerMessage::getULong()
+{
+    unsigned long val;
+
+    need(4);
+    val = CKYBuffer_GetLongLE(&data, offset);
+    offset += 4;
+    return (val == BROKER_UNAVAILABLE) ? CK_UNAVAILABLE_INFORMATION : val;
+}
+
+const CK_BYTE *
+BrokerMessage::getBytes(CK_ULONG *len)
+{
+    const CK_BYTE *bytes;
+
+    *len = getULong();
+    need(*len);
+    bytes = CKYBuffer_Data(&data) + offset;
+    offset += *len;
+    return bytes;
+}
+
+//
+// the response to putOutput: the length, and the data if the caller
+// supplied a buffer
+//
+void
+BrokerMessage::getOutput(CK_BYTE_PTR buf, CK_ULONG_PTR pLen)
+{
+    CK_ULONG len;
+    const CK_BYTE *bytes = getBytes(&len);
+    CK_ULONG outLen = getULong();
+
+    if (buf && len) {
+	if (len > *pLen) {
+	    throw PKCS11Exception(CKR_DEVICE_ERROR, "broker overran buffer");
+	}
+	memcpy(buf, bytes, len);
+    }
+    *pLen = outLen;
+}
+
+#ifndef _WIN32
+static bool
+ioAll(int fd, CKYByte *buf, size_t len, bool writing)
+{
+    while (len) {
+	ssize_t n = writing ? write(fd, buf, len) : read(fd, buf, len);
+	if (n < 0 && errno == EINTR) {
+	    continue;
+	}
+	if (n <= 0) {
+	    return false;
+	}
+	buf += n;
+	len -= n;
+    }
+    return true;
+}
+
+bool
+BrokerMessage::send(int fd) const
+{
+    CKYByte header[4];
+    CKYSize size = CKYBuffer_Size(&data);
+
+    header[0] = size & 0xff;
+    header[1] = (size >> 8) & 0xff;
+    header[2] = (size >> 16) & 0xff;
+    header[3] = (size >> 24) & 0xff;
+    return ioAll(fd, header, sizeof(header), true) &&
+	ioAll(fd, (CKYByte *)CKYBuffer_Data(&data), size, true);
+}
+
+bool
+BrokerMessage::receive(int fd)
+{
+    CKYByte header[4];
+    CKYSize size;
+
+    clear();
+    if (!ioAll(fd, header, sizeof(header), false)) {
+	return false;
+    }
+    size = header[0] | (header[1] << 8) | (header[2] << 16) | 
+						((CKYSize)header[3] << 24);
+    if (size > BROKER_MAX_MESSAGE || 
+			CKYBuffer_Resize(&data, size) != CKYSUCCESS) {
+	return false;
+    }
+    return ioAll(fd, (CKYByte *)CKYBuffer_Data(&data), size, false);
+}
+#else
+bool
+BrokerMessage::send(int fd) const
+{
+    return false;
+}
+
+bool
+BrokerMessage::receive(int fd)
+{
+    return false;
+}
+#endif
+
+//
+// the client
+//
+BrokerClient::BrokerClient(int fd_) : fd(fd_), lock(true)
+{
+}
+
+BrokerClient::~BrokerClient()
+{
+#ifndef _WIN32
+    if (fd >= 0) {
+	close(fd);
+    }
+#endif
+}
+
+BrokerClient *
+BrokerClient::connect(const char *socketName)
+{
+#ifndef _WIN32
+    struct sockaddr_un addr;
+    BrokerClient *client;
+    int fd;
+
+    if (strlen(socketName) >= sizeof(addr.sun_path)) {
+	return NULL;
+    }
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+	return NULL;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socketName);
+    if (::connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+	close(fd);
+	return NULL;
+    }
+    client = new BrokerClient(fd);
+
+    // make sure we are talking the same protocol
+    client->request.putULong(BrokerHello);
+    client->request.putULong(BROKER_VERSION);
+    if (client->call() != CKR_OK) {
+	delete client;
+	return NULL;
+    }
+    return client;
+#else
+    return NULL;
+#endif
+}
+
+//
+// wake up anyone waiting on the broker, used by C_Finalize
+//
+void
+BrokerClient::shutdown()
+{
+#ifndef _WIN32
+    ::shutdown(fd, SHUT_RDWR);
+#endif
+}
+
+//
+// send the request and wait for the response. The caller holds the lock
+// and parses the rest of the response.
+//
+CK_RV
+BrokerClient::call()
+{
+    bool ok = request.send(fd) && response.receive(fd);
+
+    request.clear();
+    if (!ok) {
+	return CKR_DEVICE_ERROR;
+    }
+    return response.getULong();
+}
+
+CK_RV
+BrokerClient::simpleCall(BrokerFunction function, CK_ULONG arg)
+{
+    CK_RV crv;
+
+    lock.getLock();
+    try {
+	request.putULong(function);
+	request.putULong(arg);
+	crv = call();
+    } catch (PKCS11Exception &e) {
+	crv = e.getCRV();
+    }
+    lock.releaseLock();
+    return crv;
+}
+
+CK_RV
+BrokerClient::callWithOutput(BrokerFunction function, CK_ULONG arg,
+	const CK_BYTE *in, CK_ULONG inLen, CK_BYTE_PTR out, CK_ULONG_PTR pOutLen)
+{
+    CK_RV crv;
+
+    lock.getLock();
+    try {
+	request.putULong(function);
+	request.putULong(arg);
+	request.putBytes(in, inLen);
+	request.putOutput(out, *pOutLen);
+	crv = call();
+	if (crv == CKR_OK || crv == CKR_BUFFER_TOO_SMALL) {
+	    response.getOutput(out, pOutLen);
+	}
+    } catch (PKCS11Exception &e) {
+	crv = e.getCRV();
+    }
+    lock.releaseLock();
+    return crv;
+}
+
+CK_RV
+BrokerClient::mechanismInit(BrokerFunction function, CK_SESSION_HANDLE hSession,
+	CK_MECHANISM_PTR pMechanism, CK_OBJECT_HANDLE hKey)
+{
+    CK_RV crv;
+
+    if (pMechanism == NULL) {
+	return CKR_ARGUMENTS_BAD;
+    }
+    lock.getLock();
+    try {
+	request.putULong(function);
+	request.putULong(hSession);
+	request.putMechanism(pMechanism);
+	request.putULong(hKey);
+	crv = call();
+    } catch (PKCS11Exception &e) {
+	crv = e.getCRV();
+    }
+    lock.releaseLock();
+    return crv;
+}
+
+static void
+copyPadded(CK_UTF8CHAR *dest, CK_ULONG destLen, const CK_BYTE *src,
+							CK_ULONG srcLen)
+{
+    memset(dest, ' ', destLen);
+    memcpy(dest, src, srcLen < destLen ? srcLen : destLen);
+}
+
+CK_RV
+BrokerClient::getInfo(CK_INFO_PTR pInfo)
+{
+    CK_RV crv;
+    CK_ULONG len;
+    const CK_BYTE *bytes;
+
+    lock.getLock();
+    try {
+	request.putULong(BrokerGetInfo);
+	crv = call();
+	if (crv == CKR_OK) {
+	    pInfo->cryptokiVersion.major = response.getULong();
+	    pInfo->cryptokiVersion.minor = response.getULong();
+	    bytes = response.getBytes(&len);
+	    copyPadded(pInfo->manufacturerID, sizeof(pInfo->manufacturerID),
+							bytes, len);
+	    pInfo->flags = response.getULong();
+	    bytes = response.getBytes(&len);
+	    copyPadded(pInfo->libraryDescription, 
+			sizeof(pInfo->libraryDescription), bytes, len);
+	    pInfo->libraryVersion.major = response.getULong();
+	    pInfo->libraryVersion.minor = response.getULong();
+	}
+    } catch (PKCS11Exception &e) {
+	crv = e.getCRV();
+    }
+    lock.releaseLock();
+    return crv;
+}
+
+CK_RV
+BrokerClient::getSlotList(CK_BBOOL tokenPresent, CK_SLOT_ID_PTR pSlotList,
+	CK_ULONG_PTR pulCount)
+{
+    CK_RV crv;
+    CK_ULONG i, count;
+
+    lock.getLock();
+    try {
+	request.putULong(BrokerGetSlotList);
+	request.putULong(tokenPresent);
+	request.putOutput((CK_BYTE *)pSlotList, *pulCount);
+	crv = call();
+	if (crv == CKR_OK || crv == CKR_BUFFER_TOO_SMALL) {
+	    count = response.getULong();
+	    if (pSlotList && crv == CKR_OK) {
+		if (count > *pulCount) {
+		    throw PKCS11Exception(CKR_DEVICE_ERROR);
+		}
+		for (i = 0; i < count; i++) {
+		    pSlotList[i] = response.getULong();
+		}
+	    }
+	    *pulCount = count;
+	}
+    } catch (PKCS11Exception &e) {
+	crv = e.getCRV();
+    }
+    lock.releaseLock();
+    return crv;
+}
+
+CK_RV
+BrokerClient::getSlotInfo(CK_SLOT_ID slotID, CK_SLOT_INFO_PTR pInfo)
+{
+    CK_RV crv;
+    CK_ULONG len;
+    const CK_BYTE *bytes;
+
+    lock.getLock();
+    try {
+	request.putULong(BrokerGetSlotInfo);
+	request.putULong(slotID);
+	crv = call();
+	if (crv == CKR_OK) {
+	    bytes = response.getBytes(&len);
+	    copyPadded(pInfo->slotDescription, sizeof(pInfo->slotDescription),
+							bytes, len);
+	    bytes = response.getBytes(&len);
+	    copyPadded(pInfo->manufacturerID, sizeof(pInfo->manufacturerID),
+							bytes, len);
+	    pInfo->flags = response.getULong();
+	    pInfo->hardwareVersion.major = response.getULong();
+	    pInfo->hardwareVersion.minor = response.getULong();
+	    pInfo->firmwareVersion.major = response.getULong();
+	    pInfo->firmwareVersion.minor = response.getULong();
+	}
+    } catch (PKCS11Exception &e) {
+	crv = e.getCRV();
+    }
+    lock.releaseLock();
+    return crv;
+}
+
+CK_RV
+BrokerClient::getTokenInfo(CK_SLOT_ID slotID, CK_TOKEN_INFO_PTR pInfo)
+{
+    CK_RV crv;
+    CK_ULONG len;
+    const CK_BYTE *bytes;
+
+    lock.getLock();
+    try {
+	request.putULong(BrokerGetTokenInfo);
+	request.putULong(slotID);
+	crv = call();
+	if (crv == CKR_OK) {
+	    bytes = response.getBytes(&len);
+	    copyPadded(pInfo->label, sizeof(pInfo->label), bytes, len);
+	    bytes = response.getBytes(&len);
+	    copyPadded(pInfo->manufacturerID, sizeof(pInfo->manufacturerID),
+							bytes, len);
+	    bytes = response.getBytes(&len);
+	    copyPadded(pInfo->model, sizeof(pInfo->model), bytes, len);
+	    bytes = response.getBytes(&len);
+	    copyPadded((CK_UTF8CHAR *)pInfo->serialNumber, 
+				sizeof(pInfo->serialNumber), bytes, len);
+	    pInfo->flags = response.getULong();
+	    pInfo->ulMaxSessionCount = response.getULong();
+	    pInfo->ulSessionCount = response.getULong();
+	    pInfo->ulMaxRwSessionCount = response.getULong();
+	    pInfo->ulRwSessionCount = response.getULong();
+	    pInfo->ulMaxPinLen = response.getULong();
+	    pInfo->ulMinPinLen = response.getULong();
+	    pInfo->ulTotalPublicMemory = response.getULong();
+	    pInfo->ulFreePublicMemory = response.getULong();
+	    pInfo->ulTotalPrivateMemory = response.getULong();
+	    pInfo->ulFreePrivateMemory = response.getULong();
+	    pInfo->hardwareVersion.major = response.getULong();
+	    pInfo->hardwareVersion.minor = response.getULong();
+	    pInfo->firmwareVersion.major = response.getULong();
+	    pInfo->firmwareVersion.minor = response.getULong();
+	    bytes = response.getBytes(&len);
+	    copyPadded((CK_UTF8CHAR *)pInfo->utcTime, sizeof(pInfo->utcTime),
+							bytes, len);
+	}
+    } catch (PKCS11Exception &e) {
+	crv = e.getCRV();
+    }
+    lock.releaseLock();
+    return crv;
+}
+
+CK_RV
+BrokerClient::getMechanismList(CK_SLOT_ID slotID, CK_MECHANISM_TYPE_PTR pList,
+	CK_ULONG_PTR pulCount)
+{
+    CK_RV crv;
+    CK_ULONG i, count;
+
+    lock.getLock();
+    try {
+	request.putULong(BrokerGetMechanismList);
+	request.putULong(slotID);
+	request.putOutput((CK_BYTE *)pList, *pulCount);
+	crv = call();
+	if (crv == CKR_OK || crv == CKR_BUFFER_TOO_SMALL) {
+	    count = response.getULong();
+	    if (pList && crv == CKR_OK) {
+		if (count > *pulCount) {
+		    throw PKCS11Exception(CKR_DEVICE_ERROR);
+		}
+		for (i = 0; i < count; i++) {
+		    pList[i] = response.getULong();
+		}
+	    }
+	    *pulCount = count;
+	}
+    } catch (PKCS11Exception &e) {
+	crv = e.getCRV();
+    }
+    lock.releaseLock();
+    return crv;
+}
+
+CK_RV
+BrokerClient::getMechanismInfo(CK_SLOT_ID slotID, CK_MECHANISM_TYPE type,
+	CK_MECHANISM_INFO_PTR pInfo)
+{
+    CK_RV crv;
+
+    lock.getLock();
+    try {
+	request.putULong(BrokerGetMechanismInfo);
+	request.putULong(slotID);
+	request.putULong(type);
+	crv = call();
+	if (crv == CKR_OK) {
+	    pInfo->ulMinKeySize = response.getULong();
+	    pInfo->ulMaxKeySize = response.getULong();
+	    pInfo->flags = response.getULong();
+	}
+    } catch (PKCS11Exception &e) {
+	crv = e.getCRV();
+    }
+    lock.releaseLock();
+    return crv;
+}
+
+CK_RV
+BrokerClient::openSession(CK_SLOT_ID slotID, CK_FLAGS flags,
+	CK_SESSION_HANDLE_PTR phSession)
+{
+    CK_RV crv;
+
+    lock.getLock();
+    try {
+	request.putULong(BrokerOpenSession);
+	request.putULong(slotID);
+	request.putULong(flags);
+	crv = call();
+	if (crv == CKR_OK) {
+	    *phSession = response.getULong();
+	}
+    } catch (PKCS11Exception &e) {
+	crv = e.getCRV();
+    }
+    lock.releaseLock();
+    return crv;
+}
+
+CK_RV
+BrokerClient::closeSession(CK_SESSION_HANDLE hSession)
+{
+    return simpleCall(BrokerCloseSession, hSession);
+}
+
+CK_RV
+BrokerClient::closeAllSessions(CK_SLOT_ID slotID)
+{
+    return simpleCall(BrokerCloseAllSessions, slotID);
+}
+
+CK_RV
+BrokerClient::getSessionInfo(CK_SESSION_HANDLE hSession,
+	CK_SESSION_INFO_PTR pInfo)
+{
+    CK_RV crv;
+
+    lock.getLock();
+    try {
+	request.putULong(BrokerGetSessionInfo);
+	request.putULong(hSession);
+	crv = call();
+	if (crv == CKR_OK) {
+	    pInfo->slotID = response.getULong();
+	    pInfo->state = response.getULong();
+	    pInfo->flags = response.getULong();
+	    pInfo->ulDeviceError = response.getULong();
+	}
+    } catch (PKCS11Exception &e) {
+	crv = e.getCRV();
+    }
+    lock.releaseLock();
+    return crv;
+}
+
+CK_RV
+BrokerClient::login(CK_SESSION_HANDLE hSession, CK_USER_TYPE userType,
+	CK_UTF8CHAR_PTR pPin, CK_ULONG ulPinLen)
+{
+    CK_RV crv;
+
+    lock.getLock();
+    try {
+	request.putULong(BrokerLogin);
+	request.putULong(hSession);
+	request.putULong(userType);
+	request.putBytes(pPin, pPin ? ulPinLen : 0);
+	crv = call();
+    } catch (PKCS11Exception &e) {
+	crv = e.getCRV();
+    }
+    lock.releaseLock();
+    return crv;
+}
+
+CK_RV
+BrokerClient::logout(CK_SESSION_HANDLE hSession)
+{
+    return simpleCall(BrokerLogout, hSession);
+}
+
+CK_RV
+BrokerClient::findObjectsInit(CK_SESSION_HANDLE hSession,
+	CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount)
+{
+    CK_RV crv;
+
+    lock.getLock();
+    try {
+	request.putULong(BrokerFindObjectsInit);
+	request.putULong(hSession);
+	request.putTemplate(pTemplate, pTemplate ? ulCount : 0);
+	crv = call();
+    } catch (PKCS11Exception &e) {
+	crv = e.getCRV();
+    }
+    lock.releaseLock();
+    return crv;
+}
+
+CK_RV
+BrokerClient::findObjects(CK_SESSION_HANDLE hSession, 
+	CK_OBJECT_HANDLE_PTR phObject, CK_ULONG ulMaxObjectCount,
+	CK_ULONG_PTR pulObjectCount)
+{
+    CK_RV crv;
+    CK_ULONG i, count;
+
+    lock.getLock();
+    try {
+	request.putULong(BrokerFindObjects);
+	request.putULong(hSession);
+	request.putULong(ulMaxObjectCount);
+	crv = call();
+	if (crv == CKR_OK) {
+	    count = response.getULong();
+	    if (count > ulMaxObjectCount) {
+		throw PKCS11Exception(CKR_DEVICE_ERROR);
+	    }
+	    for (i = 0; i < count; i++) {
+		phObject[i] = response.getULong();
+	    }
+	    *pulObjectCount = count;
+	}
+    } catch (PKCS11Exception &e) {
+	crv = e.getCRV();
+    }
+    lock.releaseLock();
+    return crv;
+}
+
+CK_RV
+BrokerClient::findObjectsFinal(CK_SESSION_HANDLE hSession)
+{
+    return simpleCall(BrokerFindObjectsFinal, hSession);
+}
+
+CK_RV
+BrokerClient::getAttributeValue(CK_SESSION_HANDLE hSession,
+	CK_OBJECT_HANDLE hObject, CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount)
+{
+    CK_RV crv;
+    CK_ULONG i;
+
+    lock.getLock();
+    try {
+	request.putULong(BrokerGetAttributeValue);
+	request.putULong(hSession);
+	request.putULong(hObject);
+	request.putULong(ulCount);
+	for (i = 0; i < ulCount; i++) {
+	    request.putULong(pTemplate[i].type);
+	    request.putOutput((CK_BYTE *)pTemplate[i].pValue, 
+						pTemplate[i].ulValueLen);
+	}
+	crv = call();
+	// these three still return the lengths of every attribute
+	if (crv == CKR_OK || crv == CKR_ATTRIBUTE_SENSITIVE || 
+		crv == CKR_ATTRIBUTE_TYPE_INVALID || 
+		crv == CKR_BUFFER_TOO_SMALL) {
+	    for (i = 0; i < ulCount; i++) {
+		response.getOutput((CK_BYTE *)pTemplate[i].pValue,
+						&pTemplate[i].ulValueLen);
+	    }
+	}
+    } catch (PKCS11Exception &e) {
+	crv = e.getCRV();
+    }
+    lock.releaseLock();
+    return crv;
+}
+
+CK_RV
+BrokerClient::signInit(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism,
+	CK_OBJECT_HANDLE hKey)
+{
+    return mechanismInit(BrokerSignInit, hSession, pMechanism, hKey);
+}
+
+CK_RV
+BrokerClient::sign(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pData,
+	CK_ULONG ulDataLen, CK_BYTE_PTR pSignature, CK_ULONG_PTR pulSignatureLen)
+{
+    return callWithOutput(BrokerSign, hSession, pData, ulDataLen,
+					pSignature, pulSignatureLen);
+}
+
+CK_RV
+BrokerClient::decryptInit(CK_SESSION_HANDLE hSession, 
+	CK_MECHANISM_PTR pMechanism, CK_OBJECT_HANDLE hKey)
+{
+    return mechanismInit(BrokerDecryptInit, hSession, pMechanism, hKey);
+}
+
+CK_RV
+BrokerClient::decrypt(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pData,
+	CK_ULONG ulDataLen, CK_BYTE_PTR pDecryptedData,
+	CK_ULONG_PTR pulDecryptedDataLen)
+{
+    return callWithOutput(BrokerDecrypt, hSession, pData, ulDataLen,
+				pDecryptedData, pulDecryptedDataLen);
+}
+
+CK_RV
+BrokerClient::decryptUpdate(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pPart,
+	CK_ULONG ulPartLen, CK_BYTE_PTR pOutput, CK_ULONG_PTR pulOutputLen)
+{
+    return callWithOutput(BrokerDecryptUpdate, hSession, pPart, ulPartLen,
+				pOutput, pulOutputLen);
+}
+
+CK_RV
+BrokerClient::decryptFinal(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pOutput,
+	CK_ULONG_PTR pulOutputLen)
+{
+    return callWithOutput(BrokerDecryptFinal, hSession, NULL, 0,
+				pOutput, pulOutputLen);
+}
+
+CK_RV
+BrokerClient::encryptInit(CK_SESSION_HANDLE hSession,
+	CK_MECHANISM_PTR pMechanism, CK_OBJECT_HANDLE hKey)
+{
+    return mechanismInit(BrokerEncryptInit, hSession, pMechanism, hKey);
+}
+
+CK_RV
+BrokerClient::encrypt(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pData,
+	CK_ULONG ulDataLen, CK_BYTE_PTR pEncryptedData,
+	CK_ULONG_PTR pulEncryptedDataLen)
+{
+    return callWithOutput(BrokerEncrypt, hSession, pData, ulDataLen,
+				pEncryptedData, pulEncryptedDataLen);
+}
+
+CK_RV
+BrokerClient::encryptUpdate(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pPart,
+	CK_ULONG ulPartLen, CK_BYTE_PTR pOutput, CK_ULONG_PTR pulOutputLen)
+{
+    return callWithOutput(BrokerEncryptUpdate, hSession, pPart, ulPartLen,
+				pOutput, pulOutputLen);
+}
+
+CK_RV
+BrokerClient::encryptFinal(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pOutput,
+	CK_ULONG_PTR pulOutputLen)
+{
+    return callWithOutput(BrokerEncryptFinal, hSession, NULL, 0,
+				pOutput, pulOutputLen);
+}
+
+CK_RV
+BrokerClient::verifyInit(CK_SESSION_HANDLE hSession,
+	CK_MECHANISM_PTR pMechanism, CK_OBJECT_HANDLE hKey)
+{
+    return mechanismInit(BrokerVerifyInit, hSession, pMechanism, hKey);
+}
+
+CK_RV
+BrokerClient::verify(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pData,
+	CK_ULONG ulDataLen, CK_BYTE_PTR pSignature, CK_ULONG ulSignatureLen)
+{
+    CK_RV crv;
+
+    lock.getLock();
+    try {
+	request.putULong(BrokerVerify);
+	request.putULong(hSession);
+	request.putBytes(pData, ulDataLen);
+	request.putBytes(pSignature, ulSignatureLen);
+	crv = call();
+    } catch (PKCS11Exception &e) {
+	crv = e.getCRV();
+    }
+    lock.releaseLock();
+    return crv;
+}
+
+CK_RV
+BrokerClient::verifyRecoverInit(CK_SESSION_HANDLE hSession,
+	CK_MECHANISM_PTR pMechanism, CK_OBJECT_HANDLE hKey)
+{
+    return mechanismInit(BrokerVerifyRecoverInit, hSession, pMechanism, hKey);
+}
+
+CK_RV
+BrokerClient::verifyRecover(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pSignature,
+	CK_ULONG ulSignatureLen, CK_BYTE_PTR pData, CK_ULONG_PTR pulDataLen)
+{
+    return callWithOutput(BrokerVerifyRecover, hSession, pSignature,
+				ulSignatureLen, pData, pulDataLen);
+}
+
+CK_RV
+BrokerClient::digestInit(CK_SESSION_HANDLE hSession,
+	CK_MECHANISM_PTR pMechanism)
+{
+    // no key, the daemon ignores the handle
+    return mechanismInit(BrokerDigestInit, hSession, pMechanism, 0);
+}
+
+CK_RV
+BrokerClient::digest(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pData,
+	CK_ULONG ulDataLen, CK_BYTE_PTR pDigest, CK_ULONG_PTR pulDigestLen)
+{
+    return callWithOutput(BrokerDigest, hSession, pData, ulDataLen,
+					pDigest, pulDigestLen);
+}
+
+CK_RV
+BrokerClient::digestUpdate(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pPart,
+	CK_ULONG ulPartLen)
+{
+    CK_RV crv;
+
+    lock.getLock();
+    try {
+	request.putULong(BrokerDigestUpdate);
+	request.putULong(hSession);
+	request.putBytes(pPart, ulPartLen);
+	crv = call();
+    } catch (PKCS11Exception &e) {
+	crv = e.getCRV();
+    }
+    lock.releaseLock();
+    return crv;
+}
+
+CK_RV
+BrokerClient::digestFinal(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pDigest,
+	CK_ULONG_PTR pulDigestLen)
+{
+    return callWithOutput(BrokerDigestFinal, hSession, NULL, 0,
+					pDigest, pulDigestLen);
+}
+
+CK_RV
+BrokerClient::signUpdate(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pPart,
+	CK_ULONG ulPartLen)
+{
+    CK_RV crv;
+
+    lock.getLock();
+    try {
+	request.putULong(BrokerSignUpdate);
+	request.putULong(hSession);
+	request.putBytes(pPart, ulPartLen);
+	crv = call();
+    } catch (PKCS11Exception &e) {
+	crv = e.getCRV();
+    }
+    lock.releaseLock();
+    return crv;
+}
+
+CK_RV
+BrokerClient::signFinal(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pSignature,
+	CK_ULONG_PTR pulSignatureLen)
+{
+    return callWithOutput(BrokerSignFinal, hSession, NULL, 0,
+					pSignature, pulSignatureLen);
+}
+
+CK_RV
+BrokerClient::seedRandom(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pData,
+	CK_ULONG ulDataLen)
+{
+    CK_RV crv;
+
+    lock.getLock();
+    try {
+	request.putULong(BrokerSeedRandom);
+	request.putULong(hSession);
+	request.putBytes(pData, ulDataLen);
+	crv = call();
+    } catch (PKCS11Exception &e) {
+	crv = e.getCRV();
+    }
+    lock.releaseLock();
+    return crv;
+}
+
+//
+// the daemon fills at most BROKER_MAX_OUTPUT bytes per call, so ask for
+// large requests a piece at a time. Every byte the caller asked for must
+// be written, a short read is an error.
+//
+CK_RV
+BrokerClient::generateRandom(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pData,
+	CK_ULONG ulDataLen)
+{
+    CK_RV crv = CKR_OK;
+
+    while (ulDataLen) {
+	CK_ULONG want = ulDataLen < BROKER_MAX_OUTPUT ? 
+					ulDataLen : BROKER_MAX_OUTPUT;
+	CK_ULONG len = want;
+
+	crv = callWithOutput(BrokerGenerateRandom, hSession, NULL, 0, 
+							pData, &len);
+	if (crv != CKR_OK) {
+	    return crv;
+	}
+	if (len != want) {
+	    return CKR_DEVICE_ERROR;
+	}
+	pData += want;
+	ulDataLen -= want;
+    }
+    return crv;
+}
+
+CK_RV
+BrokerClient::destroyObject(CK_SESSION_HANDLE hSession,
+	CK_OBJECT_HANDLE hObject)
+{
+    CK_RV crv;
+
+    lock.getLock();
+    try {
+	request.putULong(BrokerDestroyObject);
+	request.putULong(hSession);
+	request.putULong(hObject);
+	crv = call();
+    } catch (PKCS11Exception &e) {
+	crv = e.getCRV();
+    }
+    lock.releaseLock();
+    return crv;
+}
+
+CK_RV
+BrokerClient::derive(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism,
+	CK_OBJECT_HANDLE hBaseKey, CK_ATTRIBUTE_PTR pTemplate,
+	CK_ULONG ulAttributeCount, CK_OBJECT_HANDLE_PTR phKey)
+{
+    CK_RV crv;
+
+    if (pMechanism == NULL) {
+	return CKR_ARGUMENTS_BAD;
+    }
+    lock.getLock();
+    try {
+	request.putULong(BrokerDeriveKey);
+	request.putULong(hSession);
+	request.putMechanism(pMechanism);
+	request.putULong(hBaseKey);
+	request.putTemplate(pTemplate, pTemplate ? ulAttributeCount : 0);
+	crv = call();
+	if (crv == CKR_OK) {
+	    *phKey = response.getULong();
+	}
+    } catch (PKCS11Exception &e) {
+	crv = e.getCRV();
+    }
+    lock.releaseLock();
+    return crv;
+}
+
+//
+// blocking waits are done by polling, so a waiting thread never holds the
+// connection. OSSleep takes milliseconds on Windows, microseconds elsewhere.
+//
+#ifdef _WIN32
+#define BROKER_EVENT_POLL 500
+#else
+#define BROKER_EVENT_POLL (500*1000)
+#endif
+CK_RV
+BrokerClient::waitForSlotEvent(CK_FLAGS flags, CK_SLOT_ID_PTR pSlot)
+{
+    CK_RV crv;
+
+    for (;;) {
+	lock.getLock();
+	try {
+	    request.putULong(BrokerWaitForSlotEvent);
+	    crv = call();
+	    if (crv == CKR_OK) {
+		*pSlot = response.getULong();
+	    }
+	} catch (PKCS11Exception &e) {
+	    crv = e.getCRV();
+	}
+	lock.releaseLock();
+	if (crv != CKR_NO_EVENT || (flags & CKF_DONT_BLOCK)) {
+	    return crv;
+	}
+	OSSleep(BROKER_EVENT_POLL);
+    }
+}
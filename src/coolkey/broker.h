@@ -0,0 +1,235 @@
+/* ***** BEGIN COPYRIGHT BLOCK *****
+ * Copyright (C) 2005 Red Hat, Inc.
+ * All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation version
+ * 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ * ***** END COPYRIGHT BLOCK *****/
+
+#ifndef COOLKEY_BROKER_H
+#define COOLKEY_BROKER_H
+
+#include "mypkcs11.h"
+#include "cky_base.h"
+#include "machdep.h"
+
+//
+// Token broker. When COOL_KEY_BROKER names a Unix socket served by
+// coolkeyd, the module forwards PKCS #11 calls to the daemon instead of
+// talking to the cards itself. The daemon keeps the card connections,
+// parsed objects and login state for every client, so starting a client
+// is a socket connect and card access is scheduled in one place.
+//
+// Wire format: every message is length(4) payload, integers are little
+// endian. Requests start with the function code, responses with the
+// CK_RV. CK_ULONGs are sent as 4 bytes, CK_UNAVAILABLE_INFORMATION maps
+// to 0xffffffff.
+//
+#define BROKER_VERSION 1
+#define BROKER_MAX_MESSAGE (1024*1024)
+#define BROKER_MAX_OUTPUT 65536 // largest output buffer coolkeyd fills
+
+typedef enum {
+    BrokerHello = 1,
+    BrokerGetInfo,
+    BrokerGetSlotList,
+    BrokerGetSlotInfo,
+    BrokerGetTokenInfo,
+    BrokerGetMechanismList,
+    BrokerGetMechanismInfo,
+    BrokerOpenSession,
+    BrokerCloseSession,
+    BrokerCloseAllSessions,
+    BrokerGetSessionInfo,
+    BrokerLogin,
+    BrokerLogout,
+    BrokerFindObjectsInit,
+    BrokerFindObjects,
+    BrokerFindObjectsFinal,
+    BrokerGetAttributeValue,
+    BrokerSignInit,
+    BrokerSign,
+    BrokerDecryptInit,
+    BrokerDecrypt,
+    BrokerSeedRandom,
+    BrokerGenerateRandom,
+    BrokerDeriveKey,
+    BrokerWaitForSlotEvent,
+    BrokerEncryptInit,
+    BrokerEncrypt,
+    BrokerVerifyInit,
+    BrokerVerify,
+    BrokerVerifyRecoverInit,
+    BrokerVerifyRecover,
+    BrokerDigestInit,
+    BrokerDigest,
+    BrokerDigestUpdate,
+    BrokerDigestFinal,
+    BrokerSignUpdate,
+    BrokerSignFinal,
+    BrokerDestroyObject,
+    BrokerEncryptUpdate,
+    BrokerEncryptFinal,
+    BrokerDecryptUpdate,
+    BrokerDecryptFinal
+} BrokerFunction;
+
+//
+// a message being built or parsed. Parsing past the end throws
+// CKR_DEVICE_ERROR, so a short message from either side fails cleanly.
+//
+class BrokerMessage {
+  private:
+    CKYBuffer data;
+    CKYOffset offset;
+
+    BrokerMessage(const BrokerMessage &) { } // not allowed
+    BrokerMessage &operator=(const BrokerMessage &) { return *this; }
+    void need(CKYSize size);
+
+  public:
+    BrokerMessage() : offset(0) { CKYBuffer_InitEmpty(&data); }
+    ~BrokerMessage() { CKYBuffer_FreeData(&data); }
+
+    void clear() { CKYBuffer_Resize(&data, 0); offset = 0; }
+    void putULong(CK_ULONG val);
+    void putBytes(const CK_BYTE *bytes, CK_ULONG len);
+    // output buffer the caller supplied, NULL for a length query
+    void putOutput(const CK_BYTE *buf, CK_ULONG len);
+    void putTemplate(const CK_ATTRIBUTE *pTemplate, CK_ULONG count);
+    void putMechanism(const CK_MECHANISM *pMechanism);
+
+    CK_ULONG getULong();
+    const CK_BYTE *getBytes(CK_ULONG *len);
+    void getOutput(CK_BYTE_PTR buf, CK_ULONG_PTR pLen);
+
+    // blocking I/O on a connected socket, false on a broken connection
+    bool send(int fd) const;
+    bool receive(int fd);
+};
+
+//
+// The module side of the broker, one connection per process. Calls
+// from different threads are serialized on the connection. Each method
+// matches the C_ function it stands in for.
+//
+class BrokerClient {
+  private:
+    int fd;
+    OSLock lock;
+    BrokerMessage request;
+    BrokerMessage response;
+
+    BrokerClient(int fd);
+    CK_RV call();
+    CK_RV simpleCall(BrokerFunction function, CK_ULONG arg);
+    CK_RV callWithOutput(BrokerFunction function, CK_ULONG arg,
+				const CK_BYTE *in, CK_ULONG inLen,
+				CK_BYTE_PTR out, CK_ULONG_PTR pOutLen);
+    CK_RV mechanismInit(BrokerFunction function, CK_SESSION_HANDLE hSession,
+				CK_MECHANISM_PTR pMechanism, CK_OBJECT_HANDLE hKey);
+
+  public:
+    // returns NULL if the broker isn't running
+    static BrokerClient *connect(const char *socketName);
+    ~BrokerClient();
+
+    void shutdown();
+
+    CK_RV getInfo(CK_INFO_PTR pInfo);
+    CK_RV getSlotList(CK_BBOOL tokenPresent, CK_SLOT_ID_PTR pSlotList,
+				CK_ULONG_PTR pulCount);
+    CK_RV getSlotInfo(CK_SLOT_ID slotID, CK_SLOT_INFO_PTR pInfo);
+    CK_RV getTokenInfo(CK_SLOT_ID slotID, CK_TOKEN_INFO_PTR pInfo);
+    CK_RV getMechanismList(CK_SLOT_ID slotID, CK_MECHANISM_TYPE_PTR pList,
+				CK_ULONG_PTR pulCount);
+    CK_RV getMechanismInfo(CK_SLOT_ID slotID, CK_MECHANISM_TYPE type,
+				CK_MECHANISM_INFO_PTR pInfo);
+    CK_RV openSession(CK_SLOT_ID slotID, CK_FLAGS flags,
+				CK_SESSION_HANDLE_PTR phSession);
+    CK_RV closeSession(CK_SESSION_HANDLE hSession);
+    CK_RV closeAllSessions(CK_SLOT_ID slotID);
+    CK_RV getSessionInfo(CK_SESSION_HANDLE hSession,
+				CK_SESSION_INFO_PTR pInfo);
+    CK_RV login(CK_SESSION_HANDLE hSession, CK_USER_TYPE userType,
+				CK_UTF8CHAR_PTR pPin, CK_ULONG ulPinLen);
+    CK_RV logout(CK_SESSION_HANDLE hSession);
+    CK_RV findObjectsInit(CK_SESSION_HANDLE hSession,
+				CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount);
+    CK_RV findObjects(CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE_PTR phObject,
+				CK_ULONG ulMaxObjectCount,
+				CK_ULONG_PTR pulObjectCount);
+    CK_RV findObjectsFinal(CK_SESSION_HANDLE hSession);
+    CK_RV getAttributeValue(CK_SESSION_HANDLE hSession,
+				CK_OBJECT_HANDLE hObject,
+				CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount);
+    CK_RV signInit(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism,
+				CK_OBJECT_HANDLE hKey);
+    CK_RV sign(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pData,
+				CK_ULONG ulDataLen, CK_BYTE_PTR pSignature,
+				CK_ULONG_PTR pulSignatureLen);
+    CK_RV decryptInit(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism,
+				CK_OBJECT_HANDLE hKey);
+    CK_RV decrypt(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pData,
+				CK_ULONG ulDataLen, CK_BYTE_PTR pDecryptedData,
+				CK_ULONG_PTR pulDecryptedDataLen);
+    CK_RV decryptUpdate(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pPart,
+				CK_ULONG ulPartLen, CK_BYTE_PTR pOutput,
+				CK_ULONG_PTR pulOutputLen);
+    CK_RV decryptFinal(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pOutput,
+				CK_ULONG_PTR pulOutputLen);
+    CK_RV encryptInit(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism,
+				CK_OBJECT_HANDLE hKey);
+    CK_RV encrypt(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pData,
+				CK_ULONG ulDataLen, CK_BYTE_PTR pEncryptedData,
+				CK_ULONG_PTR pulEncryptedDataLen);
+    CK_RV encryptUpdate(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pPart,
+				CK_ULONG ulPartLen, CK_BYTE_PTR pOutput,
+				CK_ULONG_PTR pulOutputLen);
+    CK_RV encryptFinal(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pOutput,
+				CK_ULONG_PTR pulOutputLen);
+    CK_RV signUpdate(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pPart,
+				CK_ULONG ulPartLen);
+    CK_RV signFinal(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pSignature,
+				CK_ULONG_PTR pulSignatureLen);
+    CK_RV verifyInit(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism,
+				CK_OBJECT_HANDLE hKey);
+    CK_RV verify(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pData,
+				CK_ULONG ulDataLen, CK_BYTE_PTR pSignature,
+				CK_ULONG ulSignatureLen);
+    CK_RV verifyRecoverInit(CK_SESSION_HANDLE hSession,
+				CK_MECHANISM_PTR pMechanism, CK_OBJECT_HANDLE hKey);
+    CK_RV verifyRecover(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pSignature,
+				CK_ULONG ulSignatureLen, CK_BYTE_PTR pData,
+				CK_ULONG_PTR pulDataLen);
+    CK_RV digestInit(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism);
+    CK_RV digest(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pData,
+				CK_ULONG ulDataLen, CK_BYTE_PTR pDigest,
+				CK_ULONG_PTR pulDigestLen);
+    CK_RV digestUpdate(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pPart,
+				CK_ULONG ulPartLen);
+    CK_RV digestFinal(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pDigest,
+				CK_ULONG_PTR pulDigestLen);
+    CK_RV seedRandom(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pData,
+				CK_ULONG ulDataLen);
+    CK_RV generateRandom(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pData,
+				CK_ULONG ulDataLen);
+    CK_RV destroyObject(CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE hObject);
+    CK_RV derive(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism,
+				CK_OBJECT_HANDLE hBaseKey, CK_ATTRIBUTE_PTR pTemplate,
+				CK_ULONG ulAttributeCount, CK_OBJECT_HANDLE_PTR phKey);
+    CK_RV waitForSlotEvent(CK_FLAGS flags, CK_SLOT_ID_PTR pSlot);
+};
+
+#endif
@@ -0,0 +1,246 @@
+/* ***** BEGIN COPYRIGHT BLOCK *****
+ * Copyright (C) 2005 Red Hat, Inc.
+ * All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation version
+ * 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ * ***** END COPYRIGHT BLOCK *****/
+
+#include "mypkcs11.h"
+#include "PKCS11Exception.h"
+#include "slot.h"
+#include "carddriver.h"
+
+//
+// CoolKey applet. The only one with a usable RNG, and keys are addressed
+// by key number with the login nonce.
+//
+class CoolKeyDriver : public CardDriver {
+  public:
+    CardType getType() const { return CARD_TYPE_COOLKEY; }
+    const CardCapabilities &getCapabilities() const {
+	static const CardCapabilities caps =
+			{ CKY_MAX_READ_CHUNK_SIZE, true };
+	return caps;
+    }
+    CKYStatus detect(Slot *slot) const {
+	return CKYApplet_SelectCoolKeyManager(slot->conn, NULL);
+    }
+    void loadObjects(Slot *slot, Transaction &trans) const {
+	slot->loadCoolKeyObjects(trans);
+    }
+    void selectKey(Slot *slot, const PKCS11Object *key, bool retry) const {
+	if (!retry) {
+	    slot->selectApplet();
+	}
+    }
+    void attemptLogin(Slot *slot, CK_USER_TYPE user) const {
+	slot->oldAttemptLogin();
+    }
+    bool isCardLoggedIn(Slot *slot, CK_USER_TYPE user) const {
+	CKYAppletRespGetStatus cardStatus;
+	CKYISOStatus result = CKYISO_SUCCESS;
+	CKYStatus status;
+
+	status = CKYApplet_GetStatus(slot->conn, &cardStatus, &result);
+	if (status == CKYSUCCESS) {
+	    return (cardStatus.loggedInMask &
+				(1 << CKY_OLD_USER_PIN_NUM)) != 0;
+	}
+	return slot->pinStatusLoggedIn(status, result);
+    }
+    CKYStatus rsaCrypt(Slot *slot, const PKCS11Object *key,
+		unsigned int keySize, CKYByte direction, const CKYBuffer *input,
+		CKYBuffer *output, CKYISOStatus *result) const {
+	return CKYApplet_ComputeCrypt(slot->conn, slot->objectToKeyNum(key),
+		CKY_RSA_NO_PAD, direction, input, NULL, output,
+		slot->getNonce(), result);
+    }
+    CKYStatus eccSign(Slot *slot, const PKCS11Object *key,
+		unsigned int keySize, const CKYBuffer *input,
+		CKYBuffer *output, CKYISOStatus *result) const {
+	return CKYApplet_ComputeECCSignature(slot->conn,
+		slot->objectToKeyNum(key), input, NULL, output,
+		slot->getNonce(), result);
+    }
+    CKYStatus eccDerive(Slot *slot, const PKCS11Object *key,
+		unsigned int keySize, const CKYBuffer *publicValue,
+		CKYBuffer *secret, CKYISOStatus *result) const {
+	return CKYApplet_ComputeECCKeyAgreement(slot->conn,
+		slot->objectToKeyNum(key), publicValue, NULL, secret,
+		slot->getNonce(), result);
+    }
+};
+
+//
+// CAC and PIV share the cert loading, key selection and login, they differ
+// in how the key operations are addressed.
+//
+class GovDriver : public CardDriver {
+  public:
+    void loadObjects(Slot *slot, Transaction &trans) const {
+	slot->loadCACCerts(trans);
+    }
+    void selectKey(Slot *slot, const PKCS11Object *key, bool retry) const {
+	if (!retry) {
+	    slot->selectCACApplet(slot->objectToKeyNum(key), true);
+	}
+    }
+    void attemptLogin(Slot *slot, CK_USER_TYPE user) const {
+	slot->attemptCACLogin();
+    }
+    bool isCardLoggedIn(Slot *slot, CK_USER_TYPE user) const {
+	CKYISOStatus result = CKYISO_SUCCESS;
+	CKYStatus status;
+
+	status = CACApplet_GetPINStatus(slot->conn, slot->mCACLocalLogin,
+								&result);
+	return slot->pinStatusLoggedIn(status, result);
+    }
+};
+
+class CACDriver : public GovDriver {
+  public:
+    CardType getType() const { return CARD_TYPE_CAC; }
+    const CardCapabilities &getCapabilities() const {
+	static const CardCapabilities caps =
+			{ CKY_MAX_READ_CHUNK_SIZE, false };
+	return caps;
+    }
+    CKYStatus detect(Slot *slot) const {
+	return slot->getCACAid();
+    }
+    CKYStatus rsaCrypt(Slot *slot, const PKCS11Object *key,
+		unsigned int keySize, CKYByte direction, const CKYBuffer *input,
+		CKYBuffer *output, CKYISOStatus *result) const {
+	return CACApplet_SignDecrypt(slot->conn, input, output, result);
+    }
+    CKYStatus eccSign(Slot *slot, const PKCS11Object *key,
+		unsigned int keySize, const CKYBuffer *input,
+		CKYBuffer *output, CKYISOStatus *result) const {
+	return CACApplet_SignDecrypt(slot->conn, input, output, result);
+    }
+    CKYStatus eccDerive(Slot *slot, const PKCS11Object *key,
+		unsigned int keySize, const CKYBuffer *publicValue,
+		CKYBuffer *secret, CKYISOStatus *result) const {
+	return CACApplet_SignDecrypt(slot->conn, publicValue, secret, result);
+    }
+};
+
+class PIVDriver : public GovDriver {
+  public:
+    CardType getType() const { return CARD_TYPE_PIV; }
+    const CardCapabilities &getCapabilities() const {
+	static const CardCapabilities caps =
+			{ CKY_MAX_READ_CHUNK_SIZE, false };
+	return caps;
+    }
+    CKYStatus detect(Slot *slot) const {
+	return PIVApplet_Select(slot->conn, NULL);
+    }
+    CKYStatus rsaCrypt(Slot *slot, const PKCS11Object *key,
+		unsigned int keySize, CKYByte direction, const CKYBuffer *input,
+		CKYBuffer *output, CKYISOStatus *result) const {
+	return PIVApplet_SignDecrypt(slot->conn, slot->pivKey, keySize/8, 0,
+						input, output, result);
+    }
+    CKYStatus eccSign(Slot *slot, const PKCS11Object *key,
+		unsigned int keySize, const CKYBuffer *input,
+		CKYBuffer *output, CKYISOStatus *result) const {
+	return PIVApplet_SignDecrypt(slot->conn, slot->pivKey, keySize/8, 0,
+						input, output, result);
+    }
+    CKYStatus eccDerive(Slot *slot, const PKCS11Object *key,
+		unsigned int keySize, const CKYBuffer *publicValue,
+		CKYBuffer *secret, CKYISOStatus *result) const {
+	return PIVApplet_SignDecrypt(slot->conn, slot->pivKey, keySize/8, 1,
+						publicValue, secret, result);
+    }
+};
+
+//
+// PKCS #15. Keys live at paths that have to be selected again after a
+// login, and there is no key agreement yet.
+//
+class P15Driver : public CardDriver {
+  public:
+    CardType getType() const { return CARD_TYPE_P15; }
+    const CardCapabilities &getCapabilities() const {
+	static const CardCapabilities caps =
+			{ 256, false };
+	return caps;
+    }
+    CKYStatus detect(Slot *slot) const {
+	return slot->getP15Params();
+    }
+    void loadObjects(Slot *slot, Transaction &trans) const {
+	slot->loadP15Objects(trans);
+    }
+    void selectKey(Slot *slot, const PKCS11Object *key, bool retry) const {
+	slot->selectPath(key->getObjectPath().getPath(), NULL);
+    }
+    void attemptLogin(Slot *slot, CK_USER_TYPE user) const {
+	slot->attemptP15Login(user);
+    }
+    bool isCardLoggedIn(Slot *slot, CK_USER_TYPE user) const {
+	CKYISOStatus result = CKYISO_SUCCESS;
+	CKYStatus status;
+
+	if ((user >= MAX_AUTH_USERS) || (slot->auth[user] == NULL)) {
+	    return true;
+	}
+	status = P15Applet_GetPINStatus(slot->conn,
+			slot->auth[user]->getPinInfo(), &result);
+	return slot->pinStatusLoggedIn(status, result);
+    }
+    CKYStatus rsaCrypt(Slot *slot, const PKCS11Object *key,
+		unsigned int keySize, CKYByte direction, const CKYBuffer *input,
+		CKYBuffer *output, CKYISOStatus *result) const {
+	return P15Applet_SignDecrypt(slot->conn, key->getKeyRef(), keySize/8,
+				direction, input, output, result);
+    }
+    CKYStatus eccSign(Slot *slot, const PKCS11Object *key,
+		unsigned int keySize, const CKYBuffer *input,
+		CKYBuffer *output, CKYISOStatus *result) const {
+	return P15Applet_SignDecrypt(slot->conn, key->getKeyRef(), keySize/8,
+				CKY_DIR_ENCRYPT, input, output, result);
+    }
+    CKYStatus eccDerive(Slot *slot, const PKCS11Object *key,
+		unsigned int keySize, const CKYBuffer *publicValue,
+		CKYBuffer *secret, CKYISOStatus *result) const {
+	throw PKCS11Exception(CKR_FUNCTION_NOT_SUPPORTED);
+    }
+};
+
+static const PIVDriver pivDriver;
+static const CoolKeyDriver coolKeyDriver;
+static const CACDriver cacDriver;
+static const P15Driver p15Driver;
+
+const CardDriver *
+CardDriver::getDriver(CardType type)
+{
+    switch (type) {
+    case CARD_TYPE_PIV:
+	return &pivDriver;
+    case CARD_TYPE_CAC:
+	return &cacDriver;
+    case CARD_TYPE_P15:
+	return &p15Driver;
+    default:
+	break;
+    }
+    // anything we didn't recognize gets the CoolKey treatment, as before
+    return &coolKeyDriver;
+}
@@ -0,0 +1,83 @@
+/* ***** BEGIN COPYRIGHT BLOCK *****
+ * Copyright (C) 2005 Red Hat, Inc.
+ * All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation version
+ * 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ * ***** END COPYRIGHT BLOCK *****/
+
+#ifndef COOLKEY_CARDDRIVER_H
+#define COOLKEY_CARDDRIVER_H
+
+#include "cky_applet.h"
+#include "object.h"
+
+class Slot;
+class Transaction;
+
+// the applets we know how to talk to, in the order connectToToken tries them
+enum CardType {
+    CARD_TYPE_UNKNOWN = 0,
+    CARD_TYPE_PIV,
+    CARD_TYPE_COOLKEY,
+    CARD_TYPE_CAC,
+    CARD_TYPE_P15,
+    CARD_TYPE_COUNT
+};
+
+//
+// What a kind of card can do beyond the basics, so the slot can use it
+// without asking which kind of card it is.
+//
+struct CardCapabilities {
+    CKYSize maxReadChunk;	// Le to start bulk reads with
+    bool onCardRNG;		// GetRandom/SeedRandom work
+};
+
+//
+// Everything the slot does differently for each kind of card. There is one
+// (stateless) driver per CardType, the slot picks it once in connectToToken
+// and keeps its per-card state itself, the drivers are its friends.
+//
+class CardDriver {
+  public:
+    virtual ~CardDriver() { }
+
+    static const CardDriver *getDriver(CardType type);
+
+    virtual CardType getType() const = 0;
+    virtual const CardCapabilities &getCapabilities() const = 0;
+
+    // select the applet, and read whatever we need to recognize the card
+    virtual CKYStatus detect(Slot *slot) const = 0;
+    // build tokenObjects. trans is ended once the card isn't needed
+    virtual void loadObjects(Slot *slot, Transaction &trans) const = 0;
+    virtual void selectKey(Slot *slot, const PKCS11Object *key,
+						bool retry) const = 0;
+    virtual void attemptLogin(Slot *slot, CK_USER_TYPE user) const = 0;
+    virtual bool isCardLoggedIn(Slot *slot, CK_USER_TYPE user) const = 0;
+
+    // the private key operations, after selectKey
+    virtual CKYStatus rsaCrypt(Slot *slot, const PKCS11Object *key,
+		unsigned int keySize, CKYByte direction, const CKYBuffer *input,
+		CKYBuffer *output, CKYISOStatus *result) const = 0;
+    virtual CKYStatus eccSign(Slot *slot, const PKCS11Object *key,
+		unsigned int keySize, const CKYBuffer *input,
+		CKYBuffer *output, CKYISOStatus *result) const = 0;
+    virtual CKYStatus eccDerive(Slot *slot, const PKCS11Object *key,
+		unsigned int keySize, const CKYBuffer *publicValue,
+		CKYBuffer *secret, CKYISOStatus *result) const = 0;
+};
+
+#endif
@@ -0,0 +1,1401 @@
+/* ***** BEGIN COPYRIGHT BLOCK *****
+ * Copyright (C) 2005 Red Hat, Inc.
+ * All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation version
+ * 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ * ***** END COPYRIGHT BLOCK *****/
+
+#include <string.h>
+#include "mypkcs11.h"
+#include "PKCS11Exception.h"
+#include "cipher.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CIPHER_AES_NI 1
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+#define MIN(x, y) ((x) < (y) ? (x) : (y))
+
+// GCM encrypts and hashes this much at a time, so the hash reads the
+// ciphertext while it is still in the cache
+#define GCM_CHUNK 4096
+
+static unsigned int
+getBE32(const CKYByte *p)
+{
+    return ((unsigned int)p[0] << 24) | ((unsigned int)p[1] << 16) |
+	   ((unsigned int)p[2] << 8) | p[3];
+}
+
+static unsigned long long
+getBE64(const CKYByte *p)
+{
+    return ((unsigned long long)getBE32(p) << 32) | getBE32(p + 4);
+}
+
+static void
+putBE32(CKYByte *p, unsigned int v)
+{
+    p[0] = v >> 24; p[1] = v >> 16; p[2] = v >> 8; p[3] = v;
+}
+
+static void
+putBE64(CKYByte *p, unsigned long long v)
+{
+    putBE32(p, (unsigned int)(v >> 32));
+    putBE32(p + 4, (unsigned int)v);
+}
+
+#define ROR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+//
+// Tables for the portable code. They are built when the library is
+// loaded, before anyone can use them.
+//
+static CKYByte sbox[256];
+static CKYByte invSbox[256];
+static unsigned int te[4][256];
+static unsigned int td[4][256];
+
+static CKYByte
+xtime(CKYByte x)
+{
+    return (x << 1) ^ ((x & 0x80) ? 0x1b : 0);
+}
+
+static CKYByte
+gmul(CKYByte a, CKYByte b)
+{
+    CKYByte r = 0;
+
+    while (b) {
+	if (b & 1) {
+	    r ^= a;
+	}
+	a = xtime(a);
+	b >>= 1;
+    }
+    return r;
+}
+
+class AESTables {
+  public:
+    AESTables() {
+	unsigned int x, k;
+
+	for (x = 0; x < 256; x++) {
+	    // the multiplicative inverse is x^254
+	    CKYByte inv = 0;
+	    if (x) {
+		CKYByte base = x;
+		inv = 1;
+		for (unsigned int e = 254; e; e >>= 1) {
+		    if (e & 1) {
+			inv = gmul(inv, base);
+		    }
+		    base = gmul(base, base);
+		}
+	    }
+	    CKYByte s = inv;
+	    for (k = 1; k < 5; k++) {
+		s ^= (CKYByte)((inv << k) | (inv >> (8 - k)));
+	    }
+	    s ^= 0x63;
+	    sbox[x] = s;
+	    invSbox[s] = x;
+	}
+	for (x = 0; x < 256; x++) {
+	    CKYByte s = sbox[x];
+	    CKYByte is = invSbox[x];
+	    te[0][x] = ((unsigned int)gmul(s, 2) << 24) | (s << 16) |
+				(s << 8) | gmul(s, 3);
+	    td[0][x] = ((unsigned int)gmul(is, 14) << 24) |
+		(gmul(is, 9) << 16) | (gmul(is, 13) << 8) | gmul(is, 11);
+	    for (k = 1; k < 4; k++) {
+		te[k][x] = ROR32(te[k-1][x], 8);
+		td[k][x] = ROR32(td[k-1][x], 8);
+	    }
+	}
+    }
+};
+
+static AESTables aesTables;
+
+static unsigned int
+subWord(unsigned int w)
+{
+    return ((unsigned int)sbox[w >> 24] << 24) |
+	   (sbox[(w >> 16) & 0xff] << 16) |
+	   (sbox[(w >> 8) & 0xff] << 8) | sbox[w & 0xff];
+}
+
+static unsigned int
+invMixColumn(unsigned int w)
+{
+    return td[0][sbox[w >> 24]] ^ td[1][sbox[(w >> 16) & 0xff]] ^
+	   td[2][sbox[(w >> 8) & 0xff]] ^ td[3][sbox[w & 0xff]];
+}
+
+static void
+encryptBlockPortable(const CKYByte *keys, unsigned int rounds,
+					const CKYByte *in, CKYByte *out)
+{
+    const CKYByte *rk = keys;
+    unsigned int s0, s1, s2, s3, t0, t1, t2, t3;
+
+    s0 = getBE32(in) ^ getBE32(rk);
+    s1 = getBE32(in + 4) ^ getBE32(rk + 4);
+    s2 = getBE32(in + 8) ^ getBE32(rk + 8);
+    s3 = getBE32(in + 12) ^ getBE32(rk + 12);
+    for (unsigned int r = 1; r < rounds; r++) {
+	rk += AES_BLOCK_SIZE;
+	t0 = te[0][s0 >> 24] ^ te[1][(s1 >> 16) & 0xff] ^
+	     te[2][(s2 >> 8) & 0xff] ^ te[3][s3 & 0xff] ^ getBE32(rk);
+	t1 = te[0][s1 >> 24] ^ te[1][(s2 >> 16) & 0xff] ^
+	     te[2][(s3 >> 8) & 0xff] ^ te[3][s0 & 0xff] ^ getBE32(rk + 4);
+	t2 = te[0][s2 >> 24] ^ te[1][(s3 >> 16) & 0xff] ^
+	     te[2][(s0 >> 8) & 0xff] ^ te[3][s1 & 0xff] ^ getBE32(rk + 8);
+	t3 = te[0][s3 >> 24] ^ te[1][(s0 >> 16) & 0xff] ^
+	     te[2][(s1 >> 8) & 0xff] ^ te[3][s2 & 0xff] ^ getBE32(rk + 12);
+	s0 = t0; s1 = t1; s2 = t2; s3 = t3;
+    }
+    rk += AES_BLOCK_SIZE;
+#define LAST_ROUND(a, b, c, d) \
+    (((unsigned int)sbox[(a) >> 24] << 24) | \
+     (sbox[((b) >> 16) & 0xff] << 16) | \
+     (sbox[((c) >> 8) & 0xff] << 8) | sbox[(d) & 0xff])
+    putBE32(out, LAST_ROUND(s0, s1, s2, s3) ^ getBE32(rk));
+    putBE32(out + 4, LAST_ROUND(s1, s2, s3, s0) ^ getBE32(rk + 4));
+    putBE32(out + 8, LAST_ROUND(s2, s3, s0, s1) ^ getBE32(rk + 8));
+    putBE32(out + 12, LAST_ROUND(s3, s0, s1, s2) ^ getBE32(rk + 12));
+#undef LAST_ROUND
+}
+
+static void
+decryptBlockPortable(const CKYByte *keys, unsigned int rounds,
+					const CKYByte *in, CKYByte *out)
+{
+    const CKYByte *rk = keys;
+    unsigned int s0, s1, s2, s3, t0, t1, t2, t3;
+
+    s0 = getBE32(in) ^ getBE32(rk);
+    s1 = getBE32(in + 4) ^ getBE32(rk + 4);
+    s2 = getBE32(in + 8) ^ getBE32(rk + 8);
+    s3 = getBE32(in + 12) ^ getBE32(rk + 12);
+    for (unsigned int r = 1; r < rounds; r++) {
+	rk += AES_BLOCK_SIZE;
+	t0 = td[0][s0 >> 24] ^ td[1][(s3 >> 16) & 0xff] ^
+	     td[2][(s2 >> 8) & 0xff] ^ td[3][s1 & 0xff] ^ getBE32(rk);
+	t1 = td[0][s1 >> 24] ^ td[1][(s0 >> 16) & 0xff] ^
+	     td[2][(s3 >> 8) & 0xff] ^ td[3][s2 & 0xff] ^ getBE32(rk + 4);
+	t2 = td[0][s2 >> 24] ^ td[1][(s1 >> 16) & 0xff] ^
+	     td[2][(s0 >> 8) & 0xff] ^ td[3][s3 & 0xff] ^ getBE32(rk + 8);
+	t3 = td[0][s3 >> 24] ^ td[1][(s2 >> 16) & 0xff] ^
+	     td[2][(s1 >> 8) & 0xff] ^ td[3][s0 & 0xff] ^ getBE32(rk + 12);
+	s0 = t0; s1 = t1; s2 = t2; s3 = t3;
+    }
+    rk += AES_BLOCK_SIZE;
+#define LAST_ROUND(a, b, c, d) \
+    (((unsigned int)invSbox[(a) >> 24] << 24) | \
+     (invSbox[((b) >> 16) & 0xff] << 16) | \
+     (invSbox[((c) >> 8) & 0xff] << 8) | invSbox[(d) & 0xff])
+    putBE32(out, LAST_ROUND(s0, s3, s2, s1) ^ getBE32(rk));
+    putBE32(out + 4, LAST_ROUND(s1, s0, s3, s2) ^ getBE32(rk + 4));
+    putBE32(out + 8, LAST_ROUND(s2, s1, s0, s3) ^ getBE32(rk + 8));
+    putBE32(out + 12, LAST_ROUND(s3, s2, s1, s0) ^ getBE32(rk + 12));
+#undef LAST_ROUND
+}
+
+static void
+cbcEncryptPortable(const CKYByte *keys, unsigned int rounds, CKYByte *iv,
+			const CKYByte *in, CKYByte *out, CKYSize blocks)
+{
+    for (; blocks; blocks--) {
+	for (int i = 0; i < AES_BLOCK_SIZE; i++) {
+	    iv[i] ^= in[i];
+	}
+	encryptBlockPortable(keys, rounds, iv, iv);
+	memcpy(out, iv, AES_BLOCK_SIZE);
+	in += AES_BLOCK_SIZE;
+	out += AES_BLOCK_SIZE;
+    }
+}
+
+static void
+cbcDecryptPortable(const CKYByte *keys, unsigned int rounds, CKYByte *iv,
+			const CKYByte *in, CKYByte *out, CKYSize blocks)
+{
+    CKYByte block[AES_BLOCK_SIZE];
+    CKYByte next[AES_BLOCK_SIZE];
+
+    for (; blocks; blocks--) {
+	memcpy(next, in, AES_BLOCK_SIZE);
+	decryptBlockPortable(keys, rounds, in, block);
+	for (int i = 0; i < AES_BLOCK_SIZE; i++) {
+	    out[i] = block[i] ^ iv[i];
+	}
+	memcpy(iv, next, AES_BLOCK_SIZE);
+	in += AES_BLOCK_SIZE;
+	out += AES_BLOCK_SIZE;
+    }
+}
+
+static void
+ctrPortable(const CKYByte *keys, unsigned int rounds, AESCounter &counter,
+			const CKYByte *in, CKYByte *out, CKYSize blocks)
+{
+    CKYByte block[AES_BLOCK_SIZE];
+
+    for (; blocks; blocks--) {
+	counter.get(block);
+	counter.next();
+	encryptBlockPortable(keys, rounds, block, block);
+	for (int i = 0; i < AES_BLOCK_SIZE; i++) {
+	    out[i] = in[i] ^ block[i];
+	}
+	in += AES_BLOCK_SIZE;
+	out += AES_BLOCK_SIZE;
+    }
+}
+
+//
+// GHASH with 4 bit tables, the way most portable GCM code does it.
+//
+static const unsigned long long last4[16] = {
+    0x0000, 0x1c20, 0x3840, 0x2460, 0x7080, 0x6ca0, 0x48c0, 0x54e0,
+    0xe100, 0xfd20, 0xd940, 0xc560, 0x9180, 0x8da0, 0xa9c0, 0xb5e0
+};
+
+static void
+ghashTables(GHashKey *key, const CKYByte *h)
+{
+    unsigned long long vh = getBE64(h);
+    unsigned long long vl = getBE64(h + 8);
+    int i, j;
+
+    key->hl[8] = vl;
+    key->hh[8] = vh;
+    key->hl[0] = 0;
+    key->hh[0] = 0;
+    for (i = 4; i > 0; i >>= 1) {
+	unsigned long long t = (vl & 1) * 0xe1000000ULL;
+	vl = (vh << 63) | (vl >> 1);
+	vh = (vh >> 1) ^ (t << 32);
+	key->hl[i] = vl;
+	key->hh[i] = vh;
+    }
+    for (i = 2; i <= 8; i *= 2) {
+	vh = key->hh[i];
+	vl = key->hl[i];
+	for (j = 1; j < i; j++) {
+	    key->hh[i + j] = vh ^ key->hh[j];
+	    key->hl[i + j] = vl ^ key->hl[j];
+	}
+    }
+}
+
+static void
+ghashPortable(const GHashKey *key, CKYByte *y, const CKYByte *data,
+							CKYSize blocks)
+{
+    CKYByte x[AES_BLOCK_SIZE];
+
+    for (; blocks; blocks--) {
+	unsigned long long zh, zl;
+	int i;
+
+	for (i = 0; i < AES_BLOCK_SIZE; i++) {
+	    x[i] = y[i] ^ data[i];
+	}
+	zh = key->hh[x[15] & 0xf];
+	zl = key->hl[x[15] & 0xf];
+	for (i = 15; i >= 0; i--) {
+	    unsigned int lo = x[i] & 0xf;
+	    unsigned int hi = x[i] >> 4;
+	    unsigned int rem;
+
+	    if (i != 15) {
+		rem = zl & 0xf;
+		zl = (zh << 60) | (zl >> 4);
+		zh = (zh >> 4) ^ (last4[rem] << 48) ^ key->hh[lo];
+		zl ^= key->hl[lo];
+	    }
+	    rem = zl & 0xf;
+	    zl = (zh << 60) | (zl >> 4);
+	    zh = (zh >> 4) ^ (last4[rem] << 48) ^ key->hh[hi];
+	    zl ^= key->hl[hi];
+	}
+	putBE64(y, zh);
+	putBE64(y + 8, zl);
+	data += AES_BLOCK_SIZE;
+    }
+}
+
+#ifdef CIPHER_AES_NI
+//
+// AES-NI. Eight blocks are kept in flight so the AES unit never waits
+// for the previous round of the same block.
+//
+#define AESNI __attribute__((target("aes,sse4.1")))
+
+#define AES_ROUND8(op, k) \
+    b0 = op(b0, k); b1 = op(b1, k); b2 = op(b2, k); b3 = op(b3, k); \
+    b4 = op(b4, k); b5 = op(b5, k); b6 = op(b6, k); b7 = op(b7, k);
+
+#define LOAD(p, i) _mm_loadu_si128((const __m128i *)(p) + (i))
+#define STORE(p, i, v) _mm_storeu_si128((__m128i *)(p) + (i), (v))
+
+AESNI static void
+encryptBlockHW(const CKYByte *keys, unsigned int rounds,
+					const CKYByte *in, CKYByte *out)
+{
+    __m128i b = _mm_xor_si128(LOAD(in, 0), LOAD(keys, 0));
+
+    for (unsigned int r = 1; r < rounds; r++) {
+	b = _mm_aesenc_si128(b, LOAD(keys, r));
+    }
+    STORE(out, 0, _mm_aesenclast_si128(b, LOAD(keys, rounds)));
+}
+
+AESNI static void
+decryptBlockHW(const CKYByte *keys, unsigned int rounds,
+					const CKYByte *in, CKYByte *out)
+{
+    __m128i b = _mm_xor_si128(LOAD(in, 0), LOAD(keys, 0));
+
+    for (unsigned int r = 1; r < rounds; r++) {
+	b = _mm_aesdec_si128(b, LOAD(keys, r));
+    }
+    STORE(out, 0, _mm_aesdeclast_si128(b, LOAD(keys, rounds)));
+}
+
+// each block depends on the one before, CBC encryption can't overlap
+AESNI static void
+cbcEncryptHW(const CKYByte *keys, unsigned int rounds, CKYByte *iv,
+			const CKYByte *in, CKYByte *out, CKYSize blocks)
+{
+    __m128i rk[AES_MAX_ROUNDS + 1];
+    __m128i b = LOAD(iv, 0);
+    unsigned int r;
+
+    for (r = 0; r <= rounds; r++) {
+	rk[r] = LOAD(keys, r);
+    }
+    for (; blocks; blocks--) {
+	b = _mm_xor_si128(_mm_xor_si128(b, LOAD(in, 0)), rk[0]);
+	for (r = 1; r < rounds; r++) {
+	    b = _mm_aesenc_si128(b, rk[r]);
+	}
+	b = _mm_aesenclast_si128(b, rk[rounds]);
+	STORE(out, 0, b);
+	in += AES_BLOCK_SIZE;
+	out += AES_BLOCK_SIZE;
+    }
+    STORE(iv, 0, b);
+}
+
+// all the ciphertext is read before anything is written, so in and out
+// can be the same
+AESNI static void
+cbcDecryptHW(const CKYByte *keys, unsigned int rounds, CKYByte *iv,
+			const CKYByte *in, CKYByte *out, CKYSize blocks)
+{
+    __m128i rk[AES_MAX_ROUNDS + 1];
+    __m128i b0, b1, b2, b3, b4, b5, b6, b7;
+    __m128i prev = LOAD(iv, 0);
+    unsigned int r;
+
+    for (r = 0; r <= rounds; r++) {
+	rk[r] = LOAD(keys, r);
+    }
+    for (; blocks >= 8; blocks -= 8) {
+	b0 = _mm_xor_si128(LOAD(in, 0), rk[0]);
+	b1 = _mm_xor_si128(LOAD(in, 1), rk[0]);
+	b2 = _mm_xor_si128(LOAD(in, 2), rk[0]);
+	b3 = _mm_xor_si128(LOAD(in, 3), rk[0]);
+	b4 = _mm_xor_si128(LOAD(in, 4), rk[0]);
+	b5 = _mm_xor_si128(LOAD(in, 5), rk[0]);
+	b6 = _mm_xor_si128(LOAD(in, 6), rk[0]);
+	b7 = _mm_xor_si128(LOAD(in, 7), rk[0]);
+	for (r = 1; r < rounds; r++) {
+	    AES_ROUND8(_mm_aesdec_si128, rk[r])
+	}
+	AES_ROUND8(_mm_aesdeclast_si128, rk[rounds])
+	b0 = _mm_xor_si128(b0, prev);
+	b1 = _mm_xor_si128(b1, LOAD(in, 0));
+	b2 = _mm_xor_si128(b2, LOAD(in, 1));
+	b3 = _mm_xor_si128(b3, LOAD(in, 2));
+	b4 = _mm_xor_si128(b4, LOAD(in, 3));
+	b5 = _mm_xor_si128(b5, LOAD(in, 4));
+	b6 = _mm_xor_si128(b6, LOAD(in, 5));
+	b7 = _mm_xor_si128(b7, LOAD(in, 6));
+	prev = LOAD(in, 7);
+	STORE(out, 0, b0); STORE(out, 1, b1); STORE(out, 2, b2);
+	STORE(out, 3, b3); STORE(out, 4, b4); STORE(out, 5, b5);
+	STORE(out, 6, b6); STORE(out, 7, b7);
+	in += 8 * AES_BLOCK_SIZE;
+	out += 8 * AES_BLOCK_SIZE;
+    }
+    for (; blocks; blocks--) {
+	__m128i next = LOAD(in, 0);
+	b0 = _mm_xor_si128(next, rk[0]);
+	for (r = 1; r < rounds; r++) {
+	    b0 = _mm_aesdec_si128(b0, rk[r]);
+	}
+	b0 = _mm_aesdeclast_si128(b0, rk[rounds]);
+	STORE(out, 0, _mm_xor_si128(b0, prev));
+	prev = next;
+	in += AES_BLOCK_SIZE;
+	out += AES_BLOCK_SIZE;
+    }
+    STORE(iv, 0, prev);
+}
+
+#define COUNTER_BLOCK(c) \
+    _mm_set_epi64x((long long)__builtin_bswap64((c).lo), \
+		   (long long)__builtin_bswap64((c).hi))
+
+AESNI static void
+ctrHW(const CKYByte *keys, unsigned int rounds, AESCounter &counter,
+			const CKYByte *in, CKYByte *out, CKYSize blocks)
+{
+    __m128i rk[AES_MAX_ROUNDS + 1];
+    __m128i b0, b1, b2, b3, b4, b5, b6, b7;
+    AESCounter c = counter;
+    unsigned int r;
+
+    for (r = 0; r <= rounds; r++) {
+	rk[r] = LOAD(keys, r);
+    }
+#define CTR_BLOCK(b) \
+    b = _mm_xor_si128(COUNTER_BLOCK(c), rk[0]); c.next();
+#define XOR_STORE(b, i) \
+    STORE(out, i, _mm_xor_si128(b, LOAD(in, i)));
+
+    for (; blocks >= 8; blocks -= 8) {
+	CTR_BLOCK(b0) CTR_BLOCK(b1) CTR_BLOCK(b2) CTR_BLOCK(b3)
+	CTR_BLOCK(b4) CTR_BLOCK(b5) CTR_BLOCK(b6) CTR_BLOCK(b7)
+	for (r = 1; r < rounds; r++) {
+	    AES_ROUND8(_mm_aesenc_si128, rk[r])
+	}
+	AES_ROUND8(_mm_aesenclast_si128, rk[rounds])
+	XOR_STORE(b0, 0) XOR_STORE(b1, 1) XOR_STORE(b2, 2) XOR_STORE(b3, 3)
+	XOR_STORE(b4, 4) XOR_STORE(b5, 5) XOR_STORE(b6, 6) XOR_STORE(b7, 7)
+	in += 8 * AES_BLOCK_SIZE;
+	out += 8 * AES_BLOCK_SIZE;
+    }
+    for (; blocks; blocks--) {
+	CTR_BLOCK(b0)
+	for (r = 1; r < rounds; r++) {
+	    b0 = _mm_aesenc_si128(b0, rk[r]);
+	}
+	b0 = _mm_aesenclast_si128(b0, rk[rounds]);
+	XOR_STORE(b0, 0)
+	in += AES_BLOCK_SIZE;
+	out += AES_BLOCK_SIZE;
+    }
+#undef CTR_BLOCK
+#undef XOR_STORE
+    counter = c;
+}
+
+//
+// VAES does two blocks per instruction in a 256 bit register. Sixteen
+// blocks go through at a time, what's left over takes the AES-NI path.
+//
+#define VAES __attribute__((target("vaes,avx2,aes")))
+
+VAES static void
+ctrVAES(const CKYByte *keys, unsigned int rounds, AESCounter &counter,
+			const CKYByte *in, CKYByte *out, CKYSize blocks)
+{
+    __m256i rk[AES_MAX_ROUNDS + 1];
+    __m256i b0, b1, b2, b3, b4, b5, b6, b7;
+    AESCounter c = counter;
+    unsigned int r;
+
+    for (r = 0; r <= rounds; r++) {
+	rk[r] = _mm256_broadcastsi128_si256(LOAD(keys, r));
+    }
+#define CTR_PAIR(b) { \
+    __m128i first = COUNTER_BLOCK(c); c.next(); \
+    __m128i second = COUNTER_BLOCK(c); c.next(); \
+    b = _mm256_xor_si256(_mm256_inserti128_si256( \
+		_mm256_castsi128_si256(first), second, 1), rk[0]); }
+#define XOR_STORE(b, i) \
+    _mm256_storeu_si256((__m256i *)out + i, _mm256_xor_si256(b, \
+		_mm256_loadu_si256((const __m256i *)in + i)));
+
+    for (; blocks >= 16; blocks -= 16) {
+	CTR_PAIR(b0) CTR_PAIR(b1) CTR_PAIR(b2) CTR_PAIR(b3)
+	CTR_PAIR(b4) CTR_PAIR(b5) CTR_PAIR(b6) CTR_PAIR(b7)
+	for (r = 1; r < rounds; r++) {
+	    AES_ROUND8(_mm256_aesenc_epi128, rk[r])
+	}
+	AES_ROUND8(_mm256_aesenclast_epi128, rk[rounds])
+	XOR_STORE(b0, 0) XOR_STORE(b1, 1) XOR_STORE(b2, 2) XOR_STORE(b3, 3)
+	XOR_STORE(b4, 4) XOR_STORE(b5, 5) XOR_STORE(b6, 6) XOR_STORE(b7, 7)
+	in += 16 * AES_BLOCK_SIZE;
+	out += 16 * AES_BLOCK_SIZE;
+    }
+#undef CTR_PAIR
+#undef XOR_STORE
+    counter = c;
+    if (blocks) {
+	ctrHW(keys, rounds, counter, in, out, blocks);
+    }
+}
+
+//
+// GHASH with carry-less multiplication, on byte reversed values as in
+// Intel's GCM white paper. Four blocks are multiplied by H^4..H^1 and
+// summed before the one reduction.
+//
+#define CLMUL __attribute__((target("pclmul,sse4.1,ssse3")))
+
+#define BSWAP_MASK _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, \
+				8, 9, 10, 11, 12, 13, 14, 15)
+
+CLMUL static inline void
+clmul(__m128i a, __m128i b, __m128i *lo, __m128i *hi)
+{
+    __m128i t0 = _mm_clmulepi64_si128(a, b, 0x00);
+    __m128i t1 = _mm_clmulepi64_si128(a, b, 0x10);
+    __m128i t2 = _mm_clmulepi64_si128(a, b, 0x01);
+    __m128i t3 = _mm_clmulepi64_si128(a, b, 0x11);
+
+    t1 = _mm_xor_si128(t1, t2);
+    *lo = _mm_xor_si128(t0, _mm_slli_si128(t1, 8));
+    *hi = _mm_xor_si128(t3, _mm_srli_si128(t1, 8));
+}
+
+CLMUL static inline __m128i
+reduce(__m128i lo, __m128i hi)
+{
+    __m128i t1, t2, t3;
+
+    // shift the 256 bit product left by one for the bit reflection
+    t1 = _mm_srli_epi32(lo, 31);
+    t2 = _mm_srli_epi32(hi, 31);
+    lo = _mm_slli_epi32(lo, 1);
+    hi = _mm_slli_epi32(hi, 1);
+    t3 = _mm_srli_si128(t1, 12);
+    t2 = _mm_slli_si128(t2, 4);
+    t1 = _mm_slli_si128(t1, 4);
+    lo = _mm_or_si128(lo, t1);
+    hi = _mm_or_si128(_mm_or_si128(hi, t2), t3);
+
+    // reduce modulo x^128 + x^7 + x^2 + x + 1
+    t1 = _mm_xor_si128(_mm_xor_si128(_mm_slli_epi32(lo, 31),
+		_mm_slli_epi32(lo, 30)), _mm_slli_epi32(lo, 25));
+    t2 = _mm_srli_si128(t1, 4);
+    lo = _mm_xor_si128(lo, _mm_slli_si128(t1, 12));
+    t3 = _mm_xor_si128(_mm_xor_si128(_mm_srli_epi32(lo, 1),
+		_mm_srli_epi32(lo, 2)), _mm_srli_epi32(lo, 7));
+    lo = _mm_xor_si128(lo, _mm_xor_si128(t3, t2));
+    return _mm_xor_si128(hi, lo);
+}
+
+CLMUL static void
+ghashPowersHW(GHashKey *key, const CKYByte *h)
+{
+    __m128i h1 = _mm_shuffle_epi8(LOAD(h, 0), BSWAP_MASK);
+    __m128i p = h1, lo, hi;
+
+    STORE(key->powers, 0, h1);
+    for (int i = 1; i < 4; i++) {
+	clmul(p, h1, &lo, &hi);
+	p = reduce(lo, hi);
+	STORE(key->powers, i, p);
+    }
+}
+
+CLMUL static void
+ghashHW(const GHashKey *key, CKYByte *y, const CKYByte *data,
+							CKYSize blocks)
+{
+    const __m128i mask = BSWAP_MASK;
+    __m128i h1 = LOAD(key->powers, 0);
+    __m128i h2 = LOAD(key->powers, 1);
+    __m128i h3 = LOAD(key->powers, 2);
+    __m128i h4 = LOAD(key->powers, 3);
+    __m128i acc = _mm_shuffle_epi8(LOAD(y, 0), mask);
+    __m128i lo, hi, l, h;
+
+    for (; blocks >= 4; blocks -= 4) {
+	__m128i x0 = _mm_xor_si128(_mm_shuffle_epi8(LOAD(data, 0), mask), acc);
+	__m128i x1 = _mm_shuffle_epi8(LOAD(data, 1), mask);
+	__m128i x2 = _mm_shuffle_epi8(LOAD(data, 2), mask);
+	__m128i x3 = _mm_shuffle_epi8(LOAD(data, 3), mask);
+
+	clmul(x0, h4, &lo, &hi);
+	clmul(x1, h3, &l, &h);
+	lo = _mm_xor_si128(lo, l);
+	hi = _mm_xor_si128(hi, h);
+	clmul(x2, h2, &l, &h);
+	lo = _mm_xor_si128(lo, l);
+	hi = _mm_xor_si128(hi, h);
+	clmul(x3, h1, &l, &h);
+	lo = _mm_xor_si128(lo, l);
+	hi = _mm_xor_si128(hi, h);
+	acc = reduce(lo, hi);
+	data += 4 * AES_BLOCK_SIZE;
+    }
+    for (; blocks; blocks--) {
+	clmul(_mm_xor_si128(_mm_shuffle_epi8(LOAD(data, 0), mask), acc), h1,
+								&lo, &hi);
+	acc = reduce(lo, hi);
+	data += AES_BLOCK_SIZE;
+    }
+    STORE(y, 0, _mm_shuffle_epi8(acc, mask));
+}
+
+static bool
+cpuHasAES()
+{
+    unsigned int eax, ebx, ecx, edx;
+
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+	return false;
+    }
+    return (ecx & (1 << 25)) && (ecx & (1 << 1)) &&	// AES, PCLMULQDQ
+	   (ecx & (1 << 19)) && (ecx & (1 << 9));	// SSE4.1, SSSE3
+}
+
+static bool
+cpuHasVAES()
+{
+    unsigned int eax, ebx, ecx, edx, xcr0, xcr0hi;
+
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) ||
+	!(ecx & (1 << 27)) || !(ecx & (1 << 28))) {	// OSXSAVE, AVX
+	return false;
+    }
+    // the OS has to save the upper halves of the registers
+    __asm__ ("xgetbv" : "=a" (xcr0), "=d" (xcr0hi) : "c" (0));
+    if ((xcr0 & 6) != 6 || __get_cpuid_max(0, NULL) < 7) {
+	return false;
+    }
+    __cpuid_count(7, 0, eax, ebx, ecx, edx);
+    return (ebx & (1 << 5)) && (ecx & (1 << 9));	// AVX2, VAES
+}
+#endif
+
+typedef void (*BlockFunc)(const CKYByte *keys, unsigned int rounds,
+				const CKYByte *in, CKYByte *out);
+typedef void (*CbcFunc)(const CKYByte *keys, unsigned int rounds,
+	CKYByte *iv, const CKYByte *in, CKYByte *out, CKYSize blocks);
+typedef void (*CtrFunc)(const CKYByte *keys, unsigned int rounds,
+	AESCounter &counter, const CKYByte *in, CKYByte *out, CKYSize blocks);
+typedef void (*GHashFunc)(const GHashKey *key, CKYByte *y,
+				const CKYByte *data, CKYSize blocks);
+
+static BlockFunc encryptBlockFunc;
+static BlockFunc decryptBlockFunc;
+static CbcFunc cbcEncryptFunc;
+static CbcFunc cbcDecryptFunc;
+static CtrFunc ctrFunc;
+static GHashFunc ghashFunc;
+
+// pick the functions once. Racing threads pick the same ones.
+static void
+selectFuncs()
+{
+    BlockFunc enc = encryptBlockPortable;
+    BlockFunc dec = decryptBlockPortable;
+    CbcFunc cbcEnc = cbcEncryptPortable;
+    CbcFunc cbcDec = cbcDecryptPortable;
+    CtrFunc ctr = ctrPortable;
+    GHashFunc ghash = ghashPortable;
+#ifdef CIPHER_AES_NI
+    if (cpuHasAES()) {
+	enc = encryptBlockHW;
+	dec = decryptBlockHW;
+	cbcEnc = cbcEncryptHW;
+	cbcDec = cbcDecryptHW;
+	ctr = cpuHasVAES() ? ctrVAES : ctrHW;
+	ghash = ghashHW;
+    }
+#endif
+    encryptBlockFunc = enc;
+    decryptBlockFunc = dec;
+    cbcEncryptFunc = cbcEnc;
+    cbcDecryptFunc = cbcDec;
+    ghashFunc = ghash;
+    ctrFunc = ctr;
+}
+
+void
+AESCounter::set(const CKYByte *block, unsigned int counterBits)
+{
+    hi = getBE64(block);
+    lo = getBE64(block + 8);
+    if (counterBits >= 64) {
+	maskLo = ~0ULL;
+	maskHi = (counterBits >= 128) ? ~0ULL :
+				(1ULL << (counterBits - 64)) - 1;
+    } else {
+	maskLo = (1ULL << counterBits) - 1;
+	maskHi = 0;
+    }
+}
+
+void
+AESCounter::get(CKYByte *block) const
+{
+    putBE64(block, hi);
+    putBE64(block + 8, lo);
+}
+
+void
+HostAES::setKey(const CKYByte *key, CKYSize len)
+{
+    unsigned int w[4 * (AES_MAX_ROUNDS + 1)];
+    unsigned int nk = len / 4;
+    unsigned int total, i, r, c;
+    CKYByte rcon = 1;
+
+    if (ctrFunc == NULL) {
+	selectFuncs();
+    }
+    if (len != 16 && len != 24 && len != 32) {
+	throw PKCS11Exception(CKR_KEY_SIZE_RANGE);
+    }
+    rounds = nk + 6;
+    total = 4 * (rounds + 1);
+    for (i = 0; i < nk; i++) {
+	w[i] = getBE32(key + 4*i);
+    }
+    for (i = nk; i < total; i++) {
+	unsigned int t = w[i-1];
+	if (i % nk == 0) {
+	    t = subWord((t << 8) | (t >> 24)) ^ ((unsigned int)rcon << 24);
+	    rcon = xtime(rcon);
+	} else if (nk > 6 && i % nk == 4) {
+	    t = subWord(t);
+	}
+	w[i] = w[i-nk] ^ t;
+    }
+    for (i = 0; i < total; i++) {
+	putBE32(encKeys + 4*i, w[i]);
+    }
+    // the equivalent inverse cipher runs the round keys backwards, with
+    // InvMixColumns applied to all but the outer two
+    for (r = 0; r <= rounds; r++) {
+	for (c = 0; c < 4; c++) {
+	    unsigned int k = w[4*(rounds - r) + c];
+	    if (r != 0 && r != rounds) {
+		k = invMixColumn(k);
+	    }
+	    putBE32(decKeys + AES_BLOCK_SIZE*r + 4*c, k);
+	}
+    }
+    memset(w, 0, sizeof(w));
+}
+
+void
+HostAES::clear()
+{
+    memset(encKeys, 0, sizeof(encKeys));
+    memset(decKeys, 0, sizeof(decKeys));
+    rounds = 0;
+}
+
+void
+HostAES::encryptBlock(const CKYByte *in, CKYByte *out) const
+{
+    (*encryptBlockFunc)(encKeys, rounds, in, out);
+}
+
+void
+HostAES::decryptBlock(const CKYByte *in, CKYByte *out) const
+{
+    (*decryptBlockFunc)(decKeys, rounds, in, out);
+}
+
+void
+HostAES::cbcEncrypt(CKYByte *iv, const CKYByte *in, CKYByte *out,
+						CKYSize blocks) const
+{
+    if (blocks) {
+	(*cbcEncryptFunc)(encKeys, rounds, iv, in, out, blocks);
+    }
+}
+
+void
+HostAES::cbcDecrypt(CKYByte *iv, const CKYByte *in, CKYByte *out,
+						CKYSize blocks) const
+{
+    if (blocks) {
+	(*cbcDecryptFunc)(decKeys, rounds, iv, in, out, blocks);
+    }
+}
+
+void
+HostAES::ctr(AESCounter &counter, const CKYByte *in, CKYByte *out,
+						CKYSize blocks) const
+{
+    if (blocks) {
+	(*ctrFunc)(encKeys, rounds, counter, in, out, blocks);
+    }
+}
+
+void
+GHash::init(const CKYByte *h)
+{
+    if (ghashFunc == NULL) {
+	selectFuncs();
+    }
+    ghashTables(&key, h);
+#ifdef CIPHER_AES_NI
+    if (ghashFunc == ghashHW) {
+	ghashPowersHW(&key, h);
+    }
+#endif
+    memset(y, 0, sizeof(y));
+}
+
+void
+GHash::update(const CKYByte *data, CKYSize blocks)
+{
+    if (blocks) {
+	(*ghashFunc)(&key, y, data, blocks);
+    }
+}
+
+bool
+CipherState::isCipherMechanism(CK_MECHANISM_TYPE mech)
+{
+    return mech == CKM_AES_CBC_PAD || mech == CKM_AES_CTR ||
+						mech == CKM_AES_GCM;
+}
+
+void
+CipherState::init(CK_MECHANISM_PTR pMechanism, const CKYBuffer *key,
+							bool encrypt)
+{
+    if (active) {
+	throw PKCS11Exception(CKR_OPERATION_ACTIVE);
+    }
+    if (pMechanism == NULL) {
+	throw PKCS11Exception(CKR_ARGUMENTS_BAD);
+    }
+    if (!isCipherMechanism(pMechanism->mechanism)) {
+	throw PKCS11Exception(CKR_MECHANISM_INVALID);
+    }
+    aes.setKey(CKYBuffer_Data(key), CKYBuffer_Size(key));
+    mechanism = pMechanism->mechanism;
+    encrypting = encrypt;
+    pendingLen = 0;
+    keystreamLeft = 0;
+    hashPendingLen = 0;
+    aadLen = 0;
+    dataLen = 0;
+    held.clear();
+    try {
+	switch (mechanism) {
+	case CKM_AES_CBC_PAD:
+	    initCBC(pMechanism);
+	    break;
+	case CKM_AES_CTR:
+	    initCTR(pMechanism);
+	    break;
+	default:
+	    initGCM(pMechanism);
+	    break;
+	}
+    } catch (PKCS11Exception &) {
+	end();
+	throw;
+    }
+    active = true;
+}
+
+void
+CipherState::initCBC(CK_MECHANISM_PTR pMechanism)
+{
+    if (pMechanism->pParameter == NULL ||
+			pMechanism->ulParameterLen != AES_BLOCK_SIZE) {
+	throw PKCS11Exception(CKR_MECHANISM_PARAM_INVALID);
+    }
+    memcpy(iv, pMechanism->pParameter, AES_BLOCK_SIZE);
+}
+
+void
+CipherState::initCTR(CK_MECHANISM_PTR pMechanism)
+{
+    const CK_AES_CTR_PARAMS *params =
+		(const CK_AES_CTR_PARAMS *)pMechanism->pParameter;
+
+    if (params == NULL ||
+		pMechanism->ulParameterLen != sizeof(CK_AES_CTR_PARAMS) ||
+		params->ulCounterBits == 0 || params->ulCounterBits > 128) {
+	throw PKCS11Exception(CKR_MECHANISM_PARAM_INVALID);
+    }
+    counter.set(params->cb, params->ulCounterBits);
+    // the key stream repeats once the counter has gone all the way round
+    blocksLeft = (params->ulCounterBits >= 64) ? ~0ULL :
+					1ULL << params->ulCounterBits;
+}
+
+void
+CipherState::initGCM(CK_MECHANISM_PTR pMechanism)
+{
+    CK_GCM_PARAMS params;
+    CKYByte h[AES_BLOCK_SIZE];
+    CKYByte j0[AES_BLOCK_SIZE];
+
+    if (!getGCMParams(pMechanism, &params) || params.pIv == NULL ||
+		params.ulIvLen == 0 ||
+		(params.pAAD == NULL && params.ulAADLen != 0) ||
+		params.ulTagBits < 32 || params.ulTagBits > 128 ||
+		params.ulTagBits % 8 != 0) {
+	throw PKCS11Exception(CKR_MECHANISM_PARAM_INVALID);
+    }
+    tagLen = params.ulTagBits / 8;
+
+    memset(h, 0, sizeof(h));
+    aes.encryptBlock(h, h);
+    ghash.init(h);
+    if (params.ulIvLen == 12) {
+	memcpy(j0, params.pIv, 12);
+	putBE32(j0 + 12, 1);
+    } else {
+	// other IV lengths are hashed down to a block
+	gcmHash(params.pIv, params.ulIvLen);
+	gcmHashFlush();
+	memset(j0, 0, 8);
+	putBE64(j0 + 8, (unsigned long long)params.ulIvLen * 8);
+	ghash.update(j0, 1);
+	memcpy(j0, ghash.get(), AES_BLOCK_SIZE);
+	ghash.init(h);
+    }
+    aes.encryptBlock(j0, tagMask);
+    counter.set(j0, 32);
+    counter.next();
+    blocksLeft = 0xfffffffeULL;
+
+    gcmHash(params.pAAD, params.ulAADLen);
+    gcmHashFlush();
+    aadLen = params.ulAADLen;
+    memset(h, 0, sizeof(h));
+}
+
+void
+CipherState::end()
+{
+    active = false;
+    aes.clear();
+    ghash.clear();
+    memset(iv, 0, sizeof(iv));
+    memset(pending, 0, sizeof(pending));
+    memset(keystream, 0, sizeof(keystream));
+    memset(tagMask, 0, sizeof(tagMask));
+    pendingLen = 0;
+    keystreamLeft = 0;
+    std::vector<CKYByte>().swap(held);
+}
+
+void
+CipherState::ctrXor(const CKYByte *in, CKYByte *out, CKYSize len)
+{
+    CKYSize blocks;
+
+    // finish the key stream block the last call started
+    while (keystreamLeft && len) {
+	*out++ = *in++ ^ keystream[AES_BLOCK_SIZE - keystreamLeft--];
+	len--;
+    }
+    blocks = (len + AES_BLOCK_SIZE - 1) / AES_BLOCK_SIZE;
+    if (blocks > blocksLeft) {
+	throw PKCS11Exception(CKR_DATA_LEN_RANGE,
+		"AES counter would wrap\n");
+    }
+    blocksLeft -= blocks;
+
+    blocks = len / AES_BLOCK_SIZE;
+    aes.ctr(counter, in, out, blocks);
+    in += blocks * AES_BLOCK_SIZE;
+    out += blocks * AES_BLOCK_SIZE;
+    len -= blocks * AES_BLOCK_SIZE;
+    if (len) {
+	memset(keystream, 0, sizeof(keystream));
+	aes.ctr(counter, keystream, keystream, 1);
+	for (CKYSize i = 0; i < len; i++) {
+	    out[i] = in[i] ^ keystream[i];
+	}
+	keystreamLeft = AES_BLOCK_SIZE - len;
+    }
+}
+
+void
+CipherState::gcmHash(const CKYByte *data, CKYSize len)
+{
+    CKYSize blocks;
+
+    if (hashPendingLen) {
+	CKYSize take = MIN(AES_BLOCK_SIZE - hashPendingLen, len);
+	memcpy(hashPending + hashPendingLen, data, take);
+	hashPendingLen += take;
+	data += take;
+	len -= take;
+	if (hashPendingLen < AES_BLOCK_SIZE) {
+	    return;
+	}
+	ghash.update(hashPending, 1);
+	hashPendingLen = 0;
+    }
+    blocks = len / AES_BLOCK_SIZE;
+    ghash.update(data, blocks);
+    data += blocks * AES_BLOCK_SIZE;
+    len -= blocks * AES_BLOCK_SIZE;
+    if (len) {
+	memcpy(hashPending, data, len);
+	hashPendingLen = len;
+    }
+}
+
+// the AAD and the ciphertext are each padded out to a block
+void
+CipherState::gcmHashFlush()
+{
+    if (hashPendingLen) {
+	memset(hashPending + hashPendingLen, 0,
+					AES_BLOCK_SIZE - hashPendingLen);
+	ghash.update(hashPending, 1);
+	hashPendingLen = 0;
+    }
+}
+
+void
+CipherState::gcmTag(CKYByte *tag)
+{
+    CKYByte lengths[AES_BLOCK_SIZE];
+
+    gcmHashFlush();
+    putBE64(lengths, aadLen * 8);
+    putBE64(lengths + 8, dataLen * 8);
+    ghash.update(lengths, 1);
+    for (int i = 0; i < AES_BLOCK_SIZE; i++) {
+	tag[i] = ghash.get()[i] ^ tagMask[i];
+    }
+}
+
+// check the tag before any plaintext is made
+void
+CipherState::gcmOpen(const CKYByte *in, CKYSize len, const CKYByte *tag,
+							CKYByte *out)
+{
+    CKYByte expected[AES_BLOCK_SIZE];
+    CKYByte diff = 0;
+
+    gcmHash(in, len);
+    dataLen += len;
+    gcmTag(expected);
+    for (CKYSize i = 0; i < tagLen; i++) {
+	diff |= expected[i] ^ tag[i];
+    }
+    if (diff) {
+	throw PKCS11Exception(CKR_ENCRYPTED_DATA_INVALID);
+    }
+    ctrXor(in, out, len);
+}
+
+//
+// decrypt the last CBC block and strip the padding. Returns the length
+// left, writing it to out unless out is NULL.
+//
+CKYSize
+CipherState::unpad(const CKYByte *prev, const CKYByte *last,
+							CKYByte *out) const
+{
+    CKYByte block[AES_BLOCK_SIZE];
+    CKYByte bad = 0;
+    CKYSize pad, i;
+
+    aes.decryptBlock(last, block);
+    for (i = 0; i < AES_BLOCK_SIZE; i++) {
+	block[i] ^= prev[i];
+    }
+    pad = block[AES_BLOCK_SIZE - 1];
+    if (pad == 0 || pad > AES_BLOCK_SIZE) {
+	throw PKCS11Exception(CKR_ENCRYPTED_DATA_INVALID);
+    }
+    for (i = AES_BLOCK_SIZE - pad; i < AES_BLOCK_SIZE; i++) {
+	bad |= block[i] ^ (CKYByte)pad;
+    }
+    if (bad) {
+	throw PKCS11Exception(CKR_ENCRYPTED_DATA_INVALID);
+    }
+    if (out) {
+	memcpy(out, block, AES_BLOCK_SIZE - pad);
+    }
+    memset(block, 0, sizeof(block));
+    return AES_BLOCK_SIZE - pad;
+}
+
+CKYSize
+CipherState::updateLength(CKYSize len) const
+{
+    CKYSize total = pendingLen + len;
+
+    switch (mechanism) {
+    case CKM_AES_CBC_PAD:
+	if (encrypting) {
+	    return total - total % AES_BLOCK_SIZE;
+	}
+	// the last full block may be all padding, it waits for the final
+	if (total == 0) {
+	    return 0;
+	}
+	return total - (total % AES_BLOCK_SIZE ? total % AES_BLOCK_SIZE :
+							AES_BLOCK_SIZE);
+    case CKM_AES_GCM:
+	return encrypting ? len : 0;
+    }
+    return len;
+}
+
+CKYSize
+CipherState::finalLength() const
+{
+    switch (mechanism) {
+    case CKM_AES_CBC_PAD:
+	if (encrypting) {
+	    return AES_BLOCK_SIZE;
+	}
+	if (pendingLen != AES_BLOCK_SIZE) {
+	    throw PKCS11Exception(CKR_ENCRYPTED_DATA_LEN_RANGE);
+	}
+	return unpad(iv, pending, NULL);
+    case CKM_AES_GCM:
+	if (encrypting) {
+	    return tagLen;
+	}
+	if (held.size() < tagLen) {
+	    throw PKCS11Exception(CKR_ENCRYPTED_DATA_LEN_RANGE);
+	}
+	return held.size() - tagLen;
+    }
+    return 0;
+}
+
+CKYSize
+CipherState::doUpdate(const CKYByte *in, CKYSize len, CKYByte *out)
+{
+    CKYSize produced = 0;
+    CKYSize outLen, blocks, take, done;
+
+    switch (mechanism) {
+    case CKM_AES_CBC_PAD:
+	outLen = updateLength(len);
+	if (outLen == 0) {
+	    memcpy(pending + pendingLen, in, len);
+	    pendingLen += len;
+	    return 0;
+	}
+	if (pendingLen) {
+	    take = AES_BLOCK_SIZE - pendingLen;
+	    memcpy(pending + pendingLen, in, take);
+	    in += take;
+	    len -= take;
+	    if (encrypting) {
+		aes.cbcEncrypt(iv, pending, out, 1);
+	    } else {
+		aes.cbcDecrypt(iv, pending, out, 1);
+	    }
+	    produced = AES_BLOCK_SIZE;
+	    pendingLen = 0;
+	}
+	blocks = (outLen - produced) / AES_BLOCK_SIZE;
+	if (encrypting) {
+	    aes.cbcEncrypt(iv, in, out + produced, blocks);
+	} else {
+	    aes.cbcDecrypt(iv, in, out + produced, blocks);
+	}
+	in += blocks * AES_BLOCK_SIZE;
+	len -= blocks * AES_BLOCK_SIZE;
+	memcpy(pending, in, len);
+	pendingLen = len;
+	return outLen;
+    case CKM_AES_GCM:
+	if (!encrypting) {
+	    held.insert(held.end(), in, in + len);
+	    return 0;
+	}
+	for (done = 0; done < len; done += take) {
+	    take = MIN(len - done, GCM_CHUNK);
+	    ctrXor(in + done, out + done, take);
+	    gcmHash(out + done, take);
+	}
+	dataLen += len;
+	return len;
+    }
+    ctrXor(in, out, len);
+    return len;
+}
+
+CKYSize
+CipherState::doFinal(CKYByte *out)
+{
+    CKYByte tag[AES_BLOCK_SIZE];
+    CKYSize len;
+
+    switch (mechanism) {
+    case CKM_AES_CBC_PAD:
+	if (!encrypting) {
+	    return unpad(iv, pending, out);
+	}
+	memset(pending + pendingLen, AES_BLOCK_SIZE - pendingLen,
+					AES_BLOCK_SIZE - pendingLen);
+	aes.cbcEncrypt(iv, pending, out, 1);
+	return AES_BLOCK_SIZE;
+    case CKM_AES_GCM:
+	if (encrypting) {
+	    gcmTag(tag);
+	    memcpy(out, tag, tagLen);
+	    return tagLen;
+	}
+	len = held.size() - tagLen;
+	gcmOpen(&held[0], len, &held[len], out);
+	return len;
+    }
+    return 0;
+}
+
+void
+CipherState::cryptAll(CK_BYTE_PTR pInput, CK_ULONG ulInputLen,
+		CK_BYTE_PTR pOutput, CK_ULONG_PTR pulOutputLen)
+{
+    CKYSize need, len;
+
+    if (!active) {
+	throw PKCS11Exception(CKR_OPERATION_NOT_INITIALIZED);
+    }
+    if (pulOutputLen == NULL || (pInput == NULL && ulInputLen != 0)) {
+	end();
+	throw PKCS11Exception(CKR_ARGUMENTS_BAD);
+    }
+    try {
+	if (!encrypting && mechanism == CKM_AES_GCM) {
+	    if (ulInputLen < tagLen) {
+		throw PKCS11Exception(CKR_ENCRYPTED_DATA_LEN_RANGE);
+	    }
+	    need = ulInputLen - tagLen;
+	} else if (!encrypting && mechanism == CKM_AES_CBC_PAD) {
+	    if (ulInputLen == 0 || ulInputLen % AES_BLOCK_SIZE) {
+		throw PKCS11Exception(CKR_ENCRYPTED_DATA_LEN_RANGE);
+	    }
+	    // the exact length needs the padding, in the last block
+	    need = ulInputLen - AES_BLOCK_SIZE + unpad(ulInputLen >
+		AES_BLOCK_SIZE ? pInput + ulInputLen - 2*AES_BLOCK_SIZE : iv,
+		pInput + ulInputLen - AES_BLOCK_SIZE, NULL);
+	} else {
+	    need = updateLength(ulInputLen) + finalLength();
+	}
+    } catch (PKCS11Exception &) {
+	end();
+	throw;
+    }
+    if (pOutput == NULL) {
+	*pulOutputLen = need;
+	return;
+    }
+    if (*pulOutputLen < need) {
+	*pulOutputLen = need;
+	throw PKCS11Exception(CKR_BUFFER_TOO_SMALL);
+    }
+    try {
+	if (!encrypting && mechanism == CKM_AES_GCM) {
+	    // straight from the caller's buffer, nothing is held
+	    gcmOpen(pInput, need, pInput + need, pOutput);
+	} else {
+	    len = doUpdate(pInput, ulInputLen, pOutput);
+	    need = len + doFinal(pOutput + len);
+	}
+    } catch (PKCS11Exception &) {
+	end();
+	throw;
+    }
+    *pulOutputLen = need;
+    end();
+}
+
+void
+CipherState::update(CK_BYTE_PTR pInput, CK_ULONG ulInputLen,
+		CK_BYTE_PTR pOutput, CK_ULONG_PTR pulOutputLen)
+{
+    CKYSize need;
+
+    if (!active) {
+	throw PKCS11Exception(CKR_OPERATION_NOT_INITIALIZED);
+    }
+    if (pulOutputLen == NULL || (pInput == NULL && ulInputLen != 0)) {
+	end();
+	throw PKCS11Exception(CKR_ARGUMENTS_BAD);
+    }
+    need = updateLength(ulInputLen);
+    if (pOutput == NULL) {
+	*pulOutputLen = need;
+	return;
+    }
+    if (*pulOutputLen < need) {
+	*pulOutputLen = need;
+	throw PKCS11Exception(CKR_BUFFER_TOO_SMALL);
+    }
+    try {
+	*pulOutputLen = doUpdate(pInput, ulInputLen, pOutput);
+    } catch (PKCS11Exception &) {
+	end();
+	throw;
+    }
+}
+
+void
+CipherState::final(CK_BYTE_PTR pOutput, CK_ULONG_PTR pulOutputLen)
+{
+    CKYSize need;
+
+    if (!active) {
+	throw PKCS11Exception(CKR_OPERATION_NOT_INITIALIZED);
+    }
+    if (pulOutputLen == NULL) {
+	end();
+	throw PKCS11Exception(CKR_ARGUMENTS_BAD);
+    }
+    try {
+	need = finalLength();
+    } catch (PKCS11Exception &) {
+	end();
+	throw;
+    }
+    if (pOutput == NULL) {
+	*pulOutputLen = need;
+	return;
+    }
+    if (*pulOutputLen < need) {
+	*pulOutputLen = need;
+	throw PKCS11Exception(CKR_BUFFER_TOO_SMALL);
+    }
+    try {
+	*pulOutputLen = doFinal(pOutput);
+    } catch (PKCS11Exception &) {
+	end();
+	throw;
+    }
+    end();
+}
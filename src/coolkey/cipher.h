@@ -0,0 +1,209 @@
+/* ***** BEGIN COPYRIGHT BLOCK *****
+ * Copyright (C) 2005 Red Hat, Inc.
+ * All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation version
+ * 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ * ***** END COPYRIGHT BLOCK *****/
+
+#ifndef COOLKEY_CIPHER_H
+#define COOLKEY_CIPHER_H
+
+#include <string.h>
+#include <vector>
+#include "mypkcs11.h"
+#include "cky_base.h"
+
+#define AES_BLOCK_SIZE 16
+#define AES_MAX_ROUNDS 14
+
+//
+// A counter block for CTR and GCM, kept as two big endian halves so
+// stepping it is a couple of integer operations. Only the low bits
+// count, the rest of the block stays as it was given.
+//
+struct AESCounter {
+    unsigned long long hi, lo;
+    unsigned long long maskHi, maskLo;	// the bits that count
+
+    void set(const CKYByte *block, unsigned int counterBits);
+    void get(CKYByte *block) const;
+    void next() {
+	unsigned long long nextLo = (lo & ~maskLo) | ((lo + 1) & maskLo);
+	if (maskHi && (lo & maskLo) == maskLo) {
+	    hi = (hi & ~maskHi) | ((hi + 1) & maskHi);
+	}
+	lo = nextLo;
+    }
+};
+
+//
+// AES with an expanded key. The bulk routines use AES-NI, and VAES for
+// counter mode, when the CPU has them. In and out may be the same
+// buffer.
+//
+class HostAES {
+  private:
+    unsigned int rounds;
+    // round keys in byte order, decKeys for the equivalent inverse cipher
+    CKYByte encKeys[AES_BLOCK_SIZE * (AES_MAX_ROUNDS + 1)];
+    CKYByte decKeys[AES_BLOCK_SIZE * (AES_MAX_ROUNDS + 1)];
+
+  public:
+    HostAES() : rounds(0) { }
+    ~HostAES() { clear(); }
+
+    // throws CKR_KEY_SIZE_RANGE unless the key is 16, 24 or 32 bytes
+    void setKey(const CKYByte *key, CKYSize len);
+    void clear();
+
+    void encryptBlock(const CKYByte *in, CKYByte *out) const;
+    void decryptBlock(const CKYByte *in, CKYByte *out) const;
+    // iv is the chaining block, updated for the next call
+    void cbcEncrypt(CKYByte *iv, const CKYByte *in, CKYByte *out,
+						CKYSize blocks) const;
+    void cbcDecrypt(CKYByte *iv, const CKYByte *in, CKYByte *out,
+						CKYSize blocks) const;
+    // xors the key stream into in, counter is left at the next block
+    void ctr(AESCounter &counter, const CKYByte *in, CKYByte *out,
+						CKYSize blocks) const;
+};
+
+//
+// The GCM hash. The portable code uses 4 bit tables, PCLMULQDQ hashes
+// four blocks per reduction with the powers of H.
+//
+struct GHashKey {
+    unsigned long long hl[16], hh[16];
+    CKYByte powers[4 * AES_BLOCK_SIZE];	// H^1..H^4, byte reversed
+};
+
+class GHash {
+  private:
+    GHashKey key;
+    CKYByte y[AES_BLOCK_SIZE];
+  public:
+    void init(const CKYByte *h);
+    void clear() { memset(&key, 0, sizeof(key)); memset(y, 0, sizeof(y)); }
+    void update(const CKYByte *data, CKYSize blocks);
+    const CKYByte *get() const { return y; }
+};
+
+//
+// Callers built against older headers (NSS before 3.52 among them) pass
+// GCM parameters without ulIvBits. Takes either layout, false if the
+// parameter is neither.
+//
+struct CK_GCM_PARAMS_NO_IVBITS {
+    CK_BYTE_PTR pIv;
+    CK_ULONG ulIvLen;
+    CK_BYTE_PTR pAAD;
+    CK_ULONG ulAADLen;
+    CK_ULONG ulTagBits;
+};
+
+inline bool
+getGCMParams(const CK_MECHANISM *pMechanism, CK_GCM_PARAMS *params)
+{
+    if (pMechanism->pParameter == NULL) {
+	return false;
+    }
+    if (pMechanism->ulParameterLen == sizeof(CK_GCM_PARAMS)) {
+	*params = *(const CK_GCM_PARAMS *)pMechanism->pParameter;
+	return true;
+    }
+    if (pMechanism->ulParameterLen == sizeof(CK_GCM_PARAMS_NO_IVBITS)) {
+	const CK_GCM_PARAMS_NO_IVBITS *old =
+		(const CK_GCM_PARAMS_NO_IVBITS *)pMechanism->pParameter;
+	params->pIv = old->pIv;
+	params->ulIvLen = old->ulIvLen;
+	params->ulIvBits = old->ulIvLen * 8;
+	params->pAAD = old->pAAD;
+	params->ulAADLen = old->ulAADLen;
+	params->ulTagBits = old->ulTagBits;
+	return true;
+    }
+    return false;
+}
+
+//
+// A session's C_Encrypt or C_Decrypt with CKM_AES_CBC_PAD, CKM_AES_CTR or
+// CKM_AES_GCM, single or multi part, with the PKCS #11 rules for length
+// questions and for which errors end the operation. GCM decryption keeps
+// the ciphertext until C_DecryptFinal, no plaintext comes out before the
+// tag has been checked.
+//
+class CipherState {
+  private:
+    bool active;
+    bool encrypting;
+    CK_MECHANISM_TYPE mechanism;
+    HostAES aes;
+    // CBC
+    CKYByte iv[AES_BLOCK_SIZE];
+    CKYByte pending[AES_BLOCK_SIZE];	// input short of a block
+    CKYSize pendingLen;
+    // CTR and GCM
+    AESCounter counter;
+    unsigned long long blocksLeft;	// before the counter comes round
+    CKYByte keystream[AES_BLOCK_SIZE];
+    CKYSize keystreamLeft;		// unused bytes at its end
+    // GCM
+    GHash ghash;
+    CKYByte tagMask[AES_BLOCK_SIZE];	// E(J0)
+    CKYSize tagLen;
+    unsigned long long aadLen, dataLen;
+    CKYByte hashPending[AES_BLOCK_SIZE];
+    CKYSize hashPendingLen;
+    std::vector<CKYByte> held;		// GCM ciphertext being decrypted
+
+    void initCBC(CK_MECHANISM_PTR pMechanism);
+    void initCTR(CK_MECHANISM_PTR pMechanism);
+    void initGCM(CK_MECHANISM_PTR pMechanism);
+    void end();
+
+    void ctrXor(const CKYByte *in, CKYByte *out, CKYSize len);
+    void gcmHash(const CKYByte *data, CKYSize len);
+    void gcmHashFlush();
+    void gcmTag(CKYByte *tag);
+    void gcmOpen(const CKYByte *in, CKYSize len, const CKYByte *tag,
+							CKYByte *out);
+    CKYSize unpad(const CKYByte *prev, const CKYByte *last,
+							CKYByte *out) const;
+
+    CKYSize updateLength(CKYSize len) const;
+    CKYSize finalLength() const;
+    CKYSize doUpdate(const CKYByte *in, CKYSize len, CKYByte *out);
+    CKYSize doFinal(CKYByte *out);
+
+  public:
+    CipherState() : active(false), encrypting(false), mechanism(0),
+	pendingLen(0), blocksLeft(0), keystreamLeft(0), tagLen(0),
+	aadLen(0), dataLen(0), hashPendingLen(0) { }
+
+    static bool isCipherMechanism(CK_MECHANISM_TYPE mech);
+
+    // key is the CKA_VALUE of the secret key
+    void init(CK_MECHANISM_PTR pMechanism, const CKYBuffer *key,
+							bool encrypt);
+    bool isActive() const { return active; }
+
+    void cryptAll(CK_BYTE_PTR pInput, CK_ULONG ulInputLen,
+			CK_BYTE_PTR pOutput, CK_ULONG_PTR pulOutputLen);
+    void update(CK_BYTE_PTR pInput, CK_ULONG ulInputLen,
+			CK_BYTE_PTR pOutput, CK_ULONG_PTR pulOutputLen);
+    void final(CK_BYTE_PTR pOutput, CK_ULONG_PTR pulOutputLen);
+};
+
+#endif
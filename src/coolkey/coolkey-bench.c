@@ -0,0 +1,1176 @@
+/* ***** BEGIN COPYRIGHT BLOCK *****
+ * Copyright (C) 2006 Red Hat, Inc.
+ * All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation version
+ * 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ * ***** END COPYRIGHT BLOCK ***** */
+
+/*
+ * coolkey-bench: drive the CoolKey PKCS #11 module through a set of
+ * scenarios and report throughput, latency and APDU counts as JSON.
+ *
+ * The module is loaded with dlopen, so the same binary can be pointed at
+ * different builds to compare releases. APDUs are counted by having
+ * libckyapplet record the session (CKY_APDU_RECORD_FILE) and counting
+ * transmit records, which works against a real card or a replayed one
+ * (CKY_APDU_REPLAY_FILE).
+ *
+ * With -b the results are checked against an APDU budget table (see
+ * apdu-budgets.txt). A scenario which goes over budget prints the APDU
+ * sequence it sent and the program exits non-zero, so a replayed session
+ * can be used to catch regressions that add card round trips. -W writes
+ * the sequence of every scenario to a baseline file, and with -B the
+ * sequence of a scenario over budget is printed as a diff against it.
+ *
+ * init-cold empties the token cache in COOL_KEY_CACHE_DIR before every
+ * C_Initialize, init-warm leaves what the last one cached.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/time.h>
+#include "mypkcs11.h"
+
+#define DEFAULT_MODULE "libcoolkeypk11.so"
+#define MAX_SLOTS 32
+#define MAX_KEYS 8
+#define MAX_OBJECTS 256
+#define MAX_BUDGETS 128
+#define MAX_DIFF_LINES 2000
+
+/* libckyapplet record file layout, see cky_record.c */
+#define RECORD_MAGIC_LEN 8
+#define RECORD_HEADER_LEN 9
+#define RECORD_TRANSMIT 'T'
+#define RECORD_BEGIN 'B'
+
+typedef struct {
+    const char *name;
+    int perSession;	/* runs on the worker threads */
+} Scenario;
+
+static const Scenario scenarios[] = {
+    { "init-cold", 0 },
+    { "init-warm", 0 },
+    { "slots", 0 },
+    { "login", 1 },
+    { "find", 1 },
+    { "attr", 1 },
+    { "sign", 1 },
+    { "decrypt", 1 },
+    { "derive", 1 },
+    { "wait", 0 },
+};
+static const int scenarioCount = sizeof(scenarios)/sizeof(scenarios[0]);
+
+typedef struct {
+    char cardType[32];
+    char scenario[16];
+    double apdus;		/* per op */
+    double transactions;	/* per op */
+} Budget;
+
+typedef struct {
+    long apdus;
+    long transactions;
+} Usage;
+
+/* what one scenario sent in the baseline run, see readRecording */
+typedef struct {
+    char scenario[16];
+    char **lines;
+    int lineCount;
+} Baseline;
+
+typedef struct {
+    CK_OBJECT_HANDLE handle;
+    CK_KEY_TYPE keyType;
+    CK_BYTE id[64];
+    CK_ULONG idLen;
+    CK_BYTE point[256];	/* EC keys only, for derive */
+    CK_ULONG pointLen;
+} KeyInfo;
+
+/*
+ * every worker has a session of its own, and everything it reuses between
+ * ops hangs off it
+ */
+typedef struct {
+    CK_SLOT_ID slot;
+    CK_SESSION_HANDLE session;
+    KeyInfo keys[MAX_KEYS];
+    int keyCount;
+    CK_OBJECT_HANDLE objects[MAX_OBJECTS];
+    CK_ULONG objectCount;
+    const KeyInfo *decryptKey;	/* RSA key the ciphertext is for */
+    CK_BYTE cipher[1024];
+    CK_ULONG cipherLen;
+} SessionInfo;
+
+typedef struct {
+    const Scenario *scenario;
+    SessionInfo *session;
+    int iterations;
+    double *latency;	/* milliseconds, one per op */
+    int ops;
+    int errors;
+    CK_RV lastError;
+} Worker;
+
+static CK_FUNCTION_LIST_PTR p11;
+static const char *pin;
+static CK_ULONG pinLen;
+static const char *recordFile;
+static long recordOffset;
+static CK_SLOT_ID slots[MAX_SLOTS];
+static CK_ULONG slotCount;
+static SessionInfo *sessions;
+static int sessionCount;
+static Budget budgets[MAX_BUDGETS];
+static int budgetCount;
+static Baseline baselines[sizeof(scenarios)/sizeof(scenarios[0])];
+static int baselineCount;
+static const char *cardType = "*";
+
+static double
+now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec*1000.0 + ts.tv_nsec/1000000.0;
+}
+
+/*
+ * count the transmit and begin transaction records written since the last
+ * call. If trace is set, the header of each APDU is written to it.
+ */
+static CK_RV
+readRecording(Usage *usage, FILE *trace)
+{
+    FILE *file;
+    unsigned char header[RECORD_HEADER_LEN];
+
+    usage->apdus = usage->transactions = 0;
+    if (!recordFile || !(file = fopen(recordFile, "rb"))) {
+	return CKR_GENERAL_ERROR;
+    }
+    if (recordOffset == 0) {
+	recordOffset = RECORD_MAGIC_LEN;
+    }
+    fseek(file, recordOffset, SEEK_SET);
+    while (fread(header, 1, sizeof(header), file) == sizeof(header)) {
+	unsigned char len[2];
+	unsigned char apdu[4];
+	int skip;
+
+	switch (header[0]) {
+	case 'C':
+	    skip = 4;
+	    break;
+	case 'S':
+	    skip = 8;
+	    break;
+	case RECORD_BEGIN:
+	    if (fseek(file, 4, SEEK_CUR) != 0) {
+		goto done;
+	    }
+	    usage->transactions++;
+	    if (trace) {
+		fprintf(trace, "    -- begin transaction\n");
+	    }
+	    recordOffset = ftell(file);
+	    continue;
+	case RECORD_TRANSMIT:
+	    /* usec, rv, then the command */
+	    if (fseek(file, 8, SEEK_CUR) != 0 || fread(len, 1, 2, file) != 2) {
+		goto done;
+	    }
+	    if (trace && (len[0] | (len[1] << 8)) >= 4 &&
+				fread(apdu, 1, 4, file) == 4) {
+		fprintf(trace, "    %02x %02x %02x %02x\n",
+				apdu[0], apdu[1], apdu[2], apdu[3]);
+		fseek(file, (len[0] | (len[1] << 8)) - 4, SEEK_CUR);
+	    } else {
+		fseek(file, len[0] | (len[1] << 8), SEEK_CUR);
+	    }
+	    skip = 0;
+	    usage->apdus++;
+	    break;
+	default:
+	    goto done;
+	}
+	if (fseek(file, skip, SEEK_CUR) != 0 || fread(len, 1, 2, file) != 2) {
+	    goto done;
+	}
+	fseek(file, len[0] | (len[1] << 8), SEEK_CUR);
+	recordOffset = ftell(file);
+    }
+done:
+    fclose(file);
+    return CKR_OK;
+}
+
+/*
+ * budget table, one entry per line:
+ *   cardType scenario apdusPerOp transactionsPerOp
+ * cardType "*" matches any card. '#' starts a comment.
+ */
+static int
+loadBudgets(const char *fileName)
+{
+    FILE *file = fopen(fileName, "r");
+    char line[256];
+
+    if (!file) {
+	return 0;
+    }
+    while (fgets(line, sizeof(line), file) && budgetCount < MAX_BUDGETS) {
+	Budget *budget = &budgets[budgetCount];
+	char *comment = strchr(line, '#');
+
+	if (comment) {
+	    *comment = 0;
+	}
+	if (sscanf(line, "%31s %15s %lf %lf", budget->cardType, 
+		budget->scenario, &budget->apdus, &budget->transactions) == 4) {
+	    budgetCount++;
+	}
+    }
+    fclose(file);
+    return 1;
+}
+
+/*
+ * the most specific budget for this scenario, exact card type before "*"
+ */
+static const Budget *
+findBudget(const char *scenario)
+{
+    const Budget *wildcard = NULL;
+    int i;
+
+    for (i = 0; i < budgetCount; i++) {
+	if (strcmp(budgets[i].scenario, scenario) != 0) {
+	    continue;
+	}
+	if (strcmp(budgets[i].cardType, cardType) == 0) {
+	    return &budgets[i];
+	}
+	if (strcmp(budgets[i].cardType, "*") == 0) {
+	    wildcard = &budgets[i];
+	}
+    }
+    return wildcard;
+}
+
+/*
+ * the next line of a file, without the new line or the indent. NULL at
+ * the end of the file. The caller frees it.
+ */
+static char *
+readLine(FILE *file)
+{
+    char buf[256];
+    char *start;
+    size_t len;
+
+    if (!fgets(buf, sizeof(buf), file)) {
+	return NULL;
+    }
+    len = strlen(buf);
+    while (len && (buf[len-1] == '\n' || buf[len-1] == '\r')) {
+	buf[--len] = 0;
+    }
+    for (start = buf; *start == ' ' || *start == '\t'; start++)
+	;
+    return strdup(start);
+}
+
+static void
+appendLine(Baseline *baseline, char *line)
+{
+    char **lines = (char **)realloc(baseline->lines, 
+			(baseline->lineCount+1)*sizeof(char *));
+
+    if (!lines) {
+	free(line);
+	return;
+    }
+    lines[baseline->lineCount++] = line;
+    baseline->lines = lines;
+}
+
+static void
+freeLines(Baseline *baseline)
+{
+    int i;
+
+    for (i = 0; i < baseline->lineCount; i++) {
+	free(baseline->lines[i]);
+    }
+    free(baseline->lines);
+    baseline->lines = NULL;
+    baseline->lineCount = 0;
+}
+
+/*
+ * baseline file, as written by -W. Each scenario starts with
+ *   scenario name ops n apdus n transactions n
+ * followed by the APDUs it sent, one line each. '#' starts a comment.
+ */
+static int
+loadBaseline(const char *fileName)
+{
+    FILE *file = fopen(fileName, "r");
+    Baseline *baseline = NULL;
+    char *line;
+
+    if (!file) {
+	return 0;
+    }
+    while ((line = readLine(file)) != NULL) {
+	char name[16];
+
+	if (sscanf(line, "scenario %15s", name) == 1) {
+	    baseline = NULL;
+	    if (baselineCount < scenarioCount) {
+		baseline = &baselines[baselineCount++];
+		strcpy(baseline->scenario, name);
+	    }
+	    free(line);
+	} else if (baseline && *line && *line != '#') {
+	    appendLine(baseline, line);
+	} else {
+	    free(line);
+	}
+    }
+    fclose(file);
+    return 1;
+}
+
+static const Baseline *
+findBaseline(const char *scenario)
+{
+    int i;
+
+    for (i = 0; i < baselineCount; i++) {
+	if (strcmp(baselines[i].scenario, scenario) == 0) {
+	    return &baselines[i];
+	}
+    }
+    return NULL;
+}
+
+/*
+ * print what a scenario sent as a diff against the baseline run, "-" for
+ * lines only the baseline has and "+" for lines only this run has. Too
+ * long to diff, and it's just the lines of this run.
+ */
+static void
+printDiff(const Baseline *base, const Baseline *run, FILE *out)
+{
+    int n = base->lineCount, m = run->lineCount;
+    int *lcs = NULL;
+    int i, j;
+
+    if (n <= MAX_DIFF_LINES && m <= MAX_DIFF_LINES) {
+	lcs = (int *)calloc((n+1)*(m+1), sizeof(int));
+    }
+    if (!lcs) {
+	for (j = 0; j < m; j++) {
+	    fprintf(out, "    %s\n", run->lines[j]);
+	}
+	return;
+    }
+#define LCS(i, j) lcs[(i)*(m+1) + (j)]
+    /* longest common subsequence of the tails, from the end */
+    for (i = n-1; i >= 0; i--) {
+	for (j = m-1; j >= 0; j--) {
+	    if (strcmp(base->lines[i], run->lines[j]) == 0) {
+		LCS(i, j) = LCS(i+1, j+1) + 1;
+	    } else {
+		LCS(i, j) = LCS(i+1, j) > LCS(i, j+1) ? 
+					LCS(i+1, j) : LCS(i, j+1);
+	    }
+	}
+    }
+    for (i = 0, j = 0; i < n || j < m; ) {
+	if (i < n && j < m && strcmp(base->lines[i], run->lines[j]) == 0) {
+	    fprintf(out, "    %s\n", run->lines[j]);
+	    i++;
+	    j++;
+	} else if (j < m && (i == n || LCS(i, j+1) >= LCS(i+1, j))) {
+	    fprintf(out, "  + %s\n", run->lines[j++]);
+	} else {
+	    fprintf(out, "  - %s\n", base->lines[i++]);
+	}
+    }
+#undef LCS
+    free(lcs);
+}
+
+/*
+ * remove the shared memory segments the module caches token data in, so
+ * the next C_Initialize starts cold. Only COOL_KEY_CACHE_DIR is cleared,
+ * never the system wide cache.
+ */
+static void
+clearCache(void)
+{
+    const char *dir = getenv("COOL_KEY_CACHE_DIR");
+    struct dirent *entry;
+    DIR *d;
+
+    if (!dir || !*dir || !(d = opendir(dir))) {
+	return;
+    }
+    while ((entry = readdir(d)) != NULL) {
+	char path[1024];
+
+	if (strncmp(entry->d_name, "coolkeypk11s", 12) != 0) {
+	    continue;
+	}
+	snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+	unlink(path);
+    }
+    closedir(d);
+}
+
+static int
+compareDouble(const void *a, const void *b)
+{
+    double da = *(const double *)a;
+    double db = *(const double *)b;
+
+    return (da < db) ? -1 : (da > db) ? 1 : 0;
+}
+
+static double
+percentile(const double *sorted, int count, int pct)
+{
+    int index;
+
+    if (count == 0) {
+	return 0;
+    }
+    index = (count * pct + 99) / 100 - 1;
+    if (index < 0) {
+	index = 0;
+    }
+    return sorted[index];
+}
+
+static CK_RV
+initialize(int threaded)
+{
+    CK_C_INITIALIZE_ARGS initArgs;
+
+    memset(&initArgs, 0, sizeof(initArgs));
+    initArgs.flags = threaded ? CKF_OS_LOCKING_OK : 0;
+    return p11->C_Initialize(&initArgs);
+}
+
+/*
+ * derive needs a peer public point, the key's own public key will do
+ */
+static void
+getECPoint(SessionInfo *info, KeyInfo *key)
+{
+    CK_OBJECT_CLASS pubClass = CKO_PUBLIC_KEY;
+    CK_ATTRIBUTE pubTemplate[] = {
+	{ CKA_CLASS, &pubClass, sizeof(pubClass) },
+	{ CKA_ID, key->id, key->idLen },
+    };
+    CK_ATTRIBUTE point = { CKA_EC_POINT, key->point, sizeof(key->point) };
+    CK_OBJECT_HANDLE pub;
+    CK_ULONG count = 0;
+
+    if (p11->C_FindObjectsInit(info->session, pubTemplate, 2) != CKR_OK) {
+	return;
+    }
+    p11->C_FindObjects(info->session, &pub, 1, &count);
+    p11->C_FindObjectsFinal(info->session);
+    if (count && p11->C_GetAttributeValue(info->session, pub, &point, 1) 
+								== CKR_OK) {
+	key->pointLen = point.ulValueLen;
+    }
+}
+
+/*
+ * find the keys we can sign or decrypt with, and every object on the token
+ */
+static void
+findObjects(SessionInfo *info)
+{
+    CK_OBJECT_CLASS keyClass = CKO_PRIVATE_KEY;
+    CK_ATTRIBUTE keyTemplate = { CKA_CLASS, &keyClass, sizeof(keyClass) };
+    CK_OBJECT_HANDLE keys[MAX_KEYS];
+    CK_ULONG count = 0, i;
+
+    info->objectCount = 0;
+    if (p11->C_FindObjectsInit(info->session, NULL, 0) == CKR_OK) {
+	p11->C_FindObjects(info->session, info->objects, MAX_OBJECTS,
+						&info->objectCount);
+	p11->C_FindObjectsFinal(info->session);
+    }
+
+    info->keyCount = 0;
+    if (p11->C_FindObjectsInit(info->session, &keyTemplate, 1) != CKR_OK) {
+	return;
+    }
+    p11->C_FindObjects(info->session, keys, MAX_KEYS, &count);
+    p11->C_FindObjectsFinal(info->session);
+    for (i = 0; i < count; i++) {
+	KeyInfo *key = &info->keys[info->keyCount];
+	CK_ATTRIBUTE attrs[] = {
+	    { CKA_KEY_TYPE, &key->keyType, sizeof(key->keyType) },
+	    { CKA_ID, key->id, sizeof(key->id) },
+	};
+
+	if (p11->C_GetAttributeValue(info->session, keys[i], attrs, 2) 
+								!= CKR_OK) {
+	    continue;
+	}
+	key->handle = keys[i];
+	key->idLen = attrs[1].ulValueLen;
+	key->pointLen = 0;
+	if (key->keyType == CKK_EC) {
+	    getECPoint(info, key);
+	}
+	info->keyCount++;
+    }
+}
+
+static CK_MECHANISM_TYPE
+signMechanism(const KeyInfo *key)
+{
+    return (key->keyType == CKK_EC) ? CKM_ECDSA : CKM_RSA_PKCS;
+}
+
+/*
+ * get a ciphertext for an RSA key by encrypting with the matching
+ * public key. If the module can't encrypt, the decrypt scenario is skipped.
+ */
+static CK_RV
+makeCiphertext(SessionInfo *info, const KeyInfo *key, CK_BYTE *out, 
+							CK_ULONG *outLen)
+{
+    CK_OBJECT_CLASS pubClass = CKO_PUBLIC_KEY;
+    CK_ATTRIBUTE pubTemplate[] = {
+	{ CKA_CLASS, &pubClass, sizeof(pubClass) },
+	{ CKA_ID, (void *)key->id, key->idLen },
+    };
+    CK_MECHANISM mech = { CKM_RSA_PKCS, NULL, 0 };
+    CK_OBJECT_HANDLE pub;
+    CK_ULONG count = 0;
+    CK_BYTE data[32];
+    CK_RV rv;
+
+    rv = p11->C_FindObjectsInit(info->session, pubTemplate, 2);
+    if (rv != CKR_OK) {
+	return rv;
+    }
+    p11->C_FindObjects(info->session, &pub, 1, &count);
+    p11->C_FindObjectsFinal(info->session);
+    if (count == 0) {
+	return CKR_KEY_HANDLE_INVALID;
+    }
+    memset(data, 0x5a, sizeof(data));
+    rv = p11->C_EncryptInit(info->session, &mech, pub);
+    if (rv != CKR_OK) {
+	return rv;
+    }
+    return p11->C_Encrypt(info->session, data, sizeof(data), out, outLen);
+}
+
+static CK_RV
+runOp(Worker *worker, int iteration)
+{
+    SessionInfo *info = worker->session;
+    const char *name = worker->scenario->name;
+    CK_RV rv = CKR_OK;
+
+    if (strcmp(name, "login") == 0) {
+	/* the token was logged out before the scenario, see loginWorkers */
+	rv = p11->C_Login(info->session, CKU_USER, (CK_UTF8CHAR_PTR)pin, 
+								pinLen);
+	if (rv == CKR_OK) {
+	    rv = p11->C_Logout(info->session);
+	}
+    } else if (strcmp(name, "find") == 0) {
+	CK_OBJECT_HANDLE objects[MAX_OBJECTS];
+	CK_ULONG count;
+
+	rv = p11->C_FindObjectsInit(info->session, NULL, 0);
+	if (rv == CKR_OK) {
+	    do {
+		rv = p11->C_FindObjects(info->session, objects, MAX_OBJECTS,
+								&count);
+	    } while (rv == CKR_OK && count == MAX_OBJECTS);
+	    p11->C_FindObjectsFinal(info->session);
+	}
+    } else if (strcmp(name, "attr") == 0) {
+	CK_BYTE label[256], id[256];
+	CK_OBJECT_CLASS objClass;
+	CK_ATTRIBUTE attrs[] = {
+	    { CKA_CLASS, &objClass, sizeof(objClass) },
+	    { CKA_LABEL, label, sizeof(label) },
+	    { CKA_ID, id, sizeof(id) },
+	};
+
+	if (info->objectCount == 0) {
+	    return CKR_OBJECT_HANDLE_INVALID;
+	}
+	rv = p11->C_GetAttributeValue(info->session, 
+		info->objects[iteration % info->objectCount], attrs, 3);
+	/* not every object has every attribute */
+	if (rv == CKR_ATTRIBUTE_TYPE_INVALID) {
+	    rv = CKR_OK;
+	}
+    } else if (strcmp(name, "sign") == 0) {
+	const KeyInfo *key;
+	CK_MECHANISM mech = { 0, NULL, 0 };
+	CK_BYTE data[32], sig[1024];
+	CK_ULONG sigLen = sizeof(sig);
+
+	if (info->keyCount == 0) {
+	    return CKR_KEY_HANDLE_INVALID;
+	}
+	key = &info->keys[iteration % info->keyCount];
+	mech.mechanism = signMechanism(key);
+	memset(data, iteration & 0xff, sizeof(data));
+	rv = p11->C_SignInit(info->session, &mech, key->handle);
+	if (rv == CKR_OK) {
+	    rv = p11->C_Sign(info->session, data, sizeof(data), sig, &sigLen);
+	}
+    } else if (strcmp(name, "decrypt") == 0) {
+	CK_MECHANISM mech = { CKM_RSA_PKCS, NULL, 0 };
+	CK_BYTE plain[1024];
+	CK_ULONG plainLen = sizeof(plain);
+
+	if (!info->decryptKey || info->cipherLen == 0) {
+	    return CKR_KEY_HANDLE_INVALID;
+	}
+	rv = p11->C_DecryptInit(info->session, &mech, 
+						info->decryptKey->handle);
+	if (rv == CKR_OK) {
+	    rv = p11->C_Decrypt(info->session, info->cipher, info->cipherLen, 
+							plain, &plainLen);
+	}
+    } else if (strcmp(name, "derive") == 0) {
+	CK_OBJECT_CLASS secretClass = CKO_SECRET_KEY;
+	CK_KEY_TYPE secretType = CKK_GENERIC_SECRET;
+	CK_ATTRIBUTE secretTemplate[] = {
+	    { CKA_CLASS, &secretClass, sizeof(secretClass) },
+	    { CKA_KEY_TYPE, &secretType, sizeof(secretType) },
+	};
+	CK_ECDH1_DERIVE_PARAMS params;
+	CK_MECHANISM mech = { CKM_ECDH1_DERIVE, &params, sizeof(params) };
+	CK_OBJECT_HANDLE secret;
+	const KeyInfo *key = NULL;
+	int i;
+
+	for (i = 0; i < info->keyCount; i++) {
+	    if (info->keys[i].keyType == CKK_EC && info->keys[i].pointLen) {
+		key = &info->keys[i];
+		break;
+	    }
+	}
+	if (!key) {
+	    return CKR_KEY_HANDLE_INVALID;
+	}
+	params.kdf = CKD_NULL;
+	params.ulSharedDataLen = 0;
+	params.pSharedData = NULL;
+	params.ulPublicDataLen = key->pointLen;
+	params.pPublicData = (CK_BYTE_PTR)key->point;
+	rv = p11->C_DeriveKey(info->session, &mech, key->handle, 
+					secretTemplate, 2, &secret);
+	if (rv == CKR_OK) {
+	    /* don't let derived keys pile up, failing is harmless */
+	    p11->C_DestroyObject(info->session, secret);
+	}
+    }
+    return rv;
+}
+
+static void *
+runWorker(void *arg)
+{
+    Worker *worker = (Worker *)arg;
+    int i;
+
+    for (i = 0; i < worker->iterations; i++) {
+	double start = now();
+	CK_RV rv = runOp(worker, i);
+
+	worker->latency[worker->ops++] = now() - start;
+	if (rv != CKR_OK) {
+	    worker->errors++;
+	    worker->lastError = rv;
+	}
+    }
+    return NULL;
+}
+
+/*
+ * scenarios which don't run per session are run on the main thread
+ */
+static void
+runGlobal(Worker *worker)
+{
+    const char *name = worker->scenario->name;
+    int i;
+
+    for (i = 0; i < worker->iterations; i++) {
+	CK_SLOT_ID list[MAX_SLOTS];
+	CK_ULONG count = MAX_SLOTS;
+	CK_SLOT_ID event;
+	double start = now();
+	CK_RV rv = CKR_OK;
+
+	if (strncmp(name, "init", 4) == 0) {
+	    rv = p11->C_Finalize(NULL);
+	    if (rv == CKR_OK && strcmp(name, "init-cold") == 0) {
+		clearCache();
+	    }
+	    if (rv == CKR_OK) {
+		rv = initialize(0);
+	    }
+	    if (rv == CKR_OK) {
+		rv = p11->C_GetSlotList(TRUE, list, &count);
+	    }
+	} else if (strcmp(name, "slots") == 0) {
+	    rv = p11->C_GetSlotList(TRUE, list, &count);
+	} else if (strcmp(name, "wait") == 0) {
+	    rv = p11->C_WaitForSlotEvent(CKF_DONT_BLOCK, &event, NULL);
+	    /* nothing happening is the normal case */
+	    if (rv == CKR_NO_EVENT) {
+		rv = CKR_OK;
+	    }
+	}
+	worker->latency[worker->ops++] = now() - start;
+	if (rv != CKR_OK) {
+	    worker->errors++;
+	    worker->lastError = rv;
+	}
+    }
+}
+
+/*
+ * open sessionsPerSlot sessions on every token, and at least one for each
+ * worker thread. Sessions go round the slots, so session i is on slot
+ * i % slotCount and the first slotCount sessions are on different tokens.
+ * Returns 0 unless every worker got a session of its own.
+ */
+static int
+openSessions(int sessionsPerSlot, int threads)
+{
+    int count, i;
+
+    slotCount = MAX_SLOTS;
+    if (p11->C_GetSlotList(TRUE, slots, &slotCount) != CKR_OK || 
+							slotCount == 0) {
+	return 0;
+    }
+    count = slotCount*sessionsPerSlot;
+    if (count < threads) {
+	count = threads;
+    }
+    sessions = (SessionInfo *)calloc(count, sizeof(SessionInfo));
+    if (!sessions) {
+	return 0;
+    }
+    for (sessionCount = 0; sessionCount < count; sessionCount++) {
+	SessionInfo *info = &sessions[sessionCount];
+
+	info->slot = slots[sessionCount % slotCount];
+	if (p11->C_OpenSession(info->slot, CKF_SERIAL_SESSION, NULL, NULL,
+					&info->session) != CKR_OK) {
+	    break;
+	}
+    }
+    if (sessionCount < threads) {
+	for (i = 0; i < sessionCount; i++) {
+	    p11->C_CloseSession(sessions[i].session);
+	}
+	free(sessions);
+	sessions = NULL;
+	sessionCount = 0;
+    }
+    return sessionCount;
+}
+
+static void
+loginTokens(void)
+{
+    CK_ULONG i;
+
+    /* login is per token, logging in once covers all its sessions */
+    for (i = 0; pin && i < slotCount && i < (CK_ULONG)sessionCount; i++) {
+	p11->C_Login(sessions[i].session, CKU_USER, 
+					(CK_UTF8CHAR_PTR)pin, pinLen);
+    }
+}
+
+static void
+prepareSessions(void)
+{
+    int i, k;
+
+    loginTokens();
+    for (i = 0; i < sessionCount; i++) {
+	SessionInfo *info = &sessions[i];
+
+	findObjects(info);
+	/*
+	 * each session decrypts something made with its own token's key,
+	 * the first RSA key whose public key will encrypt
+	 */
+	info->decryptKey = NULL;
+	info->cipherLen = 0;
+	for (k = 0; k < info->keyCount; k++) {
+	    if (info->keys[k].keyType != CKK_RSA) {
+		continue;
+	    }
+	    info->cipherLen = sizeof(info->cipher);
+	    if (makeCiphertext(info, &info->keys[k], info->cipher, 
+					&info->cipherLen) == CKR_OK) {
+		info->decryptKey = &info->keys[k];
+		break;
+	    }
+	    info->cipherLen = 0;
+	}
+    }
+}
+
+/*
+ * login state belongs to the token, so two workers logging in and out of
+ * the same token would trip over each other. The login scenario runs one
+ * worker per token, starting logged out.
+ */
+static int
+loginWorkers(int threads)
+{
+    CK_ULONG i;
+
+    for (i = 0; i < slotCount && i < (CK_ULONG)sessionCount; i++) {
+	p11->C_Logout(sessions[i].session);
+    }
+    return (CK_ULONG)threads < slotCount ? threads : (int)slotCount;
+}
+
+/*
+ * print the results for one scenario, returns the number of ops.
+ */
+static int
+report(const Scenario *scenario, Worker *workers, int workerCount,
+	double elapsed, const Usage *usage, int first)
+{
+    double *all;
+    int total = 0, errors = 0, i;
+    CK_RV lastError = CKR_OK;
+
+    for (i = 0; i < workerCount; i++) {
+	total += workers[i].ops;
+	errors += workers[i].errors;
+	if (workers[i].errors) {
+	    lastError = workers[i].lastError;
+	}
+    }
+    all = (double *)malloc((total+1)*sizeof(double));
+    total = 0;
+    for (i = 0; i < workerCount; i++) {
+	memcpy(&all[total], workers[i].latency, 
+				workers[i].ops*sizeof(double));
+	total += workers[i].ops;
+    }
+    qsort(all, total, sizeof(double), compareDouble);
+
+    printf("%s    {\"name\":\"%s\",\"ops\":%d,\"errors\":%d,"
+	"\"lastError\":\"0x%08lx\",\"seconds\":%.3f,\"opsPerSec\":%.2f,"
+	"\"p50Ms\":%.3f,\"p99Ms\":%.3f,", 
+	first ? "" : ",\n", scenario->name, total, errors, lastError,
+	elapsed/1000.0, elapsed > 0 ? total*1000.0/elapsed : 0.0,
+	percentile(all, total, 50), percentile(all, total, 99));
+    if (!usage || total == 0) {
+	printf("\"apdusPerOp\":null,\"transactionsPerOp\":null}");
+    } else {
+	printf("\"apdusPerOp\":%.2f,\"transactionsPerOp\":%.2f}", 
+		(double)usage->apdus/total, (double)usage->transactions/total);
+    }
+    free(all);
+    return total;
+}
+
+/*
+ * compare a scenario against its budget, printing the APDUs it sent if
+ * it went over, as a diff if there's a baseline for it. Returns 0 if over
+ * budget.
+ */
+static int
+checkBudget(const Scenario *scenario, const Usage *usage, int ops,
+	long startOffset)
+{
+    const Budget *budget = findBudget(scenario->name);
+    const Baseline *baseline = findBaseline(scenario->name);
+    double apdus, transactions;
+    Baseline run;
+    Usage replay;
+    FILE *trace;
+    char *line;
+
+    if (!budget || ops == 0) {
+	return 1;
+    }
+    apdus = (double)usage->apdus/ops;
+    transactions = (double)usage->transactions/ops;
+    /* allow for rounding in the table */
+    if (apdus <= budget->apdus + 0.005 && 
+		transactions <= budget->transactions + 0.005) {
+	return 1;
+    }
+    fprintf(stderr, "%s: over budget on %s, %.2f APDUs (budget %.2f), "
+		"%.2f transactions (budget %.2f) per op\n", scenario->name,
+		cardType, apdus, budget->apdus, transactions, 
+		budget->transactions);
+    recordOffset = startOffset;
+    if (!baseline || !(trace = tmpfile())) {
+	readRecording(&replay, stderr);
+	return 0;
+    }
+    readRecording(&replay, trace);
+    rewind(trace);
+    memset(&run, 0, sizeof(run));
+    while ((line = readLine(trace)) != NULL) {
+	appendLine(&run, line);
+    }
+    fclose(trace);
+    fprintf(stderr, "%s: APDUs against the baseline, - only in the baseline,"
+		" + only in this run\n", scenario->name);
+    printDiff(baseline, &run, stderr);
+    freeLines(&run);
+    return 0;
+}
+
+static void
+usage(const char *prog)
+{
+    fprintf(stderr, 
+	"usage: %s [-m module] [-p pin] [-n iterations] [-t threads]\n"
+	"          [-s sessions-per-slot] [-b budget-file [-c card-type]]\n"
+	"          [-W baseline-out] [-B baseline] [scenario ...]\n"
+	"scenarios: init-cold init-warm slots login find attr sign decrypt\n"
+	"           derive wait (default all)\n", prog);
+    exit(2);
+}
+
+int
+main(int argc, char **argv)
+{
+    const char *module = DEFAULT_MODULE;
+    int iterations = 100, threads = 1, sessionsPerSlot = 1;
+    int selected[sizeof(scenarios)/sizeof(scenarios[0])];
+    int anySelected = 0, first = 1, overBudget = 0;
+    const char *budgetFile = NULL;
+    const char *baselineFile = NULL;
+    FILE *baselineOut = NULL;
+    char recordName[64];
+    CK_C_GetFunctionList getFunctionList;
+    void *library;
+    int c, i, j;
+
+    while ((c = getopt(argc, argv, "m:p:n:t:s:b:c:W:B:")) != -1) {
+	switch (c) {
+	case 'm': module = optarg; break;
+	case 'p': pin = optarg; pinLen = strlen(pin); break;
+	case 'n': iterations = atoi(optarg); break;
+	case 't': threads = atoi(optarg); break;
+	case 's': sessionsPerSlot = atoi(optarg); break;
+	case 'b': budgetFile = optarg; break;
+	case 'c': cardType = optarg; break;
+	case 'W': baselineFile = optarg; break;
+	case 'B':
+	    if (!loadBaseline(optarg)) {
+		fprintf(stderr, "can't read the baseline %s\n", optarg);
+		return 1;
+	    }
+	    break;
+	default: usage(argv[0]);
+	}
+    }
+    if (iterations < 1 || threads < 1 || sessionsPerSlot < 1) {
+	usage(argv[0]);
+    }
+    if (budgetFile && !loadBudgets(budgetFile)) {
+	fprintf(stderr, "can't read budgets from %s\n", budgetFile);
+	return 1;
+    }
+    if (baselineFile && !(baselineOut = fopen(baselineFile, "w"))) {
+	fprintf(stderr, "can't write the baseline %s\n", baselineFile);
+	return 1;
+    }
+    memset(selected, 0, sizeof(selected));
+    for (i = optind; i < argc; i++) {
+	for (j = 0; j < scenarioCount; j++) {
+	    if (strcmp(argv[i], scenarios[j].name) == 0) {
+		selected[j] = anySelected = 1;
+		break;
+	    }
+	}
+	if (j == scenarioCount) {
+	    usage(argv[0]);
+	}
+    }
+
+    /* count APDUs by recording the session, unless someone else is */
+    recordFile = getenv("CKY_APDU_RECORD_FILE");
+    if (!recordFile) {
+	sprintf(recordName, "/tmp/coolkey-bench-%d.apdu", (int)getpid());
+	setenv("CKY_APDU_RECORD_FILE", recordName, 1);
+	recordFile = recordName;
+    }
+
+    library = dlopen(module, RTLD_NOW|RTLD_LOCAL);
+    if (!library) {
+	fprintf(stderr, "can't load %s: %s\n", module, dlerror());
+	return 1;
+    }
+    getFunctionList = (CK_C_GetFunctionList) dlsym(library, 
+							"C_GetFunctionList");
+    if (!getFunctionList || getFunctionList(&p11) != CKR_OK) {
+	fprintf(stderr, "%s is not a PKCS #11 module\n", module);
+	return 1;
+    }
+    if (initialize(threads > 1) != CKR_OK) {
+	fprintf(stderr, "C_Initialize failed\n");
+	return 1;
+    }
+
+    printf("{\"module\":\"%s\",\"threads\":%d,\"sessionsPerSlot\":%d,"
+		"\"iterations\":%d,\"scenarios\":[\n", 
+		module, threads, sessionsPerSlot, iterations);
+    for (i = 0; i < scenarioCount; i++) {
+	const Scenario *scenario = &scenarios[i];
+	Worker *workers;
+	int workerCount = scenario->perSession ? threads : 1;
+	double start, elapsed;
+	Usage usage;
+	long startOffset;
+	int ops;
+
+	if (anySelected && !selected[i]) {
+	    continue;
+	}
+	if (strcmp(scenario->name, "login") == 0 && !pin) {
+	    continue;
+	}
+	/* C_Finalize under running threads isn't allowed */
+	if (strncmp(scenario->name, "init", 4) == 0 && threads > 1) {
+	    fprintf(stderr, "%s: skipped, only run with -t 1\n", 
+							scenario->name);
+	    continue;
+	}
+	if (strcmp(scenario->name, "init-cold") == 0 && 
+					!getenv("COOL_KEY_CACHE_DIR")) {
+	    fprintf(stderr, "init-cold: skipped, needs COOL_KEY_CACHE_DIR\n");
+	    continue;
+	}
+	if (scenario->perSession && !sessions) {
+	    if (!openSessions(sessionsPerSlot, threads)) {
+		fprintf(stderr, "no tokens present, or not enough sessions "
+					"for %d threads\n", threads);
+		break;
+	    }
+	    prepareSessions();
+	}
+	if (strcmp(scenario->name, "login") == 0) {
+	    workerCount = loginWorkers(threads);
+	}
+	workers = (Worker *)calloc(workerCount, sizeof(Worker));
+	for (j = 0; j < workerCount; j++) {
+	    workers[j].scenario = scenario;
+	    workers[j].iterations = iterations;
+	    workers[j].latency = (double *)malloc(iterations*sizeof(double));
+	    if (sessions) {
+		workers[j].session = &sessions[j];
+	    }
+	}
+
+	readRecording(&usage, NULL);
+	startOffset = recordOffset;
+	start = now();
+	if (scenario->perSession) {
+	    pthread_t *tids = (pthread_t *)calloc(workerCount, 
+							sizeof(pthread_t));
+	    for (j = 0; j < workerCount; j++) {
+		pthread_create(&tids[j], NULL, runWorker, &workers[j]);
+	    }
+	    for (j = 0; j < workerCount; j++) {
+		pthread_join(tids[j], NULL);
+	    }
+	    free(tids);
+	} else {
+	    runGlobal(&workers[0]);
+	}
+	elapsed = now() - start;
+	if (readRecording(&usage, NULL) == CKR_OK) {
+	    ops = report(scenario, workers, workerCount, elapsed, &usage, 
+								first);
+	    if (baselineOut) {
+		fprintf(baselineOut, "scenario %s ops %d apdus %ld "
+			"transactions %ld\n", scenario->name, ops, 
+			usage.apdus, usage.transactions);
+		recordOffset = startOffset;
+		readRecording(&usage, baselineOut);
+	    }
+	    if (!checkBudget(scenario, &usage, ops, startOffset)) {
+		overBudget = 1;
+	    }
+	} else {
+	    report(scenario, workers, workerCount, elapsed, NULL, first);
+	}
+	first = 0;
+	for (j = 0; j < workerCount; j++) {
+	    free(workers[j].latency);
+	}
+	free(workers);
+	/* the ops after it expect to be logged in */
+	if (strcmp(scenario->name, "login") == 0) {
+	    loginTokens();
+	}
+	/* init tears down the sessions */
+	if (strncmp(scenario->name, "init", 4) == 0 && sessions) {
+	    free(sessions);
+	    sessions = NULL;
+	}
+    }
+    printf("\n]}\n");
+
+    p11->C_Finalize(NULL);
+    if (baselineOut) {
+	fclose(baselineOut);
+    }
+    if (recordFile == recordName) {
+	unlink(recordName);
+    }
+    return overBudget ? 3 : 0;
+}
@@ -33,6 +33,9 @@
 #include "slot.h"
 #include "cky_base.h"
 #include "params.h"
+#include "trace.h"
+#include "broker.h"
+#include "pool.h"
 
 
 /* static module data --------------------------------  */
@@ -41,6 +44,10 @@ static Log *log = NULL;
 
 static SlotList *slotList = NULL;
 
+// set when COOL_KEY_BROKER names a running coolkeyd; the calls it
+// carries go to the daemon instead of slotList
+static BrokerClient *broker = NULL;
+
 static OSLock *finalizeLock = NULL;
 #define FINALIZE_GETLOCK() if (finalizeLock) finalizeLock->getLock();
 #define FINALIZE_RELEASELOCK() if (finalizeLock) finalizeLock->releaseLock();
@@ -49,6 +56,11 @@ static CK_BBOOL initialized = FALSE;
 static CK_BBOOL finalizing = FALSE;
 static CK_BBOOL waitEvent = FALSE;
 
+// the process our card handles belong to. A forked child sees another
+// pid (or the atfork flag) and gets its own before doing anything else.
+static unsigned long ownerPid = 0;
+static volatile CK_BBOOL forked = FALSE;
+
 char *Params::params = NULL;
 
 // manufacturerID and libraryDescription should not be NULL-terminated,
@@ -70,14 +82,40 @@ typedef struct {
  ************************** MECHANISM TABLE ***************************
  **********************************************************************/
 
+// hashing is done on the host, whatever the card
+#define DIGEST_MECHANISMS \
+    {CKM_SHA_1, {0, 0, CKF_DIGEST}}, {CKM_SHA224, {0, 0, CKF_DIGEST}}, \
+    {CKM_SHA256, {0, 0, CKF_DIGEST}}, {CKM_SHA384, {0, 0, CKF_DIGEST}}, \
+    {CKM_SHA512, {0, 0, CKF_DIGEST}}
+
 static const MechInfo
 rsaMechanismList[] = {
-    {CKM_RSA_PKCS, { 1024, 4096, CKF_HW | CKF_SIGN | CKF_DECRYPT } }
+    {CKM_RSA_PKCS, { 1024, 4096, CKF_HW | CKF_SIGN | CKF_DECRYPT |
+		CKF_ENCRYPT | CKF_VERIFY | CKF_VERIFY_RECOVER } },
+    // public key operations only, done on the host
+    {CKM_RSA_X_509, { 1024, 4096, CKF_ENCRYPT | CKF_VERIFY |
+		CKF_VERIFY_RECOVER } },
+    // hashed on the host, only the DigestInfo goes to the card
+    {CKM_SHA1_RSA_PKCS, { 1024, 4096, CKF_HW | CKF_SIGN } },
+    {CKM_SHA224_RSA_PKCS, { 1024, 4096, CKF_HW | CKF_SIGN } },
+    {CKM_SHA256_RSA_PKCS, { 1024, 4096, CKF_HW | CKF_SIGN } },
+    {CKM_SHA384_RSA_PKCS, { 1024, 4096, CKF_HW | CKF_SIGN } },
+    {CKM_SHA512_RSA_PKCS, { 1024, 4096, CKF_HW | CKF_SIGN } },
+    DIGEST_MECHANISMS
 };
 
 static const MechInfo
 ecMechanismList[] = {
-    {CKM_ECDSA,{256,521,CKF_HW | CKF_SIGN | CKF_EC_F_P}},{ CKM_ECDSA_SHA1, {256, 521, CKF_HW | CKF_SIGN | CKF_EC_F_P}},{ CKM_ECDH1_DERIVE,{256, 521, CKF_HW | CKF_DERIVE | CKF_EC_F_P} }
+    {CKM_ECDSA,{256,521,CKF_HW | CKF_SIGN | CKF_VERIFY | CKF_EC_F_P}},{ CKM_ECDSA_SHA1, {256, 521, CKF_HW | CKF_SIGN | CKF_EC_F_P}},{ CKM_ECDH1_DERIVE,{256, 521, CKF_HW | CKF_DERIVE | CKF_EC_F_P} },
+    {CKM_ECDSA_SHA224, {256, 521, CKF_HW | CKF_SIGN | CKF_EC_F_P}},
+    {CKM_ECDSA_SHA256, {256, 521, CKF_HW | CKF_SIGN | CKF_EC_F_P}},
+    {CKM_ECDSA_SHA384, {256, 521, CKF_HW | CKF_SIGN | CKF_EC_F_P}},
+    {CKM_ECDSA_SHA512, {256, 521, CKF_HW | CKF_SIGN | CKF_EC_F_P}},
+    // with the keys CKM_ECDH1_DERIVE makes, done on the host
+    {CKM_AES_CBC_PAD, {16, 32, CKF_ENCRYPT | CKF_DECRYPT}},
+    {CKM_AES_CTR, {16, 32, CKF_ENCRYPT | CKF_DECRYPT}},
+    {CKM_AES_GCM, {16, 32, CKF_ENCRYPT | CKF_DECRYPT}},
+    DIGEST_MECHANISMS
 };
 
 unsigned int numRSAMechanisms = sizeof(rsaMechanismList)/sizeof(MechInfo);
@@ -104,6 +142,48 @@ dumpTemplates(CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount)
     }
 }
 
+static void
+childAfterFork(void)
+{
+    forked = TRUE;
+}
+
+static CK_RV
+reattachAfterFork(void)
+{
+    forked = FALSE;
+    ownerPid = OSProcessID();
+    log->log("fork detected, leaving the parent's card handles alone\n");
+    if (!broker) {
+	slotList->afterFork();
+	return CKR_OK;
+    }
+    // our copy of the parent's socket is closed, the daemon keeps the
+    // parent's sessions. We get a connection of our own.
+    char * brokerName = getenv("COOL_KEY_BROKER");
+    delete broker;
+    broker = brokerName ? BrokerClient::connect(brokerName) : NULL;
+    if (broker) {
+	return CKR_OK;
+    }
+    try {
+	slotList = new SlotList(log);
+    } catch (PKCS11Exception &e) {
+	e.log(log);
+	initialized = FALSE;
+	return e.getCRV();
+    }
+    return CKR_OK;
+}
+
+#define CHECK_FORK() \
+    if (forked || OSProcessID() != ownerPid) { \
+	CK_RV forkRV = reattachAfterFork(); \
+	if (forkRV != CKR_OK) { \
+	    return forkRV; \
+	} \
+    }
+
 /* PKCS11 defined functions ----------------------------------- */
 
 
@@ -114,12 +194,17 @@ CK_RV name args \
     return CKR_FUNCTION_NOT_SUPPORTED; \
 }
 
-#define SUPPORTED(name, name2, dec_args, use_args) \
+#define SUPPORTED(name, name2, dec_args, use_args, slot) \
 CK_RV name dec_args \
 { \
     if( ! initialized ) { \
         return CKR_CRYPTOKI_NOT_INITIALIZED; \
     } \
+    CHECK_FORK(); \
+    if (broker) { \
+	return broker->name2 use_args; \
+    } \
+    TraceSpan span(#name, slot); \
     try { \
 	log->log(#name " called\n"); \
 	slotList->name2 use_args ; \
@@ -141,30 +226,13 @@ NOTSUPPORTED(C_GetOperationState, (CK_SESSION_HANDLE, CK_BYTE_PTR, CK_ULONG_PTR)
 NOTSUPPORTED(C_SetOperationState, (CK_SESSION_HANDLE, CK_BYTE_PTR, CK_ULONG, CK_OBJECT_HANDLE, CK_OBJECT_HANDLE))
 NOTSUPPORTED(C_CreateObject, (CK_SESSION_HANDLE, CK_ATTRIBUTE_PTR, CK_ULONG, CK_OBJECT_HANDLE_PTR))
 NOTSUPPORTED(C_CopyObject, (CK_SESSION_HANDLE,CK_OBJECT_HANDLE,CK_ATTRIBUTE_PTR,CK_ULONG,CK_OBJECT_HANDLE_PTR))
-NOTSUPPORTED(C_DestroyObject, (CK_SESSION_HANDLE, CK_OBJECT_HANDLE))
 NOTSUPPORTED(C_GetObjectSize, (CK_SESSION_HANDLE,CK_OBJECT_HANDLE,CK_ULONG_PTR))
 NOTSUPPORTED(C_SetAttributeValue, (CK_SESSION_HANDLE,CK_OBJECT_HANDLE,CK_ATTRIBUTE_PTR,CK_ULONG))
-NOTSUPPORTED(C_EncryptInit, (CK_SESSION_HANDLE,CK_MECHANISM_PTR,CK_OBJECT_HANDLE))
-NOTSUPPORTED(C_Encrypt, (CK_SESSION_HANDLE, CK_BYTE_PTR, CK_ULONG, CK_BYTE_PTR, CK_ULONG_PTR))
-NOTSUPPORTED(C_EncryptUpdate, (CK_SESSION_HANDLE,CK_BYTE_PTR,CK_ULONG,CK_BYTE_PTR,CK_ULONG_PTR))
-NOTSUPPORTED(C_EncryptFinal, (CK_SESSION_HANDLE,CK_BYTE_PTR,CK_ULONG_PTR))
-NOTSUPPORTED(C_DecryptUpdate,(CK_SESSION_HANDLE,CK_BYTE_PTR,CK_ULONG,CK_BYTE_PTR,CK_ULONG_PTR))
-NOTSUPPORTED(C_DecryptFinal, (CK_SESSION_HANDLE,CK_BYTE_PTR,CK_ULONG_PTR))
-NOTSUPPORTED(C_DigestInit, (CK_SESSION_HANDLE,CK_MECHANISM_PTR))
-NOTSUPPORTED(C_Digest, (CK_SESSION_HANDLE,CK_BYTE_PTR,CK_ULONG,CK_BYTE_PTR,CK_ULONG_PTR))
-NOTSUPPORTED(C_DigestUpdate, (CK_SESSION_HANDLE,CK_BYTE_PTR,CK_ULONG))
 NOTSUPPORTED(C_DigestKey, (CK_SESSION_HANDLE,CK_OBJECT_HANDLE))
-NOTSUPPORTED(C_DigestFinal, (CK_SESSION_HANDLE, CK_BYTE_PTR, CK_ULONG_PTR))
-NOTSUPPORTED(C_SignUpdate, (CK_SESSION_HANDLE, CK_BYTE_PTR, CK_ULONG))
-NOTSUPPORTED(C_SignFinal, (CK_SESSION_HANDLE,CK_BYTE_PTR,CK_ULONG_PTR))
 NOTSUPPORTED(C_SignRecoverInit, (CK_SESSION_HANDLE,CK_MECHANISM_PTR,CK_OBJECT_HANDLE))
 NOTSUPPORTED(C_SignRecover, (CK_SESSION_HANDLE,CK_BYTE_PTR,CK_ULONG,CK_BYTE_PTR,CK_ULONG_PTR))
-NOTSUPPORTED(C_VerifyInit, (CK_SESSION_HANDLE,CK_MECHANISM_PTR,CK_OBJECT_HANDLE))
-NOTSUPPORTED(C_Verify, (CK_SESSION_HANDLE,CK_BYTE_PTR,CK_ULONG,CK_BYTE_PTR,CK_ULONG))
 NOTSUPPORTED(C_VerifyUpdate, (CK_SESSION_HANDLE, CK_BYTE_PTR, CK_ULONG))
 NOTSUPPORTED(C_VerifyFinal, (CK_SESSION_HANDLE,CK_BYTE_PTR,CK_ULONG))
-NOTSUPPORTED(C_VerifyRecoverInit, (CK_SESSION_HANDLE,CK_MECHANISM_PTR,CK_OBJECT_HANDLE))
-NOTSUPPORTED(C_VerifyRecover, (CK_SESSION_HANDLE,CK_BYTE_PTR,CK_ULONG,CK_BYTE_PTR,CK_ULONG_PTR))
 NOTSUPPORTED(C_DigestEncryptUpdate, (CK_SESSION_HANDLE,CK_BYTE_PTR,CK_ULONG,CK_BYTE_PTR,CK_ULONG_PTR))
 NOTSUPPORTED(C_DecryptDigestUpdate, (CK_SESSION_HANDLE,CK_BYTE_PTR,CK_ULONG,CK_BYTE_PTR,CK_ULONG_PTR))
 NOTSUPPORTED(C_SignEncryptUpdate, (CK_SESSION_HANDLE,CK_BYTE_PTR,CK_ULONG,CK_BYTE_PTR,CK_ULONG_PTR))
@@ -180,36 +248,125 @@ NOTSUPPORTED(C_CancelFunction, (CK_SESSION_HANDLE))
 
 SUPPORTED(C_GetSlotList, getSlotList,
   (CK_BBOOL tokenPresent, CK_SLOT_ID_PTR pSlotList, CK_ULONG_PTR pulCount),
-  (tokenPresent, pSlotList, pulCount))
+  (tokenPresent, pSlotList, pulCount), 0)
 SUPPORTED(C_GetSessionInfo, getSessionInfo,
    (CK_SESSION_HANDLE hSession, CK_SESSION_INFO_PTR pInfo),
-   (hSession, pInfo) )
-SUPPORTED(C_Logout, logout, (CK_SESSION_HANDLE hSession), (hSession))
+   (hSession, pInfo),
+   sessionHandleToSlotID(hSession))
+SUPPORTED(C_Logout, logout, (CK_SESSION_HANDLE hSession), (hSession),
+   sessionHandleToSlotID(hSession))
 SUPPORTED(C_Decrypt, decrypt, 
    (CK_SESSION_HANDLE hSession, CK_BYTE_PTR pData, CK_ULONG ulDataLen,
     CK_BYTE_PTR pDecryptedData, CK_ULONG_PTR pulDecryptedDataLen),
-   (hSession, pData, ulDataLen, pDecryptedData, pulDecryptedDataLen))
+   (hSession, pData, ulDataLen, pDecryptedData, pulDecryptedDataLen),
+   sessionHandleToSlotID(hSession))
+SUPPORTED(C_DecryptUpdate, decryptUpdate,
+   (CK_SESSION_HANDLE hSession, CK_BYTE_PTR pPart, CK_ULONG ulPartLen,
+    CK_BYTE_PTR pOutput, CK_ULONG_PTR pulOutputLen),
+   (hSession, pPart, ulPartLen, pOutput, pulOutputLen),
+   sessionHandleToSlotID(hSession))
+SUPPORTED(C_DecryptFinal, decryptFinal,
+   (CK_SESSION_HANDLE hSession, CK_BYTE_PTR pOutput,
+    CK_ULONG_PTR pulOutputLen),
+   (hSession, pOutput, pulOutputLen),
+   sessionHandleToSlotID(hSession))
 SUPPORTED(C_DecryptInit, decryptInit,
    (CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism, 
-    CK_OBJECT_HANDLE hKey), (hSession, pMechanism, hKey))
+    CK_OBJECT_HANDLE hKey), (hSession, pMechanism, hKey),
+   sessionHandleToSlotID(hSession))
+SUPPORTED(C_EncryptInit, encryptInit,
+   (CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism, 
+    CK_OBJECT_HANDLE hKey), (hSession, pMechanism, hKey),
+   sessionHandleToSlotID(hSession))
+SUPPORTED(C_Encrypt, encrypt, 
+   (CK_SESSION_HANDLE hSession, CK_BYTE_PTR pData, CK_ULONG ulDataLen,
+    CK_BYTE_PTR pEncryptedData, CK_ULONG_PTR pulEncryptedDataLen),
+   (hSession, pData, ulDataLen, pEncryptedData, pulEncryptedDataLen),
+   sessionHandleToSlotID(hSession))
+SUPPORTED(C_EncryptUpdate, encryptUpdate,
+   (CK_SESSION_HANDLE hSession, CK_BYTE_PTR pPart, CK_ULONG ulPartLen,
+    CK_BYTE_PTR pOutput, CK_ULONG_PTR pulOutputLen),
+   (hSession, pPart, ulPartLen, pOutput, pulOutputLen),
+   sessionHandleToSlotID(hSession))
+SUPPORTED(C_EncryptFinal, encryptFinal,
+   (CK_SESSION_HANDLE hSession, CK_BYTE_PTR pOutput,
+    CK_ULONG_PTR pulOutputLen),
+   (hSession, pOutput, pulOutputLen),
+   sessionHandleToSlotID(hSession))
+SUPPORTED(C_DigestInit, digestInit,
+   (CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism),
+   (hSession, pMechanism),
+   sessionHandleToSlotID(hSession))
+SUPPORTED(C_Digest, digest,
+   (CK_SESSION_HANDLE hSession, CK_BYTE_PTR pData, CK_ULONG ulDataLen,
+    CK_BYTE_PTR pDigest, CK_ULONG_PTR pulDigestLen),
+   (hSession, pData, ulDataLen, pDigest, pulDigestLen),
+   sessionHandleToSlotID(hSession))
+SUPPORTED(C_DigestUpdate, digestUpdate,
+   (CK_SESSION_HANDLE hSession, CK_BYTE_PTR pPart, CK_ULONG ulPartLen),
+   (hSession, pPart, ulPartLen),
+   sessionHandleToSlotID(hSession))
+SUPPORTED(C_DigestFinal, digestFinal,
+   (CK_SESSION_HANDLE hSession, CK_BYTE_PTR pDigest,
+    CK_ULONG_PTR pulDigestLen),
+   (hSession, pDigest, pulDigestLen),
+   sessionHandleToSlotID(hSession))
+SUPPORTED(C_DestroyObject, destroyObject,
+   (CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE hObject),
+   (hSession, hObject),
+   sessionHandleToSlotID(hSession))
 SUPPORTED(C_SignInit, signInit, 
    (CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism, 
     CK_OBJECT_HANDLE hKey), 
-   (hSession, pMechanism, hKey))
+   (hSession, pMechanism, hKey),
+   sessionHandleToSlotID(hSession))
 SUPPORTED(C_Sign, sign, 
    (CK_SESSION_HANDLE hSession, CK_BYTE_PTR pData, CK_ULONG ulDataLen, 
     CK_BYTE_PTR pSignature, CK_ULONG_PTR pulSignatureLen), 
-  (hSession, pData, ulDataLen, pSignature, pulSignatureLen))
+  (hSession, pData, ulDataLen, pSignature, pulSignatureLen),
+   sessionHandleToSlotID(hSession))
+SUPPORTED(C_SignUpdate, signUpdate,
+   (CK_SESSION_HANDLE hSession, CK_BYTE_PTR pPart, CK_ULONG ulPartLen),
+   (hSession, pPart, ulPartLen),
+   sessionHandleToSlotID(hSession))
+SUPPORTED(C_SignFinal, signFinal,
+   (CK_SESSION_HANDLE hSession, CK_BYTE_PTR pSignature,
+    CK_ULONG_PTR pulSignatureLen),
+   (hSession, pSignature, pulSignatureLen),
+   sessionHandleToSlotID(hSession))
+SUPPORTED(C_VerifyInit, verifyInit, 
+   (CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism, 
+    CK_OBJECT_HANDLE hKey), 
+   (hSession, pMechanism, hKey),
+   sessionHandleToSlotID(hSession))
+SUPPORTED(C_Verify, verify, 
+   (CK_SESSION_HANDLE hSession, CK_BYTE_PTR pData, CK_ULONG ulDataLen, 
+    CK_BYTE_PTR pSignature, CK_ULONG ulSignatureLen), 
+  (hSession, pData, ulDataLen, pSignature, ulSignatureLen),
+   sessionHandleToSlotID(hSession))
+SUPPORTED(C_VerifyRecoverInit, verifyRecoverInit, 
+   (CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism, 
+    CK_OBJECT_HANDLE hKey), 
+   (hSession, pMechanism, hKey),
+   sessionHandleToSlotID(hSession))
+SUPPORTED(C_VerifyRecover, verifyRecover, 
+   (CK_SESSION_HANDLE hSession, CK_BYTE_PTR pSignature,
+    CK_ULONG ulSignatureLen, CK_BYTE_PTR pData, CK_ULONG_PTR pulDataLen), 
+  (hSession, pSignature, ulSignatureLen, pData, pulDataLen),
+   sessionHandleToSlotID(hSession))
 SUPPORTED(C_SeedRandom, seedRandom,
   (CK_SESSION_HANDLE hSession ,CK_BYTE_PTR data,CK_ULONG dataLen),
-  (hSession, data, dataLen))
+  (hSession, data, dataLen),
+   sessionHandleToSlotID(hSession))
 SUPPORTED(C_GenerateRandom, generateRandom,
   (CK_SESSION_HANDLE hSession ,CK_BYTE_PTR data,CK_ULONG dataLen),
-  (hSession, data, dataLen))
+  (hSession, data, dataLen),
+   sessionHandleToSlotID(hSession))
 SUPPORTED(C_DeriveKey,derive,
   (CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism,
   CK_OBJECT_HANDLE hBaseKey, CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulAttributeCount, CK_OBJECT_HANDLE_PTR phKey ),
-  (hSession, pMechanism, hBaseKey, pTemplate, ulAttributeCount, phKey))
+  (hSession, pMechanism, hBaseKey, pTemplate, ulAttributeCount, phKey),
+   sessionHandleToSlotID(hSession))
 
 /* non-specialized functions supported with the slot directly */
 
@@ -225,6 +382,7 @@ C_Initialize(CK_VOID_PTR pInitArgs)
     }
     CK_C_INITIALIZE_ARGS* initArgs = (CK_C_INITIALIZE_ARGS*) pInitArgs;
     OSLock::setThreadSafe(0);
+    OSThread::setAllowed(0);
     if( initArgs != NULL ) {
 	bool needThreads;
 	/* work around a bug in NSS where the library parameters are only
@@ -236,6 +394,10 @@ C_Initialize(CK_VOID_PTR pInitArgs)
 	}
   	needThreads = ((initArgs->flags & CKF_OS_LOCKING_OK) != 0);
 	OSLock::setThreadSafe(needThreads);
+	/* token loading can hand parsing off to a worker, but only to an
+	 * application that is threaded and lets us make our own */
+	OSThread::setAllowed(needThreads && ((initArgs->flags &
+				CKF_LIBRARY_CANT_CREATE_OS_THREADS) == 0));
 	/* don't get a finalize lock unless someone initializes us asking
 	 * us to use threads */
 	if (needThreads && !finalizeLock) {
@@ -258,8 +420,31 @@ C_Initialize(CK_VOID_PTR pInitArgs)
     } else {
 	log = new DummyLog();
     }
+    char * traceFileName = getenv("COOL_KEY_TRACE_FILE");
+    if (traceFileName) {
+	Trace::Open(traceFileName);
+    }
     log->log("Initialize called, hello %d\n", 5);
     CKY_SetName((char *) "coolkey");
+    TraceSpan span("C_Initialize");
+    static bool atForkSet = false;
+    if (!atForkSet) {
+	OSAtFork(childAfterFork);
+	atForkSet = true;
+    }
+    forked = FALSE;
+    ownerPid = OSProcessID();
+    char * brokerName = getenv("COOL_KEY_BROKER");
+    if (brokerName) {
+	broker = BrokerClient::connect(brokerName);
+	if (broker) {
+	    log->log("using broker %s\n", brokerName);
+	    initialized = TRUE;
+	    return CKR_OK;
+	}
+	log->log("broker %s not running, using the cards directly\n",
+							brokerName);
+    }
     slotList = new SlotList(log);
     initialized = TRUE;
     return CKR_OK;
@@ -276,6 +461,7 @@ C_Finalize(CK_VOID_PTR pReserved)
     if( ! initialized ) {
         return CKR_CRYPTOKI_NOT_INITIALIZED;
     }
+    CHECK_FORK();
     // XXX cleanup all data structures !!!
     //delete sessionManager;
     log->log("Finalizing...\n");
@@ -290,13 +476,25 @@ C_Finalize(CK_VOID_PTR pReserved)
 	/* we're waiting on a slot event, shutdown first to allow
 	 * the wait function to complete before we pull the rug out.
 	 */
-	slotList->shutdown();
+	if (broker) {
+	    broker->shutdown();
+	} else {
+	    slotList->shutdown();
+	}
 	while (waitEvent) {
 	    OSSleep(500);
 	}
     } 
-    delete slotList;
+    if (broker) {
+	broker->shutdown();
+	delete broker;
+	broker = NULL;
+    } else {
+	delete slotList;
+    }
+    slotList = NULL;
     delete log;
+    Trace::Close();
     FINALIZE_GETLOCK();
     finalizing = FALSE;
     initialized = FALSE;
@@ -311,6 +509,11 @@ C_GetInfo(CK_INFO_PTR p)
     if( ! initialized ) {
         return CKR_CRYPTOKI_NOT_INITIALIZED;
     }
+    CHECK_FORK();
+    if (broker) {
+	return broker->getInfo(p);
+    }
+    TraceSpan span("C_GetInfo");
     log->log("C_GetInfo called\n");
     ckInfo.manufacturerID[31] = ' ';
     ckInfo.libraryDescription[31] = ' ';
@@ -325,9 +528,18 @@ C_GetSlotInfo(CK_SLOT_ID slotID, CK_SLOT_INFO_PTR pSlotInfo)
     if( ! initialized ) {
         return CKR_CRYPTOKI_NOT_INITIALIZED;
     }
+    CHECK_FORK();
+    if (broker) {
+	return broker->getSlotInfo(slotID, pSlotInfo);
+    }
+    TraceSpan span("C_GetSlotInfo", slotID);
     try {
         log->log("Called C_GetSlotInfo\n");
         slotList->validateSlotID(slotID);
+        TokenPool *pool = slotList->getPool(slotID);
+        if (pool) {
+            return pool->getSlotInfo(pSlotInfo);
+        }
         return slotList->getSlot(
             slotIDToIndex(slotID))->getSlotInfo(pSlotInfo);
     } catch( PKCS11Exception &excep ) {
@@ -342,9 +554,18 @@ C_GetTokenInfo(CK_SLOT_ID slotID, CK_TOKEN_INFO_PTR pTokenInfo)
     if( ! initialized ) {
         return CKR_CRYPTOKI_NOT_INITIALIZED;
     }
+    CHECK_FORK();
+    if (broker) {
+	return broker->getTokenInfo(slotID, pTokenInfo);
+    }
+    TraceSpan span("C_GetTokenInfo", slotID);
     try {
         log->log("C_GetTokenInfo called\n");
         slotList->validateSlotID(slotID);
+        TokenPool *pool = slotList->getPool(slotID);
+        if (pool) {
+            return pool->getTokenInfo(pTokenInfo);
+        }
         return slotList->getSlot(
             slotIDToIndex(slotID))->getTokenInfo(pTokenInfo);
     } catch( PKCS11Exception &excep ) {
@@ -365,6 +586,11 @@ C_GetMechanismList(CK_SLOT_ID slotID, CK_MECHANISM_TYPE_PTR pMechanismList,
     if( ! initialized ) {
         return CKR_CRYPTOKI_NOT_INITIALIZED;
     }
+    CHECK_FORK();
+    if (broker) {
+	return broker->getMechanismList(slotID, pMechanismList, pulCount);
+    }
+    TraceSpan span("C_GetMechanismList", slotID);
     try {
         CK_RV rv = CKR_OK;
 
@@ -375,7 +601,10 @@ C_GetMechanismList(CK_SLOT_ID slotID, CK_MECHANISM_TYPE_PTR pMechanismList,
 
         slotList->validateSlotID(slotID);
 
-        Slot *slot = slotList->getSlot(slotIDToIndex(slotID));
+        // the pool's members are alike, any of them can answer
+        TokenPool *pool = slotList->getPool(slotID);
+        Slot *slot = pool ? pool->getLeaderSlot() :
+                            slotList->getSlot(slotIDToIndex(slotID));
 
         if( ! slot ||  ! slot->isTokenPresent() ) {
             return CKR_TOKEN_NOT_PRESENT;
@@ -421,6 +650,11 @@ C_GetMechanismInfo(CK_SLOT_ID slotID, CK_MECHANISM_TYPE type,
     if( ! initialized ) {
         return CKR_CRYPTOKI_NOT_INITIALIZED;
     }
+    CHECK_FORK();
+    if (broker) {
+	return broker->getMechanismInfo(slotID, type, pInfo);
+    }
+    TraceSpan span("C_GetMechanismInfo", slotID);
 
 
     try {
@@ -431,7 +665,10 @@ C_GetMechanismInfo(CK_SLOT_ID slotID, CK_MECHANISM_TYPE type,
         slotList->validateSlotID(slotID);
 
 
-        Slot *slot = slotList->getSlot(slotIDToIndex(slotID));
+        // the pool's members are alike, any of them can answer
+        TokenPool *pool = slotList->getPool(slotID);
+        Slot *slot = pool ? pool->getLeaderSlot() :
+                            slotList->getSlot(slotIDToIndex(slotID));
 
         if( ! slot ||  ! slot->isTokenPresent() ) {
             return CKR_TOKEN_NOT_PRESENT;
@@ -467,6 +704,11 @@ C_OpenSession(CK_SLOT_ID slotID, CK_FLAGS flags, CK_VOID_PTR pApplication,
     if( ! initialized ) {
         return CKR_CRYPTOKI_NOT_INITIALIZED;
     }
+    CHECK_FORK();
+    if (broker) {
+	return broker->openSession(slotID, flags, phSession);
+    }
+    TraceSpan span("C_OpenSession", slotID);
     try {
         log->log("C_OpenSession called\n");
         slotList->validateSlotID(slotID);
@@ -497,6 +739,11 @@ C_CloseSession(CK_SESSION_HANDLE hSession)
     if( ! initialized ) {
         return CKR_CRYPTOKI_NOT_INITIALIZED;
     }
+    CHECK_FORK();
+    if (broker) {
+	return broker->closeSession(hSession);
+    }
+    TraceSpan span("C_CloseSession", sessionHandleToSlotID(hSession));
     try {
         log->log("C_CloseSession(0x%x) called\n", hSession);
         // !!!XXX Hack
@@ -515,6 +762,11 @@ C_CloseAllSessions(CK_SLOT_ID slotID)
     if( ! initialized ) {
         return CKR_CRYPTOKI_NOT_INITIALIZED;
     }
+    CHECK_FORK();
+    if (broker) {
+	return broker->closeAllSessions(slotID);
+    }
+    TraceSpan span("C_CloseAllSessions", slotID);
     try {
         log->log("C_CloseAllSessions(0x%x) called\n", slotID);
         slotList->validateSlotID(slotID);
@@ -536,6 +788,11 @@ C_FindObjectsInit(CK_SESSION_HANDLE hSession, CK_ATTRIBUTE_PTR pTemplate,
     if( ! initialized ) {
         return CKR_CRYPTOKI_NOT_INITIALIZED;
     }
+    CHECK_FORK();
+    if (broker) {
+	return broker->findObjectsInit(hSession, pTemplate, ulCount);
+    }
+    TraceSpan span("C_FindObjectsInit", sessionHandleToSlotID(hSession));
     try {
         log->log("C_FindObjectsInit called, %lu templates\n", ulCount);
 	dumpTemplates(pTemplate, ulCount);
@@ -559,6 +816,12 @@ C_FindObjects(CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE_PTR phObject,
     if( ! initialized ) {
         return CKR_CRYPTOKI_NOT_INITIALIZED;
     }
+    CHECK_FORK();
+    if (broker) {
+	return broker->findObjects(hSession, phObject, ulMaxObjectCount,
+							pulObjectCount);
+    }
+    TraceSpan span("C_FindObjects", sessionHandleToSlotID(hSession));
     try {
         log->log("C_FindObjects called, max objects = %lu\n", ulMaxObjectCount );
         if( phObject == NULL && ulMaxObjectCount != 0 ) {
@@ -586,6 +849,11 @@ C_FindObjectsFinal(CK_SESSION_HANDLE hSession)
     if( ! initialized ) {
         return CKR_CRYPTOKI_NOT_INITIALIZED;
     }
+    CHECK_FORK();
+    if (broker) {
+	return broker->findObjectsFinal(hSession);
+    }
+    TraceSpan span("C_FindObjectsFinal", sessionHandleToSlotID(hSession));
     // we don't need to do any cleaup. We could check the session handle.
     return CKR_OK;
 }
@@ -597,6 +865,11 @@ C_Login(CK_SESSION_HANDLE hSession, CK_USER_TYPE userType,
     if( ! initialized ) {
         return CKR_CRYPTOKI_NOT_INITIALIZED;
     }
+    CHECK_FORK();
+    if (broker) {
+	return broker->login(hSession, userType, pPin, ulPinLen);
+    }
+    TraceSpan span("C_Login", sessionHandleToSlotID(hSession));
     try {
         log->log("C_Login called\n");
         if( pPin == NULL ) {
@@ -618,6 +891,11 @@ C_GetAttributeValue(CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE hObject,
     if( ! initialized ) {
         return CKR_CRYPTOKI_NOT_INITIALIZED;
     }
+    CHECK_FORK();
+    if (broker) {
+	return broker->getAttributeValue(hSession, hObject, pTemplate, ulCount);
+    }
+    TraceSpan span("C_GetAttributeValue", sessionHandleToSlotID(hSession));
     try {
         log->log("C_GetAttributeValue called, %lu templates for object 0x%08lx\n", ulCount, hObject);
 	dumpTemplates(pTemplate, ulCount);
@@ -648,6 +926,9 @@ C_GetAttributeValue(CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE hObject,
 CK_RV
 C_WaitForSlotEvent(CK_FLAGS flags, CK_SLOT_ID_PTR pSlot, CK_VOID_PTR pReserved)
 {
+    if (initialized) {
+	CHECK_FORK();
+    }
     FINALIZE_GETLOCK();
     if( ! initialized ) {
 	FINALIZE_RELEASELOCK();
@@ -659,6 +940,12 @@ C_WaitForSlotEvent(CK_FLAGS flags, CK_SLOT_ID_PTR pSlot, CK_VOID_PTR pReserved)
     }
     waitEvent = TRUE;
     FINALIZE_RELEASELOCK();
+    TraceSpan span("C_WaitForSlotEvent");
+    if (broker) {
+	CK_RV crv = broker->waitForSlotEvent(flags, pSlot);
+	waitEvent = FALSE;
+	return crv;
+    }
     try {
         log->log("C_WaitForSlotEvent called\n");
         slotList->waitForSlotEvent(flags, pSlot, pReserved);
@@ -0,0 +1,769 @@
+/* ***** BEGIN COPYRIGHT BLOCK *****
+ * Copyright (C) 2005 Red Hat, Inc.
+ * All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation version
+ * 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ * ***** END COPYRIGHT BLOCK *****/
+
+/*
+ * coolkeyd: the token broker. Loads the CoolKey module once and serves
+ * PKCS #11 calls to modules running with COOL_KEY_BROKER set, so every
+ * client shares one set of card connections, parsed objects and login
+ * state.
+ *
+ *   coolkeyd [-f] [-m module] [-s socket]
+ *
+ * The socket defaults to $COOL_KEY_BROKER. It is created owner only, and
+ * on Linux connections from other users are refused. Sessions a client
+ * leaves open are closed when it disconnects. Point the module at a
+ * recorded card with CKY_APDU_REPLAY_FILE to run the broker without one.
+ */
+#include "mypkcs11.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <set>
+#include <map>
+#include "PKCS11Exception.h"
+#include "broker.h"
+
+using std::set;
+using std::map;
+
+#define DEFAULT_MODULE "libcoolkeypk11.so"
+#define MAX_OUTPUT BROKER_MAX_OUTPUT
+#define MAX_ATTRIBUTES 64
+
+static CK_FUNCTION_LIST_PTR p11;
+
+typedef set<CK_SESSION_HANDLE> SessionSet;
+typedef map<CK_SLOT_ID, unsigned long> EventCounts;
+
+//
+// the module has one event queue and each client wants to see every
+// event. watchSlots counts events per slot here, and every client keeps
+// the counts it has already reported.
+//
+static EventCounts slotEvents;
+static pthread_mutex_t eventLock = PTHREAD_MUTEX_INITIALIZER;
+
+struct Client {
+    SessionSet sessions;
+    EventCounts seenEvents;
+};
+
+//
+// output buffer request from BrokerMessage::putOutput. Returns the buffer
+// to hand the module, NULL for a length query. Lengths are capped at
+// MAX_OUTPUT, asked (if given) gets what the client really wanted.
+//
+static CK_BYTE_PTR
+getOutput(BrokerMessage &request, CK_BYTE *buf, CK_ULONG *len,
+						CK_ULONG *asked = NULL)
+{
+    bool present = request.getULong() != 0;
+
+    *len = request.getULong();
+    if (asked) {
+	*asked = *len;
+    }
+    if (*len > MAX_OUTPUT) {
+	*len = MAX_OUTPUT;
+    }
+    return present ? buf : NULL;
+}
+
+static void
+putOutput(BrokerMessage &response, CK_RV crv, const CK_BYTE *buf, 
+							CK_ULONG len)
+{
+    response.putBytes(buf, (crv == CKR_OK && buf && 
+			len != CK_UNAVAILABLE_INFORMATION) ? len : 0);
+    response.putULong(len);
+}
+
+static void
+putPadded(BrokerMessage &response, const CK_UTF8CHAR *str, CK_ULONG len)
+{
+    response.putBytes(str, len);
+}
+
+union MechanismParams {
+    CK_ECDH1_DERIVE_PARAMS ecdh;
+    CK_GCM_PARAMS gcm;
+};
+
+//
+// decode a mechanism from BrokerMessage::putMechanism. params is storage
+// for parameters that need rebuilding.
+//
+static void
+getMechanism(BrokerMessage &request, CK_MECHANISM *mech, 
+					MechanismParams *params)
+{
+    CK_ULONG len;
+
+    mech->mechanism = request.getULong();
+    if (mech->mechanism == CKM_ECDH1_DERIVE) {
+	CK_ECDH1_DERIVE_PARAMS *ecdh = &params->ecdh;
+
+	ecdh->kdf = request.getULong();
+	ecdh->pSharedData = (CK_BYTE_PTR)request.getBytes(&len);
+	ecdh->ulSharedDataLen = len;
+	if (len == 0) {
+	    ecdh->pSharedData = NULL;
+	}
+	ecdh->pPublicData = (CK_BYTE_PTR)request.getBytes(&len);
+	ecdh->ulPublicDataLen = len;
+	mech->pParameter = ecdh;
+	mech->ulParameterLen = sizeof(*ecdh);
+	return;
+    }
+    if (mech->mechanism == CKM_AES_GCM) {
+	CK_GCM_PARAMS *gcm = &params->gcm;
+
+	gcm->pIv = (CK_BYTE_PTR)request.getBytes(&len);
+	gcm->ulIvLen = len;
+	gcm->ulIvBits = len * 8;
+	gcm->pAAD = (CK_BYTE_PTR)request.getBytes(&len);
+	gcm->ulAADLen = len;
+	if (len == 0) {
+	    gcm->pAAD = NULL;
+	}
+	gcm->ulTagBits = request.getULong();
+	mech->pParameter = gcm;
+	mech->ulParameterLen = sizeof(*gcm);
+	return;
+    }
+    mech->pParameter = (CK_VOID_PTR)request.getBytes(&len);
+    mech->ulParameterLen = len;
+    if (len == 0) {
+	mech->pParameter = NULL;
+    }
+}
+
+static CK_ULONG
+getTemplate(BrokerMessage &request, CK_ATTRIBUTE *attrs)
+{
+    CK_ULONG count = request.getULong();
+    CK_ULONG i;
+
+    if (count > MAX_ATTRIBUTES) {
+	throw PKCS11Exception(CKR_TEMPLATE_INCONSISTENT);
+    }
+    for (i = 0; i < count; i++) {
+	attrs[i].type = request.getULong();
+	attrs[i].pValue = (CK_VOID_PTR)request.getBytes(&attrs[i].ulValueLen);
+    }
+    return count;
+}
+
+static CK_RV
+nextSlotEvent(Client &client, CK_SLOT_ID *slot)
+{
+    EventCounts::iterator it;
+    CK_RV crv = CKR_NO_EVENT;
+
+    pthread_mutex_lock(&eventLock);
+    for (it = slotEvents.begin(); it != slotEvents.end(); ++it) {
+	if (client.seenEvents[it->first] != it->second) {
+	    client.seenEvents[it->first] = it->second;
+	    *slot = it->first;
+	    crv = CKR_OK;
+	    break;
+	}
+    }
+    pthread_mutex_unlock(&eventLock);
+    return crv;
+}
+
+//
+// run one request against the module
+//
+static void
+dispatch(BrokerMessage &request, BrokerMessage &response, Client &client)
+{
+    SessionSet &sessions = client.sessions;
+
+    CK_ULONG function = request.getULong();
+    CK_BYTE buf[MAX_OUTPUT];
+    CK_ATTRIBUTE attrs[MAX_ATTRIBUTES];
+    CK_MECHANISM mech;
+    MechanismParams params;
+    CK_ULONG len, count, asked, i;
+    CK_ULONG handle, arg;
+    const CK_BYTE *data;
+    CK_BYTE_PTR out;
+    CK_RV crv;
+
+    switch (function) {
+    case BrokerHello:
+	response.putULong(request.getULong() == BROKER_VERSION ? 
+				CKR_OK : CKR_FUNCTION_NOT_SUPPORTED);
+	break;
+    case BrokerGetInfo:
+	{
+	    CK_INFO info;
+
+	    crv = p11->C_GetInfo(&info);
+	    response.putULong(crv);
+	    if (crv != CKR_OK) break;
+	    response.putULong(info.cryptokiVersion.major);
+	    response.putULong(info.cryptokiVersion.minor);
+	    putPadded(response, info.manufacturerID, 
+				sizeof(info.manufacturerID));
+	    response.putULong(info.flags);
+	    putPadded(response, info.libraryDescription, 
+				sizeof(info.libraryDescription));
+	    response.putULong(info.libraryVersion.major);
+	    response.putULong(info.libraryVersion.minor);
+	}
+	break;
+    case BrokerGetSlotList:
+    case BrokerGetMechanismList:
+	{
+	    CK_ULONG list[MAX_OUTPUT/sizeof(CK_ULONG)];
+	    CK_ULONG_PTR listPtr;
+
+	    arg = request.getULong();
+	    listPtr = (CK_ULONG_PTR)getOutput(request, (CK_BYTE *)list, &len);
+	    count = len < MAX_OUTPUT/sizeof(CK_ULONG) ? 
+					len : MAX_OUTPUT/sizeof(CK_ULONG);
+	    if (function == BrokerGetSlotList) {
+		crv = p11->C_GetSlotList((CK_BBOOL)arg, listPtr, &count);
+	    } else {
+		crv = p11->C_GetMechanismList(arg, listPtr, &count);
+	    }
+	    response.putULong(crv);
+	    if (crv != CKR_OK && crv != CKR_BUFFER_TOO_SMALL) break;
+	    response.putULong(count);
+	    if (listPtr && crv == CKR_OK) {
+		for (i = 0; i < count; i++) {
+		    response.putULong(list[i]);
+		}
+	    }
+	}
+	break;
+    case BrokerGetSlotInfo:
+	{
+	    CK_SLOT_INFO info;
+
+	    crv = p11->C_GetSlotInfo(request.getULong(), &info);
+	    response.putULong(crv);
+	    if (crv != CKR_OK) break;
+	    putPadded(response, info.slotDescription, 
+				sizeof(info.slotDescription));
+	    putPadded(response, info.manufacturerID, 
+				sizeof(info.manufacturerID));
+	    response.putULong(info.flags);
+	    response.putULong(info.hardwareVersion.major);
+	    response.putULong(info.hardwareVersion.minor);
+	    response.putULong(info.firmwareVersion.major);
+	    response.putULong(info.firmwareVersion.minor);
+	}
+	break;
+    case BrokerGetTokenInfo:
+	{
+	    CK_TOKEN_INFO info;
+
+	    crv = p11->C_GetTokenInfo(request.getULong(), &info);
+	    response.putULong(crv);
+	    if (crv != CKR_OK) break;
+	    putPadded(response, info.label, sizeof(info.label));
+	    putPadded(response, info.manufacturerID, 
+					sizeof(info.manufacturerID));
+	    putPadded(response, info.model, sizeof(info.model));
+	    putPadded(response, (CK_UTF8CHAR *)info.serialNumber, 
+					sizeof(info.serialNumber));
+	    response.putULong(info.flags);
+	    response.putULong(info.ulMaxSessionCount);
+	    response.putULong(info.ulSessionCount);
+	    response.putULong(info.ulMaxRwSessionCount);
+	    response.putULong(info.ulRwSessionCount);
+	    response.putULong(info.ulMaxPinLen);
+	    response.putULong(info.ulMinPinLen);
+	    response.putULong(info.ulTotalPublicMemory);
+	    response.putULong(info.ulFreePublicMemory);
+	    response.putULong(info.ulTotalPrivateMemory);
+	    response.putULong(info.ulFreePrivateMemory);
+	    response.putULong(info.hardwareVersion.major);
+	    response.putULong(info.hardwareVersion.minor);
+	    response.putULong(info.firmwareVersion.major);
+	    response.putULong(info.firmwareVersion.minor);
+	    putPadded(response, (CK_UTF8CHAR *)info.utcTime, 
+					sizeof(info.utcTime));
+	}
+	break;
+    case BrokerGetMechanismInfo:
+	{
+	    CK_MECHANISM_INFO info;
+
+	    arg = request.getULong();
+	    crv = p11->C_GetMechanismInfo(arg, request.getULong(), &info);
+	    response.putULong(crv);
+	    if (crv != CKR_OK) break;
+	    response.putULong(info.ulMinKeySize);
+	    response.putULong(info.ulMaxKeySize);
+	    response.putULong(info.flags);
+	}
+	break;
+    case BrokerWaitForSlotEvent:
+	{
+	    CK_SLOT_ID slot;
+
+	    crv = nextSlotEvent(client, &slot);
+	    response.putULong(crv);
+	    if (crv == CKR_OK) {
+		response.putULong(slot);
+	    }
+	}
+	break;
+    case BrokerOpenSession:
+	arg = request.getULong();
+	crv = p11->C_OpenSession(arg, request.getULong(), NULL, NULL, 
+								&handle);
+	response.putULong(crv);
+	if (crv == CKR_OK) {
+	    sessions.insert(handle);
+	    response.putULong(handle);
+	}
+	break;
+    case BrokerCloseSession:
+	handle = request.getULong();
+	if (sessions.find(handle) == sessions.end()) {
+	    response.putULong(CKR_SESSION_HANDLE_INVALID);
+	    break;
+	}
+	sessions.erase(handle);
+	response.putULong(p11->C_CloseSession(handle));
+	break;
+    case BrokerCloseAllSessions:
+	// only this client's sessions, the others aren't ours to close
+	arg = request.getULong();
+	{
+	    SessionSet::iterator it = sessions.begin();
+	    while (it != sessions.end()) {
+		CK_SESSION_INFO info;
+		SessionSet::iterator next = it;
+
+		next++;
+		if (p11->C_GetSessionInfo(*it, &info) != CKR_OK ||
+						info.slotID == arg) {
+		    p11->C_CloseSession(*it);
+		    sessions.erase(it);
+		}
+		it = next;
+	    }
+	}
+	response.putULong(CKR_OK);
+	break;
+    default:
+	// everything else works on one of this client's sessions
+	handle = request.getULong();
+	if (sessions.find(handle) == sessions.end()) {
+	    response.putULong(CKR_SESSION_HANDLE_INVALID);
+	    break;
+	}
+	switch (function) {
+	case BrokerGetSessionInfo:
+	    {
+		CK_SESSION_INFO info;
+
+		crv = p11->C_GetSessionInfo(handle, &info);
+		response.putULong(crv);
+		if (crv != CKR_OK) break;
+		response.putULong(info.slotID);
+		response.putULong(info.state);
+		response.putULong(info.flags);
+		response.putULong(info.ulDeviceError);
+	    }
+	    break;
+	case BrokerLogin:
+	    arg = request.getULong();
+	    data = request.getBytes(&len);
+	    response.putULong(p11->C_Login(handle, arg, 
+					(CK_UTF8CHAR_PTR)data, len));
+	    break;
+	case BrokerLogout:
+	    response.putULong(p11->C_Logout(handle));
+	    break;
+	case BrokerFindObjectsInit:
+	    count = getTemplate(request, attrs);
+	    response.putULong(p11->C_FindObjectsInit(handle, 
+					count ? attrs : NULL, count));
+	    break;
+	case BrokerFindObjects:
+	    {
+		CK_OBJECT_HANDLE objects[MAX_OUTPUT/sizeof(CK_OBJECT_HANDLE)];
+		CK_ULONG max = request.getULong();
+
+		if (max > sizeof(objects)/sizeof(objects[0])) {
+		    max = sizeof(objects)/sizeof(objects[0]);
+		}
+		crv = p11->C_FindObjects(handle, objects, max, &count);
+		response.putULong(crv);
+		if (crv != CKR_OK) break;
+		response.putULong(count);
+		for (i = 0; i < count; i++) {
+		    response.putULong(objects[i]);
+		}
+	    }
+	    break;
+	case BrokerFindObjectsFinal:
+	    response.putULong(p11->C_FindObjectsFinal(handle));
+	    break;
+	case BrokerGetAttributeValue:
+	    {
+		CK_OBJECT_HANDLE object = request.getULong();
+		CK_ULONG used = 0;
+
+		count = request.getULong();
+		if (count > MAX_ATTRIBUTES) {
+		    response.putULong(CKR_TEMPLATE_INCONSISTENT);
+		    break;
+		}
+		// carve the output buffers out of buf
+		for (i = 0; i < count; i++) {
+		    attrs[i].type = request.getULong();
+		    attrs[i].pValue = getOutput(request, buf + used, 
+						&attrs[i].ulValueLen);
+		    if (attrs[i].pValue) {
+			if (attrs[i].ulValueLen > MAX_OUTPUT - used) {
+			    attrs[i].ulValueLen = MAX_OUTPUT - used;
+			}
+			used += attrs[i].ulValueLen;
+		    }
+		}
+		crv = p11->C_GetAttributeValue(handle, object, attrs, count);
+		response.putULong(crv);
+		if (crv != CKR_OK && crv != CKR_ATTRIBUTE_SENSITIVE &&
+			crv != CKR_ATTRIBUTE_TYPE_INVALID &&
+			crv != CKR_BUFFER_TOO_SMALL) {
+		    break;
+		}
+		for (i = 0; i < count; i++) {
+		    // per attribute the value is good if the length is
+		    putOutput(response, CKR_OK, (CK_BYTE *)attrs[i].pValue,
+						attrs[i].ulValueLen);
+		}
+	    }
+	    break;
+	case BrokerSignInit:
+	case BrokerDecryptInit:
+	case BrokerEncryptInit:
+	case BrokerVerifyInit:
+	case BrokerVerifyRecoverInit:
+	case BrokerDigestInit:
+	    getMechanism(request, &mech, &params);
+	    arg = request.getULong();
+	    if (function == BrokerSignInit) {
+		response.putULong(p11->C_SignInit(handle, &mech, arg));
+	    } else if (function == BrokerDecryptInit) {
+		response.putULong(p11->C_DecryptInit(handle, &mech, arg));
+	    } else if (function == BrokerEncryptInit) {
+		response.putULong(p11->C_EncryptInit(handle, &mech, arg));
+	    } else if (function == BrokerVerifyInit) {
+		response.putULong(p11->C_VerifyInit(handle, &mech, arg));
+	    } else if (function == BrokerDigestInit) {
+		response.putULong(p11->C_DigestInit(handle, &mech));
+	    } else {
+		response.putULong(p11->C_VerifyRecoverInit(handle, &mech, arg));
+	    }
+	    break;
+	case BrokerVerify:
+	    {
+		const CK_BYTE *sig;
+		CK_ULONG sigLen;
+
+		data = request.getBytes(&len);
+		sig = request.getBytes(&sigLen);
+		response.putULong(p11->C_Verify(handle, (CK_BYTE_PTR)data, len,
+						(CK_BYTE_PTR)sig, sigLen));
+	    }
+	    break;
+	case BrokerSign:
+	case BrokerDecrypt:
+	case BrokerEncrypt:
+	case BrokerVerifyRecover:
+	case BrokerDigest:
+	case BrokerDigestFinal:
+	case BrokerSignFinal:
+	case BrokerEncryptUpdate:
+	case BrokerEncryptFinal:
+	case BrokerDecryptUpdate:
+	case BrokerDecryptFinal:
+	case BrokerGenerateRandom:
+	    data = request.getBytes(&len);
+	    out = getOutput(request, buf, &count, &asked);
+	    if (function == BrokerSign) {
+		crv = p11->C_Sign(handle, (CK_BYTE_PTR)data, len, out, &count);
+	    } else if (function == BrokerDecrypt) {
+		crv = p11->C_Decrypt(handle, (CK_BYTE_PTR)data, len, out, 
+								&count);
+	    } else if (function == BrokerEncrypt) {
+		crv = p11->C_Encrypt(handle, (CK_BYTE_PTR)data, len, out, 
+								&count);
+	    } else if (function == BrokerVerifyRecover) {
+		crv = p11->C_VerifyRecover(handle, (CK_BYTE_PTR)data, len, out,
+								&count);
+	    } else if (function == BrokerDigest) {
+		crv = p11->C_Digest(handle, (CK_BYTE_PTR)data, len, out,
+								&count);
+	    } else if (function == BrokerDigestFinal) {
+		crv = p11->C_DigestFinal(handle, out, &count);
+	    } else if (function == BrokerSignFinal) {
+		crv = p11->C_SignFinal(handle, out, &count);
+	    } else if (function == BrokerEncryptUpdate) {
+		crv = p11->C_EncryptUpdate(handle, (CK_BYTE_PTR)data, len, out,
+								&count);
+	    } else if (function == BrokerEncryptFinal) {
+		crv = p11->C_EncryptFinal(handle, out, &count);
+	    } else if (function == BrokerDecryptUpdate) {
+		crv = p11->C_DecryptUpdate(handle, (CK_BYTE_PTR)data, len, out,
+								&count);
+	    } else if (function == BrokerDecryptFinal) {
+		crv = p11->C_DecryptFinal(handle, out, &count);
+	    } else if (asked > count) {
+		/* the client splits big requests, never hand back less
+		 * random data than was asked for */
+		crv = CKR_ARGUMENTS_BAD;
+	    } else {
+		crv = p11->C_GenerateRandom(handle, out, count);
+	    }
+	    response.putULong(crv);
+	    if (crv == CKR_OK || crv == CKR_BUFFER_TOO_SMALL) {
+		putOutput(response, crv, out, count);
+	    }
+	    break;
+	case BrokerSeedRandom:
+	    data = request.getBytes(&len);
+	    response.putULong(p11->C_SeedRandom(handle, (CK_BYTE_PTR)data, 
+								len));
+	    break;
+	case BrokerDigestUpdate:
+	    data = request.getBytes(&len);
+	    response.putULong(p11->C_DigestUpdate(handle, (CK_BYTE_PTR)data,
+								len));
+	    break;
+	case BrokerSignUpdate:
+	    data = request.getBytes(&len);
+	    response.putULong(p11->C_SignUpdate(handle, (CK_BYTE_PTR)data,
+								len));
+	    break;
+	case BrokerDestroyObject:
+	    arg = request.getULong();
+	    response.putULong(p11->C_DestroyObject(handle, arg));
+	    break;
+	case BrokerDeriveKey:
+	    {
+		CK_OBJECT_HANDLE key;
+
+		getMechanism(request, &mech, &params);
+		arg = request.getULong();
+		count = getTemplate(request, attrs);
+		crv = p11->C_DeriveKey(handle, &mech, arg, 
+					count ? attrs : NULL, count, &key);
+		response.putULong(crv);
+		if (crv == CKR_OK) {
+		    response.putULong(key);
+		}
+	    }
+	    break;
+	default:
+	    response.putULong(CKR_FUNCTION_NOT_SUPPORTED);
+	    break;
+	}
+	break;
+    }
+}
+
+static void *
+serveClient(void *arg)
+{
+    int fd = (int)(long)arg;
+    BrokerMessage request, response;
+    Client client;
+    SessionSet::iterator it;
+
+    // start from the current counts, only later events are news
+    pthread_mutex_lock(&eventLock);
+    client.seenEvents = slotEvents;
+    pthread_mutex_unlock(&eventLock);
+
+    while (request.receive(fd)) {
+	response.clear();
+	try {
+	    dispatch(request, response, client);
+	} catch (PKCS11Exception &e) {
+	    response.clear();
+	    response.putULong(e.getCRV());
+	}
+	if (!response.send(fd)) {
+	    break;
+	}
+    }
+    close(fd);
+    for (it = client.sessions.begin(); it != client.sessions.end(); ++it) {
+	p11->C_CloseSession(*it);
+    }
+    return NULL;
+}
+
+static void *
+watchSlots(void *arg)
+{
+    CK_SLOT_ID slot;
+    CK_RV crv;
+
+    for (;;) {
+	crv = p11->C_WaitForSlotEvent(0, &slot, NULL);
+	if (crv == CKR_CRYPTOKI_NOT_INITIALIZED) {
+	    break;
+	}
+	if (crv != CKR_OK) {
+	    sleep(1);
+	    continue;
+	}
+	pthread_mutex_lock(&eventLock);
+	slotEvents[slot]++;
+	pthread_mutex_unlock(&eventLock);
+    }
+    return NULL;
+}
+
+static bool
+sameUser(int fd)
+{
+#ifdef SO_PEERCRED
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0) {
+	return false;
+    }
+    return cred.uid == getuid();
+#else
+    return true; // the socket is owner only
+#endif
+}
+
+static void
+usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-f] [-m module] [-s socket]\n", prog);
+    exit(2);
+}
+
+int
+main(int argc, char **argv)
+{
+    const char *module = DEFAULT_MODULE;
+    const char *socketName = getenv("COOL_KEY_BROKER");
+    bool foreground = false;
+    CK_C_GetFunctionList getFunctionList;
+    CK_C_INITIALIZE_ARGS initArgs;
+    struct sockaddr_un addr;
+    pthread_attr_t attr;
+    pthread_t thread;
+    void *library;
+    int listenFd, c;
+
+    while ((c = getopt(argc, argv, "fm:s:")) != -1) {
+	switch (c) {
+	case 'f': foreground = true; break;
+	case 'm': module = optarg; break;
+	case 's': socketName = optarg; break;
+	default: usage(argv[0]);
+	}
+    }
+    if (!socketName || strlen(socketName) >= sizeof(addr.sun_path)) {
+	usage(argv[0]);
+    }
+
+    // the module we load must talk to the cards, not to us
+    unsetenv("COOL_KEY_BROKER");
+    library = dlopen(module, RTLD_NOW|RTLD_LOCAL);
+    if (!library) {
+	fprintf(stderr, "can't load %s: %s\n", module, dlerror());
+	return 1;
+    }
+    getFunctionList = (CK_C_GetFunctionList) dlsym(library, 
+						"C_GetFunctionList");
+    if (!getFunctionList || getFunctionList(&p11) != CKR_OK) {
+	fprintf(stderr, "%s is not a PKCS #11 module\n", module);
+	return 1;
+    }
+    listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listenFd < 0) {
+	perror("socket");
+	return 1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socketName);
+    unlink(socketName);
+    umask(077);
+    if (bind(listenFd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+					listen(listenFd, 16) < 0) {
+	perror(socketName);
+	return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    if (!foreground && daemon(0, 0) < 0) {
+	perror("daemon");
+	return 1;
+    }
+
+    // the module's threads, locks and PC/SC context belong to whichever
+    // process initializes it, so that has to be the one left after daemon()
+    memset(&initArgs, 0, sizeof(initArgs));
+    initArgs.flags = CKF_OS_LOCKING_OK;
+    if (p11->C_Initialize(&initArgs) != CKR_OK) {
+	fprintf(stderr, "C_Initialize failed\n");
+	unlink(socketName);
+	return 1;
+    }
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_create(&thread, &attr, watchSlots, NULL);
+    for (;;) {
+	int fd = accept(listenFd, NULL, NULL);
+
+	if (fd < 0) {
+	    if (errno == EINTR) {
+		continue;
+	    }
+	    perror("accept");
+	    break;
+	}
+	if (!sameUser(fd) || 
+	    pthread_create(&thread, &attr, serveClient, (void *)(long)fd) != 0) {
+	    close(fd);
+	}
+    }
+    p11->C_Finalize(NULL);
+    unlink(socketName);
+    return 1;
+}
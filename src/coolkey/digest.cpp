@@ -0,0 +1,683 @@
+/* ***** BEGIN COPYRIGHT BLOCK *****
+ * Copyright (C) 2005 Red Hat, Inc.
+ * All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation version
+ * 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ * ***** END COPYRIGHT BLOCK *****/
+
+#include <string.h>
+#include "mypkcs11.h"
+#include "PKCS11Exception.h"
+#include "digest.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define DIGEST_SHA_EXTENSIONS 1
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+static const unsigned int sha1Init[5] = {
+    0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0
+};
+
+static const unsigned int sha224Init[8] = {
+    0xc1059ed8, 0x367cd507, 0x3070dd17, 0xf70e5939,
+    0xffc00b31, 0x68581511, 0x64f98fa7, 0xbefa4fa4
+};
+
+static const unsigned int sha256Init[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+    0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+static const unsigned long long sha384Init[8] = {
+    0xcbbb9d5dc1059ed8ULL, 0x629a292a367cd507ULL, 0x9159015a3070dd17ULL,
+    0x152fecd8f70e5939ULL, 0x67332667ffc00b31ULL, 0x8eb44a8768581511ULL,
+    0xdb0c2e0d64f98fa7ULL, 0x47b5481dbefa4fa4ULL
+};
+
+static const unsigned long long sha512Init[8] = {
+    0x6a09e667f3bcc908ULL, 0xbb67ae8584caa73bULL, 0x3c6ef372fe94f82bULL,
+    0xa54ff53a5f1d36f1ULL, 0x510e527fade682d1ULL, 0x9b05688c2b3e6c1fULL,
+    0x1f83d9abfb41bd6bULL, 0x5be0cd19137e2179ULL
+};
+
+static const unsigned int sha256K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+    0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+    0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+    0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+    0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static const unsigned long long sha512K[80] = {
+    0x428a2f98d728ae22ULL, 0x7137449123ef65cdULL, 0xb5c0fbcfec4d3b2fULL,
+    0xe9b5dba58189dbbcULL, 0x3956c25bf348b538ULL, 0x59f111f1b605d019ULL,
+    0x923f82a4af194f9bULL, 0xab1c5ed5da6d8118ULL, 0xd807aa98a3030242ULL,
+    0x12835b0145706fbeULL, 0x243185be4ee4b28cULL, 0x550c7dc3d5ffb4e2ULL,
+    0x72be5d74f27b896fULL, 0x80deb1fe3b1696b1ULL, 0x9bdc06a725c71235ULL,
+    0xc19bf174cf692694ULL, 0xe49b69c19ef14ad2ULL, 0xefbe4786384f25e3ULL,
+    0x0fc19dc68b8cd5b5ULL, 0x240ca1cc77ac9c65ULL, 0x2de92c6f592b0275ULL,
+    0x4a7484aa6ea6e483ULL, 0x5cb0a9dcbd41fbd4ULL, 0x76f988da831153b5ULL,
+    0x983e5152ee66dfabULL, 0xa831c66d2db43210ULL, 0xb00327c898fb213fULL,
+    0xbf597fc7beef0ee4ULL, 0xc6e00bf33da88fc2ULL, 0xd5a79147930aa725ULL,
+    0x06ca6351e003826fULL, 0x142929670a0e6e70ULL, 0x27b70a8546d22ffcULL,
+    0x2e1b21385c26c926ULL, 0x4d2c6dfc5ac42aedULL, 0x53380d139d95b3dfULL,
+    0x650a73548baf63deULL, 0x766a0abb3c77b2a8ULL, 0x81c2c92e47edaee6ULL,
+    0x92722c851482353bULL, 0xa2bfe8a14cf10364ULL, 0xa81a664bbc423001ULL,
+    0xc24b8b70d0f89791ULL, 0xc76c51a30654be30ULL, 0xd192e819d6ef5218ULL,
+    0xd69906245565a910ULL, 0xf40e35855771202aULL, 0x106aa07032bbd1b8ULL,
+    0x19a4c116b8d2d0c8ULL, 0x1e376c085141ab53ULL, 0x2748774cdf8eeb99ULL,
+    0x34b0bcb5e19b48a8ULL, 0x391c0cb3c5c95a63ULL, 0x4ed8aa4ae3418acbULL,
+    0x5b9cca4f7763e373ULL, 0x682e6ff3d6b2b8a3ULL, 0x748f82ee5defb2fcULL,
+    0x78a5636f43172f60ULL, 0x84c87814a1f0ab72ULL, 0x8cc702081a6439ecULL,
+    0x90befffa23631e28ULL, 0xa4506cebde82bde9ULL, 0xbef9a3f7b2c67915ULL,
+    0xc67178f2e372532bULL, 0xca273eceea26619cULL, 0xd186b8c721c0c207ULL,
+    0xeada7dd6cde0eb1eULL, 0xf57d4f7fee6ed178ULL, 0x06f067aa72176fbaULL,
+    0x0a637dc5a2c898a6ULL, 0x113f9804bef90daeULL, 0x1b710b35131c471bULL,
+    0x28db77f523047d84ULL, 0x32caab7b40c72493ULL, 0x3c9ebe0a15c9bebcULL,
+    0x431d67c49c100d4cULL, 0x4cc5d4becb3e42b6ULL, 0x597f299cfc657e2aULL,
+    0x5fcb6fab3ad6faecULL, 0x6c44198c4a475817ULL
+};
+
+#define ROL32(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+#define ROR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+#define ROR64(x, n) (((x) >> (n)) | ((x) << (64 - (n))))
+
+static unsigned int
+getBE32(const CKYByte *p)
+{
+    return ((unsigned int)p[0] << 24) | ((unsigned int)p[1] << 16) |
+	   ((unsigned int)p[2] << 8) | p[3];
+}
+
+static unsigned long long
+getBE64(const CKYByte *p)
+{
+    return ((unsigned long long)getBE32(p) << 32) | getBE32(p + 4);
+}
+
+static void
+sha1Blocks(unsigned int *h, const CKYByte *data, CKYSize blocks)
+{
+    unsigned int w[80];
+
+    for (; blocks; blocks--, data += 64) {
+	unsigned int a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+	int i;
+
+	for (i=0; i < 16; i++) {
+	    w[i] = getBE32(data + 4*i);
+	}
+	for (; i < 80; i++) {
+	    w[i] = ROL32(w[i-3] ^ w[i-8] ^ w[i-14] ^ w[i-16], 1);
+	}
+#define SHA1_ROUND(f, k) { \
+	    unsigned int t = ROL32(a, 5) + (f) + e + (k) + w[i]; \
+	    e = d; d = c; c = ROL32(b, 30); b = a; a = t; \
+	}
+	for (i=0; i < 20; i++) SHA1_ROUND((b & c) | (~b & d), 0x5a827999)
+	for (; i < 40; i++) SHA1_ROUND(b ^ c ^ d, 0x6ed9eba1)
+	for (; i < 60; i++) SHA1_ROUND((b & c) | (b & d) | (c & d), 0x8f1bbcdc)
+	for (; i < 80; i++) SHA1_ROUND(b ^ c ^ d, 0xca62c1d6)
+#undef SHA1_ROUND
+	h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e;
+    }
+}
+
+static void
+sha256Blocks(unsigned int *h, const CKYByte *data, CKYSize blocks)
+{
+    unsigned int w[64];
+
+    for (; blocks; blocks--, data += 64) {
+	unsigned int a = h[0], b = h[1], c = h[2], d = h[3];
+	unsigned int e = h[4], f = h[5], g = h[6], hh = h[7];
+	int i;
+
+	for (i=0; i < 16; i++) {
+	    w[i] = getBE32(data + 4*i);
+	}
+	for (; i < 64; i++) {
+	    unsigned int s0 = ROR32(w[i-15], 7) ^ ROR32(w[i-15], 18) ^
+							(w[i-15] >> 3);
+	    unsigned int s1 = ROR32(w[i-2], 17) ^ ROR32(w[i-2], 19) ^
+							(w[i-2] >> 10);
+	    w[i] = w[i-16] + s0 + w[i-7] + s1;
+	}
+	for (i=0; i < 64; i++) {
+	    unsigned int s1 = ROR32(e, 6) ^ ROR32(e, 11) ^ ROR32(e, 25);
+	    unsigned int ch = (e & f) ^ (~e & g);
+	    unsigned int t1 = hh + s1 + ch + sha256K[i] + w[i];
+	    unsigned int s0 = ROR32(a, 2) ^ ROR32(a, 13) ^ ROR32(a, 22);
+	    unsigned int maj = (a & b) ^ (a & c) ^ (b & c);
+	    unsigned int t2 = s0 + maj;
+	    hh = g; g = f; f = e; e = d + t1;
+	    d = c; c = b; b = a; a = t1 + t2;
+	}
+	h[0] += a; h[1] += b; h[2] += c; h[3] += d;
+	h[4] += e; h[5] += f; h[6] += g; h[7] += hh;
+    }
+}
+
+static void
+sha512Blocks(unsigned long long *h, const CKYByte *data, CKYSize blocks)
+{
+    unsigned long long w[80];
+
+    for (; blocks; blocks--, data += 128) {
+	unsigned long long a = h[0], b = h[1], c = h[2], d = h[3];
+	unsigned long long e = h[4], f = h[5], g = h[6], hh = h[7];
+	int i;
+
+	for (i=0; i < 16; i++) {
+	    w[i] = getBE64(data + 8*i);
+	}
+	for (; i < 80; i++) {
+	    unsigned long long s0 = ROR64(w[i-15], 1) ^ ROR64(w[i-15], 8) ^
+							(w[i-15] >> 7);
+	    unsigned long long s1 = ROR64(w[i-2], 19) ^ ROR64(w[i-2], 61) ^
+							(w[i-2] >> 6);
+	    w[i] = w[i-16] + s0 + w[i-7] + s1;
+	}
+	for (i=0; i < 80; i++) {
+	    unsigned long long s1 = ROR64(e, 14) ^ ROR64(e, 18) ^ ROR64(e, 41);
+	    unsigned long long ch = (e & f) ^ (~e & g);
+	    unsigned long long t1 = hh + s1 + ch + sha512K[i] + w[i];
+	    unsigned long long s0 = ROR64(a, 28) ^ ROR64(a, 34) ^ ROR64(a, 39);
+	    unsigned long long maj = (a & b) ^ (a & c) ^ (b & c);
+	    unsigned long long t2 = s0 + maj;
+	    hh = g; g = f; f = e; e = d + t1;
+	    d = c; c = b; b = a; a = t1 + t2;
+	}
+	h[0] += a; h[1] += b; h[2] += c; h[3] += d;
+	h[4] += e; h[5] += f; h[6] += g; h[7] += hh;
+    }
+}
+
+#ifdef DIGEST_SHA_EXTENSIONS
+//
+// SHA-1 and SHA-256 with the SHA extensions, four rounds (two for
+// SHA-256) per instruction. The message schedule is the one in Intel's
+// white paper, written as one macro per group of four rounds.
+//
+__attribute__((target("sha,sse4.1,ssse3")))
+static void
+sha1BlocksHW(unsigned int *h, const CKYByte *data, CKYSize blocks)
+{
+    const __m128i mask = _mm_set_epi64x(0x0001020304050607ULL,
+						0x08090a0b0c0d0e0fULL);
+    __m128i abcd = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)h),
+									0x1b);
+    __m128i e0 = _mm_set_epi32(h[4], 0, 0, 0);
+
+    for (; blocks; blocks--, data += 64) {
+	__m128i abcdSave = abcd;
+	__m128i e0Save = e0;
+	__m128i e1;
+	__m128i msg[4];
+	int i;
+
+	for (i=0; i < 4; i++) {
+	    msg[i] = _mm_shuffle_epi8(
+		_mm_loadu_si128((const __m128i *)(data + 16*i)), mask);
+	}
+	e0 = _mm_add_epi32(e0, msg[0]);
+	e1 = abcd;
+	abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+
+#define SHA1_ROUNDS(i, ecur, enext, func) \
+	ecur = _mm_sha1nexte_epu32(ecur, msg[(i) % 4]); \
+	enext = abcd; \
+	if ((i) >= 3 && (i) <= 18) { \
+	    msg[((i)+1) % 4] = _mm_sha1msg2_epu32(msg[((i)+1) % 4], \
+							msg[(i) % 4]); \
+	} \
+	abcd = _mm_sha1rnds4_epu32(abcd, ecur, func); \
+	if ((i) <= 16) { \
+	    msg[((i)+3) % 4] = _mm_sha1msg1_epu32(msg[((i)+3) % 4], \
+							msg[(i) % 4]); \
+	} \
+	if ((i) >= 2 && (i) <= 17) { \
+	    msg[((i)+2) % 4] = _mm_xor_si128(msg[((i)+2) % 4], \
+							msg[(i) % 4]); \
+	}
+
+	SHA1_ROUNDS(1, e1, e0, 0)
+	SHA1_ROUNDS(2, e0, e1, 0)
+	SHA1_ROUNDS(3, e1, e0, 0)
+	SHA1_ROUNDS(4, e0, e1, 0)
+	SHA1_ROUNDS(5, e1, e0, 1)
+	SHA1_ROUNDS(6, e0, e1, 1)
+	SHA1_ROUNDS(7, e1, e0, 1)
+	SHA1_ROUNDS(8, e0, e1, 1)
+	SHA1_ROUNDS(9, e1, e0, 1)
+	SHA1_ROUNDS(10, e0, e1, 2)
+	SHA1_ROUNDS(11, e1, e0, 2)
+	SHA1_ROUNDS(12, e0, e1, 2)
+	SHA1_ROUNDS(13, e1, e0, 2)
+	SHA1_ROUNDS(14, e0, e1, 2)
+	SHA1_ROUNDS(15, e1, e0, 3)
+	SHA1_ROUNDS(16, e0, e1, 3)
+	SHA1_ROUNDS(17, e1, e0, 3)
+	SHA1_ROUNDS(18, e0, e1, 3)
+	SHA1_ROUNDS(19, e1, e0, 3)
+#undef SHA1_ROUNDS
+
+	e0 = _mm_sha1nexte_epu32(e0, e0Save);
+	abcd = _mm_add_epi32(abcd, abcdSave);
+    }
+    _mm_storeu_si128((__m128i *)h, _mm_shuffle_epi32(abcd, 0x1b));
+    h[4] = _mm_extract_epi32(e0, 3);
+}
+
+__attribute__((target("sha,sse4.1,ssse3")))
+static void
+sha256BlocksHW(unsigned int *h, const CKYByte *data, CKYSize blocks)
+{
+    const __m128i mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL,
+						0x0405060700010203ULL);
+    __m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)h),
+									0xb1);
+    __m128i state1 = _mm_shuffle_epi32(
+			_mm_loadu_si128((const __m128i *)(h + 4)), 0x1b);
+    __m128i state0 = _mm_alignr_epi8(tmp, state1, 8);	// ABEF
+    state1 = _mm_blend_epi16(state1, tmp, 0xf0);	// CDGH
+
+    for (; blocks; blocks--, data += 64) {
+	__m128i abefSave = state0;
+	__m128i cdghSave = state1;
+	__m128i msg[4];
+	__m128i m;
+	int i;
+
+	for (i=0; i < 4; i++) {
+	    msg[i] = _mm_shuffle_epi8(
+		_mm_loadu_si128((const __m128i *)(data + 16*i)), mask);
+	}
+
+#define SHA256_ROUNDS(i) \
+	m = _mm_add_epi32(msg[(i) % 4], \
+			_mm_loadu_si128((const __m128i *)(sha256K + 4*(i)))); \
+	state1 = _mm_sha256rnds2_epu32(state1, state0, m); \
+	if ((i) >= 3 && (i) <= 14) { \
+	    tmp = _mm_alignr_epi8(msg[(i) % 4], msg[((i)+3) % 4], 4); \
+	    msg[((i)+1) % 4] = _mm_add_epi32(msg[((i)+1) % 4], tmp); \
+	    msg[((i)+1) % 4] = _mm_sha256msg2_epu32(msg[((i)+1) % 4], \
+							msg[(i) % 4]); \
+	} \
+	m = _mm_shuffle_epi32(m, 0x0e); \
+	state0 = _mm_sha256rnds2_epu32(state0, state1, m); \
+	if ((i) >= 1 && (i) <= 12) { \
+	    msg[((i)+3) % 4] = _mm_sha256msg1_epu32(msg[((i)+3) % 4], \
+							msg[(i) % 4]); \
+	}
+
+	SHA256_ROUNDS(0)  SHA256_ROUNDS(1)  SHA256_ROUNDS(2)  SHA256_ROUNDS(3)
+	SHA256_ROUNDS(4)  SHA256_ROUNDS(5)  SHA256_ROUNDS(6)  SHA256_ROUNDS(7)
+	SHA256_ROUNDS(8)  SHA256_ROUNDS(9)  SHA256_ROUNDS(10) SHA256_ROUNDS(11)
+	SHA256_ROUNDS(12) SHA256_ROUNDS(13) SHA256_ROUNDS(14) SHA256_ROUNDS(15)
+#undef SHA256_ROUNDS
+
+	state0 = _mm_add_epi32(state0, abefSave);
+	state1 = _mm_add_epi32(state1, cdghSave);
+    }
+    tmp = _mm_shuffle_epi32(state0, 0x1b);		// FEBA
+    state1 = _mm_shuffle_epi32(state1, 0xb1);		// DCHG
+    _mm_storeu_si128((__m128i *)h, _mm_blend_epi16(tmp, state1, 0xf0));
+    _mm_storeu_si128((__m128i *)(h + 4), _mm_alignr_epi8(state1, tmp, 8));
+}
+
+static bool
+cpuHasSHA()
+{
+    unsigned int eax, ebx, ecx, edx;
+
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) ||
+	!(ecx & (1 << 9)) || !(ecx & (1 << 19))) {	// SSSE3, SSE4.1
+	return false;
+    }
+    if (__get_cpuid_max(0, NULL) < 7) {
+	return false;
+    }
+    __cpuid_count(7, 0, eax, ebx, ecx, edx);
+    return (ebx & (1 << 29)) != 0;			// SHA
+}
+#endif
+
+typedef void (*Blocks32Func)(unsigned int *h, const CKYByte *data,
+							CKYSize blocks);
+
+static Blocks32Func sha1Func;
+static Blocks32Func sha256Func;
+
+// pick the block functions once. Racing threads pick the same ones.
+static void
+selectFuncs()
+{
+    Blocks32Func f1 = sha1Blocks;
+    Blocks32Func f256 = sha256Blocks;
+#ifdef DIGEST_SHA_EXTENSIONS
+    if (cpuHasSHA()) {
+	f1 = sha1BlocksHW;
+	f256 = sha256BlocksHW;
+    }
+#endif
+    sha1Func = f1;
+    sha256Func = f256;
+}
+
+CKYSize
+HostDigest::getSize(CK_MECHANISM_TYPE mech)
+{
+    switch (mech) {
+    case CKM_SHA_1:
+	return 20;
+    case CKM_SHA224:
+	return 28;
+    case CKM_SHA256:
+	return 32;
+    case CKM_SHA384:
+	return 48;
+    case CKM_SHA512:
+	return 64;
+    }
+    return 0;
+}
+
+void
+HostDigest::init(CK_MECHANISM_TYPE mech)
+{
+    if (sha256Func == NULL) {
+	selectFuncs();
+    }
+    switch (mech) {
+    case CKM_SHA_1:
+	memcpy(state.s32, sha1Init, sizeof(sha1Init));
+	break;
+    case CKM_SHA224:
+	memcpy(state.s32, sha224Init, sizeof(sha224Init));
+	break;
+    case CKM_SHA256:
+	memcpy(state.s32, sha256Init, sizeof(sha256Init));
+	break;
+    case CKM_SHA384:
+	memcpy(state.s64, sha384Init, sizeof(sha384Init));
+	break;
+    case CKM_SHA512:
+	memcpy(state.s64, sha512Init, sizeof(sha512Init));
+	break;
+    default:
+	throw PKCS11Exception(CKR_MECHANISM_INVALID);
+    }
+    mechanism = mech;
+    size = getSize(mech);
+    blockSize = (mech == CKM_SHA384 || mech == CKM_SHA512) ? 128 : 64;
+    length = 0;
+    blockLen = 0;
+}
+
+void
+HostDigest::compress(const CKYByte *data, CKYSize blocks)
+{
+    switch (mechanism) {
+    case CKM_SHA_1:
+	(*sha1Func)(state.s32, data, blocks);
+	break;
+    case CKM_SHA224:
+    case CKM_SHA256:
+	(*sha256Func)(state.s32, data, blocks);
+	break;
+    default:
+	sha512Blocks(state.s64, data, blocks);
+	break;
+    }
+}
+
+void
+HostDigest::update(const CKYByte *data, CKYSize len)
+{
+    length += len;
+    if (blockLen) {
+	CKYSize fill = blockSize - blockLen;
+	if (fill > len) {
+	    fill = len;
+	}
+	memcpy(block + blockLen, data, fill);
+	blockLen += fill;
+	data += fill;
+	len -= fill;
+	if (blockLen < blockSize) {
+	    return;
+	}
+	compress(block, 1);
+	blockLen = 0;
+    }
+    if (len >= blockSize) {
+	CKYSize blocks = len / blockSize;
+	compress(data, blocks);
+	data += blocks * blockSize;
+	len -= blocks * blockSize;
+    }
+    if (len) {
+	memcpy(block, data, len);
+	blockLen = len;
+    }
+}
+
+void
+HostDigest::final(CKYByte *out)
+{
+    unsigned long long bits = length * 8;
+    CKYSize lenSize = blockSize / 8;	// 8 bytes of length, 16 for SHA-512
+    CKYSize i;
+
+    block[blockLen++] = 0x80;
+    if (blockLen > blockSize - lenSize) {
+	memset(block + blockLen, 0, blockSize - blockLen);
+	compress(block, 1);
+	blockLen = 0;
+    }
+    memset(block + blockLen, 0, blockSize - blockLen);
+    for (i=0; i < 8; i++) {
+	block[blockSize - 1 - i] = (CKYByte) (bits >> (8*i));
+    }
+    compress(block, 1);
+
+    for (i=0; i < size; i++) {
+	if (blockSize == 128) {
+	    out[i] = (CKYByte) (state.s64[i/8] >> (8 * (7 - i%8)));
+	} else {
+	    out[i] = (CKYByte) (state.s32[i/4] >> (8 * (3 - i%4)));
+	}
+    }
+    memset(block, 0, sizeof(block));
+    blockLen = 0;
+}
+
+CK_MECHANISM_TYPE
+HostDigest::getSignDigest(CK_MECHANISM_TYPE signMech,
+					CK_MECHANISM_TYPE *rawMech)
+{
+    *rawMech = CKM_RSA_PKCS;
+    switch (signMech) {
+    case CKM_SHA1_RSA_PKCS:
+	return CKM_SHA_1;
+    case CKM_SHA224_RSA_PKCS:
+	return CKM_SHA224;
+    case CKM_SHA256_RSA_PKCS:
+	return CKM_SHA256;
+    case CKM_SHA384_RSA_PKCS:
+	return CKM_SHA384;
+    case CKM_SHA512_RSA_PKCS:
+	return CKM_SHA512;
+    }
+    *rawMech = CKM_ECDSA;
+    switch (signMech) {
+    case CKM_ECDSA_SHA1:
+	return CKM_SHA_1;
+    case CKM_ECDSA_SHA224:
+	return CKM_SHA224;
+    case CKM_ECDSA_SHA256:
+	return CKM_SHA256;
+    case CKM_ECDSA_SHA384:
+	return CKM_SHA384;
+    case CKM_ECDSA_SHA512:
+	return CKM_SHA512;
+    }
+    *rawMech = signMech;
+    return 0;
+}
+
+// DER DigestInfo up to the hash itself, from PKCS #1
+static const CKYByte sha1Info[] = { 0x30, 0x21, 0x30, 0x09, 0x06, 0x05,
+    0x2b, 0x0e, 0x03, 0x02, 0x1a, 0x05, 0x00, 0x04, 0x14 };
+static const CKYByte sha224Info[] = { 0x30, 0x2d, 0x30, 0x0d, 0x06, 0x09,
+    0x60, 0x86, 0x48, 0x01, 0x65, 0x03, 0x04, 0x02, 0x04, 0x05, 0x00,
+    0x04, 0x1c };
+static const CKYByte sha256Info[] = { 0x30, 0x31, 0x30, 0x0d, 0x06, 0x09,
+    0x60, 0x86, 0x48, 0x01, 0x65, 0x03, 0x04, 0x02, 0x01, 0x05, 0x00,
+    0x04, 0x20 };
+static const CKYByte sha384Info[] = { 0x30, 0x41, 0x30, 0x0d, 0x06, 0x09,
+    0x60, 0x86, 0x48, 0x01, 0x65, 0x03, 0x04, 0x02, 0x02, 0x05, 0x00,
+    0x04, 0x30 };
+static const CKYByte sha512Info[] = { 0x30, 0x51, 0x30, 0x0d, 0x06, 0x09,
+    0x60, 0x86, 0x48, 0x01, 0x65, 0x03, 0x04, 0x02, 0x03, 0x05, 0x00,
+    0x04, 0x40 };
+
+CKYSize
+HostDigest::finalForSign(CK_MECHANISM_TYPE rawMech, CKYByte *out)
+{
+    const CKYByte *info = NULL;
+    CKYSize infoLen = 0;
+
+    if (rawMech == CKM_RSA_PKCS) {
+	switch (mechanism) {
+	case CKM_SHA_1:
+	    info = sha1Info; infoLen = sizeof(sha1Info);
+	    break;
+	case CKM_SHA224:
+	    info = sha224Info; infoLen = sizeof(sha224Info);
+	    break;
+	case CKM_SHA256:
+	    info = sha256Info; infoLen = sizeof(sha256Info);
+	    break;
+	case CKM_SHA384:
+	    info = sha384Info; infoLen = sizeof(sha384Info);
+	    break;
+	default:
+	    info = sha512Info; infoLen = sizeof(sha512Info);
+	    break;
+	}
+	memcpy(out, info, infoLen);
+    }
+    final(out + infoLen);
+    return infoLen + size;
+}
+
+void
+DigestState::init(CK_MECHANISM_PTR pMechanism)
+{
+    if (active) {
+	throw PKCS11Exception(CKR_OPERATION_ACTIVE);
+    }
+    if (pMechanism == NULL) {
+	throw PKCS11Exception(CKR_ARGUMENTS_BAD);
+    }
+    digest.init(pMechanism->mechanism);
+    active = true;
+    multiPart = false;
+}
+
+//
+// hand out the digest, or its length if pDigest is NULL. Only a finished
+// digest ends the operation, the length questions leave it going.
+//
+void
+DigestState::output(CK_BYTE_PTR pDigest, CK_ULONG_PTR pulDigestLen)
+{
+    CKYSize size = digest.getSize();
+
+    if (pDigest == NULL) {
+	*pulDigestLen = size;
+	return;
+    }
+    if (*pulDigestLen < size) {
+	*pulDigestLen = size;
+	throw PKCS11Exception(CKR_BUFFER_TOO_SMALL);
+    }
+    digest.final(pDigest);
+    *pulDigestLen = size;
+    active = false;
+}
+
+void
+DigestState::digestAll(CK_BYTE_PTR pData, CK_ULONG ulDataLen,
+		CK_BYTE_PTR pDigest, CK_ULONG_PTR pulDigestLen)
+{
+    if (!active) {
+	throw PKCS11Exception(CKR_OPERATION_NOT_INITIALIZED);
+    }
+    // a multi-part digest can only be finished with C_DigestFinal. Like
+    // softoken we leave it going.
+    if (multiPart) {
+	throw PKCS11Exception(CKR_OPERATION_ACTIVE);
+    }
+    if (pulDigestLen == NULL || (pData == NULL && ulDataLen != 0)) {
+	active = false;
+	throw PKCS11Exception(CKR_ARGUMENTS_BAD);
+    }
+    // don't hash anything until there is somewhere to put the result,
+    // the application will call again with the same data
+    if (pDigest == NULL || *pulDigestLen < digest.getSize()) {
+	output(pDigest, pulDigestLen);
+	return;
+    }
+    digest.update(pData, ulDataLen);
+    output(pDigest, pulDigestLen);
+}
+
+void
+DigestState::update(CK_BYTE_PTR pPart, CK_ULONG ulPartLen)
+{
+    if (!active) {
+	throw PKCS11Exception(CKR_OPERATION_NOT_INITIALIZED);
+    }
+    if (pPart == NULL && ulPartLen != 0) {
+	active = false;
+	throw PKCS11Exception(CKR_ARGUMENTS_BAD);
+    }
+    digest.update(pPart, ulPartLen);
+    multiPart = true;
+}
+
+void
+DigestState::final(CK_BYTE_PTR pDigest, CK_ULONG_PTR pulDigestLen)
+{
+    if (!active) {
+	throw PKCS11Exception(CKR_OPERATION_NOT_INITIALIZED);
+    }
+    if (pulDigestLen == NULL) {
+	active = false;
+	throw PKCS11Exception(CKR_ARGUMENTS_BAD);
+    }
+    output(pDigest, pulDigestLen);
+}
@@ -0,0 +1,102 @@
+/* ***** BEGIN COPYRIGHT BLOCK *****
+ * Copyright (C) 2005 Red Hat, Inc.
+ * All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation version
+ * 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ * ***** END COPYRIGHT BLOCK *****/
+
+#ifndef COOLKEY_DIGEST_H
+#define COOLKEY_DIGEST_H
+
+#include "mypkcs11.h"
+#include "cky_base.h"
+
+#define DIGEST_MAX_SIZE 64	/* SHA-512 */
+#define DIGEST_MAX_BLOCK 128
+#define DIGEST_MAX_SIGN_INPUT (19 + DIGEST_MAX_SIZE) /* DigestInfo */
+
+//
+// SHA-1 and SHA-2 hashing on the host, for C_Digest and for the hash and
+// sign mechanisms. Full blocks are hashed straight out of the caller's
+// buffer; only a partial block at either end is copied. SHA-1 and
+// SHA-256 use the x86 SHA extensions when the CPU has them.
+//
+class HostDigest {
+  private:
+    CK_MECHANISM_TYPE mechanism;
+    CKYSize size;		// bytes of output
+    CKYSize blockSize;		// 64, or 128 for SHA-384 and SHA-512
+    unsigned long long length;	// bytes hashed so far
+    union {
+	unsigned int s32[8];
+	unsigned long long s64[8];
+    } state;
+    CKYByte block[DIGEST_MAX_BLOCK];
+    CKYSize blockLen;		// bytes waiting in block
+
+    void compress(const CKYByte *data, CKYSize blocks);
+
+  public:
+    HostDigest() : mechanism(0), size(0), blockSize(0), length(0),
+							blockLen(0) { }
+
+    // throws CKR_MECHANISM_INVALID for anything but CKM_SHA*
+    void init(CK_MECHANISM_TYPE mech);
+    void update(const CKYByte *data, CKYSize len);
+    // writes getSize() bytes. The digest must be initialized again to
+    // be used after this.
+    void final(CKYByte *out);
+
+    CK_MECHANISM_TYPE getMechanism() const { return mechanism; }
+    CKYSize getSize() const { return size; }
+
+    // the same, but produces what a hash and sign mechanism hands the
+    // key: a DigestInfo for CKM_RSA_PKCS, the bare hash for CKM_ECDSA.
+    // out must hold DIGEST_MAX_SIGN_INPUT bytes. Returns the length.
+    CKYSize finalForSign(CK_MECHANISM_TYPE rawMech, CKYByte *out);
+
+    // output size for a digest mechanism, 0 if we don't do it
+    static CKYSize getSize(CK_MECHANISM_TYPE mech);
+
+    // splits a hash and sign mechanism (CKM_SHA256_RSA_PKCS ...) into
+    // the digest it uses, returned, and the signing mechanism that
+    // takes the result (CKM_RSA_PKCS or CKM_ECDSA), in *rawMech. Returns
+    // 0 for mechanisms that don't hash.
+    static CK_MECHANISM_TYPE getSignDigest(CK_MECHANISM_TYPE signMech,
+					CK_MECHANISM_TYPE *rawMech);
+};
+
+//
+// A session's C_Digest operation, with the PKCS #11 rules for asking
+// the output length and for which errors end the operation.
+//
+class DigestState {
+  private:
+    bool active;
+    bool multiPart;	// C_DigestUpdate was called, C_Digest can't be
+    HostDigest digest;
+
+    void output(CK_BYTE_PTR pDigest, CK_ULONG_PTR pulDigestLen);
+  public:
+    DigestState() : active(false), multiPart(false) { }
+
+    void init(CK_MECHANISM_PTR pMechanism);
+    void digestAll(CK_BYTE_PTR pData, CK_ULONG ulDataLen,
+			CK_BYTE_PTR pDigest, CK_ULONG_PTR pulDigestLen);
+    void update(CK_BYTE_PTR pPart, CK_ULONG ulPartLen);
+    void final(CK_BYTE_PTR pDigest, CK_ULONG_PTR pulDigestLen);
+};
+
+#endif
@@ -38,6 +38,7 @@
 #endif
 
 bool OSLock::needThread = 0;
+bool OSThread::allowed = 0;
 
 #ifdef _WIN32
 //
@@ -170,11 +171,145 @@ OSTime OSTimeNow(void)
     return GetTickCount(); 
 }
 
+OSTimeUsec OSTimeNowUsec(void)
+{
+    LARGE_INTEGER count, freq;
+
+    if (!QueryPerformanceFrequency(&freq) || !QueryPerformanceCounter(&count)) {
+	return (OSTimeUsec) GetTickCount() * 1000;
+    }
+    return (OSTimeUsec) (count.QuadPart / freq.QuadPart) * 1000000 +
+	((count.QuadPart % freq.QuadPart) * 1000000) / freq.QuadPart;
+}
+
+unsigned long OSThreadID(void)
+{
+    return GetCurrentThreadId();
+}
+
+unsigned long OSProcessID(void)
+{
+    return GetCurrentProcessId();
+}
+
+void OSAtFork(void (*handler)(void))
+{
+}
+
+// RtlGenRandom, looked up so we don't need to link against advapi32
+typedef BOOLEAN (APIENTRY *OSGenRandomFunc)(PVOID, ULONG);
+
+bool OSRandom(unsigned char *buf, unsigned long len)
+{
+    static OSGenRandomFunc genRandom = NULL;
+
+    if (genRandom == NULL) {
+	HMODULE lib = LoadLibraryA("advapi32.dll");
+	if (lib) {
+	    genRandom = (OSGenRandomFunc) GetProcAddress(lib,
+						"SystemFunction036");
+	}
+    }
+    return genRandom && genRandom(buf, len);
+}
+
 void OSSleep(int time) 
 {
     Sleep(time);
 }
 
+struct OSConditionData {
+    CRITICAL_SECTION mutex;
+    CONDITION_VARIABLE cond;
+};
+
+OSCondition::OSCondition()
+{
+    condData = new OSConditionData;
+    InitializeCriticalSection(&condData->mutex);
+    InitializeConditionVariable(&condData->cond);
+}
+
+OSCondition::~OSCondition()
+{
+    DeleteCriticalSection(&condData->mutex);
+    delete condData;
+}
+
+void OSCondition::getLock()
+{
+    EnterCriticalSection(&condData->mutex);
+}
+
+void OSCondition::releaseLock()
+{
+    LeaveCriticalSection(&condData->mutex);
+}
+
+void OSCondition::wait()
+{
+    SleepConditionVariableCS(&condData->cond, &condData->mutex, INFINITE);
+}
+
+void OSCondition::signal()
+{
+    WakeAllConditionVariable(&condData->cond);
+}
+
+struct OSThreadData {
+    HANDLE thread;
+    void (*func)(void *);
+    void *arg;
+};
+
+static DWORD WINAPI
+OSThreadMain(LPVOID data)
+{
+    OSThreadData *threadData = (OSThreadData *)data;
+
+    (*threadData->func)(threadData->arg);
+    return 0;
+}
+
+OSThread::OSThread() : threadData(NULL)
+{
+}
+
+OSThread *
+OSThread::start(void (*func)(void *), void *arg)
+{
+    if (!allowed) {
+	return NULL;
+    }
+    OSThread *thread = new OSThread();
+    thread->threadData = new OSThreadData;
+    thread->threadData->func = func;
+    thread->threadData->arg = arg;
+    thread->threadData->thread = CreateThread(NULL, 0, OSThreadMain,
+					thread->threadData, 0, NULL);
+    if (thread->threadData->thread == NULL) {
+	delete thread;
+	return NULL;
+    }
+    return thread;
+}
+
+void
+OSThread::join()
+{
+    if (threadData && threadData->thread) {
+	WaitForSingleObject(threadData->thread, INFINITE);
+	CloseHandle(threadData->thread);
+	threadData->thread = NULL;
+    }
+}
+
+OSThread::~OSThread()
+{
+    join();
+    delete threadData;
+}
+
 #else
 //
 // MAC/Unix functions to grab a named shared memory segment of a specific size,
@@ -325,22 +460,28 @@ SHMem::initSegment(const char *name, int size, bool &init)
 	// from getSHMemAddr.
 	return NULL;
     }
+    /* tests point this somewhere of their own, so they start cold */
+    const char *dir = getenv("COOL_KEY_CACHE_DIR");
+    if (dir == NULL || *dir == 0) {
+	dir = MEMSEGPATH;
+    }
+    int dirLen = strlen(dir);
     int mask = umask(0);
-    int ret = mkdir (MEMSEGPATH, 01777);
+    int ret = mkdir (dir, 01777);
     umask(mask);
     if ((ret == -1) && (errno != EEXIST)) {
 	delete shmemData;
 	return NULL;
     }
     /* 1 for the '/', one for the '-' and one for the null */
-    shmemData->path = new char [sizeof(MEMSEGPATH)+strlen(name)+UID_DIGITS+3];
+    shmemData->path = new char [dirLen+strlen(name)+UID_DIGITS+3];
     if (shmemData->path == NULL) {
 	delete shmemData;
 	return NULL;
     }
-    memcpy(shmemData->path,MEMSEGPATH, sizeof(MEMSEGPATH));
-    shmemData->path[sizeof(MEMSEGPATH)-1] = '/';
-    strcpy(&shmemData->path[sizeof(MEMSEGPATH)],name);
+    memcpy(shmemData->path, dir, dirLen);
+    shmemData->path[dirLen] = '/';
+    strcpy(&shmemData->path[dirLen+1],name);
 
     sprintf(uid_str, "-%u",getuid());
     strcat(shmemData->path,uid_str);
@@ -529,10 +670,150 @@ OSTime OSTimeNow(void)
 }
 #endif
 
+OSTimeUsec OSTimeNowUsec(void)
+{
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+
+  return (OSTimeUsec) tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+unsigned long OSThreadID(void)
+{
+    return (unsigned long) pthread_self();
+}
+
+unsigned long OSProcessID(void)
+{
+    return (unsigned long) getpid();
+}
+
+void OSAtFork(void (*handler)(void))
+{
+    pthread_atfork(NULL, NULL, handler);
+}
+
+bool OSRandom(unsigned char *buf, unsigned long len)
+{
+    int fd = open("/dev/urandom", O_RDONLY);
+
+    if (fd < 0) {
+	return false;
+    }
+    while (len) {
+	ssize_t got = read(fd, buf, len);
+	if (got <= 0) {
+	    if (got < 0 && errno == EINTR) {
+		continue;
+	    }
+	    close(fd);
+	    return false;
+	}
+	buf += got;
+	len -= got;
+    }
+    close(fd);
+    return true;
+}
+
 void OSSleep(int time) 
 { 
     usleep(time); 
 }
+
+struct OSConditionData {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+};
+
+OSCondition::OSCondition()
+{
+    condData = new OSConditionData;
+    pthread_mutex_init(&condData->mutex, NULL);
+    pthread_cond_init(&condData->cond, NULL);
+}
+
+OSCondition::~OSCondition()
+{
+    pthread_cond_destroy(&condData->cond);
+    pthread_mutex_destroy(&condData->mutex);
+    delete condData;
+}
+
+void OSCondition::getLock()
+{
+    pthread_mutex_lock(&condData->mutex);
+}
+
+void OSCondition::releaseLock()
+{
+    pthread_mutex_unlock(&condData->mutex);
+}
+
+void OSCondition::wait()
+{
+    pthread_cond_wait(&condData->cond, &condData->mutex);
+}
+
+void OSCondition::signal()
+{
+    pthread_cond_broadcast(&condData->cond);
+}
+
+struct OSThreadData {
+    pthread_t thread;
+    bool running;
+    void (*func)(void *);
+    void *arg;
+};
+
+static void *
+OSThreadMain(void *data)
+{
+    OSThreadData *threadData = (OSThreadData *)data;
+
+    (*threadData->func)(threadData->arg);
+    return NULL;
+}
+
+OSThread::OSThread() : threadData(NULL)
+{
+}
+
+OSThread *
+OSThread::start(void (*func)(void *), void *arg)
+{
+    if (!allowed) {
+	return NULL;
+    }
+    OSThread *thread = new OSThread();
+    thread->threadData = new OSThreadData;
+    thread->threadData->func = func;
+    thread->threadData->arg = arg;
+    thread->threadData->running = (pthread_create(&thread->threadData->thread,
+			NULL, OSThreadMain, thread->threadData) == 0);
+    if (!thread->threadData->running) {
+	delete thread;
+	return NULL;
+    }
+    return thread;
+}
+
+void
+OSThread::join()
+{
+    if (threadData && threadData->running) {
+	pthread_join(threadData->thread, NULL);
+	threadData->running = false;
+    }
+}
+
+OSThread::~OSThread()
+{
+    join();
+    delete threadData;
+}
 #endif /* _WINDOWS */
 
 
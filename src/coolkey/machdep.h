@@ -50,9 +50,55 @@ public:
    static void setThreadSafe(bool thread) { needThread = thread; }
 };
 
+/*
+ * A lock with a condition to wait on. Unlike OSLock it is always real,
+ * it is there to talk to an OSThread.
+ */
+struct OSConditionData;
+class OSCondition {
+private:
+   OSConditionData *condData;
+public:
+   OSCondition();
+   ~OSCondition();
+   void getLock();
+   void releaseLock();
+   void wait();		// lock must be held
+   void signal();
+};
+
+/*
+ * A worker thread. start() returns NULL if the application told us not to
+ * create threads (or we couldn't), callers should then do the work inline.
+ */
+struct OSThreadData;
+class OSThread {
+private:
+   OSThreadData *threadData;
+   static bool allowed;
+   OSThread();
+public:
+   ~OSThread();		// joins
+   void join();
+   static OSThread *start(void (*func)(void *), void *arg);
+   static void setAllowed(bool allow) { allowed = allow; }
+};
+
 typedef unsigned long OSTime;
 OSTime OSTimeNow(void);
 
+/* finer grained clock and thread/process ids, used by the trace output */
+typedef unsigned long long OSTimeUsec;
+OSTimeUsec OSTimeNowUsec(void);
+unsigned long OSThreadID(void);
+unsigned long OSProcessID(void);
+
+/* run handler in the child after a fork. A no-op where there is no fork */
+void OSAtFork(void (*handler)(void));
+
+/* fill buf from the system's random source, false if there isn't one */
+bool OSRandom(unsigned char *buf, unsigned long len);
+
 void OSSleep(int time);
 
 #define USE_SHMEM
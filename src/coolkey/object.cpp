@@ -179,8 +179,9 @@ SecretKey::SecretKey(unsigned long muscleObjID_, CK_OBJECT_HANDLE handle_, CKYBu
     if(!attributeExists(CKA_KEY_TYPE))
         setAttributeULong(CKA_KEY_TYPE, keyType);
 
+    // a derived key is a session object unless asked otherwise
     if(!attributeExists(CKA_TOKEN))
-        setAttributeBool(CKA_TOKEN, value);
+        setAttributeBool(CKA_TOKEN, FALSE);
       
     if(!attributeExists(CKA_DERIVE)) 
         setAttributeBool(CKA_DERIVE, value);
@@ -580,7 +581,7 @@ PKCS11Object::getLabel()
 }
 
 CK_OBJECT_CLASS
-PKCS11Object::getClass() 
+PKCS11Object::getClass() const
 {
     CK_OBJECT_CLASS objClass;
     // find matching attribute
@@ -1065,6 +1066,176 @@ PKCS11Object::completeKey(const PKCS11Object &cert)
     CKYBuffer_FreeData(&param2);
 }
 
+//
+// Object snapshots. A snapshot is everything the parsers above derive from
+// the card data, so an object restored from one needs no further work.
+// Values are stored in applet (big endian) order as a 2 byte length
+// followed by the data. The label is only a cache and is not saved.
+//
+static CKYStatus
+appendSnapshotData(CKYBuffer *out, const CKYByte *data, CKYSize size)
+{
+    CKYStatus status;
+
+    if (size > 0xffff) {
+	return CKYDATATOOLONG;
+    }
+    status = CKYBuffer_AppendShort(out, (unsigned short) size);
+    if (status != CKYSUCCESS) {
+	return status;
+    }
+    return CKYBuffer_AppendData(out, data, size);
+}
+
+static CKYStatus
+appendSnapshotBuffer(CKYBuffer *out, const CKYBuffer *buf)
+{
+    return appendSnapshotData(out, CKYBuffer_Data(buf), CKYBuffer_Size(buf));
+}
+
+static CKYStatus
+getSnapshotLong(const CKYBuffer *in, CKYOffset *offset, unsigned long *val)
+{
+    if (CKYBuffer_Size(in) < *offset + 4) {
+	return CKYINVALIDDATA;
+    }
+    *val = CKYBuffer_GetLong(in, *offset);
+    *offset += 4;
+    return CKYSUCCESS;
+}
+
+static CKYStatus
+getSnapshotData(const CKYBuffer *in, CKYOffset *offset, 
+					const CKYByte **data, CKYSize *size)
+{
+    if (CKYBuffer_Size(in) < *offset + 2) {
+	return CKYINVALIDDATA;
+    }
+    *size = CKYBuffer_GetShort(in, *offset);
+    if (CKYBuffer_Size(in) < *offset + 2 + *size) {
+	return CKYINVALIDDATA;
+    }
+    *data = CKYBuffer_Data(in) + *offset + 2;
+    *offset += 2 + *size;
+    return CKYSUCCESS;
+}
+
+static CKYStatus
+getSnapshotBuffer(const CKYBuffer *in, CKYOffset *offset, CKYBuffer *buf)
+{
+    const CKYByte *data;
+    CKYSize size;
+    CKYStatus status = getSnapshotData(in, offset, &data, &size);
+
+    if (status != CKYSUCCESS) {
+	return status;
+    }
+    return CKYBuffer_Replace(buf, 0, data, size);
+}
+
+CKYStatus
+PKCS11Object::saveSnapshot(CKYBuffer *out) const
+{
+    const CKYBuffer *path = objectPath.getPath();
+    AttributeConstIter iter;
+    CKYStatus status;
+
+    status = CKYBuffer_AppendLong(out, muscleObjID);
+    if (status == CKYSUCCESS) status = CKYBuffer_AppendChar(out, keyType);
+    if (status == CKYSUCCESS) status = CKYBuffer_AppendLong(out, user);
+    if (status == CKYSUCCESS) status = CKYBuffer_AppendLong(out, keySize);
+    if (status == CKYSUCCESS) status = CKYBuffer_AppendLong(out, keyRef);
+    if (status == CKYSUCCESS) status = appendSnapshotData(out, 
+		(const CKYByte *)name, name ? strlen(name) : 0);
+    if (status == CKYSUCCESS) status = appendSnapshotBuffer(out, &pubKey);
+    if (status == CKYSUCCESS) status = appendSnapshotBuffer(out, &authId);
+    if (status == CKYSUCCESS) status = appendSnapshotBuffer(out, &pinAuthId);
+    if (status == CKYSUCCESS) status = appendSnapshotBuffer(out, path);
+    if (status == CKYSUCCESS) 
+	status = CKYBuffer_AppendLong(out, objectPath.getIndex());
+    if (status == CKYSUCCESS) 
+	status = CKYBuffer_AppendLong(out, objectPath.getLength());
+    if (status == CKYSUCCESS) 
+	status = CKYBuffer_AppendLong(out, attributes.size());
+    for (iter = attributes.begin(); 
+		(status == CKYSUCCESS) && (iter != attributes.end()); ++iter) {
+	status = CKYBuffer_AppendLong(out, iter->getType());
+	if (status == CKYSUCCESS) {
+	    status = appendSnapshotBuffer(out, iter->getValue());
+	}
+    }
+    return status;
+}
+
+//
+// Rebuild an object from a snapshot starting at *offset. The handle is
+// not part of the snapshot, the caller constructs us with a fresh one.
+//
+CKYStatus
+PKCS11Object::restoreSnapshot(const CKYBuffer *in, CKYOffset *offset)
+{
+    const CKYByte *data;
+    CKYSize size;
+    unsigned long val, count, index;
+    CKYStatus status;
+
+    status = getSnapshotLong(in, offset, &muscleObjID);
+    if (status != CKYSUCCESS) return status;
+    if (CKYBuffer_Size(in) < *offset + 1) return CKYINVALIDDATA;
+    val = CKYBuffer_GetChar(in, *offset);
+    *offset += 1;
+    if (val > unknown) return CKYINVALIDDATA;
+    keyType = (KeyType) val;
+    status = getSnapshotLong(in, offset, &val);
+    if (status != CKYSUCCESS) return status;
+    user = val;
+    status = getSnapshotLong(in, offset, &val);
+    if (status != CKYSUCCESS) return status;
+    keySize = val;
+    status = getSnapshotLong(in, offset, &val);
+    if (status != CKYSUCCESS) return status;
+    keyRef = val;
+
+    status = getSnapshotData(in, offset, &data, &size);
+    if (status != CKYSUCCESS) return status;
+    delete [] name;
+    name = NULL;
+    if (size) {
+	name = new char [size+1];
+	memcpy(name, data, size);
+	name[size] = 0;
+    }
+    status = getSnapshotBuffer(in, offset, &pubKey);
+    if (status != CKYSUCCESS) return status;
+    status = getSnapshotBuffer(in, offset, &authId);
+    if (status != CKYSUCCESS) return status;
+    status = getSnapshotBuffer(in, offset, &pinAuthId);
+    if (status != CKYSUCCESS) return status;
+
+    CKYBuffer path;
+    CKYBuffer_InitEmpty(&path);
+    status = getSnapshotBuffer(in, offset, &path);
+    if (status == CKYSUCCESS) status = getSnapshotLong(in, offset, &index);
+    if (status == CKYSUCCESS) status = getSnapshotLong(in, offset, &val);
+    if (status == CKYSUCCESS) {
+	status = objectPath.setObjectPath(&path, index, val);
+    }
+    CKYBuffer_FreeData(&path);
+    if (status != CKYSUCCESS) return status;
+
+    status = getSnapshotLong(in, offset, &count);
+    if (status != CKYSUCCESS) return status;
+    attributes.clear();
+    for (unsigned long i = 0; i < count; i++) {
+	status = getSnapshotLong(in, offset, &val);
+	if (status != CKYSUCCESS) return status;
+	status = getSnapshotData(in, offset, &data, &size);
+	if (status != CKYSUCCESS) return status;
+	attributes.push_back(PKCS11Attribute(val, data, size));
+    }
+    return CKYSUCCESS;
+}
+
 static SECStatus
 GetCertFieldItems(const CKYByte *dercert, CKYSize cert_length,
         CCItem *issuer, CCItem *serial, CCItem *derSN, CCItem *subject,
@@ -1231,8 +1402,15 @@ Reader::Reader(unsigned long muscleObjID, CK_OBJECT_HANDLE handle,
 }
 
 
+static int
+cacPrivKeyID(CKYByte instance)
+{
+    return (instance >= PIV_RETIRED_INSTANCE) ? 
+	PIV_RETIRED_KEY_ID + instance - PIV_RETIRED_INSTANCE : instance + '0';
+}
+
 CACPrivKey::CACPrivKey(CKYByte instance, const PKCS11Object &cert) : 
-        PKCS11Object( ((int)'k') << 24 | ((int)instance+'0') << 16,
+        PKCS11Object( ((int)'k') << 24 | cacPrivKeyID(instance) << 16,
                          instance | 0x400)
 {
     CKYBuffer id;
@@ -1240,8 +1418,8 @@ CACPrivKey::CACPrivKey(CKYByte instance, const PKCS11Object &cert) :
     CK_BBOOL decrypt = FALSE;
 
     /* So we know what the key is supposed to be used for based on
-     * the instance */
-    if (instance == 2) {
+     * the instance. Retired keys are all old encryption keys. */
+    if (instance == 2 || instance >= PIV_RETIRED_INSTANCE) {
         decrypt = TRUE;
     }
 
@@ -1314,7 +1492,7 @@ CACPubKey::CACPubKey(CKYByte instance, const PKCS11Object &cert) :
 
     /* So we know what the key is supposed to be used for based on
      * the instance */
-    if (instance == 2) {
+    if (instance == 2 || instance >= PIV_RETIRED_INSTANCE) {
         encrypt = TRUE;
     }
 
@@ -1470,7 +1648,14 @@ CACCert::CACCert(CKYByte instance, const CKYBuffer *derCert) :
     setAttribute(CKA_ID, &id);
     CKYBuffer_FreeData(&id);
     setAttributeULong(CKA_CERTIFICATE_TYPE, CKC_X_509);
-    setAttribute(CKA_LABEL, CAC_Label[instance]);
+    if (instance < sizeof(CAC_Label)/sizeof(CAC_Label[0])) {
+        setAttribute(CKA_LABEL, CAC_Label[instance]);
+    } else {
+        char label[40];
+        sprintf(label, "Retired Key %d Certificate",
+				instance - PIV_RETIRED_INSTANCE + 1);
+        setAttribute(CKA_LABEL, label);
+    }
 
     CKYBuffer derSerial; CKYBuffer_InitEmpty(&derSerial);
     CKYBuffer derSubject; CKYBuffer_InitEmpty(&derSubject);
@@ -1563,6 +1748,15 @@ unsigned long GetBits(const CKYByte *entry, CKYSize entrySize,
 }
 
 
+CKYStatus PK15ObjectPath::setObjectPath(const CKYBuffer *path_,
+					CKYOffset index_, CKYSize length_)
+{
+    index = index_;
+    length = length_;
+    return CKYBuffer_Replace(&path, 0, CKYBuffer_Data(path_),
+						CKYBuffer_Size(path_));
+}
+
 /*
  * parse the path object.
  * Caller has already unwrapped the outer ASN1Sequence
@@ -1576,6 +1770,10 @@ CKYStatus PK15ObjectPath::setObjectPath(const CKYByte *current, CKYSize size)
     CKYStatus status;
 
 
+    /* the object may be reused, don't leave the last path behind */
+    index = 0;
+    length = 0;
+    CKYBuffer_Resize(&path, 0);
     if ((current == NULL) || (current[0] != ASN1_OCTET_STRING)) {
 	return CKYINVALIDDATA;
     }
@@ -1621,6 +1819,60 @@ CKYStatus PK15ObjectPath::setObjectPath(const CKYByte *current, CKYSize size)
     return CKYSUCCESS;
 }
 
+bool PK15ODFEntry::next(const CKYByte **current, CKYSize *size)
+{
+    const CKYByte *entry;
+    CKYSize entrySize;
+    CKYSize tagSize;
+    CKYByte tag, type1;
+
+    wanted = false;
+    byPath = false;
+    data = NULL;
+    dataSize = 0;
+    if (*size == 0) {
+	return false;
+    }
+
+    tag = (*current)[0];
+    entry = dataStart(*current, *size, &entrySize, false);
+    if (entry == NULL) { return false; }
+    tagSize = entry - *current;
+    if (*size < (entrySize + tagSize)) { return false; }
+    *current += entrySize + tagSize;
+    *size -= (entrySize + tagSize);
+
+    /* skip those entries we aren't going to parse */
+    switch (tag) {
+    case 0xa2: return true; /* skip EF(PuKDF-trusted) */
+    case 0xa3: return true; /* skip EF(SKDF) */
+    case 0xa7: return true; /* skip EF(DODF) */
+    default: return true;
+    case 0xa0: type = PK15PvKey; break;   /* EF(PvKDF) */
+    case 0xa1: type = PK15PuKey; break;   /* EF(PuKDF) */
+    case 0xa4: type = PK15Cert; break;    /* EF(CDF) */
+    case 0xa5: type = PK15Cert; break;    /* EF(CDF-trusted) */
+    case 0xa6: type = PK15Cert; break;    /* EF(CDF-useful) */
+    case 0xa8: type = PK15AuthObj; break; /* EF(AODF) */
+    }
+
+    type1 = entry[0];
+    /* unwrap */
+    entry = dataStart(entry, entrySize, &entrySize, false);
+    if (entry == NULL) { return true; }
+    if (type1 == ASN1_SEQUENCE) {
+	path.setObjectPath(entry, entrySize);
+	byPath = true;
+    } else if (type1 == ASN1_CHOICE_0) {
+	data = entry;
+	dataSize = entrySize;
+    } else {
+	return true;
+    }
+    wanted = true;
+    return true;
+}
+
 static unsigned int pK15GetTag(PK15ObjectType type) {
      switch (type) { case PK15PvKey: case PK15PuKey: return 'k'<<24;
 		     case PK15Cert: return 'c' << 24; default: break; }
@@ -2145,7 +2397,7 @@ PK15Object::completeKeyObject(const CKYByte *current, CKYSize currentSize)
 
     /* parse native (currently unused) */
     /*native=true; */
-    if (commonKeyAttributes[0] == ASN1_BOOLEAN) {
+    if ((commonSize > 0) && (commonKeyAttributes[0] == ASN1_BOOLEAN)) {
 	entry = dataStart(commonKeyAttributes, commonSize, &entrySize, false);
 	if (entry == NULL) { return CKYINVALIDARGS; }
 	tagSize = entry - commonKeyAttributes;
@@ -2157,7 +2409,7 @@ PK15Object::completeKeyObject(const CKYByte *current, CKYSize currentSize)
     }
     /* parse access flags */
     bits = BROKEN_FLAG;
-    if (commonKeyAttributes[0] == ASN1_BIT_STRING) {
+    if ((commonSize > 0) && (commonKeyAttributes[0] == ASN1_BIT_STRING)) {
 	entry = dataStart(commonKeyAttributes, commonSize, &entrySize, false);
 	if (entry == NULL) { return CKYINVALIDARGS; }
 	tagSize = entry - commonKeyAttributes;
@@ -2181,7 +2433,7 @@ PK15Object::completeKeyObject(const CKYByte *current, CKYSize currentSize)
 
     /* parse the key reference */
     keyRef = PK15_INVALID_KEY_REF; /* invalid keyRef */
-    if (commonKeyAttributes[0] == ASN1_INTEGER) {
+    if ((commonSize > 0) && (commonKeyAttributes[0] == ASN1_INTEGER)) {
 	entry = dataStart(commonKeyAttributes, commonSize, &entrySize, false);
 	if (entry == NULL) { return CKYINVALIDARGS; }
 	tagSize = entry - commonKeyAttributes;
@@ -2194,7 +2446,8 @@ PK15Object::completeKeyObject(const CKYByte *current, CKYSize currentSize)
 	}
     }
     setAttribute(CKA_START_DATE, &empty);
-    if (commonKeyAttributes[0] == ASN1_GENERALIZED_TIME) {
+    if ((commonSize > 0) && 
+		(commonKeyAttributes[0] == ASN1_GENERALIZED_TIME)) {
 	entry = dataStart(commonKeyAttributes, commonSize, &entrySize, false);
 	if (entry == NULL) { return CKYINVALIDARGS; }
 	tagSize = entry - commonKeyAttributes;
@@ -2203,7 +2456,7 @@ PK15Object::completeKeyObject(const CKYByte *current, CKYSize currentSize)
 	setAttribute(CKA_START_DATE,entry, entrySize);
     }
     setAttribute(CKA_END_DATE, &empty);
-    if (commonKeyAttributes[0] == ASN1_CHOICE_0) {
+    if ((commonSize > 0) && (commonKeyAttributes[0] == ASN1_CHOICE_0)) {
 	entry = dataStart(commonKeyAttributes, commonSize, &entrySize, false);
 	if (entry == NULL) { return CKYINVALIDARGS; }
 	tagSize = entry - commonKeyAttributes;
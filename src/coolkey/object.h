@@ -100,6 +100,8 @@ class PK15ObjectPath {
     CKYOffset getIndex() const { return index; }
     CKYSize getLength() const { return length; }
     CKYStatus setObjectPath(const CKYByte *entry, CKYSize size);
+    CKYStatus setObjectPath(const CKYBuffer *path_, CKYOffset index_,
+							CKYSize length_);
 };
 
 
@@ -170,7 +172,7 @@ class PKCS11Object {
 
     /* PKCS11Attribute* getAttribute(CK_ATTRIBUTE_TYPE type); */
     const char *getLabel();
-    CK_OBJECT_CLASS getClass();
+    CK_OBJECT_CLASS getClass() const;
     const char *getName() { return name; }
 
     void setAttribute(CK_ATTRIBUTE_TYPE type, const CKYBuffer *value);
@@ -204,6 +206,9 @@ class PKCS11Object {
     const CKYBuffer *getPinAuthId(void) const { return &pinAuthId; }
     const PK15ObjectPath &getObjectPath() const { return objectPath; }
     void completeKey(const PKCS11Object &cert);
+    /* flat copy of the built object, see Slot::saveObjectSnapshot */
+    CKYStatus saveSnapshot(CKYBuffer *out) const;
+    CKYStatus restoreSnapshot(const CKYBuffer *in, CKYOffset *offset);
 };
 
 class Key : public PKCS11Object {
@@ -217,6 +222,17 @@ class Cert : public PKCS11Object {
         CK_OBJECT_HANDLE handle, const CKYBuffer *derCert);
 };
 
+//
+// CAC and PIV objects are made per instance. PIV instances past the
+// first three are retired key management keys, retired key 1 is
+// PIV_RETIRED_INSTANCE.
+//
+#define PIV_RETIRED_INSTANCE 4
+#define PIV_RETIRED_KEYS 20
+/* CAC/PIV private keys are 'k' '0'+instance, public keys 'k' '5'+instance.
+ * Retired private keys would run into the public ones, so they start here */
+#define PIV_RETIRED_KEY_ID 'a'
+
 class CACPrivKey : public PKCS11Object {
   public:
     CACPrivKey(CKYByte instance, const PKCS11Object &cert);
@@ -310,6 +326,31 @@ class PK15Object : public PKCS11Object {
     const P15PinInfo *getPinInfo(void) const { return &pinInfo; }
 };
 
+//
+// one entry of an EF(ODF). The directory files we load are either held
+// inline in the entry, or named by a path the caller has to read.
+//
+class PK15ODFEntry {
+  private:
+    bool wanted;
+    bool byPath;
+    PK15ObjectType type;
+    PK15ObjectPath path;
+    const CKYByte *data;
+    CKYSize dataSize;
+  public:
+    PK15ODFEntry() : wanted(false), byPath(false), type(PK15AuthObj),
+		data(NULL), dataSize(0) {}
+    // step over the next entry, false at the end of the file or bad DER
+    bool next(const CKYByte **current, CKYSize *size);
+    bool isWanted(void) const { return wanted; }
+    bool isPath(void) const { return byPath; }
+    PK15ObjectType getType(void) const { return type; }
+    const PK15ObjectPath &getPath(void) const { return path; }
+    const CKYByte *getData(void) const { return data; }
+    CKYSize getDataSize(void) const { return dataSize; }
+};
+
 class Reader : public PKCS11Object {
   public:
     Reader(unsigned long muscleObjID, CK_OBJECT_HANDLE handle, 
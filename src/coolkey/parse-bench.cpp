@@ -0,0 +1,415 @@
+/* ***** BEGIN COPYRIGHT BLOCK *****
+ * Copyright (C) 2006 Red Hat, Inc.
+ * All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation version
+ * 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ * ***** END COPYRIGHT BLOCK *****/
+
+/*
+ * parse-bench: time the certificate and PKCS #15 parsers in object.cpp
+ * against a corpus of DER files, without a card.
+ *
+ *   parse-bench [-n iterations] corpus-dir
+ *
+ * Files are dispatched on their extension:
+ *   .crt	X.509 certificate, parsed as a CAC cert plus its keys
+ *   .prkdf .pukdf .cdf .aodf	PKCS #15 directory files, one object per entry
+ *   .odf	PKCS #15 EF.ODF, walked as the slot does. Entries by path
+ *		are read from the corpus directory file of the same type
+ *   .tokeninfo	PKCS #15 EF.TokenInfo
+ *   .sig	DER ECDSA signature, the key size is taken from the name (p256)
+ *
+ * Results are printed as JSON, ns and heap allocations per parsed object.
+ * Allocations are only counted with glibc.
+ */
+#include "mypkcs11.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <time.h>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include "object.h"
+
+using std::vector;
+using std::string;
+
+#ifdef __GLIBC__
+/*
+ * count heap allocations by interposing malloc. operator new and the
+ * CKYBuffer routines all end up here.
+ */
+extern "C" {
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+static unsigned long allocations;
+
+void *
+malloc(size_t size)
+{
+    allocations++;
+    return __libc_malloc(size);
+}
+
+void *
+calloc(size_t count, size_t size)
+{
+    allocations++;
+    return __libc_calloc(count, size);
+}
+
+void *
+realloc(void *ptr, size_t size)
+{
+    allocations++;
+    return __libc_realloc(ptr, size);
+}
+
+void
+free(void *ptr)
+{
+    __libc_free(ptr);
+}
+}
+#define ALLOCATIONS_COUNTED true
+#else
+static unsigned long allocations;
+#define ALLOCATIONS_COUNTED false
+#endif
+
+typedef enum { CorpusCert, CorpusP15, CorpusODF, CorpusTokenInfo, 
+		CorpusSig } CorpusType;
+
+struct CorpusFile {
+    string name;
+    CorpusType type;
+    PK15ObjectType p15Type;
+    CKYBuffer data;
+    unsigned int keySize;	/* signatures */
+    unsigned int objects;	/* parsed per iteration */
+};
+
+static const CKYBuffer *rawCert;	/* for CDF entries which use a path */
+static const CKYBuffer *p15Files[PK15AuthObj+1]; /* for ODF paths */
+
+static double
+now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec*1e9 + ts.tv_nsec;
+}
+
+static bool
+hasSuffix(const string &name, const char *suffix)
+{
+    size_t len = strlen(suffix);
+
+    return name.size() > len && 
+		name.compare(name.size() - len, len, suffix) == 0;
+}
+
+static bool
+loadFile(const string &path, CKYBuffer *buf)
+{
+    FILE *file = fopen(path.c_str(), "rb");
+    CKYByte data[1024];
+    size_t len;
+
+    if (!file) {
+	return false;
+    }
+    CKYBuffer_InitEmpty(buf);
+    while ((len = fread(data, 1, sizeof(data), file)) > 0) {
+	CKYBuffer_AppendData(buf, data, len);
+    }
+    fclose(file);
+    return CKYBuffer_Size(buf) != 0;
+}
+
+/*
+ * parse every entry in a PKCS #15 directory file the way the slot does
+ * when it loads the token. Returns the number of entries that failed.
+ */
+static unsigned int
+parseP15(const CKYByte *current, CKYSize size, PK15ObjectType p15Type,
+							unsigned int *count)
+{
+    unsigned int failed = 0;
+    CKYByte instance = 0;
+
+    *count = 0;
+    while (size > 0) {
+	const CKYByte *entry;
+	CKYSize entrySize;
+	CKYSize tagSize;
+
+	entry = dataStart(current, size, &entrySize, true);
+	if (entry == NULL) {
+	    failed++;
+	    break;
+	}
+	tagSize = entry - current;
+	PK15Object obj(instance++, p15Type, entry, entrySize);
+	if (obj.getState() == PK15StateNeedRawCertificate && rawCert) {
+	    obj.completeObject(CKYBuffer_Data(rawCert), 
+						CKYBuffer_Size(rawCert));
+	}
+	if (obj.getState() == PK15StateInit) {
+	    failed++;
+	}
+	(*count)++;
+	if (size < entrySize + tagSize) {
+	    break;
+	}
+	current += entrySize + tagSize;
+	size -= entrySize + tagSize;
+    }
+    return failed;
+}
+
+/*
+ * walk an EF(ODF) and parse the directory files it names. Returns the
+ * number of entries that failed, including paths we have no file for.
+ */
+static unsigned int
+parseODF(const CorpusFile &file, unsigned int *count)
+{
+    const CKYByte *current = CKYBuffer_Data(&file.data);
+    CKYSize size = CKYBuffer_Size(&file.data);
+    PK15ODFEntry odfEntry;
+    unsigned int failed = 0;
+
+    *count = 0;
+    while (odfEntry.next(&current, &size)) {
+	const CKYBuffer *dir;
+	unsigned int dirCount;
+
+	if (!odfEntry.isWanted()) {
+	    continue;
+	}
+	if (!odfEntry.isPath()) {
+	    failed += parseP15(odfEntry.getData(), odfEntry.getDataSize(),
+					odfEntry.getType(), &dirCount);
+	} else if ((dir = p15Files[odfEntry.getType()]) != NULL) {
+	    failed += parseP15(CKYBuffer_Data(dir), CKYBuffer_Size(dir),
+					odfEntry.getType(), &dirCount);
+	} else {
+	    failed++;
+	    dirCount = 0;
+	}
+	*count += dirCount;
+    }
+    if (size != 0) {
+	failed++;
+    }
+    return failed;
+}
+
+/*
+ * parse the file once, returns the number of objects that failed
+ */
+static unsigned int
+parse(CorpusFile &file)
+{
+    unsigned int failed = 0;
+
+    switch (file.type) {
+    case CorpusCert:
+	{
+	    CACCert cert(0, &file.data);
+	    CACPubKey pubKey(0, cert);
+	    CACPrivKey privKey(0, cert);
+
+	    if (cert.getLabel() == NULL || *cert.getLabel() == 0) {
+		failed++;
+	    }
+	    file.objects = 1;
+	}
+	break;
+    case CorpusP15:
+	failed = parseP15(CKYBuffer_Data(&file.data), 
+		CKYBuffer_Size(&file.data), file.p15Type, &file.objects);
+	break;
+    case CorpusODF:
+	failed = parseODF(file, &file.objects);
+	break;
+    case CorpusTokenInfo:
+	{
+	    DEREncodedTokenInfo tokenInfo(&file.data);
+
+	    if (tokenInfo.tokenName == NULL) {
+		failed++;
+	    }
+	    file.objects = 1;
+	}
+	break;
+    case CorpusSig:
+	{
+	    DEREncodedSignature sig(&file.data);
+	    CKYBuffer raw;
+
+	    CKYBuffer_InitEmpty(&raw);
+	    if (sig.getRawSignature(&raw, file.keySize) != CKYSUCCESS) {
+		failed++;
+	    }
+	    CKYBuffer_FreeData(&raw);
+	    file.objects = 1;
+	}
+	break;
+    }
+    return failed;
+}
+
+static bool
+addFile(vector<CorpusFile> &corpus, const string &dir, const string &name)
+{
+    CorpusFile file;
+
+    file.name = name;
+    file.keySize = 0;
+    file.objects = 0;
+    file.p15Type = PK15AuthObj;
+    if (hasSuffix(name, ".crt")) {
+	file.type = CorpusCert;
+    } else if (hasSuffix(name, ".prkdf")) {
+	file.type = CorpusP15;
+	file.p15Type = PK15PvKey;
+    } else if (hasSuffix(name, ".pukdf")) {
+	file.type = CorpusP15;
+	file.p15Type = PK15PuKey;
+    } else if (hasSuffix(name, ".cdf")) {
+	file.type = CorpusP15;
+	file.p15Type = PK15Cert;
+    } else if (hasSuffix(name, ".aodf")) {
+	file.type = CorpusP15;
+	file.p15Type = PK15AuthObj;
+    } else if (hasSuffix(name, ".odf")) {
+	file.type = CorpusODF;
+    } else if (hasSuffix(name, ".tokeninfo")) {
+	file.type = CorpusTokenInfo;
+    } else if (hasSuffix(name, ".sig")) {
+	const char *cp = name.c_str();
+
+	file.type = CorpusSig;
+	while (*cp && !isdigit(*cp)) {
+	    cp++;
+	}
+	file.keySize = atoi(cp);
+	if (file.keySize == 0) {
+	    return false;
+	}
+    } else {
+	return false;
+    }
+    if (!loadFile(dir + "/" + name, &file.data)) {
+	return false;
+    }
+    corpus.push_back(file);
+    return true;
+}
+
+static bool
+byName(const CorpusFile &a, const CorpusFile &b)
+{
+    return a.name < b.name;
+}
+
+int
+main(int argc, char **argv)
+{
+    int iterations = 10000;
+    const char *dirName;
+    vector<CorpusFile> corpus;
+    DIR *dir;
+    struct dirent *dirEntry;
+    unsigned int i;
+    int c;
+
+    while ((c = getopt(argc, argv, "n:")) != -1) {
+	switch (c) {
+	case 'n': iterations = atoi(optarg); break;
+	default: goto usage;
+	}
+    }
+    if (optind != argc-1 || iterations < 1) {
+	goto usage;
+    }
+    dirName = argv[optind];
+
+    dir = opendir(dirName);
+    if (!dir) {
+	fprintf(stderr, "can't open %s\n", dirName);
+	return 1;
+    }
+    while ((dirEntry = readdir(dir)) != NULL) {
+	addFile(corpus, dirName, dirEntry->d_name);
+    }
+    closedir(dir);
+    std::sort(corpus.begin(), corpus.end(), byName);
+    for (i = 0; i < corpus.size(); i++) {
+	if (corpus[i].type == CorpusCert && !rawCert) {
+	    rawCert = &corpus[i].data;
+	}
+	if (corpus[i].type == CorpusP15 && !p15Files[corpus[i].p15Type]) {
+	    p15Files[corpus[i].p15Type] = &corpus[i].data;
+	}
+    }
+
+    printf("{\"iterations\":%d,\"allocationsCounted\":%s,\"files\":[\n",
+		iterations, ALLOCATIONS_COUNTED ? "true" : "false");
+    for (i = 0; i < corpus.size(); i++) {
+	CorpusFile &file = corpus[i];
+	unsigned long startAllocations;
+	unsigned int failed;
+	double start, elapsed;
+	int j;
+
+	/* warm up, and find out how many objects the file holds */
+	failed = parse(file);
+	startAllocations = allocations;
+	start = now();
+	for (j = 0; j < iterations; j++) {
+	    parse(file);
+	}
+	elapsed = now() - start;
+
+	printf("%s    {\"name\":\"%s\",\"bytes\":%lu,\"objects\":%u,"
+		"\"failed\":%u,\"nsPerObject\":%.1f,"
+		"\"allocationsPerObject\":%.1f}", i ? ",\n" : "",
+		file.name.c_str(), (unsigned long)CKYBuffer_Size(&file.data), 
+		file.objects, failed, 
+		file.objects ? elapsed/iterations/file.objects : 0.0,
+		file.objects ? (double)(allocations - startAllocations)/
+					iterations/file.objects : 0.0);
+    }
+    printf("\n]}\n");
+    for (i = 0; i < corpus.size(); i++) {
+	CKYBuffer_FreeData(&corpus[i].data);
+    }
+    return 0;
+
+usage:
+    fprintf(stderr, "usage: %s [-n iterations] corpus-dir\n", argv[0]);
+    return 2;
+}
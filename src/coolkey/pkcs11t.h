@@ -552,6 +552,13 @@ typedef CK_ULONG          CK_MECHANISM_TYPE;
 #define CKM_RSA_PKCS_PSS               0x0000000D
 #define CKM_SHA1_RSA_PKCS_PSS          0x0000000E
 
+/* CKM_SHA256_RSA_PKCS, CKM_SHA384_RSA_PKCS and CKM_SHA512_RSA_PKCS are
+ * new for v2.20, CKM_SHA224_RSA_PKCS for the v2.20 amendment 3 */
+#define CKM_SHA256_RSA_PKCS            0x00000040
+#define CKM_SHA384_RSA_PKCS            0x00000041
+#define CKM_SHA512_RSA_PKCS            0x00000042
+#define CKM_SHA224_RSA_PKCS            0x00000046
+
 #define CKM_DSA_KEY_PAIR_GEN           0x00000010
 #define CKM_DSA                        0x00000011
 #define CKM_DSA_SHA1                   0x00000012
@@ -632,6 +639,13 @@ typedef CK_ULONG          CK_MECHANISM_TYPE;
 #define CKM_RIPEMD160_HMAC             0x00000241
 #define CKM_RIPEMD160_HMAC_GENERAL     0x00000242
 
+/* CKM_SHA256, CKM_SHA384 and CKM_SHA512 are new for v2.20,
+ * CKM_SHA224 for the v2.20 amendment 3 */
+#define CKM_SHA256                     0x00000250
+#define CKM_SHA224                     0x00000255
+#define CKM_SHA384                     0x00000260
+#define CKM_SHA512                     0x00000270
+
 /* All of the following mechanisms are new for v2.0 */
 /* Note that CAST128 and CAST5 are the same algorithm */
 #define CKM_CAST_KEY_GEN               0x00000300
@@ -746,6 +760,12 @@ typedef CK_ULONG          CK_MECHANISM_TYPE;
 
 #define CKM_ECDSA                      0x00001041
 #define CKM_ECDSA_SHA1                 0x00001042
+/* CKM_ECDSA_SHA224, CKM_ECDSA_SHA256, CKM_ECDSA_SHA384 and
+ * CKM_ECDSA_SHA512 are new for v3.0 */
+#define CKM_ECDSA_SHA224               0x00001043
+#define CKM_ECDSA_SHA256               0x00001044
+#define CKM_ECDSA_SHA384               0x00001045
+#define CKM_ECDSA_SHA512               0x00001046
 
 /* CKM_ECDH1_DERIVE, CKM_ECDH1_COFACTOR_DERIVE, and CKM_ECMQV_DERIVE
  * are new for v2.11 */
@@ -771,6 +791,9 @@ typedef CK_ULONG          CK_MECHANISM_TYPE;
 #define CKM_AES_MAC                    0x00001083
 #define CKM_AES_MAC_GENERAL            0x00001084
 #define CKM_AES_CBC_PAD                0x00001085
+/* CKM_AES_CTR and CKM_AES_GCM are new for v2.20 amendment 3 */
+#define CKM_AES_CTR                    0x00001086
+#define CKM_AES_GCM                    0x00001087
 #define CKM_DSA_PARAMETER_GEN          0x00002000
 #define CKM_DH_PKCS_PARAMETER_GEN      0x00002001
 #define CKM_X9_42_DH_PARAMETER_GEN     0x00002002
@@ -1392,4 +1415,24 @@ typedef struct CK_ECDH1_DERIVE_PARAMS {
 
 typedef CK_ECDH1_DERIVE_PARAMS CK_PTR CK_ECDH1_DERIVE_PARAMS_PTR;
 
+/* CK_AES_CTR_PARAMS and CK_GCM_PARAMS are new for v2.20 amendment 3,
+ * ulIvBits was added to CK_GCM_PARAMS in v2.40 */
+typedef struct CK_AES_CTR_PARAMS {
+  CK_ULONG ulCounterBits;
+  CK_BYTE cb[16];
+} CK_AES_CTR_PARAMS;
+
+typedef CK_AES_CTR_PARAMS CK_PTR CK_AES_CTR_PARAMS_PTR;
+
+typedef struct CK_GCM_PARAMS {
+  CK_BYTE_PTR pIv;
+  CK_ULONG ulIvLen;
+  CK_ULONG ulIvBits;
+  CK_BYTE_PTR pAAD;
+  CK_ULONG ulAADLen;
+  CK_ULONG ulTagBits;
+} CK_GCM_PARAMS;
+
+typedef CK_GCM_PARAMS CK_PTR CK_GCM_PARAMS_PTR;
+
 #endif
@@ -0,0 +1,1349 @@
+/* ***** BEGIN COPYRIGHT BLOCK *****
+ * Copyright (C) 2005 Red Hat, Inc.
+ * All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation version
+ * 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ * ***** END COPYRIGHT BLOCK *****/
+
+#include <string>
+#include <algorithm>
+#include "mypkcs11.h"
+#include <assert.h>
+#include "log.h"
+#include "PKCS11Exception.h"
+#include "slot.h"
+#include "pool.h"
+#include "machdep.h"
+
+#define MIN(x, y) ((x) < (y) ? (x) : (y))
+
+//
+// One call made on a member. The pool picks the member, the call only
+// has to know which slot, session and (translated) object handle to use.
+//
+class PoolCall {
+  public:
+    virtual ~PoolCall() { }
+    virtual void call(Slot *slot, SessionHandleSuffix session,
+					CK_OBJECT_HANDLE handle) = 0;
+};
+
+class PoolCryptCall : public PoolCall {
+  private:
+    PoolCryptOp op;
+    CK_MECHANISM mechanism;
+    CK_RSA_PKCS_OAEP_PARAMS oaep;
+    CK_BYTE_PTR pInput;
+    CK_ULONG ulInputLen;
+    CK_BYTE_PTR pOutput;		// the signature for PoolVerify
+    CK_ULONG_PTR pulOutputLen;
+  public:
+    PoolCryptCall(PoolCryptOp op_, const PoolMechanism &mech,
+	CK_BYTE_PTR pInput_, CK_ULONG ulInputLen_, CK_BYTE_PTR pOutput_,
+	CK_ULONG_PTR pulOutputLen_) : op(op_), pInput(pInput_),
+	ulInputLen(ulInputLen_), pOutput(pOutput_),
+	pulOutputLen(pulOutputLen_) {
+	mech.get(&mechanism, &oaep);
+    }
+    void call(Slot *slot, SessionHandleSuffix session, CK_OBJECT_HANDLE key) {
+	// the member session may have been used for another key since,
+	// so set the key up again every time
+	switch (op) {
+	case PoolSign:
+	    slot->signInit(session, &mechanism, key);
+	    slot->sign(session, pInput, ulInputLen, pOutput, pulOutputLen);
+	    break;
+	case PoolDecrypt:
+	    slot->decryptInit(session, &mechanism, key);
+	    slot->decrypt(session, pInput, ulInputLen, pOutput, pulOutputLen);
+	    break;
+	case PoolVerify:
+	    slot->verifyInit(session, &mechanism, key);
+	    slot->verify(session, pInput, ulInputLen, pOutput, *pulOutputLen);
+	    break;
+	case PoolEncrypt:
+	    slot->encryptInit(session, &mechanism, key);
+	    slot->encrypt(session, pInput, ulInputLen, pOutput, pulOutputLen);
+	    break;
+	case PoolVerifyRecover:
+	    slot->verifyRecoverInit(session, &mechanism, key);
+	    slot->verifyRecover(session, pInput, ulInputLen, pOutput,
+							pulOutputLen);
+	    break;
+	default:
+	    throw PKCS11Exception(CKR_FUNCTION_NOT_SUPPORTED);
+	}
+    }
+};
+
+class PoolAttributeCall : public PoolCall {
+  private:
+    CK_ATTRIBUTE_PTR pTemplate;
+    CK_ULONG ulCount;
+  public:
+    PoolAttributeCall(CK_ATTRIBUTE_PTR pTemplate_, CK_ULONG ulCount_) :
+	pTemplate(pTemplate_), ulCount(ulCount_) { }
+    void call(Slot *slot, SessionHandleSuffix session, CK_OBJECT_HANDLE obj) {
+	slot->getAttributeValue(session, obj, pTemplate, ulCount);
+    }
+};
+
+class PoolFindCall : public PoolCall {
+  private:
+    CK_ATTRIBUTE_PTR pTemplate;
+    CK_ULONG ulCount;
+  public:
+    std::vector<CK_OBJECT_HANDLE> found;
+    PoolFindCall(CK_ATTRIBUTE_PTR pTemplate_, CK_ULONG ulCount_) :
+	pTemplate(pTemplate_), ulCount(ulCount_) { }
+    void call(Slot *slot, SessionHandleSuffix session, CK_OBJECT_HANDLE) {
+	CK_OBJECT_HANDLE handles[32];
+	CK_ULONG count;
+
+	found.clear();
+	slot->findObjectsInit(session, pTemplate, ulCount);
+	do {
+	    slot->findObjects(session, handles, 32, &count);
+	    found.insert(found.end(), handles, handles + count);
+	} while (count == 32);
+    }
+};
+
+class PoolRandomCall : public PoolCall {
+  private:
+    bool seed;
+    CK_BYTE_PTR pData;
+    CK_ULONG ulDataLen;
+  public:
+    PoolRandomCall(bool seed_, CK_BYTE_PTR pData_, CK_ULONG ulDataLen_) :
+	seed(seed_), pData(pData_), ulDataLen(ulDataLen_) { }
+    void call(Slot *slot, SessionHandleSuffix session, CK_OBJECT_HANDLE) {
+	if (seed) {
+	    slot->seedRandom(session, pData, ulDataLen);
+	} else {
+	    slot->generateRandom(session, pData, ulDataLen);
+	}
+    }
+};
+
+void
+PoolMechanism::set(const CK_MECHANISM *pMechanism)
+{
+    type = pMechanism->mechanism;
+    param.clear();
+    source.clear();
+    if (pMechanism->pParameter == NULL) {
+	return;
+    }
+    param.assign((const char *)pMechanism->pParameter,
+					pMechanism->ulParameterLen);
+    if (type == CKM_RSA_PKCS_OAEP &&
+		pMechanism->ulParameterLen == sizeof(CK_RSA_PKCS_OAEP_PARAMS)) {
+	const CK_RSA_PKCS_OAEP_PARAMS *params =
+		(const CK_RSA_PKCS_OAEP_PARAMS *)pMechanism->pParameter;
+	if (params->pSourceData) {
+	    source.assign((const char *)params->pSourceData,
+						params->ulSourceDataLen);
+	}
+    }
+}
+
+void
+PoolMechanism::get(CK_MECHANISM *mechanism,
+				CK_RSA_PKCS_OAEP_PARAMS *oaep) const
+{
+    mechanism->mechanism = type;
+    mechanism->pParameter = param.empty() ? NULL : (CK_VOID_PTR)param.data();
+    mechanism->ulParameterLen = param.size();
+    if (type == CKM_RSA_PKCS_OAEP &&
+			param.size() == sizeof(CK_RSA_PKCS_OAEP_PARAMS)) {
+	// point the copy at our copy of the source data
+	memcpy(oaep, param.data(), sizeof(*oaep));
+	oaep->pSourceData = source.empty() ? NULL : (CK_VOID_PTR)source.data();
+	mechanism->pParameter = oaep;
+    }
+}
+
+//
+// errors that say something is wrong with the card or reader rather than
+// with the request. The same request may well work on another member.
+//
+static bool
+isMemberFailure(CK_RV rv)
+{
+    switch (rv) {
+    case CKR_DEVICE_ERROR:
+    case CKR_DEVICE_MEMORY:
+    case CKR_DEVICE_REMOVED:
+    case CKR_TOKEN_NOT_PRESENT:
+    case CKR_TOKEN_NOT_RECOGNIZED:
+    case CKR_SESSION_HANDLE_INVALID:
+    case CKR_SESSION_CLOSED:
+    case CKR_KEY_HANDLE_INVALID:
+    case CKR_OBJECT_HANDLE_INVALID:
+    case CKR_FUNCTION_FAILED:
+	return true;
+    }
+    return false;
+}
+
+static void
+appendBuffer(std::string &out, const CKYBuffer *buf)
+{
+    CKYSize size = buf ? CKYBuffer_Size(buf) : 0;
+
+    out += (char) ((size >> 24) & 0xff);
+    out += (char) ((size >> 16) & 0xff);
+    out += (char) ((size >> 8) & 0xff);
+    out += (char) (size & 0xff);
+    if (size) {
+	out.append((const char *)CKYBuffer_Data(buf), size);
+    }
+}
+
+TokenPool::TokenPool(Log *log_) : log(log_), formed(false),
+	poolHandleCounter(0), sessionHandleCounter(0), nextMember(0),
+	pinUser(CKU_USER)
+{
+}
+
+TokenPool::~TokenPool()
+{
+    unsigned int i;
+
+    for (i=0; i < members.size(); i++) {
+	delete members[i];
+    }
+    for (i=0; i < retired.size(); i++) {
+	delete retired[i];
+    }
+}
+
+//
+// objects are matched between tokens by class and CKA_ID. Objects without
+// an ID (the reader object, for one) belong to the card, not the key set,
+// and are left out of the pool.
+//
+std::string
+TokenPool::objectKey(const PKCS11Object &object)
+{
+    const CKYBuffer *id = object.getAttribute(CKA_ID);
+    const CKYBuffer *objClass = object.getAttribute(CKA_CLASS);
+    std::string key;
+
+    if (id == NULL || objClass == NULL || CKYBuffer_Size(id) == 0) {
+	return key;
+    }
+    appendBuffer(key, objClass);
+    appendBuffer(key, id);
+    return key;
+}
+
+//
+// Two tokens are interchangeable if they hold the same keyed objects with
+// the same public halves. The signature is the sorted list of
+// class/ID/public value triples; it is empty for a token with no keys.
+//
+std::string
+TokenPool::tokenSignature(Slot *slot)
+{
+    static const CK_ATTRIBUTE_TYPE publicValues[] =
+	{ CKA_MODULUS, CKA_EC_POINT, CKA_VALUE };
+    std::vector<std::string> entries;
+    std::string signature;
+    unsigned int i;
+
+    const ObjectList &objects = slot->getTokenObjects();
+    for (ObjectConstIter iter = objects.begin(); iter != objects.end();
+								++iter) {
+	std::string entry = objectKey(*iter);
+	if (entry.empty()) {
+	    continue;
+	}
+	for (i=0; i < sizeof(publicValues)/sizeof(publicValues[0]); i++) {
+	    appendBuffer(entry, iter->getAttribute(publicValues[i]));
+	}
+	entries.push_back(entry);
+    }
+    std::sort(entries.begin(), entries.end());
+    for (i=0; i < entries.size(); i++) {
+	signature += entries[i];
+    }
+    return signature;
+}
+
+//
+// Pool handles stay the same for the life of the pool, whichever member
+// ends up answering for them. Each member keeps its own translation, its
+// handles change every time its token is reloaded.
+//
+void
+TokenPool::mapObjects(Member *member)
+{
+    member->toMember.clear();
+    member->toPool.clear();
+
+    const ObjectList &objects = member->slot->getTokenObjects();
+    for (ObjectConstIter iter = objects.begin(); iter != objects.end();
+								++iter) {
+	std::string key = objectKey(*iter);
+	if (key.empty()) {
+	    continue;
+	}
+	std::map<std::string, CK_OBJECT_HANDLE>::iterator handle =
+						poolHandles.find(key);
+	if (handle == poolHandles.end()) {
+	    handle = poolHandles.insert(std::make_pair(key,
+					++poolHandleCounter)).first;
+	}
+	member->toMember[handle->second] = iter->getHandle();
+	member->toPool[iter->getHandle()] = handle->second;
+    }
+}
+
+//
+// Give a member a session of our own and log it in if the pool is logged
+// in. Called with the pool lock held.
+//
+bool
+TokenPool::attachMember(Member *member)
+{
+    if (!member->slot->isValidSession(member->session)) {
+	try {
+	    member->session = member->slot->openSession(Session::RO);
+	} catch (PKCS11Exception &excep) {
+	    excep.log(log);
+	    return false;
+	}
+	member->loggedIn = false;
+    }
+    mapObjects(member);
+    if (pinCache.isValid() && !member->loggedIn) {
+	const CKYBuffer *pin = pinCache.get();
+	try {
+	    member->slot->login(member->session, pinUser,
+		(CK_UTF8CHAR_PTR) CKYBuffer_Data(pin), CKYBuffer_Size(pin)-1);
+	    member->loggedIn = true;
+	} catch (PKCS11Exception &excep) {
+	    if (excep.getCRV() == CKR_USER_ALREADY_LOGGED_IN) {
+		member->loggedIn = true;
+	    } else {
+		excep.log(log);
+		member->pinRejected = !isMemberFailure(excep.getCRV());
+	    }
+	}
+    }
+    member->retryAt = 0;
+    return true;
+}
+
+void
+TokenPool::retireMember(unsigned int index)
+{
+    Member *member = members[index];
+
+    log->log("Token pool: slot %d left the pool\n", member->slotID);
+    try {
+	member->slot->closeSession(member->session);
+    } catch (PKCS11Exception &) {
+	// the token is already gone
+    }
+    members.erase(members.begin() + index);
+    retired.push_back(member);
+}
+
+void
+TokenPool::update(Slot **slots, const bool *tokenIsPresent,
+							unsigned int numSlots)
+{
+    typedef std::map<std::string, std::vector<unsigned int> > GroupMap;
+    GroupMap groups;
+    unsigned int i, j;
+
+    // the pool's slot ID has to stay clear of the readers'
+    if (numSlots >= TOKEN_POOL_SLOT_ID) {
+	return;
+    }
+    for (i=0; i < numSlots; i++) {
+	if (!tokenIsPresent[i]) {
+	    continue;
+	}
+	std::string sig = tokenSignature(slots[i]);
+	if (!sig.empty()) {
+	    groups[sig].push_back(i);
+	}
+    }
+
+    lock.getLock();
+    if (!formed) {
+	GroupMap::iterator best = groups.end();
+	for (GroupMap::iterator iter = groups.begin(); iter != groups.end();
+								++iter) {
+	    if (iter->second.size() >= 2 && (best == groups.end() ||
+			iter->second.size() > best->second.size())) {
+		best = iter;
+	    }
+	}
+	if (best == groups.end()) {
+	    lock.releaseLock();
+	    return;
+	}
+	signature = best->first;
+	formed = true;
+	log->log("Token pool formed from %d identical tokens\n",
+				(int) best->second.size());
+    }
+
+    std::vector<unsigned int> group;
+    GroupMap::iterator found = groups.find(signature);
+    if (found != groups.end()) {
+	group = found->second;
+    }
+
+    // drop members whose token is gone or has changed. A member still
+    // in use is dropped on a later pass, its operations fail over.
+    for (i=0; i < members.size(); ) {
+	bool stays = false;
+	for (j=0; j < group.size(); j++) {
+	    stays = stays || (slots[group[j]] == members[i]->slot);
+	}
+	if (!stays && members[i]->inFlight == 0) {
+	    retireMember(i);
+	    continue;
+	}
+	i++;
+    }
+
+    for (j=0; j < group.size(); j++) {
+	Member *member = NULL;
+	for (i=0; i < members.size(); i++) {
+	    if (members[i]->slot == slots[group[j]]) {
+		member = members[i];
+		break;
+	    }
+	}
+	if (member == NULL) {
+	    member = new Member();
+	    member->slot = slots[group[j]];
+	    member->slotID = slotIndexToID(group[j]);
+	    if (attachMember(member)) {
+		log->log("Token pool: slot %d joined the pool\n",
+							member->slotID);
+		members.push_back(member);
+	    } else {
+		delete member;
+	    }
+	} else if (member->inFlight == 0 &&
+		!member->slot->isValidSession(member->session)) {
+	    // the token was reinserted, its objects were reloaded
+	    attachMember(member);
+	}
+    }
+    lock.releaseLock();
+}
+
+//
+// A benched member whose time is up gets another chance. If its token
+// went away and came back we need a new session, handles and login, and
+// we need to be sure it's the same token. Called with the pool lock held.
+//
+bool
+TokenPool::reviveMember(Member *member)
+{
+    if (member->slot->isValidSession(member->session)) {
+	return true;
+    }
+    if (!member->slot->isTokenPresent() ||
+			tokenSignature(member->slot) != signature) {
+	return false;
+    }
+    return attachMember(member);
+}
+
+TokenPool::Member *
+TokenPool::getLeader()
+{
+    OSTime now = OSTimeNow();
+
+    for (unsigned int i=0; i < members.size(); i++) {
+	if (members[i]->retryAt == 0 || (long)(now - members[i]->retryAt) >= 0) {
+	    return members[i];
+	}
+    }
+    return members.empty() ? NULL : members[0];
+}
+
+//
+// Pick the healthy member with the fewest operations outstanding that has
+// not been tried yet for this request. Equally busy members take turns.
+//
+TokenPool::Member *
+TokenPool::acquireMember(CK_OBJECT_HANDLE hObject, bool needLogin,
+    std::vector<Member *>& tried, CK_OBJECT_HANDLE *memberHandle)
+{
+    Member *best;
+    unsigned int bestIndex = 0;
+    bool known = (hObject == 0);
+    unsigned int i;
+
+    lock.getLock();
+    for (;;) {
+	OSTime now = OSTimeNow();
+	unsigned int count = members.size();
+
+	best = NULL;
+	for (i=0; i < count; i++) {
+	    unsigned int index = (nextMember + i) % count;
+	    Member *member = members[index];
+
+	    if (hObject != 0) {
+		if (member->toMember.find(hObject) == member->toMember.end()) {
+		    continue;
+		}
+		known = true;
+	    }
+	    if (std::find(tried.begin(), tried.end(), member) != tried.end()) {
+		continue;
+	    }
+	    if (member->retryAt && (long)(now - member->retryAt) < 0) {
+		continue;
+	    }
+	    // members that aren't logged in yet are logged in on use,
+	    // unless they already turned the pin down
+	    if (needLogin && pinCache.isValid() && member->pinRejected) {
+		continue;
+	    }
+	    if (best == NULL || member->inFlight < best->inFlight) {
+		best = member;
+		bestIndex = index;
+	    }
+	}
+	if (best == NULL || best->retryAt == 0) {
+	    break;
+	}
+	if (reviveMember(best)) {
+	    best->retryAt = 0;
+	    break;
+	}
+	benchMember(best);
+	tried.push_back(best);
+    }
+
+    if (best) {
+	best->inFlight++;
+	nextMember = bestIndex + 1;
+	*memberHandle = hObject ? best->toMember[hObject] : 0;
+    }
+    lock.releaseLock();
+
+    if (!known) {
+	throw PKCS11Exception(CKR_OBJECT_HANDLE_INVALID);
+    }
+    return best;
+}
+
+// Called with the pool lock held.
+void
+TokenPool::benchMember(Member *member)
+{
+    member->retryAt = OSTimeNow() + TOKEN_POOL_RETRY_TIME;
+    if (member->retryAt == 0) {
+	member->retryAt = 1;
+    }
+}
+
+void
+TokenPool::releaseMember(Member *member, bool failed)
+{
+    lock.getLock();
+    member->inFlight--;
+    if (failed) {
+	benchMember(member);
+    }
+    lock.releaseLock();
+}
+
+//
+// Log a member in with the pool's pin if it isn't already. Members whose
+// login failed on a card error when they joined, or when the pool was
+// logged in, get another go here. Called with member->busy held and the
+// pool lock not held.
+//
+CK_RV
+TokenPool::loginMember(Member *member)
+{
+    std::string pin;
+    CK_USER_TYPE user = CKU_USER;
+    CK_RV rv = CKR_OK;
+
+    lock.getLock();
+    bool needed = pinCache.isValid() && !member->loggedIn;
+    if (needed) {
+	const CKYBuffer *pinBuf = pinCache.get();
+	pin.assign((const char *)CKYBuffer_Data(pinBuf),
+					CKYBuffer_Size(pinBuf)-1);
+	user = pinUser;
+    }
+    lock.releaseLock();
+    if (!needed) {
+	return CKR_OK;
+    }
+
+    try {
+	member->slot->login(member->session, user,
+			(CK_UTF8CHAR_PTR) pin.data(), pin.size());
+    } catch (PKCS11Exception &excep) {
+	rv = excep.getCRV();
+    }
+    lock.getLock();
+    if (rv == CKR_OK || rv == CKR_USER_ALREADY_LOGGED_IN) {
+	member->loggedIn = true;
+	rv = CKR_OK;
+    } else if (!isMemberFailure(rv)) {
+	// the pin worked elsewhere, this card wants a different one
+	member->pinRejected = true;
+    }
+    lock.releaseLock();
+    return rv;
+}
+
+//
+// Run a call on some member, moving on to the next one if the card fails
+// under us. Errors about the request itself go straight back to the
+// caller. Returns the member that answered.
+//
+TokenPool::Member *
+TokenPool::dispatch(PoolCall &call, CK_OBJECT_HANDLE hObject, bool needLogin)
+{
+    std::vector<Member *> tried;
+    CK_RV lastError = CKR_TOKEN_NOT_PRESENT;
+
+    for (;;) {
+	CK_OBJECT_HANDLE memberHandle = 0;
+	Member *member = acquireMember(hObject, needLogin, tried,
+							&memberHandle);
+	if (member == NULL) {
+	    throw PKCS11Exception(lastError,
+		"Token pool has no usable member left\n");
+	}
+	tried.push_back(member);
+
+	CK_RV rv = CKR_OK;
+	std::string message;
+	bool failed;
+	member->busy.getLock();
+	if (needLogin) {
+	    rv = loginMember(member);
+	}
+	// a member that can't log in is no fault of the request
+	failed = (rv != CKR_OK);
+	if (!failed) {
+	    try {
+		call.call(member->slot, member->session, memberHandle);
+	    } catch (PKCS11Exception &excep) {
+		rv = excep.getCRV();
+		message = excep.getMessage();
+	    }
+	    failed = isMemberFailure(rv);
+	}
+	member->busy.releaseLock();
+
+	releaseMember(member, failed);
+	if (rv == CKR_OK) {
+	    return member;
+	}
+	if (!failed) {
+	    throw PKCS11Exception(rv, message);
+	}
+	log->log("Token pool: slot %d failed with 0x%x, trying the next one\n",
+						member->slotID, rv);
+	lastError = CKR_DEVICE_REMOVED;
+    }
+}
+
+TokenPool::PoolSession *
+TokenPool::findSession(CK_SESSION_HANDLE suffix)
+{
+    for (unsigned int i=0; i < sessions.size(); i++) {
+	if (sessions[i].suffix == suffix) {
+	    return &sessions[i];
+	}
+    }
+    return NULL;
+}
+
+// find a session and keep the pool locked while it is used
+TokenPool::PoolSession *
+TokenPool::lockSession(CK_SESSION_HANDLE suffix)
+{
+    lock.getLock();
+    PoolSession *session = findSession(suffix);
+    if (session == NULL) {
+	lock.releaseLock();
+	throw PKCS11Exception(CKR_SESSION_HANDLE_INVALID);
+    }
+    return session;
+}
+
+bool
+TokenPool::isTokenPresent()
+{
+    lock.getLock();
+    bool present = !members.empty();
+    lock.releaseLock();
+    return present;
+}
+
+Slot *
+TokenPool::getLeaderSlot()
+{
+    lock.getLock();
+    Member *leader = getLeader();
+    lock.releaseLock();
+    return leader ? leader->slot : NULL;
+}
+
+CK_RV
+TokenPool::getSlotInfo(CK_SLOT_INFO_PTR pSlotInfo)
+{
+    static CK_VERSION version = {0,0};
+    static const char description[] = "CoolKey Token Pool";
+    static const char manufacturer[] = "CoolKey";
+
+    if( pSlotInfo == NULL ) {
+	throw PKCS11Exception(CKR_ARGUMENTS_BAD);
+    }
+    pSlotInfo->flags = CKF_REMOVABLE_DEVICE;
+    if (isTokenPresent()) {
+	pSlotInfo->flags |= CKF_TOKEN_PRESENT;
+    }
+    memset(pSlotInfo->slotDescription, ' ', 64);
+    memcpy(pSlotInfo->slotDescription, description,
+	MIN(64, strlen(description)));
+    memset(pSlotInfo->manufacturerID, ' ', 32);
+    memcpy(pSlotInfo->manufacturerID, manufacturer,
+	MIN(32, strlen(manufacturer)));
+    pSlotInfo->hardwareVersion = version;
+    pSlotInfo->firmwareVersion = version;
+    return CKR_OK;
+}
+
+//
+// The members are the same token as far as the keys go, so report the
+// one we'd use now. The label and serial number are the pool's own so
+// the pool is not mistaken for the member it happens to be showing.
+//
+CK_RV
+TokenPool::getTokenInfo(CK_TOKEN_INFO_PTR pTokenInfo)
+{
+    static const char label[] = "CoolKey Token Pool";
+    static const char serial[] = "POOL";
+
+    if (pTokenInfo == NULL) {
+	throw PKCS11Exception(CKR_ARGUMENTS_BAD);
+    }
+    lock.getLock();
+    Member *leader = getLeader();
+    lock.releaseLock();
+    if (leader == NULL) {
+	throw PKCS11Exception(CKR_TOKEN_NOT_PRESENT);
+    }
+    leader->busy.getLock();
+    try {
+	leader->slot->getTokenInfo(pTokenInfo);
+    } catch (PKCS11Exception &) {
+	leader->busy.releaseLock();
+	throw;
+    }
+    leader->busy.releaseLock();
+
+    memset(pTokenInfo->label, ' ', sizeof(pTokenInfo->label));
+    memcpy(pTokenInfo->label, label, MIN(sizeof(pTokenInfo->label),
+							strlen(label)));
+    memset(pTokenInfo->serialNumber, ' ', sizeof(pTokenInfo->serialNumber));
+    memcpy(pTokenInfo->serialNumber, serial,
+		MIN(sizeof(pTokenInfo->serialNumber), strlen(serial)));
+    return CKR_OK;
+}
+
+CK_SESSION_HANDLE
+TokenPool::openSession(Session::Type type)
+{
+    CK_SESSION_HANDLE suffix;
+
+    lock.getLock();
+    if (members.empty()) {
+	lock.releaseLock();
+	throw PKCS11Exception(CKR_TOKEN_NOT_PRESENT);
+    }
+    do {
+	suffix = (++sessionHandleCounter) & 0x00ffffff;
+    } while (suffix == 0 || findSession(suffix) != NULL);
+    sessions.push_back(PoolSession(suffix, type));
+    lock.releaseLock();
+    return suffix;
+}
+
+void
+TokenPool::closeSession(CK_SESSION_HANDLE suffix)
+{
+    lock.getLock();
+    for (unsigned int i=0; i < sessions.size(); i++) {
+	if (sessions[i].suffix == suffix) {
+	    sessions.erase(sessions.begin() + i);
+	    lock.releaseLock();
+	    return;
+	}
+    }
+    lock.releaseLock();
+    throw PKCS11Exception(CKR_SESSION_HANDLE_INVALID);
+}
+
+bool
+TokenPool::isValidSession(CK_SESSION_HANDLE suffix)
+{
+    lock.getLock();
+    bool valid = findSession(suffix) != NULL;
+    lock.releaseLock();
+    return valid;
+}
+
+void
+TokenPool::getSessionInfo(CK_SESSION_HANDLE suffix,
+    CK_SESSION_INFO_PTR pInfo)
+{
+    lock.getLock();
+    PoolSession *session = findSession(suffix);
+    if (session == NULL) {
+	lock.releaseLock();
+	throw PKCS11Exception(CKR_SESSION_HANDLE_INVALID);
+    }
+    bool loggedIn = pinCache.isValid();
+    if (session->type == Session::RO) {
+	pInfo->state = loggedIn ? CKS_RO_USER_FUNCTIONS : CKS_RO_PUBLIC_SESSION;
+	pInfo->flags = CKF_SERIAL_SESSION;
+    } else {
+	pInfo->state = loggedIn ? CKS_RW_USER_FUNCTIONS : CKS_RW_PUBLIC_SESSION;
+	pInfo->flags = CKF_RW_SESSION | CKF_SERIAL_SESSION;
+    }
+    pInfo->ulDeviceError = 0;
+    lock.releaseLock();
+}
+
+//
+// Log in every member. A PIN one token rejects would be rejected by the
+// rest as well, so stop there rather than use up their retry counters.
+//
+void
+TokenPool::login(CK_SESSION_HANDLE suffix, CK_USER_TYPE user,
+    CK_UTF8CHAR_PTR pPin, CK_ULONG ulPinLen)
+{
+    CK_RV rv = CKR_TOKEN_NOT_PRESENT;
+    std::string message;
+    bool loggedIn = false;
+    unsigned int i;
+
+    if (!isValidSession(suffix)) {
+	throw PKCS11Exception(CKR_SESSION_HANDLE_INVALID);
+    }
+    lock.getLock();
+    std::vector<Member *> current = members;
+    lock.releaseLock();
+
+    for (i=0; i < current.size(); i++) {
+	Member *member = current[i];
+	CK_RV memberRv = CKR_OK;
+
+	member->busy.getLock();
+	try {
+	    member->slot->login(member->session, user, pPin, ulPinLen);
+	} catch (PKCS11Exception &excep) {
+	    memberRv = excep.getCRV();
+	    message = excep.getMessage();
+	}
+	member->busy.releaseLock();
+
+	if (memberRv == CKR_OK || memberRv == CKR_USER_ALREADY_LOGGED_IN) {
+	    lock.getLock();
+	    member->loggedIn = true;
+	    member->pinRejected = false;
+	    lock.releaseLock();
+	    loggedIn = true;
+	    continue;
+	}
+	rv = memberRv;
+	if (!isMemberFailure(memberRv)) {
+	    lock.getLock();
+	    member->pinRejected = true;
+	    lock.releaseLock();
+	    break;
+	}
+	lock.getLock();
+	benchMember(member);
+	lock.releaseLock();
+    }
+    if (!loggedIn) {
+	throw PKCS11Exception(rv, message);
+    }
+    if (user != CKU_CONTEXT_SPECIFIC) {
+	lock.getLock();
+	pinCache.set((const char *)pPin, ulPinLen);
+	pinCache.validate();
+	pinUser = user;
+	lock.releaseLock();
+    }
+}
+
+void
+TokenPool::logout(CK_SESSION_HANDLE suffix)
+{
+    if (!isValidSession(suffix)) {
+	throw PKCS11Exception(CKR_SESSION_HANDLE_INVALID);
+    }
+    lock.getLock();
+    pinCache.clearPin();
+    std::vector<Member *> current = members;
+    for (unsigned int i=0; i < current.size(); i++) {
+	current[i]->loggedIn = false;
+	current[i]->pinRejected = false;
+    }
+    lock.releaseLock();
+
+    for (unsigned int i=0; i < current.size(); i++) {
+	current[i]->busy.getLock();
+	try {
+	    current[i]->slot->logout(current[i]->session);
+	} catch (PKCS11Exception &excep) {
+	    excep.log(log);
+	}
+	current[i]->busy.releaseLock();
+    }
+}
+
+void
+TokenPool::findObjectsInit(CK_SESSION_HANDLE suffix,
+    CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount)
+{
+    PoolFindCall call(pTemplate, ulCount);
+    std::vector<CK_OBJECT_HANDLE> found;
+
+    if (!isValidSession(suffix)) {
+	throw PKCS11Exception(CKR_SESSION_HANDLE_INVALID);
+    }
+    Member *member = dispatch(call, 0, false);
+
+    lock.getLock();
+    for (unsigned int i=0; i < call.found.size(); i++) {
+	HandleMap::iterator handle = member->toPool.find(call.found[i]);
+	if (handle != member->toPool.end()) {
+	    found.push_back(handle->second);
+	}
+    }
+    PoolSession *session = findSession(suffix);
+    if (session) {
+	session->found = found;
+	session->nextFound = 0;
+    }
+    lock.releaseLock();
+}
+
+void
+TokenPool::findObjects(CK_SESSION_HANDLE suffix, CK_OBJECT_HANDLE_PTR phObject,
+    CK_ULONG ulMaxObjectCount, CK_ULONG_PTR pulObjectCount)
+{
+    CK_ULONG count = 0;
+
+    lock.getLock();
+    PoolSession *session = findSession(suffix);
+    if (session == NULL) {
+	lock.releaseLock();
+	throw PKCS11Exception(CKR_SESSION_HANDLE_INVALID);
+    }
+    while (count < ulMaxObjectCount &&
+			session->nextFound < session->found.size()) {
+	phObject[count++] = session->found[session->nextFound++];
+    }
+    lock.releaseLock();
+    *pulObjectCount = count;
+}
+
+void
+TokenPool::getAttributeValue(CK_SESSION_HANDLE suffix,
+    CK_OBJECT_HANDLE hObject, CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount)
+{
+    PoolAttributeCall call(pTemplate, ulCount);
+
+    if (!isValidSession(suffix)) {
+	throw PKCS11Exception(CKR_SESSION_HANDLE_INVALID);
+    }
+    if (hObject == 0) {
+	throw PKCS11Exception(CKR_OBJECT_HANDLE_INVALID);
+    }
+    dispatch(call, hObject, false);
+}
+
+void
+TokenPool::cryptInit(PoolCryptOp op, CK_SESSION_HANDLE suffix,
+    CK_MECHANISM_PTR pMechanism, CK_OBJECT_HANDLE hKey)
+{
+    bool known = false;
+
+    if (pMechanism == NULL) {
+	throw PKCS11Exception(CKR_ARGUMENTS_BAD);
+    }
+    lock.getLock();
+    PoolSession *session = findSession(suffix);
+    if (session == NULL) {
+	lock.releaseLock();
+	throw PKCS11Exception(CKR_SESSION_HANDLE_INVALID);
+    }
+    for (unsigned int i=0; i < members.size(); i++) {
+	known = known || (hKey != 0 && members[i]->toMember.find(hKey) !=
+					members[i]->toMember.end());
+    }
+    if (known) {
+	session->crypt[op].active = true;
+	session->crypt[op].key = hKey;
+	session->crypt[op].mech.set(pMechanism);
+	if (op == PoolSign) {
+	    CK_MECHANISM_TYPE rawMech;
+	    CK_MECHANISM_TYPE hashMech =
+		HostDigest::getSignDigest(pMechanism->mechanism, &rawMech);
+	    session->signHashing = (hashMech != 0);
+	    session->signInputLen = 0;
+	    if (hashMech) {
+		session->signDigest.init(hashMech);
+	    }
+	}
+    }
+    lock.releaseLock();
+    if (!known) {
+	throw PKCS11Exception(CKR_KEY_HANDLE_INVALID);
+    }
+}
+
+void
+TokenPool::crypt(PoolCryptOp op, CK_SESSION_HANDLE suffix, CK_BYTE_PTR pInput,
+    CK_ULONG ulInputLen, CK_BYTE_PTR pOutput, CK_ULONG_PTR pulOutputLen)
+{
+    CK_OBJECT_HANDLE hKey;
+    PoolMechanism mech;
+    bool active;
+
+    lock.getLock();
+    PoolSession *session = findSession(suffix);
+    if (session == NULL) {
+	lock.releaseLock();
+	throw PKCS11Exception(CKR_SESSION_HANDLE_INVALID);
+    }
+    active = session->crypt[op].active;
+    hKey = session->crypt[op].key;
+    mech = session->crypt[op].mech;
+    lock.releaseLock();
+
+    if (!active) {
+	throw PKCS11Exception(CKR_OPERATION_NOT_INITIALIZED);
+    }
+    runCrypt(op, suffix, hKey, mech, pInput, ulInputLen, pOutput,
+							pulOutputLen);
+}
+
+void
+TokenPool::runCrypt(PoolCryptOp op, CK_SESSION_HANDLE suffix,
+    CK_OBJECT_HANDLE hKey, const PoolMechanism &mech, CK_BYTE_PTR pInput,
+    CK_ULONG ulInputLen, CK_BYTE_PTR pOutput, CK_ULONG_PTR pulOutputLen)
+{
+    bool done = true;
+
+    PoolCryptCall call(op, mech, pInput, ulInputLen, pOutput, pulOutputLen);
+    try {
+	// only the private key operations need the card logged in
+	dispatch(call, hKey, op == PoolSign || op == PoolDecrypt);
+	// asking for the length leaves the operation going
+	done = (op == PoolVerify || pOutput != NULL);
+    } catch (PKCS11Exception &excep) {
+	done = (excep.getCRV() != CKR_BUFFER_TOO_SMALL);
+	if (done) {
+	    endCrypt(op, suffix);
+	}
+	throw;
+    }
+    if (done) {
+	endCrypt(op, suffix);
+    }
+}
+
+void
+TokenPool::endCrypt(PoolCryptOp op, CK_SESSION_HANDLE suffix)
+{
+    lock.getLock();
+    PoolSession *session = findSession(suffix);
+    if (session) {
+	session->crypt[op].active = false;
+	if (op == PoolSign) {
+	    session->signHashing = false;
+	    session->signInputLen = 0;
+	}
+    }
+    lock.releaseLock();
+}
+
+void
+TokenPool::signInit(CK_SESSION_HANDLE suffix, CK_MECHANISM_PTR pMechanism,
+    CK_OBJECT_HANDLE hKey)
+{
+    cryptInit(PoolSign, suffix, pMechanism, hKey);
+}
+
+void
+TokenPool::sign(CK_SESSION_HANDLE suffix, CK_BYTE_PTR pData,
+    CK_ULONG ulDataLen, CK_BYTE_PTR pSignature, CK_ULONG_PTR pulSignatureLen)
+{
+    crypt(PoolSign, suffix, pData, ulDataLen, pSignature, pulSignatureLen);
+}
+
+void
+TokenPool::signUpdate(CK_SESSION_HANDLE suffix, CK_BYTE_PTR pPart,
+    CK_ULONG ulPartLen)
+{
+    PoolSession *session = lockSession(suffix);
+    if (!session->crypt[PoolSign].active) {
+	lock.releaseLock();
+	throw PKCS11Exception(CKR_OPERATION_NOT_INITIALIZED);
+    }
+    if (!session->signHashing || session->signInputLen != 0) {
+	lock.releaseLock();
+	throw PKCS11Exception(CKR_FUNCTION_NOT_SUPPORTED);
+    }
+    if (pPart == NULL && ulPartLen != 0) {
+	lock.releaseLock();
+	endCrypt(PoolSign, suffix);
+	throw PKCS11Exception(CKR_ARGUMENTS_BAD);
+    }
+    // hash without the pool lock, see getDigestState
+    HostDigest digest = session->signDigest;
+    lock.releaseLock();
+    digest.update(pPart, ulPartLen);
+
+    lock.getLock();
+    session = findSession(suffix);
+    if (session && session->crypt[PoolSign].active) {
+	session->signDigest = digest;
+    }
+    lock.releaseLock();
+}
+
+//
+// The digest is finished once and kept, so a length query followed by the
+// real call (possibly on another member) signs the same thing.
+//
+void
+TokenPool::signFinal(CK_SESSION_HANDLE suffix, CK_BYTE_PTR pSignature,
+    CK_ULONG_PTR pulSignatureLen)
+{
+    CKYByte input[DIGEST_MAX_SIGN_INPUT];
+    CKYSize inputLen;
+    CK_MECHANISM_TYPE rawMech;
+    CK_OBJECT_HANDLE hKey;
+    PoolMechanism mech;
+
+    PoolSession *session = lockSession(suffix);
+    if (!session->crypt[PoolSign].active || !session->signHashing) {
+	lock.releaseLock();
+	throw PKCS11Exception(CKR_OPERATION_NOT_INITIALIZED);
+    }
+    HostDigest::getSignDigest(session->crypt[PoolSign].mech.getType(),
+								&rawMech);
+    if (session->signInputLen == 0) {
+	session->signInputLen =
+		session->signDigest.finalForSign(rawMech, session->signInput);
+    }
+    inputLen = session->signInputLen;
+    memcpy(input, session->signInput, inputLen);
+    hKey = session->crypt[PoolSign].key;
+    // the member signs the hash with the raw mechanism, same parameters
+    mech = session->crypt[PoolSign].mech;
+    mech.setType(rawMech);
+    lock.releaseLock();
+
+    runCrypt(PoolSign, suffix, hKey, mech, input, inputLen, pSignature,
+							pulSignatureLen);
+}
+
+void
+TokenPool::decryptInit(CK_SESSION_HANDLE suffix, CK_MECHANISM_PTR pMechanism,
+    CK_OBJECT_HANDLE hKey)
+{
+    cryptInit(PoolDecrypt, suffix, pMechanism, hKey);
+}
+
+void
+TokenPool::decrypt(CK_SESSION_HANDLE suffix, CK_BYTE_PTR pData,
+    CK_ULONG ulDataLen, CK_BYTE_PTR pDecryptedData,
+    CK_ULONG_PTR pulDecryptedDataLen)
+{
+    crypt(PoolDecrypt, suffix, pData, ulDataLen, pDecryptedData,
+						pulDecryptedDataLen);
+}
+
+void
+TokenPool::verifyInit(CK_SESSION_HANDLE suffix, CK_MECHANISM_PTR pMechanism,
+    CK_OBJECT_HANDLE hKey)
+{
+    cryptInit(PoolVerify, suffix, pMechanism, hKey);
+}
+
+void
+TokenPool::verify(CK_SESSION_HANDLE suffix, CK_BYTE_PTR pData,
+    CK_ULONG ulDataLen, CK_BYTE_PTR pSignature, CK_ULONG ulSignatureLen)
+{
+    crypt(PoolVerify, suffix, pData, ulDataLen, pSignature, &ulSignatureLen);
+}
+
+void
+TokenPool::encryptInit(CK_SESSION_HANDLE suffix, CK_MECHANISM_PTR pMechanism,
+    CK_OBJECT_HANDLE hKey)
+{
+    cryptInit(PoolEncrypt, suffix, pMechanism, hKey);
+}
+
+void
+TokenPool::encrypt(CK_SESSION_HANDLE suffix, CK_BYTE_PTR pData,
+    CK_ULONG ulDataLen, CK_BYTE_PTR pEncryptedData,
+    CK_ULONG_PTR pulEncryptedDataLen)
+{
+    crypt(PoolEncrypt, suffix, pData, ulDataLen, pEncryptedData,
+						pulEncryptedDataLen);
+}
+
+void
+TokenPool::verifyRecoverInit(CK_SESSION_HANDLE suffix,
+    CK_MECHANISM_PTR pMechanism, CK_OBJECT_HANDLE hKey)
+{
+    cryptInit(PoolVerifyRecover, suffix, pMechanism, hKey);
+}
+
+void
+TokenPool::verifyRecover(CK_SESSION_HANDLE suffix, CK_BYTE_PTR pSignature,
+    CK_ULONG ulSignatureLen, CK_BYTE_PTR pData, CK_ULONG_PTR pulDataLen)
+{
+    crypt(PoolVerifyRecover, suffix, pSignature, ulSignatureLen, pData,
+							pulDataLen);
+}
+
+void
+TokenPool::digestInit(CK_SESSION_HANDLE suffix, CK_MECHANISM_PTR pMechanism)
+{
+    PoolSession *session = lockSession(suffix);
+    try {
+	session->digestState.init(pMechanism);
+    } catch (PKCS11Exception &) {
+	lock.releaseLock();
+	throw;
+    }
+    lock.releaseLock();
+}
+
+//
+// Hashing a big input takes a while, so it isn't done under the pool lock.
+// The session's digest is copied out, worked on, and put back. PKCS #11
+// doesn't let an application run two operations on one session at once,
+// so nothing else changes it in the meantime.
+//
+DigestState
+TokenPool::getDigestState(CK_SESSION_HANDLE suffix)
+{
+    PoolSession *session = lockSession(suffix);
+    DigestState state = session->digestState;
+    lock.releaseLock();
+    return state;
+}
+
+void
+TokenPool::putDigestState(CK_SESSION_HANDLE suffix, const DigestState &state)
+{
+    lock.getLock();
+    PoolSession *session = findSession(suffix);
+    if (session) {
+	session->digestState = state;
+    }
+    lock.releaseLock();
+}
+
+void
+TokenPool::digest(CK_SESSION_HANDLE suffix, CK_BYTE_PTR pData,
+    CK_ULONG ulDataLen, CK_BYTE_PTR pDigest, CK_ULONG_PTR pulDigestLen)
+{
+    DigestState state = getDigestState(suffix);
+    try {
+	state.digestAll(pData, ulDataLen, pDigest, pulDigestLen);
+    } catch (PKCS11Exception &) {
+	putDigestState(suffix, state);
+	throw;
+    }
+    putDigestState(suffix, state);
+}
+
+void
+TokenPool::digestUpdate(CK_SESSION_HANDLE suffix, CK_BYTE_PTR pPart,
+    CK_ULONG ulPartLen)
+{
+    DigestState state = getDigestState(suffix);
+    try {
+	state.update(pPart, ulPartLen);
+    } catch (PKCS11Exception &) {
+	putDigestState(suffix, state);
+	throw;
+    }
+    putDigestState(suffix, state);
+}
+
+void
+TokenPool::digestFinal(CK_SESSION_HANDLE suffix, CK_BYTE_PTR pDigest,
+    CK_ULONG_PTR pulDigestLen)
+{
+    DigestState state = getDigestState(suffix);
+    try {
+	state.final(pDigest, pulDigestLen);
+    } catch (PKCS11Exception &) {
+	putDigestState(suffix, state);
+	throw;
+    }
+    putDigestState(suffix, state);
+}
+
+void
+TokenPool::seedRandom(CK_SESSION_HANDLE suffix, CK_BYTE_PTR pData,
+    CK_ULONG ulDataLen)
+{
+    PoolRandomCall call(true, pData, ulDataLen);
+
+    if (!isValidSession(suffix)) {
+	throw PKCS11Exception(CKR_SESSION_HANDLE_INVALID);
+    }
+    dispatch(call, 0, false);
+}
+
+void
+TokenPool::generateRandom(CK_SESSION_HANDLE suffix, CK_BYTE_PTR pData,
+    CK_ULONG ulDataLen)
+{
+    PoolRandomCall call(false, pData, ulDataLen);
+
+    if (!isValidSession(suffix)) {
+	throw PKCS11Exception(CKR_SESSION_HANDLE_INVALID);
+    }
+    dispatch(call, 0, false);
+}
@@ -0,0 +1,237 @@
+/* ***** BEGIN COPYRIGHT BLOCK *****
+ * Copyright (C) 2005 Red Hat, Inc.
+ * All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation version
+ * 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ * ***** END COPYRIGHT BLOCK *****/
+
+#ifndef COOLKEY_POOL_H
+#define COOLKEY_POOL_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include "mypkcs11.h"
+#include "log.h"
+#include "machdep.h"
+#include "slot.h"
+
+//
+// Token pool. When COOL_KEY_TOKEN_POOL is set, tokens that carry the same
+// keys (the same CKA_ID and public key or certificate on every keyed
+// object) are gathered behind one extra slot. The pool shows a single
+// set of objects; each C_Sign or C_Decrypt is sent to the least busy
+// healthy member. A member that fails with a card error is benched for a
+// while and the operation is retried on the next one, so pulling one
+// reader out of a pool of several is not seen by the application.
+//
+// The member tokens are still reachable through their own slots.
+//
+#define TOKEN_POOL_SLOT_ID 0xff
+#define TOKEN_POOL_RETRY_TIME 5000	/* msec a failed member sits out */
+
+class PoolCall;
+
+// the operations a pool session can have going on a key
+enum PoolCryptOp {
+    PoolSign, PoolDecrypt, PoolVerify, PoolEncrypt, PoolVerifyRecover,
+    PoolCryptOps
+};
+
+//
+// A mechanism as given to C_*Init, kept so it can be replayed on whichever
+// member ends up doing the operation. The parameter block is copied, and
+// for OAEP so is the source data it points at.
+//
+class PoolMechanism {
+  private:
+    CK_MECHANISM_TYPE type;
+    std::string param;
+    std::string source;
+  public:
+    PoolMechanism() : type(0) { }
+    void set(const CK_MECHANISM *pMechanism);
+    CK_MECHANISM_TYPE getType() const { return type; }
+    void setType(CK_MECHANISM_TYPE type_) { type = type_; }
+    // oaep is scratch space for the rebuilt OAEP parameters
+    void get(CK_MECHANISM *mechanism, CK_RSA_PKCS_OAEP_PARAMS *oaep) const;
+};
+
+class TokenPool {
+  private:
+    typedef std::map<CK_OBJECT_HANDLE, CK_OBJECT_HANDLE> HandleMap;
+
+    struct Member {
+	Slot *slot;
+	CK_SLOT_ID slotID;
+	SessionHandleSuffix session;	// our own session on the member
+	bool loggedIn;
+	bool pinRejected;		// refused the pool's pin, don't retry
+	unsigned int inFlight;		// operations queued or running
+	OSTime retryAt;			// benched until then, 0 when healthy
+	OSLock busy;			// one operation on a card at a time
+	HandleMap toMember;		// pool handle -> member handle
+	HandleMap toPool;		// member handle -> pool handle
+	Member() : slot(NULL), slotID(0), loggedIn(false),
+			pinRejected(false), inFlight(0), retryAt(0) { }
+    };
+
+    struct PoolSession {
+	CK_SESSION_HANDLE suffix;
+	Session::Type type;
+	std::vector<CK_OBJECT_HANDLE> found;
+	unsigned int nextFound;
+	struct {
+	    bool active;
+	    CK_OBJECT_HANDLE key;
+	    PoolMechanism mech;
+	} crypt[PoolCryptOps];	// indexed by PoolCryptOp
+	DigestState digestState;	// hashing needs no member at all
+	// C_SignUpdate hashes here, only the final sign goes to a member
+	HostDigest signDigest;
+	bool signHashing;
+	CKYByte signInput[DIGEST_MAX_SIGN_INPUT];
+	CKYSize signInputLen;		// 0 until the digest is finished
+	PoolSession(CK_SESSION_HANDLE s, Session::Type t) : suffix(s), type(t),
+		nextFound(0), signHashing(false), signInputLen(0) {
+	    for (int i=0; i < PoolCryptOps; i++) {
+		crypt[i].active = false;
+		crypt[i].key = 0;
+	    }
+	}
+    };
+
+    Log *log;
+    OSLock lock;		// members, sessions, handles and the pin
+    bool formed;
+    std::string signature;	// what every member must carry
+    std::vector<Member *> members;
+    std::vector<Member *> retired; // dropped while busy, freed at the end
+    std::map<std::string, CK_OBJECT_HANDLE> poolHandles;
+    CK_OBJECT_HANDLE poolHandleCounter;
+    std::vector<PoolSession> sessions;
+    CK_SESSION_HANDLE sessionHandleCounter;
+    unsigned int nextMember;	// round robin between equally busy members
+    PinCache pinCache;
+    CK_USER_TYPE pinUser;
+
+    static std::string objectKey(const PKCS11Object &object);
+    static std::string tokenSignature(Slot *slot);
+    void mapObjects(Member *member);
+    bool attachMember(Member *member);
+    CK_RV loginMember(Member *member);
+    bool reviveMember(Member *member);
+    void retireMember(unsigned int index);
+    PoolSession *findSession(CK_SESSION_HANDLE suffix);
+    PoolSession *lockSession(CK_SESSION_HANDLE suffix);
+    Member *getLeader();
+    Member *acquireMember(CK_OBJECT_HANDLE hObject, bool needLogin,
+	std::vector<Member *>& tried, CK_OBJECT_HANDLE *memberHandle);
+    void benchMember(Member *member);
+    void releaseMember(Member *member, bool failed);
+    Member *dispatch(PoolCall &call, CK_OBJECT_HANDLE hObject,
+							bool needLogin);
+    void cryptInit(PoolCryptOp op, CK_SESSION_HANDLE suffix,
+	CK_MECHANISM_PTR pMechanism, CK_OBJECT_HANDLE hKey);
+    void crypt(PoolCryptOp op, CK_SESSION_HANDLE suffix, CK_BYTE_PTR pInput,
+	CK_ULONG ulInputLen, CK_BYTE_PTR pOutput, CK_ULONG_PTR pulOutputLen);
+    void runCrypt(PoolCryptOp op, CK_SESSION_HANDLE suffix,
+	CK_OBJECT_HANDLE hKey, const PoolMechanism &mech, CK_BYTE_PTR pInput,
+	CK_ULONG ulInputLen, CK_BYTE_PTR pOutput, CK_ULONG_PTR pulOutputLen);
+    void endCrypt(PoolCryptOp op, CK_SESSION_HANDLE suffix);
+    DigestState getDigestState(CK_SESSION_HANDLE suffix);
+    void putDigestState(CK_SESSION_HANDLE suffix, const DigestState &state);
+
+    TokenPool(const TokenPool &cpy) {} // not allowed
+    TokenPool &operator=(const TokenPool &cpy) { return *this; } // not allowed
+  public:
+    TokenPool(Log *log);
+    ~TokenPool();
+
+    // look for members among the slots. Called whenever the slot list is
+    // refreshed, once the slots have checked their tokens.
+    void update(Slot **slots, const bool *tokenIsPresent,
+						unsigned int numSlots);
+
+    // the pool slot shows up once two identical tokens have been seen
+    bool isFormed() const { return formed; }
+    bool isTokenPresent();
+
+    // a member to answer questions about mechanisms, NULL if none
+    Slot *getLeaderSlot();
+
+    CK_RV getSlotInfo(CK_SLOT_INFO_PTR pSlotInfo);
+    CK_RV getTokenInfo(CK_TOKEN_INFO_PTR pTokenInfo);
+
+    CK_SESSION_HANDLE openSession(Session::Type type);
+    void closeSession(CK_SESSION_HANDLE suffix);
+    bool isValidSession(CK_SESSION_HANDLE suffix);
+    void getSessionInfo(CK_SESSION_HANDLE suffix, CK_SESSION_INFO_PTR pInfo);
+
+    void login(CK_SESSION_HANDLE suffix, CK_USER_TYPE user,
+	CK_UTF8CHAR_PTR pPin, CK_ULONG ulPinLen);
+    void logout(CK_SESSION_HANDLE suffix);
+
+    void findObjectsInit(CK_SESSION_HANDLE suffix, CK_ATTRIBUTE_PTR pTemplate,
+	CK_ULONG ulCount);
+    void findObjects(CK_SESSION_HANDLE suffix, CK_OBJECT_HANDLE_PTR phObject,
+	CK_ULONG ulMaxObjectCount, CK_ULONG_PTR pulObjectCount);
+    void getAttributeValue(CK_SESSION_HANDLE suffix, CK_OBJECT_HANDLE hObject,
+	CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount);
+
+    void signInit(CK_SESSION_HANDLE suffix, CK_MECHANISM_PTR pMechanism,
+	CK_OBJECT_HANDLE hKey);
+    void sign(CK_SESSION_HANDLE suffix, CK_BYTE_PTR pData, CK_ULONG ulDataLen,
+	CK_BYTE_PTR pSignature, CK_ULONG_PTR pulSignatureLen);
+    void signUpdate(CK_SESSION_HANDLE suffix, CK_BYTE_PTR pPart,
+	CK_ULONG ulPartLen);
+    void signFinal(CK_SESSION_HANDLE suffix, CK_BYTE_PTR pSignature,
+	CK_ULONG_PTR pulSignatureLen);
+    void decryptInit(CK_SESSION_HANDLE suffix, CK_MECHANISM_PTR pMechanism,
+	CK_OBJECT_HANDLE hKey);
+    void decrypt(CK_SESSION_HANDLE suffix, CK_BYTE_PTR pData,
+	CK_ULONG ulDataLen, CK_BYTE_PTR pDecryptedData,
+	CK_ULONG_PTR pulDecryptedDataLen);
+
+    // public key operations don't need a login, any member will do
+    void verifyInit(CK_SESSION_HANDLE suffix, CK_MECHANISM_PTR pMechanism,
+	CK_OBJECT_HANDLE hKey);
+    void verify(CK_SESSION_HANDLE suffix, CK_BYTE_PTR pData,
+	CK_ULONG ulDataLen, CK_BYTE_PTR pSignature, CK_ULONG ulSignatureLen);
+    void encryptInit(CK_SESSION_HANDLE suffix, CK_MECHANISM_PTR pMechanism,
+	CK_OBJECT_HANDLE hKey);
+    void encrypt(CK_SESSION_HANDLE suffix, CK_BYTE_PTR pData,
+	CK_ULONG ulDataLen, CK_BYTE_PTR pEncryptedData,
+	CK_ULONG_PTR pulEncryptedDataLen);
+    void verifyRecoverInit(CK_SESSION_HANDLE suffix,
+	CK_MECHANISM_PTR pMechanism, CK_OBJECT_HANDLE hKey);
+    void verifyRecover(CK_SESSION_HANDLE suffix, CK_BYTE_PTR pSignature,
+	CK_ULONG ulSignatureLen, CK_BYTE_PTR pData, CK_ULONG_PTR pulDataLen);
+
+    void digestInit(CK_SESSION_HANDLE suffix, CK_MECHANISM_PTR pMechanism);
+    void digest(CK_SESSION_HANDLE suffix, CK_BYTE_PTR pData,
+	CK_ULONG ulDataLen, CK_BYTE_PTR pDigest, CK_ULONG_PTR pulDigestLen);
+    void digestUpdate(CK_SESSION_HANDLE suffix, CK_BYTE_PTR pPart,
+	CK_ULONG ulPartLen);
+    void digestFinal(CK_SESSION_HANDLE suffix, CK_BYTE_PTR pDigest,
+	CK_ULONG_PTR pulDigestLen);
+
+    void seedRandom(CK_SESSION_HANDLE suffix, CK_BYTE_PTR pData,
+	CK_ULONG ulDataLen);
+    void generateRandom(CK_SESSION_HANDLE suffix, CK_BYTE_PTR pData,
+	CK_ULONG ulDataLen);
+};
+
+#endif
@@ -0,0 +1,880 @@
+/* ***** BEGIN COPYRIGHT BLOCK *****
+ * Copyright (C) 2005 Red Hat, Inc.
+ * All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation version
+ * 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ * ***** END COPYRIGHT BLOCK *****/
+
+#include <string.h>
+#include "mypkcs11.h"
+#include "PKCS11Exception.h"
+#include "machdep.h"
+#include "object.h"
+#include "pubkey.h"
+
+//
+// Just enough multiprecision arithmetic for public key operations:
+// fixed size little endian arrays of 32 bit words and Montgomery
+// multiplication. Nothing secret passes through here, so there is no
+// attempt at constant time.
+//
+typedef unsigned int BNWord;
+typedef unsigned long long BNDWord;
+
+#define BN_WORD_BITS 32
+#define BN_MAX_WORDS (4096/BN_WORD_BITS + 2)
+
+static bool
+bnFromBytes(BNWord *w, unsigned int len, const CKYByte *bytes, CKYSize size)
+{
+    unsigned int i;
+
+    memset(w, 0, len * sizeof(BNWord));
+    // leading zeros don't count against the length
+    while (size && *bytes == 0) {
+	bytes++;
+	size--;
+    }
+    if (size > len * sizeof(BNWord)) {
+	return false;
+    }
+    for (i=0; i < size; i++) {
+	w[i/4] |= ((BNWord) bytes[size - 1 - i]) << (8 * (i % 4));
+    }
+    return true;
+}
+
+static void
+bnToBytes(CKYByte *bytes, CKYSize size, const BNWord *w, unsigned int len)
+{
+    for (CKYSize i=0; i < size; i++) {
+	bytes[size - 1 - i] = (i/4 < len) ? (CKYByte) (w[i/4] >> (8*(i%4))) : 0;
+    }
+}
+
+static int
+bnCmp(const BNWord *a, const BNWord *b, unsigned int len)
+{
+    while (len--) {
+	if (a[len] != b[len]) {
+	    return a[len] < b[len] ? -1 : 1;
+	}
+    }
+    return 0;
+}
+
+static bool
+bnIsZero(const BNWord *a, unsigned int len)
+{
+    while (len--) {
+	if (a[len]) {
+	    return false;
+	}
+    }
+    return true;
+}
+
+// r = a - b, returns the borrow
+static BNWord
+bnSub(BNWord *r, const BNWord *a, const BNWord *b, unsigned int len)
+{
+    BNWord borrow = 0;
+
+    for (unsigned int i=0; i < len; i++) {
+	BNDWord d = (BNDWord) a[i] - b[i] - borrow;
+	r[i] = (BNWord) d;
+	borrow = (BNWord) (d >> BN_WORD_BITS) & 1;
+    }
+    return borrow;
+}
+
+// r = a + b, returns the carry
+static BNWord
+bnAdd(BNWord *r, const BNWord *a, const BNWord *b, unsigned int len)
+{
+    BNWord carry = 0;
+
+    for (unsigned int i=0; i < len; i++) {
+	BNDWord s = (BNDWord) a[i] + b[i] + carry;
+	r[i] = (BNWord) s;
+	carry = (BNWord) (s >> BN_WORD_BITS);
+    }
+    return carry;
+}
+
+static unsigned int
+bnBits(const BNWord *a, unsigned int len)
+{
+    while (len && a[len-1] == 0) {
+	len--;
+    }
+    if (len == 0) {
+	return 0;
+    }
+    unsigned int bits = (len - 1) * BN_WORD_BITS;
+    for (BNWord top = a[len-1]; top; top >>= 1) {
+	bits++;
+    }
+    return bits;
+}
+
+static int
+bnBit(const BNWord *a, unsigned int bit)
+{
+    return (a[bit / BN_WORD_BITS] >> (bit % BN_WORD_BITS)) & 1;
+}
+
+//
+// An odd modulus and what Montgomery multiplication needs to work in it.
+// Numbers "in the Montgomery domain" are stored as aR mod m, R being
+// 2^(32*len).
+//
+class MontModulus {
+  public:
+    unsigned int len;
+    BNWord m[BN_MAX_WORDS];
+    BNWord minv;		// -1/m mod 2^32
+    BNWord one[BN_MAX_WORDS];	// R mod m, 1 in the Montgomery domain
+    BNWord rr[BN_MAX_WORDS];	// R^2 mod m, for getting into the domain
+
+    bool init(const CKYByte *bytes, CKYSize size);
+
+    void add(BNWord *r, const BNWord *a, const BNWord *b) const {
+	if (bnAdd(r, a, b, len) || bnCmp(r, m, len) >= 0) {
+	    bnSub(r, r, m, len);
+	}
+    }
+    void sub(BNWord *r, const BNWord *a, const BNWord *b) const {
+	if (bnSub(r, a, b, len)) {
+	    bnAdd(r, r, m, len);
+	}
+    }
+    // r = a*b/R mod m. r may be a or b.
+    void mul(BNWord *r, const BNWord *a, const BNWord *b) const;
+    void toMont(BNWord *r, const BNWord *a) const { mul(r, a, rr); }
+    void fromMont(BNWord *r, const BNWord *a) const {
+	BNWord plainOne[BN_MAX_WORDS];
+	memset(plainOne, 0, len * sizeof(BNWord));
+	plainOne[0] = 1;
+	mul(r, a, plainOne);
+    }
+    // r = a^e, a and r in the Montgomery domain, e big endian bytes
+    void exp(BNWord *r, const BNWord *a, const CKYByte *e, CKYSize eLen) const;
+    // r = 1/a for a prime modulus, in the Montgomery domain
+    void inverse(BNWord *r, const BNWord *a) const;
+};
+
+bool
+MontModulus::init(const CKYByte *bytes, CKYSize size)
+{
+    unsigned int i;
+
+    while (size && *bytes == 0) {
+	bytes++;
+	size--;
+    }
+    len = (size + sizeof(BNWord) - 1) / sizeof(BNWord);
+    if (len == 0 || len > BN_MAX_WORDS || (bytes[size-1] & 1) == 0) {
+	return false;
+    }
+    bnFromBytes(m, len, bytes, size);
+
+    // Newton's iteration doubles the good bits each round: 1, 2, 4 ... 32
+    BNWord inv = 1;
+    for (i=0; i < 5; i++) {
+	inv *= 2 - m[0] * inv;
+    }
+    minv = (BNWord) 0 - inv;
+
+    // R mod m and R^2 mod m by doubling
+    memset(one, 0, len * sizeof(BNWord));
+    one[0] = 1;
+    for (i=0; i < len * BN_WORD_BITS * 2; i++) {
+	if (i == len * BN_WORD_BITS) {
+	    memcpy(rr, one, len * sizeof(BNWord));
+	}
+	BNWord *x = (i < len * BN_WORD_BITS) ? one : rr;
+	if (bnAdd(x, x, x, len) || bnCmp(x, m, len) >= 0) {
+	    bnSub(x, x, m, len);
+	}
+    }
+    return true;
+}
+
+void
+MontModulus::mul(BNWord *r, const BNWord *a, const BNWord *b) const
+{
+    BNWord t[BN_MAX_WORDS + 2];
+    unsigned int i, j;
+
+    memset(t, 0, (len + 2) * sizeof(BNWord));
+    for (i=0; i < len; i++) {
+	BNDWord carry = 0;
+	BNDWord uv;
+
+	for (j=0; j < len; j++) {
+	    uv = (BNDWord) t[j] + (BNDWord) a[j] * b[i] + carry;
+	    t[j] = (BNWord) uv;
+	    carry = uv >> BN_WORD_BITS;
+	}
+	uv = (BNDWord) t[len] + carry;
+	t[len] = (BNWord) uv;
+	t[len+1] = (BNWord) (uv >> BN_WORD_BITS);
+
+	BNWord q = t[0] * minv;
+	uv = (BNDWord) t[0] + (BNDWord) q * m[0];
+	carry = uv >> BN_WORD_BITS;
+	for (j=1; j < len; j++) {
+	    uv = (BNDWord) t[j] + (BNDWord) q * m[j] + carry;
+	    t[j-1] = (BNWord) uv;
+	    carry = uv >> BN_WORD_BITS;
+	}
+	uv = (BNDWord) t[len] + carry;
+	t[len-1] = (BNWord) uv;
+	t[len] = t[len+1] + (BNWord) (uv >> BN_WORD_BITS);
+    }
+    if (t[len] || bnCmp(t, m, len) >= 0) {
+	bnSub(t, t, m, len);
+    }
+    memcpy(r, t, len * sizeof(BNWord));
+}
+
+void
+MontModulus::exp(BNWord *r, const BNWord *a, const CKYByte *e,
+							CKYSize eLen) const
+{
+    BNWord base[BN_MAX_WORDS];
+    BNWord acc[BN_MAX_WORDS];
+
+    memcpy(base, a, len * sizeof(BNWord));
+    memcpy(acc, one, len * sizeof(BNWord));
+    for (CKYSize i=0; i < eLen; i++) {
+	for (int bit=7; bit >= 0; bit--) {
+	    mul(acc, acc, acc);
+	    if ((e[i] >> bit) & 1) {
+		mul(acc, acc, base);
+	    }
+	}
+    }
+    memcpy(r, acc, len * sizeof(BNWord));
+}
+
+void
+MontModulus::inverse(BNWord *r, const BNWord *a) const
+{
+    // Fermat: a^(m-2)
+    CKYByte e[BN_MAX_WORDS * sizeof(BNWord)];
+    CKYSize eLen = len * sizeof(BNWord);
+    BNWord two[BN_MAX_WORDS];
+    BNWord mm2[BN_MAX_WORDS];
+
+    memset(two, 0, len * sizeof(BNWord));
+    two[0] = 2;
+    bnSub(mm2, m, two, len);
+    bnToBytes(e, eLen, mm2, len);
+    exp(r, a, e, eLen);
+}
+
+//
+// The curves our cards carry. All have a = -3.
+//
+struct ECCurve {
+    const CKYByte *oid;		// DER encoded, as in CKA_EC_PARAMS
+    CKYSize oidLen;
+    CKYSize size;		// bytes in a field element and in the order
+    const char *p;
+    const char *n;
+    const char *b;
+    const char *gx;
+    const char *gy;
+};
+
+static const CKYByte oidP256[] =
+	{ 0x06, 0x08, 0x2a, 0x86, 0x48, 0xce, 0x3d, 0x03, 0x01, 0x07 };
+static const CKYByte oidP384[] = { 0x06, 0x05, 0x2b, 0x81, 0x04, 0x00, 0x22 };
+static const CKYByte oidP521[] = { 0x06, 0x05, 0x2b, 0x81, 0x04, 0x00, 0x23 };
+
+static const ECCurve curves[] = {
+    { oidP256, sizeof(oidP256), 32,
+	"FFFFFFFF00000001000000000000000000000000FFFFFFFFFFFFFFFFFFFFFFFF",
+	"FFFFFFFF00000000FFFFFFFFFFFFFFFFBCE6FAADA7179E84F3B9CAC2FC632551",
+	"5AC635D8AA3A93E7B3EBBD55769886BC651D06B0CC53B0F63BCE3C3E27D2604B",
+	"6B17D1F2E12C4247F8BCE6E563A440F277037D812DEB33A0F4A13945D898C296",
+	"4FE342E2FE1A7F9B8EE7EB4A7C0F9E162BCE33576B315ECECBB6406837BF51F5" },
+    { oidP384, sizeof(oidP384), 48,
+	"FFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFE"
+	"FFFFFFFF0000000000000000FFFFFFFF",
+	"FFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFC7634D81F4372DDF"
+	"581A0DB248B0A77AECEC196ACCC52973",
+	"B3312FA7E23EE7E4988E056BE3F82D19181D9C6EFE8141120314088F5013875A"
+	"C656398D8A2ED19D2A85C8EDD3EC2AEF",
+	"AA87CA22BE8B05378EB1C71EF320AD746E1D3B628BA79B9859F741E082542A38"
+	"5502F25DBF55296C3A545E3872760AB7",
+	"3617DE4A96262C6F5D9E98BF9292DC29F8F41DBD289A147CE9DA3113B5F0B8C0"
+	"0A60B1CE1D7E819D7A431D7C90EA0E5F" },
+    { oidP521, sizeof(oidP521), 66,
+	"01FFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFF"
+	"FFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFF",
+	"01FFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFF"
+	"FA51868783BF2F966B7FCC0148F709A5D03BB5C9B8899C47AEBB6FB71E91386409",
+	"0051953EB9618E1C9A1F929A21A0B68540EEA2DA725B99B315F3B8B489918EF1"
+	"09E156193951EC7E937B1652C0BD3BB1BF073573DF883D2C34F1EF451FD46B503F00",
+	"00C6858E06B70404E9CD9E3ECB662395B4429C648139053FB521F828AF606B4D"
+	"3DBAA14B5E77EFE75928FE1DC127A2FFA8DE3348B3C1856A429BF97E7E31C2E5BD66",
+	"011839296A789A3BC0045C8A5FB42C7D1BD998F54449579B446817AFBD17273E"
+	"662C97EE72995EF42640C550B9013FAD0761353C7086A272C24088BE94769FD16650" }
+};
+
+static const unsigned int numCurves = sizeof(curves)/sizeof(curves[0]);
+
+static CKYByte
+hexValue(char c)
+{
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return c - 'a' + 10;
+}
+
+static void
+hexToWords(BNWord *w, unsigned int len, const char *hex)
+{
+    CKYByte bytes[BN_MAX_WORDS * sizeof(BNWord)];
+    CKYSize size = strlen(hex) / 2;
+
+    for (CKYSize i=0; i < size; i++) {
+	bytes[i] = (hexValue(hex[2*i]) << 4) | hexValue(hex[2*i+1]);
+    }
+    bnFromBytes(w, len, bytes, size);
+}
+
+static void
+hexToModulus(MontModulus *mod, const char *hex)
+{
+    CKYByte bytes[BN_MAX_WORDS * sizeof(BNWord)];
+    CKYSize size = strlen(hex) / 2;
+
+    for (CKYSize i=0; i < size; i++) {
+	bytes[i] = (hexValue(hex[2*i]) << 4) | hexValue(hex[2*i+1]);
+    }
+    mod->init(bytes, size);
+}
+
+//
+// Jacobian coordinates over the field, Montgomery domain. Z = 0 is the
+// point at infinity.
+//
+struct ECPoint {
+    BNWord x[BN_MAX_WORDS];
+    BNWord y[BN_MAX_WORDS];
+    BNWord z[BN_MAX_WORDS];
+};
+
+static void
+ecDouble(const MontModulus &f, ECPoint *r, const ECPoint *p)
+{
+    BNWord delta[BN_MAX_WORDS], gamma[BN_MAX_WORDS], beta[BN_MAX_WORDS];
+    BNWord alpha[BN_MAX_WORDS], t1[BN_MAX_WORDS], t2[BN_MAX_WORDS];
+    unsigned int len = f.len;
+
+    if (bnIsZero(p->z, len)) {
+	*r = *p;
+	return;
+    }
+    // dbl-2001-b, a = -3
+    f.mul(delta, p->z, p->z);
+    f.mul(gamma, p->y, p->y);
+    f.mul(beta, p->x, gamma);
+    f.sub(t1, p->x, delta);
+    f.add(t2, p->x, delta);
+    f.mul(alpha, t1, t2);
+    f.add(t1, alpha, alpha);
+    f.add(alpha, t1, alpha);
+    // Z3 = (Y1+Z1)^2 - gamma - delta
+    f.add(t1, p->y, p->z);
+    f.mul(t1, t1, t1);
+    f.sub(t1, t1, gamma);
+    f.sub(r->z, t1, delta);
+    // X3 = alpha^2 - 8*beta
+    f.add(t2, beta, beta);
+    f.add(t2, t2, t2);		// 4*beta
+    f.add(t1, t2, t2);		// 8*beta
+    f.mul(r->x, alpha, alpha);
+    f.sub(r->x, r->x, t1);
+    // Y3 = alpha*(4*beta - X3) - 8*gamma^2
+    f.sub(t2, t2, r->x);
+    f.mul(t2, alpha, t2);
+    f.mul(gamma, gamma, gamma);
+    f.add(gamma, gamma, gamma);
+    f.add(gamma, gamma, gamma);
+    f.add(gamma, gamma, gamma);
+    f.sub(r->y, t2, gamma);
+}
+
+static void
+ecAdd(const MontModulus &f, ECPoint *r, const ECPoint *p, const ECPoint *q)
+{
+    BNWord z1z1[BN_MAX_WORDS], z2z2[BN_MAX_WORDS], u1[BN_MAX_WORDS];
+    BNWord u2[BN_MAX_WORDS], s1[BN_MAX_WORDS], s2[BN_MAX_WORDS];
+    BNWord h[BN_MAX_WORDS], i[BN_MAX_WORDS], j[BN_MAX_WORDS];
+    BNWord rr[BN_MAX_WORDS], v[BN_MAX_WORDS], t[BN_MAX_WORDS];
+    unsigned int len = f.len;
+
+    if (bnIsZero(p->z, len)) {
+	*r = *q;
+	return;
+    }
+    if (bnIsZero(q->z, len)) {
+	*r = *p;
+	return;
+    }
+    // add-2007-bl
+    f.mul(z1z1, p->z, p->z);
+    f.mul(z2z2, q->z, q->z);
+    f.mul(u1, p->x, z2z2);
+    f.mul(u2, q->x, z1z1);
+    f.mul(s1, p->y, q->z);
+    f.mul(s1, s1, z2z2);
+    f.mul(s2, q->y, p->z);
+    f.mul(s2, s2, z1z1);
+    f.sub(h, u2, u1);
+    f.sub(rr, s2, s1);
+    if (bnIsZero(h, len)) {
+	if (bnIsZero(rr, len)) {
+	    ecDouble(f, r, p);
+	} else {
+	    memset(r->z, 0, len * sizeof(BNWord));
+	}
+	return;
+    }
+    f.add(rr, rr, rr);
+    f.add(i, h, h);
+    f.mul(i, i, i);
+    f.mul(j, h, i);
+    f.mul(v, u1, i);
+    // Z3 = ((Z1+Z2)^2 - Z1Z1 - Z2Z2) * H, before X and Y since r may be p
+    f.add(t, p->z, q->z);
+    f.mul(t, t, t);
+    f.sub(t, t, z1z1);
+    f.sub(t, t, z2z2);
+    f.mul(r->z, t, h);
+    // X3 = r^2 - J - 2V
+    f.mul(t, rr, rr);
+    f.sub(t, t, j);
+    f.sub(t, t, v);
+    f.sub(r->x, t, v);
+    // Y3 = r*(V - X3) - 2*S1*J
+    f.sub(t, v, r->x);
+    f.mul(t, rr, t);
+    f.mul(s1, s1, j);
+    f.add(s1, s1, s1);
+    f.sub(r->y, t, s1);
+}
+
+static const ECCurve *
+findCurve(const CKYBuffer *params)
+{
+    for (unsigned int i=0; i < numCurves; i++) {
+	if (CKYBuffer_DataIsEqual(params, curves[i].oid, curves[i].oidLen)) {
+	    return &curves[i];
+	}
+    }
+    return NULL;
+}
+
+HostPublicKey::HostPublicKey(const PKCS11Object *key) :
+	keyType(PKCS11Object::unknown), curve(NULL)
+{
+    CKYBuffer_InitEmpty(&modulus);
+    CKYBuffer_InitEmpty(&exponent);
+    CKYBuffer_InitEmpty(&point);
+
+    const CKYBuffer *mod = key->getAttribute(CKA_MODULUS);
+    const CKYBuffer *exp = key->getAttribute(CKA_PUBLIC_EXPONENT);
+    const CKYBuffer *ecPoint = key->getAttribute(CKA_EC_POINT);
+    const CKYBuffer *ecParams = key->getAttribute(CKA_EC_PARAMS);
+
+    if (mod && exp && CKYBuffer_Size(mod) && CKYBuffer_Size(exp)) {
+	const CKYByte *data = CKYBuffer_Data(mod);
+	CKYSize size = CKYBuffer_Size(mod);
+
+	while (size && *data == 0) {
+	    data++;
+	    size--;
+	}
+	if (size == 0 || size > 4096/8 || (data[size-1] & 1) == 0) {
+	    throw PKCS11Exception(CKR_KEY_TYPE_INCONSISTENT,
+				"Unusable RSA modulus\n");
+	}
+	CKYBuffer_Replace(&modulus, 0, data, size);
+	CKYBuffer_Replace(&exponent, 0, CKYBuffer_Data(exp),
+						CKYBuffer_Size(exp));
+	keyType = PKCS11Object::rsa;
+	return;
+    }
+    if (ecPoint && ecParams) {
+	curve = findCurve(ecParams);
+	if (curve == NULL) {
+	    throw PKCS11Exception(CKR_KEY_TYPE_INCONSISTENT,
+				"Unsupported EC curve\n");
+	}
+	const CKYByte *data = CKYBuffer_Data(ecPoint);
+	CKYSize size = CKYBuffer_Size(ecPoint);
+	// either the bare point or the DER OCTET STRING around it
+	if (size != 1 + 2*curve->size && size > 2 && data[0] == 0x04) {
+	    CKYSize dataLen;
+	    const CKYByte *inner = dataStart(data, size, &dataLen, false);
+	    if (inner) {
+		data = inner;
+		size = dataLen;
+	    }
+	}
+	// we only deal in uncompressed points
+	if (size != 1 + 2*curve->size || data[0] != 0x04) {
+	    throw PKCS11Exception(CKR_KEY_TYPE_INCONSISTENT,
+				"Unusable EC point\n");
+	}
+	CKYBuffer_Replace(&point, 0, data + 1, size - 1);
+	keyType = PKCS11Object::ecc;
+	return;
+    }
+    throw PKCS11Exception(CKR_KEY_TYPE_INCONSISTENT,
+				"Key has no public values\n");
+}
+
+HostPublicKey::~HostPublicKey()
+{
+    CKYBuffer_FreeData(&modulus);
+    CKYBuffer_FreeData(&exponent);
+    CKYBuffer_FreeData(&point);
+}
+
+void
+HostPublicKey::checkMechanism(CK_MECHANISM_TYPE mech,
+					CK_ATTRIBUTE_TYPE use) const
+{
+    switch (keyType) {
+    case PKCS11Object::rsa:
+	if (mech == CKM_RSA_PKCS || mech == CKM_RSA_X_509) {
+	    return;
+	}
+	break;
+    case PKCS11Object::ecc:
+	if (mech == CKM_ECDSA && use == CKA_VERIFY) {
+	    return;
+	}
+	break;
+    default:
+	break;
+    }
+    throw PKCS11Exception(CKR_MECHANISM_INVALID);
+}
+
+CKYSize
+HostPublicKey::getOutputSize() const
+{
+    if (keyType == PKCS11Object::ecc) {
+	return 2 * curve->size;
+    }
+    return CKYBuffer_Size(&modulus);
+}
+
+//
+// out = in^e mod n, modulus sized. in must already be less than n.
+//
+void
+HostPublicKey::rsaPublic(CKYBuffer *out, const CKYByte *in,
+						CKYSize inLen) const
+{
+    MontModulus n;
+    BNWord x[BN_MAX_WORDS];
+    CKYSize size = CKYBuffer_Size(&modulus);
+
+    if (!n.init(CKYBuffer_Data(&modulus), size)) {
+	throw PKCS11Exception(CKR_KEY_TYPE_INCONSISTENT);
+    }
+    if (!bnFromBytes(x, n.len, in, inLen) || bnCmp(x, n.m, n.len) >= 0) {
+	throw PKCS11Exception(CKR_DATA_LEN_RANGE);
+    }
+    n.toMont(x, x);
+    n.exp(x, x, CKYBuffer_Data(&exponent), CKYBuffer_Size(&exponent));
+    n.fromMont(x, x);
+
+    CKYBuffer_Resize(out, size);
+    bnToBytes((CKYByte *)CKYBuffer_Data(out), size, x, n.len);
+}
+
+void
+HostPublicKey::encrypt(CK_MECHANISM_TYPE mech, const CKYByte *in,
+				CKYSize inLen, CKYBuffer *out) const
+{
+    CKYSize k = CKYBuffer_Size(&modulus);
+    CKYBuffer block;
+
+    checkMechanism(mech, CKA_ENCRYPT);
+    if (mech == CKM_RSA_X_509) {
+	if (inLen > k) {
+	    throw PKCS11Exception(CKR_DATA_LEN_RANGE);
+	}
+	rsaPublic(out, in, inLen);
+	return;
+    }
+
+    // PKCS #1 v1.5 block type 2: 00 02 <nonzero random> 00 data
+    if (inLen + 11 > k) {
+	throw PKCS11Exception(CKR_DATA_LEN_RANGE);
+    }
+    CKYBuffer_InitFromLen(&block, k);
+    CKYByte *em = (CKYByte *)CKYBuffer_Data(&block);
+    CKYSize padLen = k - 3 - inLen;
+    em[0] = 0;
+    em[1] = 2;
+    if (!OSRandom(em + 2, padLen)) {
+	CKYBuffer_FreeData(&block);
+	throw PKCS11Exception(CKR_DEVICE_ERROR,
+				"No random source for padding\n");
+    }
+    for (CKYSize i=0; i < padLen; i++) {
+	while (em[2+i] == 0) {
+	    if (!OSRandom(em + 2 + i, 1)) {
+		CKYBuffer_FreeData(&block);
+		throw PKCS11Exception(CKR_DEVICE_ERROR,
+				"No random source for padding\n");
+	    }
+	}
+    }
+    em[2 + padLen] = 0;
+    memcpy(em + 3 + padLen, in, inLen);
+    try {
+	rsaPublic(out, em, k);
+    } catch (PKCS11Exception &) {
+	CKYBuffer_Zero(&block);
+	CKYBuffer_FreeData(&block);
+	throw;
+    }
+    CKYBuffer_Zero(&block);
+    CKYBuffer_FreeData(&block);
+}
+
+void
+HostPublicKey::verifyRecover(CK_MECHANISM_TYPE mech, const CKYByte *sig,
+				CKYSize sigLen, CKYBuffer *out) const
+{
+    CKYSize k = CKYBuffer_Size(&modulus);
+    CKYBuffer block;
+
+    checkMechanism(mech, CKA_VERIFY_RECOVER);
+    if (sigLen != k) {
+	throw PKCS11Exception(CKR_SIGNATURE_LEN_RANGE);
+    }
+    CKYBuffer_InitEmpty(&block);
+    try {
+	rsaPublic(&block, sig, sigLen);
+    } catch (PKCS11Exception &e) {
+	CKYBuffer_FreeData(&block);
+	throw PKCS11Exception(e.getCRV() == CKR_DATA_LEN_RANGE ?
+				CKR_SIGNATURE_INVALID : e.getCRV());
+    }
+    if (mech == CKM_RSA_X_509) {
+	CKYBuffer_Replace(out, 0, CKYBuffer_Data(&block), k);
+	CKYBuffer_FreeData(&block);
+	return;
+    }
+
+    // PKCS #1 v1.5 block type 1: 00 01 FF..FF 00 data, at least 8 FFs
+    const CKYByte *em = CKYBuffer_Data(&block);
+    CKYSize i = 2;
+    bool good = (k > 11) && em[0] == 0 && em[1] == 1;
+    while (good && i < k && em[i] == 0xff) {
+	i++;
+    }
+    good = good && i >= 10 && i < k && em[i] == 0;
+    if (!good) {
+	CKYBuffer_FreeData(&block);
+	throw PKCS11Exception(CKR_SIGNATURE_INVALID);
+    }
+    i++;
+    CKYBuffer_Resize(out, 0);
+    CKYBuffer_AppendData(out, em + i, k - i);
+    CKYBuffer_FreeData(&block);
+}
+
+void
+HostPublicKey::verify(CK_MECHANISM_TYPE mech, const CKYByte *data,
+	CKYSize dataLen, const CKYByte *sig, CKYSize sigLen) const
+{
+    checkMechanism(mech, CKA_VERIFY);
+    if (keyType == PKCS11Object::ecc) {
+	if (!ecdsaVerify(data, dataLen, sig, sigLen)) {
+	    throw PKCS11Exception(CKR_SIGNATURE_INVALID);
+	}
+	return;
+    }
+
+    CKYSize k = CKYBuffer_Size(&modulus);
+    CKYBuffer recovered;
+    bool good;
+
+    if (mech == CKM_RSA_X_509 ? dataLen > k : dataLen + 11 > k) {
+	throw PKCS11Exception(CKR_DATA_LEN_RANGE);
+    }
+    CKYBuffer_InitEmpty(&recovered);
+    try {
+	verifyRecover(mech, sig, sigLen, &recovered);
+    } catch (PKCS11Exception &) {
+	CKYBuffer_FreeData(&recovered);
+	throw;
+    }
+    if (mech == CKM_RSA_X_509) {
+	// raw: the data is the block, short data has leading zeros
+	const CKYByte *em = CKYBuffer_Data(&recovered);
+	CKYSize i;
+	good = true;
+	for (i=0; i < k - dataLen; i++) {
+	    good = good && em[i] == 0;
+	}
+	good = good && memcmp(em + i, data, dataLen) == 0;
+    } else {
+	good = CKYBuffer_DataIsEqual(&recovered, data, dataLen);
+    }
+    CKYBuffer_FreeData(&recovered);
+    if (!good) {
+	throw PKCS11Exception(CKR_SIGNATURE_INVALID);
+    }
+}
+
+//
+// ECDSA verification. sig is r || s, each the size of the order, which
+// is what C_Sign returns for CKM_ECDSA.
+//
+bool
+HostPublicKey::ecdsaVerify(const CKYByte *hash, CKYSize hashLen,
+			const CKYByte *sig, CKYSize sigLen) const
+{
+    MontModulus p, n;
+    BNWord r[BN_MAX_WORDS], s[BN_MAX_WORDS], e[BN_MAX_WORDS];
+    BNWord w[BN_MAX_WORDS], u1[BN_MAX_WORDS], u2[BN_MAX_WORDS];
+    BNWord t1[BN_MAX_WORDS], t2[BN_MAX_WORDS];
+    ECPoint g, q, gq, acc;
+    CKYSize size = curve->size;
+    unsigned int len, i;
+
+    if (sigLen != 2 * size) {
+	throw PKCS11Exception(CKR_SIGNATURE_LEN_RANGE);
+    }
+    hexToModulus(&p, curve->p);
+    hexToModulus(&n, curve->n);
+    len = p.len;
+
+    // 0 < r, s < n
+    bnFromBytes(r, n.len, sig, size);
+    bnFromBytes(s, n.len, sig + size, size);
+    if (bnIsZero(r, n.len) || bnIsZero(s, n.len) ||
+	bnCmp(r, n.m, n.len) >= 0 || bnCmp(s, n.m, n.len) >= 0) {
+	return false;
+    }
+
+    // e is the leftmost bits of the hash, as many as the order has
+    unsigned int nBits = bnBits(n.m, n.len);
+    CKYSize eLen = hashLen;
+    if (eLen * 8 > nBits) {
+	eLen = (nBits + 7) / 8;
+    }
+    bnFromBytes(e, n.len, hash, eLen);
+    if (eLen * 8 > nBits) {
+	// shift out the extra low bits of the last byte taken
+	unsigned int shift = eLen * 8 - nBits;
+	for (i=0; i < n.len; i++) {
+	    e[i] = (e[i] >> shift) |
+		(i + 1 < n.len ? e[i+1] << (BN_WORD_BITS - shift) : 0);
+	}
+    }
+    if (bnCmp(e, n.m, n.len) >= 0) {
+	bnSub(e, e, n.m, n.len);
+    }
+
+    // w = 1/s, u1 = e*w, u2 = r*w. Multiplying a plain number by one in
+    // the Montgomery domain gives a plain result.
+    n.toMont(w, s);
+    n.inverse(w, w);
+    n.mul(u1, e, w);
+    n.mul(u2, r, w);
+
+    // the key must be a point on the curve: y^2 = x^3 - 3x + b
+    if (!bnFromBytes(q.x, len, CKYBuffer_Data(&point), size) ||
+	!bnFromBytes(q.y, len, CKYBuffer_Data(&point) + size, size) ||
+	bnCmp(q.x, p.m, len) >= 0 || bnCmp(q.y, p.m, len) >= 0) {
+	throw PKCS11Exception(CKR_KEY_TYPE_INCONSISTENT);
+    }
+    p.toMont(q.x, q.x);
+    p.toMont(q.y, q.y);
+    memcpy(q.z, p.one, len * sizeof(BNWord));
+    hexToWords(t2, len, curve->b);
+    p.toMont(t2, t2);
+    p.mul(t1, q.x, q.x);
+    p.mul(t1, t1, q.x);
+    p.add(t1, t1, t2);
+    p.sub(t1, t1, q.x);
+    p.sub(t1, t1, q.x);
+    p.sub(t1, t1, q.x);
+    p.mul(t2, q.y, q.y);
+    if (bnCmp(t1, t2, len) != 0) {
+	throw PKCS11Exception(CKR_KEY_TYPE_INCONSISTENT,
+				"EC public key is not on the curve\n");
+    }
+
+    hexToWords(g.x, len, curve->gx);
+    hexToWords(g.y, len, curve->gy);
+    p.toMont(g.x, g.x);
+    p.toMont(g.y, g.y);
+    memcpy(g.z, p.one, len * sizeof(BNWord));
+
+    // u1*G + u2*Q in one pass (Shamir's trick)
+    ecAdd(p, &gq, &g, &q);
+    memset(&acc, 0, sizeof(acc));
+    unsigned int bits = bnBits(u1, n.len);
+    unsigned int bits2 = bnBits(u2, n.len);
+    if (bits2 > bits) {
+	bits = bits2;
+    }
+    while (bits--) {
+	ecDouble(p, &acc, &acc);
+	int b1 = bnBit(u1, bits);
+	int b2 = bnBit(u2, bits);
+	if (b1 && b2) {
+	    ecAdd(p, &acc, &acc, &gq);
+	} else if (b1) {
+	    ecAdd(p, &acc, &acc, &g);
+	} else if (b2) {
+	    ecAdd(p, &acc, &acc, &q);
+	}
+    }
+    if (bnIsZero(acc.z, len)) {
+	return false;
+    }
+
+    // affine x = X/Z^2, then compare x mod n with r
+    p.inverse(t1, acc.z);
+    p.mul(t1, t1, t1);
+    p.mul(t1, acc.x, t1);
+    p.fromMont(t1, t1);
+    memset(t2, 0, sizeof(t2));
+    memcpy(t2, n.m, n.len * sizeof(BNWord));
+    if (bnCmp(t1, t2, len) >= 0) {
+	bnSub(t1, t1, t2, len);
+    }
+    memset(t2, 0, sizeof(t2));
+    memcpy(t2, r, n.len * sizeof(BNWord));
+    return bnCmp(t1, t2, len) == 0;
+}
@@ -0,0 +1,77 @@
+/* ***** BEGIN COPYRIGHT BLOCK *****
+ * Copyright (C) 2005 Red Hat, Inc.
+ * All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation version
+ * 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ * ***** END COPYRIGHT BLOCK *****/
+
+#ifndef COOLKEY_PUBKEY_H
+#define COOLKEY_PUBKEY_H
+
+#include "mypkcs11.h"
+#include "cky_base.h"
+#include "object.h"
+
+//
+// Host side public key operations. Verifying a signature or encrypting
+// to a key only needs the public half, which was parsed out of the
+// certificates and key objects when the token was loaded, so none of
+// this goes near the card. RSA public operations, PKCS #1 v1.5
+// encryption and ECDSA verification on P-256, P-384 and P-521.
+//
+// Errors are thrown as PKCS11Exceptions with the CK_RV C_Verify or
+// C_Encrypt should return.
+//
+struct ECCurve;
+
+class HostPublicKey {
+  private:
+    PKCS11Object::KeyType keyType;
+    CKYBuffer modulus;		// RSA, big endian, no leading zeros
+    CKYBuffer exponent;
+    const ECCurve *curve;	// ECC
+    CKYBuffer point;		// ECC, X || Y each a field element long
+
+    void rsaPublic(CKYBuffer *out, const CKYByte *in, CKYSize inLen) const;
+    bool ecdsaVerify(const CKYByte *hash, CKYSize hashLen,
+				const CKYByte *sig, CKYSize sigLen) const;
+
+    HostPublicKey(const HostPublicKey &) { } // not allowed
+    HostPublicKey &operator=(const HostPublicKey &) { return *this; }
+  public:
+    // pulls the public values out of a public key object. Throws
+    // CKR_KEY_TYPE_INCONSISTENT if it doesn't carry any we can use.
+    HostPublicKey(const PKCS11Object *key);
+    ~HostPublicKey();
+
+    PKCS11Object::KeyType getKeyType() const { return keyType; }
+
+    // throws CKR_MECHANISM_INVALID unless mech works with this key for
+    // the given use (CKA_ENCRYPT, CKA_VERIFY or CKA_VERIFY_RECOVER)
+    void checkMechanism(CK_MECHANISM_TYPE mech, CK_ATTRIBUTE_TYPE use) const;
+
+    // length of an encryption result or a signature in bytes
+    CKYSize getOutputSize() const;
+
+    void encrypt(CK_MECHANISM_TYPE mech, const CKYByte *in, CKYSize inLen,
+						CKYBuffer *out) const;
+    // returns quietly if the signature is good
+    void verify(CK_MECHANISM_TYPE mech, const CKYByte *data, CKYSize dataLen,
+				const CKYByte *sig, CKYSize sigLen) const;
+    void verifyRecover(CK_MECHANISM_TYPE mech, const CKYByte *sig,
+				CKYSize sigLen, CKYBuffer *out) const;
+};
+
+#endif
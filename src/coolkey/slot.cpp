@@ -27,6 +27,9 @@
 #include "slot.h"
 #include "zlib.h"
 #include "params.h"
+#include "trace.h"
+#include "pool.h"
+#include "pubkey.h"
 
 #include "machdep.h"
 
@@ -92,12 +95,17 @@ SlotList::SlotList(Log *log_) : log(log_)
     // initialize things to NULL so we can recover from an exception
     slots = NULL;
     numSlots = 0;
+    slotCapacity = 0;
     readerStates = NULL;
     numReaders = 0;
     context = NULL;
+    pool = NULL;
     shuttingDown  = FALSE;
 
     try {
+	if (getenv("COOL_KEY_TOKEN_POOL") != NULL) {
+	    pool = new TokenPool(log);
+	}
 
         context = CKYCardContext_Create(SCARD_SCOPE_USER);
         if( context == NULL) {
@@ -106,6 +114,7 @@ SlotList::SlotList(Log *log_) : log(log_)
         }
 	updateSlotList();
     } catch( PKCS11Exception &) {
+	delete pool;
         CKYCardContext_Destroy(context);
 	if (readerStates) {
 	    CKYReader_DestroyArray(readerStates, numReaders);
@@ -116,6 +125,9 @@ SlotList::SlotList(Log *log_) : log(log_)
 
 SlotList::~SlotList()
 {
+    // the pool holds sessions on the slots, so it goes first
+    delete pool;
+    pool = NULL;
     if( slots ) {
         assert( numSlots > 0 );
         for( unsigned int i=0; i < numSlots; ++i ) {
@@ -124,6 +136,7 @@ SlotList::~SlotList()
         delete [] slots;
         slots = NULL;
         numSlots = 0;
+        slotCapacity = 0;
     }
     if (readerStates) {
 	CKYReader_DestroyArray(readerStates, numReaders);
@@ -142,6 +155,24 @@ SlotList::shutdown()
    CKYCardContext_Cancel(context);
 }
 
+//
+// The PC/SC context and card handles we inherited are the parent's. Using
+// them would interleave our requests with the parent's on the same
+// connection, and releasing them would pull them out from under the
+// parent. Drop them quietly, new ones are made as they are needed. The
+// tokens we loaded stay and are checked against the cards as each slot
+// is next used.
+//
+void
+SlotList::afterFork()
+{
+    CKYCardContext_Abandon(context);
+    for (unsigned int i=0; i < numSlots; i++) {
+	slots[i]->afterFork();
+    }
+}
+
+#define SLOT_LIST_MIN_CAPACITY 8
 void
 SlotList::updateSlotList()
 {
@@ -163,38 +194,61 @@ SlotList::updateSlotList()
 			"Reader and slot count inconsistant\n");
     }
 
+    //
+    // The slot array grows in chunks, so readers showing up one at a time
+    // don't reallocate it on every change. Slots are only filled in past
+    // numSlots, which other threads don't look at until the count moves.
+    //
+    unsigned int capacity = slotCapacity;
     try {
-	newSlots = new Slot*[numReaders];
-        if (newSlots == NULL ) 
-	    throw PKCS11Exception(CKR_HOST_MEMORY);
-	memset(newSlots, 0, numReaders*sizeof(Slot*));
-
-	/* keep coverity happy, even though slot == NULL implies that
-	 * numSlots == 0 */
-	if (slots) { 
-	     memcpy(newSlots, slots, sizeof(slots[0]) * numSlots);
+	if (numReaders > slotCapacity) {
+	    if (capacity == 0) {
+		capacity = SLOT_LIST_MIN_CAPACITY;
+	    }
+	    while (capacity < numReaders) {
+		capacity *= 2;
+	    }
+	    newSlots = new Slot*[capacity];
+	    if (newSlots == NULL ) 
+		throw PKCS11Exception(CKR_HOST_MEMORY);
+	    memset(newSlots, 0, capacity*sizeof(Slot*));
+
+	    /* keep coverity happy, even though slot == NULL implies that
+	     * numSlots == 0 */
+	    if (slots) { 
+		memcpy(newSlots, slots, sizeof(slots[0]) * numSlots);
+	    }
 	}
+	Slot **fill = newSlots ? newSlots : slots;
 
 	for (unsigned int i=numSlots; i < numReaders; i++) {
-	    newSlots[i] = new
-		Slot(CKYReader_GetReaderName(&readerStates[i]), log, context);
+	    fill[i] = new
+		Slot(CKYReader_GetReaderName(&readerStates[i]), log, context,
+							slotIndexToID(i));
 	}
 
-	oldSlots = slots;
-	slots = newSlots;  // update the pointer first 
+	if (newSlots) {
+	    oldSlots = slots;
+	    slots = newSlots;  // update the pointer first 
+	    slotCapacity = capacity;
+	}
 	numSlots = numReaders; // now update the count 
 	if (oldSlots) {    // ok we can free the old value now
 	    delete [] oldSlots;
 	}
     } catch( PKCS11Exception &) {
         // Recover by deleting everything that was created.
-        if( newSlots ) {
-            assert(numSlots < numReaders );
+	Slot **fill = newSlots ? newSlots : slots;
+        assert(numSlots < numReaders );
+	if (fill) {
             for( unsigned int i=numSlots; i < numReaders; ++i ) {
-                if( newSlots[i] ) {
-                    delete newSlots[i];
+                if( fill[i] ) {
+                    delete fill[i];
+		    fill[i] = NULL;
                 }
             }
+	}
+        if( newSlots ) {
             delete [] newSlots;
         }
         readerListLock.releaseLock();
@@ -412,10 +466,12 @@ SlotList::updateReaderList()
 }
     
 
-Slot::Slot(const char *readerName_, Log *log_, CKYCardContext* context_)
-    : log(log_), readerName(NULL), personName(NULL), manufacturer(NULL),
+Slot::Slot(const char *readerName_, Log *log_, CKYCardContext* context_,
+						CK_SLOT_ID slotID_)
+    : log(log_), slotID(slotID_), readerName(NULL), personName(NULL), manufacturer(NULL),
 	tokenManufacturer(NULL),
 	slotInfoFound(false), context(context_), conn(NULL), state(UNKNOWN), 
+	driver(CardDriver::getDriver(CARD_TYPE_UNKNOWN)),
 	isVersion1Key(false), needLogin(false), fullTokenName(false), 
 	mCoolkey(false), mOldCAC(false), mCACLocalLogin(false),
 	pivContainer(-1), pivKey(-1), mECC(false), p15aid(0), p15odfAddr(0),
@@ -443,6 +499,10 @@ Slot::Slot(const char *readerName_, Log *log_, CKYCardContext* context_)
     if( conn == 0 ) {
         throw PKCS11Exception(CKR_GENERAL_ERROR);
     }
+    if (Trace::isEnabled()) {
+	CKYCardConnection_SetTrace(conn, Trace::cardTrace,
+						(void *)(size_t) slotID);
+    }
     hwVersion.major = 255;
     hwVersion.minor = 255;
 
@@ -450,6 +510,8 @@ Slot::Slot(const char *readerName_, Log *log_, CKYCardContext* context_)
     reverify = false;
     nonceValid = false;
     loggedIn = false;
+    probeLogin = false;
+    forkRevalidate = false;
     pinCache.invalidate();
     pinCache.clearPin();
     contextPinCache.invalidate();
@@ -469,6 +531,7 @@ Slot::Slot(const char *readerName_, Log *log_, CKYCardContext* context_)
     }
     CKYBuffer_InitEmpty(&cardATR);
     CKYBuffer_InitEmpty(&mCUID);
+    CKYBuffer_InitEmpty(&mCardIdentity);
     for (int i=0; i < MAX_CERT_SLOTS; i++) {
 	CKYBuffer_InitEmpty(&cardAID[i]);
     }
@@ -542,6 +605,7 @@ Slot::~Slot()
     CKYBuffer_FreeData(&nonce);
     CKYBuffer_FreeData(&cardATR);
     CKYBuffer_FreeData(&mCUID);
+    CKYBuffer_FreeData(&mCardIdentity);
     CKYBuffer_FreeData(&p15AID);
     CKYBuffer_FreeData(&p15odf);
     CKYBuffer_FreeData(&p15tokenInfo);
@@ -599,6 +663,20 @@ SlotList::getSlotList(CK_BBOOL tokenPresent, CK_SLOT_ID_PTR pSlotList,
         numPresent += tokenIsPresent[i];
     }
 
+    //
+    // the token pool, if there is one, is listed after the readers
+    //
+    unsigned int numListed = numSlots;
+    bool poolPresent = false;
+    if( pool ) {
+        pool->update(slots, tokenIsPresent, numSlots);
+        if( pool->isFormed() ) {
+            numListed++;
+            poolPresent = pool->isTokenPresent();
+            numPresent += poolPresent;
+        }
+    }
+
     //
     // now fill in the slot list if it was supplied
     //
@@ -614,6 +692,9 @@ SlotList::getSlotList(CK_BBOOL tokenPresent, CK_SLOT_ID_PTR pSlotList,
                         pSlotList[j++] = slotIndexToID(i);
                     }
                 }
+                if( poolPresent ) {
+                    pSlotList[j++] = TOKEN_POOL_SLOT_ID;
+                }
                 assert( j == numPresent );
             } else {
                 // not enough space
@@ -621,11 +702,14 @@ SlotList::getSlotList(CK_BBOOL tokenPresent, CK_SLOT_ID_PTR pSlotList,
             }
         } else {
             // all slots, even without tokens present
-            if( *pulCount >= numSlots ) {
+            if( *pulCount >= numListed ) {
                 // we have enough space to copy the slot IDs
                 for( i=0; i < numSlots; ++i ) {
                     pSlotList[i] = slotIndexToID(i);
                 }
+                if( numListed > numSlots ) {
+                    pSlotList[numSlots] = TOKEN_POOL_SLOT_ID;
+                }
             } else {
                 // not enough space
                 rv = CKR_BUFFER_TOO_SMALL;
@@ -637,12 +721,18 @@ SlotList::getSlotList(CK_BBOOL tokenPresent, CK_SLOT_ID_PTR pSlotList,
     if( tokenPresent ) {
         *pulCount = numPresent;
     } else {
-        *pulCount = numSlots;
+        *pulCount = numListed;
     }
 
     return rv;
 }
 
+TokenPool *
+SlotList::getPool(CK_SLOT_ID slotID) const
+{
+    return (slotID == TOKEN_POOL_SLOT_ID) ? pool : NULL;
+}
+
 bool
 Slot::getPIVLoginType(void)
 {
@@ -680,6 +770,7 @@ Slot::connectToToken()
     OSTime time = OSTimeNow();
 
     mCoolkey = 0;
+    driver = CardDriver::getDriver(CARD_TYPE_UNKNOWN);
     tokenFWVersion.major = 0;
     tokenFWVersion.minor = 0;
 
@@ -724,6 +815,7 @@ Slot::connectToToken()
         disconnect();
         return;
     }
+    applyATRProfile();
     log->log("time connect: connection status %d ms\n", OSTimeNow() - time);
     if( cardState & SCARD_PRESENT ) {
         state = CARD_PRESENT;
@@ -773,8 +865,51 @@ Slot::connectToToken()
     // see if the applet is selectable
 
     log->log("time connnect: Begin transaction %d ms\n", OSTimeNow() - time);
-    status = PIVApplet_Select(conn, NULL);
-    if (status = CKYSUCCESS) {
+
+    // try what this kind of card was last time first, then the rest in
+    // order. Cards of one ATR are usually all the same applet, so this
+    // saves a string of failed selects for anything but a PIV card.
+    ATRProfileMap::iterator profile =
+		atrProfiles.find(P15LoadCache::toKey(&cardATR));
+    CardType learned = profile == atrProfiles.end() ?
+				CARD_TYPE_UNKNOWN : profile->second.cardType;
+    CardType cardType = CARD_TYPE_UNKNOWN;
+
+    if (learned != CARD_TYPE_UNKNOWN) {
+	status = CardDriver::getDriver(learned)->detect(this);
+	if (status == CKYSUCCESS) {
+	    cardType = learned;
+	} else {
+	    log->log("Learned card type %d select failed 0x%x\n", learned,
+								status);
+	}
+    }
+    for (int type = CARD_TYPE_PIV; cardType == CARD_TYPE_UNKNOWN &&
+					type < CARD_TYPE_COUNT; type++) {
+	if (type == learned) {
+	    continue;
+	}
+	status = CardDriver::getDriver((CardType)type)->detect(this);
+	if (status == CKYSUCCESS) {
+	    cardType = (CardType)type;
+	} else {
+	    log->log("Card type %d select failed 0x%x\n", type, status);
+	}
+    }
+    if (cardType == CARD_TYPE_UNKNOWN) {
+	if (status == CKYSCARDERR) {
+	    log->log("Card Failure 0x%x\n",
+			CKYCardConnection_GetLastError(conn));
+	    disconnect();
+	}
+	/* Card is unknown */
+	return ;
+    }
+    atrProfiles[P15LoadCache::toKey(&cardATR)].cardType = cardType;
+    driver = CardDriver::getDriver(cardType);
+
+    switch (cardType) {
+    case CARD_TYPE_PIV:
 	/* Card is a PIV card */
 	state |= PIV_CARD | APPLET_SELECTABLE | APPLET_PERSONALIZED;
 	isVersion1Key = 0;
@@ -783,37 +918,23 @@ Slot::connectToToken()
 	mOldCAC = 0;
 	mCACLocalLogin = getPIVLoginType();
 	return;
-    }
-    status = CKYApplet_SelectCoolKeyManager(conn, NULL);
-    if (status != CKYSUCCESS) {
-	log->log("CoolKey Select failed 0x%x\n", status);
-	status = getCACAid();
-	if (status != CKYSUCCESS) {
-	    log->log("CAC Select failed 0x%x\n", status);
-	    status = getP15Params();
-	    if (status != CKYSUCCESS) {
-		if (status == CKYSCARDERR) {
-		    log->log("Card Failure 0x%x\n",
-			CKYCardConnection_GetLastError(conn));
-		    disconnect();
-		}
-		/* Card is unknown */
-		return ;
-	    }
-	    /* enable PKCS 15 */
-	    state |= P15_CARD | APPLET_SELECTABLE | APPLET_PERSONALIZED;
-	    isVersion1Key = 0;
-	    needLogin = false; /* get it from token info */
-	    mCoolkey = 0;
-	    mCACLocalLogin = false;
-	    return;
-	}
+    case CARD_TYPE_CAC:
 	state |= CAC_CARD | APPLET_SELECTABLE | APPLET_PERSONALIZED;
 	isVersion1Key = 0;
 	needLogin = true;
 	mCoolkey = 0;
 	mCACLocalLogin = false;
 	return;
+    case CARD_TYPE_P15:
+	/* enable PKCS 15 */
+	state |= P15_CARD | APPLET_SELECTABLE | APPLET_PERSONALIZED;
+	isVersion1Key = 0;
+	needLogin = false; /* get it from token info */
+	mCoolkey = 0;
+	mCACLocalLogin = false;
+	return;
+    default:
+	break;
     }
     mCoolkey = 1;
     log->log("time connect: Select Applet %d ms\n", OSTimeNow() - time);
@@ -841,6 +962,60 @@ Slot::connectToToken()
     return;
 }
     
+void
+Slot::afterFork()
+{
+    CKYCardConnection_Abandon(conn);
+    if (state & APPLET_SELECTABLE) {
+	forkRevalidate = true;
+	// the card may have been logged out while nobody was connected
+	probeLogin = true;
+    }
+}
+
+//
+// connect to the card again after a fork and see if it's the one we
+// loaded. The ATR has to match, and if we read a CUID from the card the
+// CUID has to match as well. Returns false if the token needs reloading.
+//
+bool
+Slot::reattachToToken()
+{
+    CKYStatus status;
+    unsigned long cardState;
+    CKYBuffer buf;
+    bool same;
+
+    status = CKYCardConnection_Connect(conn, readerName);
+    if (status != CKYSUCCESS) {
+	return false;
+    }
+    CKYBuffer_InitEmpty(&buf);
+    status = CKYCardConnection_GetStatus(conn, &cardState, &buf);
+    same = (status == CKYSUCCESS) && (cardState & SCARD_PRESENT) &&
+				CKYBuffer_IsEqual(&buf, &cardATR);
+    if (!same || CKYBuffer_Size(&mCUID) == 0) {
+	CKYBuffer_FreeData(&buf);
+	return same;
+    }
+
+    Transaction trans;
+    status = trans.begin(conn);
+    if (status == CKYSUCCESS) {
+	if (state & GOV_CARD) {
+	    status = CACApplet_SelectCardManager(conn, NULL);
+	} else {
+	    status = CKYApplet_SelectCardManager(conn, NULL);
+	}
+    }
+    if (status == CKYSUCCESS) {
+	status = CKYApplet_GetCUID(conn, &buf, NULL);
+    }
+    same = (status == CKYSUCCESS) && CKYBuffer_IsEqual(&buf, &mCUID);
+    CKYBuffer_FreeData(&buf);
+    return same;
+}
+
 bool
 Slot::cardStateMayHaveChanged()
 {
@@ -916,6 +1091,7 @@ Slot::getCACAid()
     for (i=0; i < MAX_CERT_SLOTS; i++) {
 	CKYBuffer_Resize(&cardAID[i],0);
     }
+    CKYBuffer_Resize(&mCardIdentity, 0);
 
     status = CACApplet_SelectCCC(conn,NULL);
     if (status != CKYSUCCESS) {
@@ -944,6 +1120,8 @@ Slot::getCACAid()
     if (status != CKYSUCCESS) {
 	goto done;
     }
+    /* the CCC carries the card identifier, we've already paid for it */
+    setCardIdentity(&vBuf);
     tlen = CKYBuffer_Size(&tBuf);
     vlen = CKYBuffer_Size(&vBuf);
 
@@ -993,6 +1171,82 @@ done:
     return status;
 }
 
+//
+// Start the connection off with what we learned the last time we saw this
+// kind of card, and remember what we learn this time.
+//
+void
+Slot::applyATRProfile()
+{
+    ATRProfileMap::iterator profile =
+		atrProfiles.find(P15LoadCache::toKey(&cardATR));
+
+    CKYCardConnection_SetMaxReadChunk(conn, profile == atrProfiles.end() ?
+					0 : profile->second.maxReadChunk);
+}
+
+void
+Slot::saveATRProfile()
+{
+    CKYByte maxReadChunk = CKYCardConnection_GetMaxReadChunk(conn);
+
+    if (CKYBuffer_Size(&cardATR) == 0 || maxReadChunk == 0) {
+	return;
+    }
+    atrProfiles[P15LoadCache::toKey(&cardATR)].maxReadChunk = maxReadChunk;
+}
+
+//
+// Reduce the card's identity object (the CAC CCC or the PIV CHUID) to
+// something that fits in the shared memory CUID field. The certs cached
+// there are only trusted if this matches, which saves reading any of the
+// certs off the card. Old CACs have no identity object and fall back to
+// comparing the first chunk of cert 0.
+//
+void
+Slot::setCardIdentity(const CKYBuffer *data)
+{
+    HostDigest digest;
+    CKYByte hash[DIGEST_MAX_SIZE];
+
+    CKYBuffer_Resize(&mCardIdentity, 0);
+    if (CKYBuffer_Size(data) == 0) {
+	return;
+    }
+    digest.init(CKM_SHA_1);
+    digest.update(CKYBuffer_Data(data), CKYBuffer_Size(data));
+    digest.final(hash);
+    CKYBuffer_Replace(&mCardIdentity, 0, hash, OBJ_CUID_SIZE);
+}
+
+//
+// The CHUID holds the card's FASC-N and GUID. One GET DATA.
+//
+void
+Slot::loadPIVIdentity()
+{
+    CKYStatus status;
+    CKYISOStatus apduRC;
+    CKYBuffer chuid;
+
+    CKYBuffer_Resize(&mCardIdentity, 0);
+    status = PIVApplet_Select(conn, NULL);
+    if (status == CKYSCARDERR) handleConnectionError();
+    if (status != CKYSUCCESS) {
+	return;
+    }
+    CKYBuffer_InitEmpty(&chuid);
+    status = PIVApplet_GetCertificate(conn, &chuid, PIV_CHUID_TAG, &apduRC);
+    if (status == CKYSCARDERR) {
+	CKYBuffer_FreeData(&chuid);
+	handleConnectionError();
+    }
+    if (status == CKYSUCCESS) {
+	setCardIdentity(&chuid);
+    }
+    CKYBuffer_FreeData(&chuid);
+}
+
 CKYStatus Slot::getP15Params()
 {
     CKYStatus status = CKYSCARDERR;
@@ -1063,62 +1317,119 @@ CKYStatus Slot::getP15Params()
     return CKYSUCCESS;
 }
 
+//
+// read more of a cached file until it holds need bytes from index on, or
+// the file ends. Reads carry on from the end of what we have when index
+// is in it, otherwise the file is started again at index.
+//
 CKYStatus
-Slot::readFromPath(const PK15ObjectPath &obj, CKYBuffer *file)
+Slot::fillCachedFile(P15LoadCache &cache, const CKYBuffer *path,
+		P15CachedFile &file, CKYOffset index, CKYSize need)
 {
     CKYStatus status;
     CKYISOStatus apduRC;
-    CKYSize bufSize;
-    CKYOffset index = obj.getIndex();
-    CKYSize length = obj.getLength();
+    CKYSize have;
+    CKYSize maxChunk;
 
-    CKYBuffer_Resize(file, 0);
-    status = selectPath(obj.getPath(), &apduRC);
-    if (status != CKYSUCCESS) {
-	return status;
+    if (index < file.start ||
+		index > file.start + CKYBuffer_Size(&file.data)) {
+	file.start = index;
+	file.atEnd = false;
+	CKYBuffer_Resize(&file.data, 0);
     }
-    status = P15Applet_ReadBinary(conn, index, 0, 0, 
-			(length >= 256)?0:length, file, &apduRC);
-    if (status != CKYSUCCESS) {
-	return status;
+    have = file.start + CKYBuffer_Size(&file.data) - index;
+    if (have >= need || file.atEnd) {
+	return CKYSUCCESS;
     }
-
-    /* if we asked for a specific length and got it, or we asked for 
-     * an indeterminate length and got less than 256 bytes, then we 
-     * got everything. */
-    bufSize = CKYBuffer_Size(file);
-    if ((length && (bufSize >= length)) || ((length == 0) && (bufSize < 256))) {
-	/* we've already got it all */
+    status = selectCachedPath(cache, path, &apduRC);
+    if (status != CKYSUCCESS) {
 	return status;
     }
-    if (bufSize < 0x82) {
-	/* make sure we have enough bytes to handle the worst case ANS.1
-         * mistake */
-	return CKYINVALIDDATA;
-    }
-    
-    if (length == 0) {
-	/* we don't yet know how long the length is, use the ASN.1 parser to
-         * find out. We lie to dataStart about actual size so that it won't
-         * fail since we know we don't have the whole buffer yet.*/
-	(void) dataStart(CKYBuffer_Data(file), 65535, &length, true);
+    maxChunk = CKYCardConnection_GetMaxReadChunk(conn);
+    if (maxChunk == 0) {
+	maxChunk = driver->getCapabilities().maxReadChunk;
     }
-    if (length > 65535) {
-	return CKYINVALIDDATA;
+    while (have < need) {
+	CKYSize bufSize = CKYBuffer_Size(&file.data);
+	CKYSize want = need - have;
+
+	if (want >= maxChunk) want = maxChunk;
+	if (file.start + bufSize > 65535) {
+	    return CKYINVALIDDATA;
+	}
+	status = P15Applet_ReadBinary(conn,
+			(unsigned short)(file.start + bufSize), 0, 0,
+			(want == 256) ? 0 : want, &file.data, &apduRC);
+	if (status != CKYSUCCESS) {
+	    /* more than the card will send at once, back off and remember
+	     * it for the rest of the files */
+	    if (apduRC == CKYISO_WRONG_LENGTH && maxChunk > 1) {
+		maxChunk /= 2;
+		CKYCardConnection_SetMaxReadChunk(conn, (CKYByte) maxChunk);
+		continue;
+	    }
+	    return status;
+	}
+	/* a short read means we hit the end of the file */
+	if (CKYBuffer_Size(&file.data) - bufSize < want) {
+	    file.atEnd = true;
+	    break;
+	}
+	have += want;
     }
-    while ((bufSize =CKYBuffer_Size(file)) < length) {
-	CKYSize tmpLength = length - bufSize;
+    return CKYSUCCESS;
+}
+
+CKYStatus
+Slot::readFromPath(const PK15ObjectPath &obj, CKYBuffer *file,
+						P15LoadCache &cache)
+{
+    CKYStatus status;
+    CKYOffset index = obj.getIndex();
+    CKYSize length = obj.getLength();
+    CKYSize have;
+    const CKYByte *data;
+
+    CKYBuffer_Resize(file, 0);
+    P15CachedFile &cached = cache.files[P15LoadCache::toKey(obj.getPath())];
 
-	if (tmpLength >= 256) tmpLength = 0;
+    status = fillCachedFile(cache, obj.getPath(), cached, index,
+					length ? length : 256);
+    if (status != CKYSUCCESS) {
+	return status;
+    }
+    have = cached.start + CKYBuffer_Size(&cached.data) - index;
+    data = CKYBuffer_Data(&cached.data) + (index - cached.start);
 
-	status = P15Applet_ReadBinary(conn, (unsigned short)(index+bufSize),
-			 0, 0, tmpLength, file, &apduRC);
+    if (length == 0) {
+	/* an indeterminate length that ends short of 256 bytes is the rest
+	 * of the file. Otherwise the ASN.1 header says how long it is. */
+	if (cached.atEnd && have < 256) {
+	    length = have;
+	} else {
+	    if (have < 0x82) {
+		/* make sure we have enough bytes to handle the worst case
+		 * ASN.1 mistake */
+		return CKYINVALIDDATA;
+	    }
+	    /* We lie to dataStart about actual size so that it won't
+	     * fail since we may not have the whole buffer yet.*/
+	    (void) dataStart(data, 65535, &length, true);
+	}
+	if (length > 65535) {
+	    return CKYINVALIDDATA;
+	}
+	status = fillCachedFile(cache, obj.getPath(), cached, index, length);
 	if (status != CKYSUCCESS) {
 	    return status;
 	}
+	have = cached.start + CKYBuffer_Size(&cached.data) - index;
+	data = CKYBuffer_Data(&cached.data) + (index - cached.start);
     }
-	
-    return CKYSUCCESS;
+    if (have < length) {
+	return CKYINVALIDDATA;
+    }
+    return CKYBuffer_AppendData(file, data, length);
 }
 
 void
@@ -1164,63 +1475,27 @@ Slot::parseEF_ODF(void)
     const CKYByte *current = CKYBuffer_Data(&p15odf);
     CKYSize size = CKYBuffer_Size(&p15odf);
     CKYBuffer files;
+    P15LoadCache cache;
+    PK15ODFEntry odfEntry;
 
     CKYBuffer_InitEmpty(&files);
 
-    while (size > 0) {
+    while (odfEntry.next(&current, &size)) {
 	const CKYByte *entry;
 	CKYSize entrySize;
-	CKYSize tagSize;
-	CKYByte type, type1;
-	PK15ObjectPath objPath;
-	bool skip;
 
-	type = current[0];
-	entry = dataStart(current, size, &entrySize, false);
-	if (entry == NULL) { break; }
-	tagSize = entry-current;
-	current += entrySize + tagSize;
-	size -= (entrySize + tagSize);
-
-	/* skip those entries we aren't going to parse */
-	skip = false;
-	switch (type) {
-	case 0xa2: skip=true; break; /* skip EF(PuKDF-trusted) */
-	case 0xa3: skip=true; break; /* skip EF(SKDF) */
-	case 0xa7: skip=true; break; /* skip EF(DODF) */
-	default: skip=true; break;
-	case 0xa0:        /* EF(PvKDF) */
-	case 0xa1:        /* EF(PuKDF) */
-	case 0xa4:        /* EF(CDF) */
-	case 0xa5:        /* EF(CDF-trusted) */
-	case 0xa6:        /* EF(CDF-useful) */
-	case 0xa8: break; /* EF(AODF) */
- 	}
-	if (skip) continue;
-
-	type1 = entry[0];
-	/* unwrap */
-	entry = dataStart(entry, entrySize, &entrySize, false);
-	if (entry == NULL) continue;
-	if (type1 == ASN1_SEQUENCE) {
-	    objPath.setObjectPath(entry, entrySize);
+	if (!odfEntry.isWanted()) continue;
+
+	if (odfEntry.isPath()) {
 	    CKYBuffer_Resize(&files, 0);
-	    readFromPath(objPath, &files);
+	    readFromPath(odfEntry.getPath(), &files, cache);
 	    entry = CKYBuffer_Data(&files);
 	    entrySize = CKYBuffer_Size(&files);
-	} else if (type1 != ASN1_CHOICE_0) {
-	    continue;
-	}
-	
-	switch (type) {
-	case 0xa0: parseEF_Directory(entry, entrySize, PK15PvKey); break;
-	case 0xa1: parseEF_Directory(entry, entrySize, PK15PuKey); break;
-	case 0xa4: parseEF_Directory(entry, entrySize, PK15Cert); break;
-	case 0xa5: parseEF_Directory(entry, entrySize, PK15Cert); break;
-	case 0xa6: parseEF_Directory(entry, entrySize, PK15Cert); break;
-	case 0xa8: parseEF_Directory(entry, entrySize, PK15AuthObj); break;
-	default: break;
+	} else {
+	    entry = odfEntry.getData();
+	    entrySize = odfEntry.getDataSize();
 	}
+	parseEF_Directory(entry, entrySize, odfEntry.getType(), cache);
     }
     CKYBuffer_FreeData(&files);
     return;
@@ -1246,28 +1521,9 @@ class ObjectCertCKAIDMatch {
     }
 };
 
-class ObjectKeyCKAIDMatch {
-  private:
-    const CKYBuffer *cka_id;
-  public:
-    ObjectKeyCKAIDMatch(const CKYBuffer *cka_id_) : cka_id(cka_id_) {}
-    bool operator()(const PKCS11Object& obj) {
-	const CKYBuffer *id;
-        const CKYBuffer *objClass;
-	CK_OBJECT_CLASS keyClass = CKO_PRIVATE_KEY;
-	objClass = obj.getAttribute(CKA_CLASS);
-        if (objClass == NULL || !CKYBuffer_DataIsEqual(objClass, 
-				(CKYByte *)&keyClass, sizeof(keyClass))) {
-	    return false;
-        }
- 	id = obj.getAttribute(CKA_ID);
-        return (id != NULL && CKYBuffer_IsEqual(id,cka_id)) ? true : false;
-    }
-};
-
 CKYStatus
 Slot::parseEF_Directory(const CKYByte *current, 
-					CKYSize size, PK15ObjectType type)
+		CKYSize size, PK15ObjectType type, P15LoadCache &cache)
 {
     CKYBuffer file;
     CKYBuffer_InitEmpty(&file);
@@ -1299,7 +1555,7 @@ Slot::parseEF_Directory(const CKYByte *current,
 	    status = CKYSUCCESS;
 	    while (obj.getState() != PK15StateComplete) {
 	        CKYBuffer_Resize(&file, 0);
-	        readFromPath(obj.getObjectPath(), &file);
+	        readFromPath(obj.getObjectPath(), &file, cache);
 		status = obj.completeObject(CKYBuffer_Data(&file), 
 						CKYBuffer_Size(&file));
 		if (status != CKYSUCCESS) {
@@ -1340,36 +1596,32 @@ Slot::parseEF_Directory(const CKYByte *current,
 	    case PK15PvKey:
 		/* does the cert already exist? */
 		{
-		    ObjectConstIter iter;
+		    std::map<std::string, ObjectIter>::iterator iter;
 		    const CKYBuffer *id;
 
 		    id = obj.getAttribute(CKA_ID);
 		    if ((!id) || (CKYBuffer_Size(id) != 1)) {
 			break;
 		    }
-		    iter = find_if(tokenObjects.begin(), tokenObjects.end(),
-                        ObjectCertCKAIDMatch(id));
-			
-		    if ( iter != tokenObjects.end() ) {
-			obj.completeKey(*iter);
+		    iter = cache.certs.find(P15LoadCache::toKey(id));
+		    if ( iter != cache.certs.end() ) {
+			obj.completeKey(*iter->second);
 		    }
 		}
 		break;
 	    case PK15Cert:
 		/* does a corresponding key already exist? */
 		{
-		    ObjectIter iter;
+		    std::map<std::string, ObjectIter>::iterator iter;
 		    const CKYBuffer *id;
 
 		    id = obj.getAttribute(CKA_ID);
 		    if ((!id) || (CKYBuffer_Size(id) != 1)) {
 			break;
 		    }
-		    iter = find_if(tokenObjects.begin(), tokenObjects.end(),
-                        ObjectKeyCKAIDMatch(id));
-			
-		    if ( iter != tokenObjects.end() ) {
-			iter->completeKey(obj);
+		    iter = cache.keys.find(P15LoadCache::toKey(id));
+		    if ( iter != cache.keys.end() ) {
+			iter->second->completeKey(obj);
 		    }
 		}
 		break;
@@ -1377,6 +1629,19 @@ Slot::parseEF_Directory(const CKYByte *current,
 		break;
 	    }
     	    tokenObjects.push_back(obj);
+	    /* remember the first key and cert with each id for pairing */
+	    {
+		const CKYBuffer *id = obj.getAttribute(CKA_ID);
+		ObjectIter added = --tokenObjects.end();
+
+		if (id && type == PK15PvKey) {
+		    cache.keys.insert(std::make_pair(
+				P15LoadCache::toKey(id), added));
+		} else if (id && type == PK15Cert) {
+		    cache.certs.insert(std::make_pair(
+				P15LoadCache::toKey(id), added));
+		}
+	    }
   	} while ( false );
     }
     CKYBuffer_FreeData(&file);
@@ -1384,6 +1649,43 @@ Slot::parseEF_Directory(const CKYByte *current,
 }
 
 
+//
+// selectPath() for a load. Selecting an EF leaves its DF current, so a
+// path in the same DF as the EF we last read only selects its last part.
+//
+CKYStatus
+Slot::selectCachedPath(P15LoadCache &cache, const CKYBuffer *path,
+						CKYISOStatus *apduRC)
+{
+    CKYSize size = CKYBuffer_Size(path);
+    CKYSize dfSize = CKYBuffer_Size(&cache.selected);
+    CKYStatus status = CKYINVALIDARGS;
+    CKYOffset pos = 0;
+
+    if (size != 0 && CKYBuffer_IsEqual(path, &cache.selected)) {
+	return CKYSUCCESS;
+    }
+    if (dfSize >= 2) {
+	dfSize -= 2;
+	if (size > dfSize && memcmp(CKYBuffer_Data(path),
+		CKYBuffer_Data(&cache.selected), dfSize) == 0) {
+	    pos = dfSize;
+	}
+    }
+    CKYBuffer_Resize(&cache.selected, 0);
+    for (; pos < size; pos += 2) {
+	unsigned short ef = CKYBuffer_GetShort(path, pos);
+	status = P15Applet_SelectFile(conn, ef, apduRC);
+	if (status != CKYSUCCESS) {
+	    return status;
+	}
+    }
+    if (status == CKYSUCCESS) {
+	CKYBuffer_AppendCopy(&cache.selected, path);
+    }
+    return status;
+}
+
 CKYStatus
 Slot::selectPath(const CKYBuffer *path, CKYISOStatus  *apduRC)
 {
@@ -1404,11 +1706,22 @@ Slot::selectPath(const CKYBuffer *path, CKYISOStatus  *apduRC)
 void
 Slot::refreshTokenState()
 {
-    if( cardStateMayHaveChanged() ) {
+    TraceSpan span("refreshTokenState", slotID);
+    bool changed;
+
+    if (forkRevalidate) {
+	forkRevalidate = false;
+	changed = !reattachToToken();
+    } else {
+	changed = cardStateMayHaveChanged();
+    }
+    if( changed ) {
         log->log("card changed\n");
 	invalidateLogin(true);
+	probeLogin = false;
         closeAllSessions();
 	unloadObjects();
+	saveATRProfile();	// for the card that just left
         connectToToken();
 
         if( state & APPLET_PERSONALIZED ) {
@@ -1421,6 +1734,7 @@ Slot::refreshTokenState()
         } else if (state & APPLET_SELECTABLE) {
 	    initEmpty();
 	}
+	saveATRProfile();
 
     }
 }
@@ -1444,7 +1758,7 @@ void
 SlotList::decomposeSessionHandle(CK_SESSION_HANDLE hSession, CK_SLOT_ID& slotID,
     SessionHandleSuffix& suffix) const
 {
-    slotID = hSession >> 24;
+    slotID = sessionHandleToSlotID(hSession);
     suffix = SessionHandleSuffix(hSession);
     try {
         validateSlotID(slotID);
@@ -1461,8 +1775,12 @@ SlotList::openSession(Session::Type type, CK_SLOT_ID slotID,
 {
     validateSlotID(slotID);
 
-    SessionHandleSuffix suffix = 
-        slots[slotIDToIndex(slotID)]->openSession(type);
+    SessionHandleSuffix suffix;
+    if( slotID == TOKEN_POOL_SLOT_ID ) {
+        suffix = pool->openSession(type);
+    } else {
+        suffix = slots[slotIDToIndex(slotID)]->openSession(type);
+    }
 
     *phSession = makeSessionHandle(slotID, suffix);
 }
@@ -1475,6 +1793,10 @@ SlotList::closeSession(CK_SESSION_HANDLE hSession)
 
     decomposeSessionHandle(hSession, slotID, suffix);
 
+    if( slotID == TOKEN_POOL_SLOT_ID ) {
+        pool->closeSession(suffix);
+        return;
+    }
     slots[slotIDToIndex(slotID)]->closeSession(suffix);
 }
     
@@ -1517,6 +1839,7 @@ Slot::closeSession(SessionHandleSuffix handleSuffix)
                 (unsigned long)handleSuffix);
     } else {
         log->log("Closed session 0x%08x\n", (unsigned long)handleSuffix);
+        releaseSessionObjects(*iter);
         sessions.erase(iter);
     }
 }
@@ -1755,6 +2078,9 @@ Slot::getTokenInfo(CK_TOKEN_INFO_PTR pTokenInfo)
 void
 SlotList::validateSlotID(CK_SLOT_ID slotID) const
 {
+    if( slotID == TOKEN_POOL_SLOT_ID && pool && pool->isFormed() ) {
+        return;
+    }
     if( slotID < 1 || slotID > numSlots ) {
         throw PKCS11Exception(CKR_SLOT_ID_INVALID);
     }
@@ -1888,31 +2214,87 @@ Slot::handleConnectionError()
     throw PKCS11Exception(ckrv);
 }
 
-list<ListObjectInfo>
-Slot::getObjectList()
+// Applets speaking protocol 1.2 or later can return a batch of object
+// records per APDU; returns false if the applet rejects the bulk command.
+bool
+Slot::getObjectListBulk(list<ListObjectInfo> &objInfoList)
 {
-    list<ListObjectInfo> objInfoList;
+    CKYAppletRespListObjects lop[CKY_LIST_OBJECTS_BULK_MAX];
+
+    if ((tokenFWVersion.major < 1) ||
+		((tokenFWVersion.major == 1) && (tokenFWVersion.minor < 2))) {
+	return false;
+    }
 
     while(true) {
-	CKYISOStatus result;
-        ListObjectInfo info;
-        CKYByte seq = objInfoList.size() == 0  ? CKY_LIST_RESET : CKY_LIST_NEXT;
-	CKYStatus status=CKYApplet_ListObjects(conn, seq,  &info.obj, &result);
+	CKYISOStatus result = 0;
+	unsigned int count = 0;
+	CKYByte seq = objInfoList.size() == 0  ? CKY_LIST_RESET : CKY_LIST_NEXT;
+	CKYStatus status = CKYApplet_ListObjectsBulk(conn, seq, lop,
+							&count, &result);
 	if (status != CKYSUCCESS) {
-	    // we failed because of a connection error
 	    if (status == CKYSCARDERR) {
 		handleConnectionError();
 	    }
-	    // we failed simply because we hit the end of the list
-	    // (in which case we are done)
-	    if ((result == CKYISO_SUCCESS)  || (result == CKYISO_SEQUENCE_END)) {
+	    // a malformed batch comes back as CKYINVALIDDATA with a 9000
+	    // status word, only the applet saying so ends the list
+	    if ((status == CKYAPDUFAIL) && (result == CKYISO_SEQUENCE_END)) {
 		break;
 	    }
-	    // we failed fror some other reason...
-  	    throw PKCS11Exception(CKR_DEVICE_ERROR);
+	    // older applet, or a bad batch; let the caller list one by one
+	    objInfoList.clear();
+	    return false;
 	}
 
-        log->log("===Object\n");
+	for (unsigned int i = 0; i < count; i++) {
+	    ListObjectInfo info;
+
+	    info.obj = lop[i];
+	    log->log("===Object\n");
+	    log->log("===id: 0x%04x\n", info.obj.objectID);
+	    log->log("===size: %d\n", info.obj.objectSize);
+	    log->log("===acl: 0x%02x,0x%02x,0x%02x\n", info.obj.readACL,
+				info.obj.writeACL, info.obj.deleteACL);
+	    log->log("\n");
+	    objInfoList.push_back(info);
+	}
+	// a short batch means the applet has nothing more to send
+	if (count < CKY_LIST_OBJECTS_BULK_MAX) {
+	    break;
+	}
+    }
+    return true;
+}
+
+list<ListObjectInfo>
+Slot::getObjectList()
+{
+    list<ListObjectInfo> objInfoList;
+
+    if (getObjectListBulk(objInfoList)) {
+	return objInfoList;
+    }
+
+    while(true) {
+	CKYISOStatus result;
+        ListObjectInfo info;
+        CKYByte seq = objInfoList.size() == 0  ? CKY_LIST_RESET : CKY_LIST_NEXT;
+	CKYStatus status=CKYApplet_ListObjects(conn, seq,  &info.obj, &result);
+	if (status != CKYSUCCESS) {
+	    // we failed because of a connection error
+	    if (status == CKYSCARDERR) {
+		handleConnectionError();
+	    }
+	    // we failed simply because we hit the end of the list
+	    // (in which case we are done)
+	    if ((result == CKYISO_SUCCESS)  || (result == CKYISO_SEQUENCE_END)) {
+		break;
+	    }
+	    // we failed fror some other reason...
+  	    throw PKCS11Exception(CKR_DEVICE_ERROR);
+	}
+
+        log->log("===Object\n");
         log->log("===id: 0x%04x\n", info.obj.objectID);
         log->log("===size: %d\n", info.obj.objectSize);
         log->log("===acl: 0x%02x,0x%02x,0x%02x\n", info.obj.readACL,
@@ -2067,16 +2449,137 @@ Slot::generateUnusedObjectHandle()
     CK_OBJECT_HANDLE handle;
     ObjectConstIter iter;
     do {
-        handle = ++objectHandleCounter;
+        objectHandleCounter = (objectHandleCounter + 1) &
+						~SESSION_OBJECT_HANDLE_FLAG;
+        handle = objectHandleCounter;
         iter = find_if(tokenObjects.begin(), tokenObjects.end(),
             ObjectHandleMatch(handle));
     } while( handle == CK_INVALID_HANDLE || iter != tokenObjects.end() );
     return handle;
 }
 
-/* Create a short lived Secret Key for ECC key derive. */
-PKCS11Object *
-Slot::createSecretKeyObject(CK_OBJECT_HANDLE handle, CKYBuffer *secretKeyBuffer, CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulAttributeCount)
+const ObjectHandleTable::Entry *
+ObjectHandleTable::getEntry(CK_OBJECT_HANDLE handle) const
+{
+    unsigned long index = handle & SESSION_OBJECT_INDEX_MASK;
+    unsigned long generation = (handle >> SESSION_OBJECT_INDEX_BITS) &
+						SESSION_OBJECT_GEN_MASK;
+
+    if( !isSessionHandle(handle) || index >= entries.size() ) {
+        return NULL;
+    }
+    const Entry *entry = &entries[index];
+    if( !entry->inUse || entry->generation != generation ) {
+        return NULL;
+    }
+    return entry;
+}
+
+CK_OBJECT_HANDLE
+ObjectHandleTable::allocate(SessionHandleSuffix owner)
+{
+    unsigned long index;
+
+    if( !freeEntries.empty() ) {
+        index = freeEntries.back();
+        freeEntries.pop_back();
+    } else {
+        if( entries.size() > SESSION_OBJECT_INDEX_MASK ) {
+            throw PKCS11Exception(CKR_HOST_MEMORY,
+                "Too many session objects\n");
+        }
+        index = entries.size();
+        entries.push_back(Entry());
+    }
+    Entry &entry = entries[index];
+    entry.owner = owner;
+    entry.inUse = true;
+    return SESSION_OBJECT_HANDLE_FLAG |
+	(entry.generation << SESSION_OBJECT_INDEX_BITS) | index;
+}
+
+void
+ObjectHandleTable::bind(CK_OBJECT_HANDLE handle, ObjectIter object)
+{
+    Entry *entry = (Entry *)getEntry(handle);
+    assert(entry != NULL);
+    entry->object = object;
+}
+
+bool
+ObjectHandleTable::lookup(CK_OBJECT_HANDLE handle, ObjectIter &object,
+	SessionHandleSuffix &owner) const
+{
+    const Entry *entry = getEntry(handle);
+    if( entry == NULL ) {
+        return false;
+    }
+    object = entry->object;
+    owner = entry->owner;
+    return true;
+}
+
+void
+ObjectHandleTable::release(CK_OBJECT_HANDLE handle)
+{
+    Entry *entry = (Entry *)getEntry(handle);
+    if( entry == NULL ) {
+        return;
+    }
+    // a new generation, so the old handle no longer finds the entry
+    entry->inUse = false;
+    entry->generation = (entry->generation + 1) & SESSION_OBJECT_GEN_MASK;
+    freeEntries.push_back(handle & SESSION_OBJECT_INDEX_MASK);
+}
+
+void
+Slot::releaseSessionObjects(Session &session)
+{
+    ObjectConstIter iter;
+    for( iter = session.objects.begin(); iter != session.objects.end();
+								++iter) {
+        sessionObjectHandles.release(iter->getHandle());
+    }
+    session.objects.clear();
+}
+
+// find a token or session object
+const PKCS11Object *
+Slot::findObject(CK_OBJECT_HANDLE hObject)
+{
+    if( ObjectHandleTable::isSessionHandle(hObject) ) {
+        ObjectIter object;
+        SessionHandleSuffix owner;
+        if( !sessionObjectHandles.lookup(hObject, object, owner) ) {
+            return NULL;
+        }
+        return &*object;
+    }
+    ObjectConstIter iter = find_if(tokenObjects.begin(), tokenObjects.end(),
+        ObjectHandleMatch(hObject));
+    if( iter == tokenObjects.end() ) {
+        return NULL;
+    }
+    return &*iter;
+}
+
+static bool
+templateIsTokenObject(CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulAttributeCount)
+{
+    for( CK_ULONG i = 0; i < ulAttributeCount; i++ ) {
+        if( pTemplate[i].type == CKA_TOKEN && pTemplate[i].pValue &&
+			pTemplate[i].ulValueLen == sizeof(CK_BBOOL) ) {
+            return *(CK_BBOOL *)pTemplate[i].pValue != FALSE;
+        }
+    }
+    return false;
+}
+
+/* Create a short lived Secret Key for ECC key derive. Unless the template
+ * asks for a token object it belongs to the session and goes away with it.
+ */
+CK_OBJECT_HANDLE
+Slot::createSecretKeyObject(SessionIter session, CKYBuffer *secretKeyBuffer, CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulAttributeCount)
 {
 
     if (secretKeyBuffer == NULL ) {
@@ -2085,16 +2588,25 @@ Slot::createSecretKeyObject(CK_OBJECT_HANDLE handle, CKYBuffer *secretKeyBuffer,
     }
 
     unsigned long muscleID = 0xfff;
-    PKCS11Object *secret =  new SecretKey(muscleID,  handle, secretKeyBuffer, pTemplate, ulAttributeCount);
+    CK_OBJECT_HANDLE handle;
 
-    if (secret == NULL) {
-        throw PKCS11Exception(CKR_DEVICE_ERROR,
-                        "Can't create secret key object for ECC.");
+    if (templateIsTokenObject(pTemplate, ulAttributeCount)) {
+        handle = generateUnusedObjectHandle();
+        tokenObjects.push_back(SecretKey(muscleID, handle, secretKeyBuffer,
+					pTemplate, ulAttributeCount));
+        return handle;
     }
 
-    tokenObjects.push_back(*secret);
-    
-    return secret;
+    handle = sessionObjectHandles.allocate(session->getHandleSuffix());
+    try {
+        session->objects.push_back(SecretKey(muscleID, handle,
+			secretKeyBuffer, pTemplate, ulAttributeCount));
+    } catch (PKCS11Exception &) {
+        sessionObjectHandles.release(handle);
+        throw;
+    }
+    sessionObjectHandles.bind(handle, --session->objects.end());
+    return handle;
 }
 
 void
@@ -2198,7 +2710,7 @@ Slot::unloadObjects()
 // shared memory is layed out as follows:
 //
 // Header:
-//  1 short  (version) shared mem layout version number (currrent 1,0)
+//  1 short  (version) shared mem layout version number (currrent 1,1)
 //  1 short  (header size) size in bytes of the shared memory header
 //  1 byte   (valid)  segment is valid or not (valid =1; not valid =0 )
 //  1 byte   (reserved) (set to zero)
@@ -2209,6 +2721,10 @@ Slot::unloadObjects()
 //  1 short  (data offset) offset to the uncompressed card data.
 //  1 long   (header size) size in bytes of the card's data header.
 //  1 long   (data size) size in bytes of the uncompressed data.
+//  1 long   (cert2 offset) offset to the third CAC cert / end of the data.
+//  1 long   (cert2 size) size in bytes of the third CAC cert.
+//  1 long   (snapshot offset) offset to the parsed object snapshot.
+//  1 long   (snapshot size) size in bytes of the snapshot (0 = none).
 //  .
 //  .
 // DataHeader:
@@ -2217,6 +2733,14 @@ Slot::unloadObjects()
 //  .
 // Data:
 //  n bytes   Data.
+//  .
+//  .
+// Snapshot:
+//  n bytes   Snapshot, packed against the end of the segment.
+//
+// The snapshot holds the objects built from the data, so other processes
+// can skip parsing it. It is only meaningful while the rest of the segment
+// is valid, and is dropped whenever the data is rewritten.
 //
 // All data in the shared memory header is stored in machine order, packing,
 //  and size. Data in the DataHeader and Data sections are stored in applet 
@@ -2240,6 +2764,8 @@ struct SlotSegmentHeader {
     unsigned long  dataSize;
     unsigned long  cert2Offset;
     unsigned long  cert2Size;
+    unsigned long  snapshotOffset;
+    unsigned long  snapshotSize;
 };
 
 #define MAX_OBJECT_STORE_SIZE 15000
@@ -2249,38 +2775,22 @@ struct SlotSegmentHeader {
 //
 #define SEGMENT_PREFIX "coolkeypk11s"
 #define CAC_FAKE_CUID "CAC Certs"
+//
+// Only the name is worked out here. Creating and mapping the segment file
+// waits for the first real use of the slot (see attach), so readers nobody
+// touches never cost us a file.
+//
 SlotMemSegment::SlotMemSegment(const char *readerName): 
-	segmentAddr(NULL),  segmentSize(0), segment(NULL)
+	segmentAddr(NULL),  segmentSize(0), segment(NULL), segName(NULL),
+	attached(false)
 {
-   bool needInit;
-   char *segName;
-
    segName = new char[strlen(readerName)+sizeof(SEGMENT_PREFIX)+1];
    if (!segName) {
 	// just run without shared memory
+	attached = true;
 	return;
     }
     sprintf(segName,SEGMENT_PREFIX"%s",readerName); 
-    segment = SHMem::initSegment(segName, MAX_OBJECT_STORE_SIZE, needInit);
-    delete [] segName;
-    if (!segment) {
-	// just run without shared memory
-	return;
-    }
-    segmentAddr = segment->getSHMemAddr();
-    assert(segmentAddr);
-    // paranoia, shouldn't happen..
-    if (!segmentAddr) {
-	delete segment;
-	segment = NULL;
-	return;
-    }
-
-    SlotSegmentHeader *segmentHeader = (SlotSegmentHeader *)segmentAddr;
-    if (needInit) {
-	segmentHeader->valid = 0;
-    }
-    segmentSize = segment->getSHMemSize();
 }
 
 SlotMemSegment::~SlotMemSegment()
@@ -2288,12 +2798,56 @@ SlotMemSegment::~SlotMemSegment()
     if (segment) {
 	delete segment;
     }
+    delete [] segName;
+}
+
+//
+// Several threads can get here for the same slot, so the mapping is built
+// in locals and published under attachLock, segment last. Everything that
+// reads the other fields does so only after attach has returned true.
+//
+bool
+SlotMemSegment::attach() const
+{
+    bool needInit;
+    bool ok;
+
+    attachLock.getLock();
+    if (!attached) {
+	SHMem *newSegment;
+	char *addr = NULL;
+
+	newSegment = SHMem::initSegment(segName, MAX_OBJECT_STORE_SIZE,
+								needInit);
+	if (newSegment) {
+	    addr = newSegment->getSHMemAddr();
+	    assert(addr);
+	    // paranoia, shouldn't happen..
+	    if (!addr) {
+		delete newSegment;
+		newSegment = NULL;
+	    }
+	}
+	if (newSegment) {
+	    if (needInit) {
+		((SlotSegmentHeader *)addr)->valid = 0;
+	    }
+	    segmentAddr = addr;
+	    segmentSize = newSegment->getSHMemSize();
+	    segment = newSegment;
+	}
+	// without a segment we just run without shared memory
+	attached = true;
+    }
+    ok = segment != NULL;
+    attachLock.releaseLock();
+    return ok;
 }
 
 bool
 SlotMemSegment::CUIDIsEqual(const CKYBuffer *cuid) const
 {
-    if (!segment) {
+    if (!attach()) {
 	return false;
     }
     SlotSegmentHeader *segmentHeader = (SlotSegmentHeader *)segmentAddr;
@@ -2306,7 +2860,7 @@ SlotMemSegment::CUIDIsEqual(const CKYBuffer *cuid) const
 void
 SlotMemSegment::setCUID(const CKYBuffer *cuid)
 {
-    if (!segment) {
+    if (!attach()) {
 	return;
     }
 
@@ -2323,7 +2877,7 @@ SlotMemSegment::setCUID(const CKYBuffer *cuid)
 const unsigned char *
 SlotMemSegment::getCUID() const
 {
-    if (!segment) {
+    if (!attach()) {
 	return NULL;
     }
     SlotSegmentHeader *segmentHeader = (SlotSegmentHeader *)segmentAddr;
@@ -2333,7 +2887,7 @@ SlotMemSegment::getCUID() const
 unsigned short
 SlotMemSegment::getVersion() const
 {
-    if (!segment) {
+    if (!attach()) {
 	return 0;
     }
 
@@ -2344,7 +2898,7 @@ SlotMemSegment::getVersion() const
 unsigned short
 SlotMemSegment::getDataVersion() const
 {
-    if (!segment) {
+    if (!attach()) {
 	return 0;
     }
 
@@ -2355,7 +2909,7 @@ SlotMemSegment::getDataVersion() const
 void
 SlotMemSegment::setVersion(unsigned short version)
 {
-    if (!segment) {
+    if (!attach()) {
 	return;
     }
 
@@ -2367,7 +2921,7 @@ SlotMemSegment::setVersion(unsigned short version)
 void
 SlotMemSegment::setDataVersion(unsigned short version)
 {
-    if (!segment) {
+    if (!attach()) {
 	return;
     }
 
@@ -2378,7 +2932,7 @@ SlotMemSegment::setDataVersion(unsigned short version)
 bool
 SlotMemSegment::isValid() const
 {
-    if (!segment) {
+    if (!attach()) {
 	return false;
     }
     SlotSegmentHeader *segmentHeader = (SlotSegmentHeader *)segmentAddr;
@@ -2388,7 +2942,7 @@ SlotMemSegment::isValid() const
 void
 SlotMemSegment::readHeader(CKYBuffer *dataHeader) const
 {
-    if (!segment) {
+    if (!attach()) {
 	return;
     }
     SlotSegmentHeader *segmentHeader = (SlotSegmentHeader *)segmentAddr;
@@ -2400,7 +2954,7 @@ SlotMemSegment::readHeader(CKYBuffer *dataHeader) const
 void
 SlotMemSegment::readData(CKYBuffer *objData) const
 {
-    if (!segment) {
+    if (!attach()) {
 	return;
     }
     SlotSegmentHeader *segmentHeader = (SlotSegmentHeader *)segmentAddr;
@@ -2413,7 +2967,7 @@ SlotMemSegment::readData(CKYBuffer *objData) const
 void
 SlotMemSegment::writeHeader(const CKYBuffer *dataHeader)
 {
-    if (!segment) {
+    if (!attach()) {
 	return;
     }
     SlotSegmentHeader *segmentHeader = (SlotSegmentHeader *)segmentAddr;
@@ -2422,6 +2976,10 @@ SlotMemSegment::writeHeader(const CKYBuffer *dataHeader)
     segmentHeader->dataHeaderSize = size;
     segmentHeader->dataHeaderOffset = sizeof *segmentHeader;
     segmentHeader->dataOffset = segmentHeader->dataHeaderOffset + size;
+    segmentHeader->dataSize = 0;
+    segmentHeader->cert2Offset = segmentHeader->dataOffset;
+    segmentHeader->cert2Size = 0;
+    segmentHeader->snapshotSize = 0;
     CKYByte *data = (CKYByte *) &segmentAddr[segmentHeader->dataHeaderOffset];
     memcpy(data, CKYBuffer_Data(dataHeader), size);
 }
@@ -2429,20 +2987,77 @@ SlotMemSegment::writeHeader(const CKYBuffer *dataHeader)
 void
 SlotMemSegment::writeData(const CKYBuffer *objData)
 {
-    if (!segment) {
+    if (!attach()) {
 	return;
     }
     SlotSegmentHeader *segmentHeader = (SlotSegmentHeader *)segmentAddr;
     int size = CKYBuffer_Size(objData);
     segmentHeader->dataSize = size;
+    segmentHeader->cert2Offset = segmentHeader->dataOffset + size;
+    segmentHeader->cert2Size = 0;
+    segmentHeader->snapshotSize = 0;
     CKYByte *data = (CKYByte *) &segmentAddr[segmentHeader->dataOffset];
     memcpy(data, CKYBuffer_Data(objData), size);
 }
 
+//
+// The snapshot lives at the end of the segment, behind whatever card data
+// is there. Returns false if it doesn't fit; we just go without one.
+//
+bool
+SlotMemSegment::writeSnapshot(const CKYBuffer *snapshot)
+{
+    if (!attach()) {
+	return false;
+    }
+    SlotSegmentHeader *segmentHeader = (SlotSegmentHeader *)segmentAddr;
+    unsigned long size = CKYBuffer_Size(snapshot);
+    unsigned long dataEnd = segmentHeader->cert2Offset +
+						segmentHeader->cert2Size;
+
+    segmentHeader->snapshotSize = 0;
+    if ((segmentHeader->headerSize != sizeof *segmentHeader) ||
+	(dataEnd > (unsigned long)segmentSize) ||
+	(size > (unsigned long)segmentSize - dataEnd)) {
+	return false;
+    }
+    segmentHeader->snapshotOffset = segmentSize - size;
+    memcpy(&segmentAddr[segmentHeader->snapshotOffset],
+					CKYBuffer_Data(snapshot), size);
+    segmentHeader->snapshotSize = size;
+    return true;
+}
+
+//
+// The header may have been written by a library that predates snapshots,
+// so check everything before believing it.
+//
+void
+SlotMemSegment::readSnapshot(CKYBuffer *snapshot) const
+{
+    CKYBuffer_Resize(snapshot, 0);
+    if (!attach()) {
+	return;
+    }
+    SlotSegmentHeader *segmentHeader = (SlotSegmentHeader *)segmentAddr;
+    unsigned long offset = segmentHeader->snapshotOffset;
+    unsigned long size = segmentHeader->snapshotSize;
+    unsigned long dataEnd = segmentHeader->cert2Offset +
+						segmentHeader->cert2Size;
+
+    if ((segmentHeader->headerSize != sizeof *segmentHeader) ||
+	(size == 0) || (offset < dataEnd) ||
+	(offset > (unsigned long)segmentSize) ||
+	(size > (unsigned long)segmentSize - offset)) {
+	return;
+    }
+    CKYBuffer_Replace(snapshot, 0, (CKYByte *)&segmentAddr[offset], size);
+}
+
 void
 SlotMemSegment::readCACCert(CKYBuffer *objData, CKYByte instance) const
 {
-    if (!segment) {
+    if (!attach()) {
 	return;
     }
     SlotSegmentHeader *segmentHeader = (SlotSegmentHeader *)segmentAddr;
@@ -2473,7 +3088,7 @@ SlotMemSegment::readCACCert(CKYBuffer *objData, CKYByte instance) const
 void
 SlotMemSegment::writeCACCert(const CKYBuffer *data, CKYByte instance)
 {
-    if (!segment) {
+    if (!attach()) {
 	return;
     }
     SlotSegmentHeader *segmentHeader = (SlotSegmentHeader *)segmentAddr;
@@ -2488,16 +3103,19 @@ SlotMemSegment::writeCACCert(const CKYBuffer *data, CKYByte instance)
 	segmentHeader->dataSize = 0;
 	segmentHeader->cert2Offset = segmentHeader->dataOffset;
 	segmentHeader->cert2Size = 0;
+	segmentHeader->snapshotSize = 0;
 	shmData = (CKYByte *) &segmentAddr[segmentHeader->dataHeaderOffset];
 	break;
     case 1:
 	segmentHeader->dataSize = size;
 	segmentHeader->cert2Offset = segmentHeader->dataOffset + size;
 	segmentHeader->cert2Size = 0;
+	segmentHeader->snapshotSize = 0;
 	shmData = (CKYByte *) &segmentAddr[segmentHeader->dataOffset];
 	break;
     case 2:
 	segmentHeader->cert2Size = size;
+	segmentHeader->snapshotSize = 0;
 	shmData = (CKYByte *) &segmentAddr[segmentHeader->cert2Offset];
 	break;
     default:
@@ -2510,7 +3128,7 @@ void
 SlotMemSegment::clearValid(CKYByte instance)
 {
 
-    if (!segment) {
+    if (!attach()) {
 	return;
     }
     SlotSegmentHeader *segmentHeader = (SlotSegmentHeader *)segmentAddr;
@@ -2522,13 +3140,14 @@ SlotMemSegment::clearValid(CKYByte instance)
     case 1:
 	segmentHeader->dataSize = 0;
     }
+    segmentHeader->snapshotSize = 0;
     segmentHeader->valid = 0;
 }
 
 void
 SlotMemSegment::setValid()
 {
-    if (!segment) {
+    if (!attach()) {
 	return;
     }
     SlotSegmentHeader *segmentHeader = (SlotSegmentHeader *)segmentAddr;
@@ -2635,6 +3254,7 @@ Slot::fetchCombinedObjects(const CKYBuffer *header)
     unsigned short compressedSize = CKYBuffer_GetShort(
 					header, OBJ_COMP_SIZE_OFFSET);
     OSTime time = OSTimeNow();
+    TraceSpan span("fetchCombinedObjects", slotID);
 
 #ifdef USE_SHMEM
 
@@ -2690,6 +3310,7 @@ Slot::fetchCombinedObjects(const CKYBuffer *header)
 	    CKYSize objSize = 0;
 	    int zret = Z_MEM_ERROR;
 
+	    TraceSpan zspan("uncompress", slotID);
 	    CKYBuffer_InitFromCopy(&compBuffer,&objBuffer);
 	    do {
 		guessFinalSize *= 2;
@@ -2725,6 +3346,7 @@ Slot::fetchCombinedObjects(const CKYBuffer *header)
      //
      // now pull apart the objects
      //
+    TraceSpan parseSpan("parse objects", slotID);
     unsigned short offset = 
 		CKYBuffer_GetShort(&objBuffer, OBJ_OBJECT_OFFSET_OFFSET);
     unsigned short objectCount = CKYBuffer_GetShort(
@@ -3149,27 +3771,101 @@ Slot::readCACCertificateAppend(CKYBuffer *cert, CKYSize nextSize)
     return CACApplet_GetCertificateAppend(conn, cert, nextSize, &apduRC);
 }
 
-void
-Slot::loadCACCert(CKYByte instance)
+//
+// The PIV Key History object says how many retired key management keys
+// have their certificates on the card. Those fill the retired containers
+// from the first one on, so only they need reading. 0 if there is no
+// key history.
+//
+int
+Slot::getPIVRetiredKeyCount()
+{
+    CKYStatus status;
+    CKYISOStatus apduRC;
+    CKYBuffer history;
+    CKYBuffer entries;
+    CKYBuffer value;
+    int count = 0;
+
+    CKYBuffer_InitEmpty(&history);
+    CKYBuffer_InitEmpty(&entries);
+    CKYBuffer_InitEmpty(&value);
+    status = PIVApplet_GetCertificate(conn, &history, PIV_KEY_HISTORY_TAG,
+								&apduRC);
+    if (status == CKYSCARDERR) {
+	CKYBuffer_FreeData(&history);
+	handleConnectionError();
+    }
+    if (status == CKYSUCCESS) {
+	status = berProcess(&history, 0x53, &entries, BER_UNWRAP);
+    }
+    while ((status == CKYSUCCESS) && (CKYBuffer_Size(&entries) != 0)) {
+	CKYByte tag = CKYBuffer_GetChar(&entries, 0);
+
+	CKYBuffer_Resize(&value, 0);
+	status = berProcess(&entries, 0, &value, BER_UNWRAP);
+	if (status != CKYSUCCESS) {
+	    break;
+	}
+	if (tag == PIV_TAG_KEYS_ON_CARD && CKYBuffer_Size(&value) == 1) {
+	    count = CKYBuffer_GetChar(&value, 0);
+	}
+	CKYBuffer_Resize(&value, 0);
+	status = berProcess(&entries, 0, &value, BER_NEXT);
+	if (status == CKYSUCCESS) {
+	    CKYBuffer_Resize(&entries, 0);
+	    status = CKYBuffer_AppendCopy(&entries, &value);
+	}
+    }
+    CKYBuffer_FreeData(&history);
+    CKYBuffer_FreeData(&entries);
+    CKYBuffer_FreeData(&value);
+    if (count > PIV_RETIRED_KEYS) {
+	count = PIV_RETIRED_KEYS;
+    }
+    return count;
+}
+
+//
+// Get the raw (possibly compressed) cert for a CAC/PIV instance, from
+// shared memory if we can, otherwise off the card. Returns false if the
+// card doesn't have this instance.
+//
+bool
+Slot::fetchCACCert(CKYByte instance, CKYBuffer *rawCertOut)
 {
     CKYStatus status = CKYSUCCESS;
-    CKYBuffer cert;
     CKYBuffer rawCert;
     CKYBuffer shmCert;
     CKYSize  nextSize;
 
     OSTime time = OSTimeNow();
+    TraceSpan span("fetchCACCert", slotID);
 
-    CKYBuffer_InitEmpty(&cert);
     CKYBuffer_InitEmpty(&rawCert);
     CKYBuffer_InitEmpty(&shmCert);
 
+    /* caches keyed by the card identity are version 2, so an older library
+     * sharing the segment can't hand us certs without resetting the CUID */
+    bool haveIdentity = CKYBuffer_Size(&mCardIdentity) != 0;
+    unsigned short dataVersion = haveIdentity ? 2 : 1;
+    CKYBool needRead = 1;
+
+    /* same card as the cache was filled from, don't touch the card at all.
+     * Only the first three certs have room there, retired PIV certs always
+     * come from the card */
+    bool fromCache = haveIdentity && instance < MAX_CERT_SLOTS &&
+		shmem.isValid() && shmem.getDataVersion() == dataVersion &&
+		shmem.CUIDIsEqual(&mCardIdentity);
+
     //
     // not all CAC cards have all the PKI instances
     // catch the applet selection errors if they don't
     //
     try {
-        selectCACApplet(instance, false);
+	if (!fromCache) {
+	    selectCACApplet(instance, false);
+	}
     } catch(PKCS11Exception& e) {
 	// all CAC's must have instance '0', throw the error it
 	// they don't.
@@ -3179,13 +3875,13 @@ Slot::loadCACCert(CKYByte instance)
 	if ((instance == 2) && !shmem.isValid()) {
 	    shmem.setValid();
 	}
-	return;
+	return false;
     }
 
     log->log("CAC Cert %d: select CAC applet:  %d ms\n",
 						 instance, OSTimeNow() - time);
 
-    if (instance == 0) {
+    if (instance == 0 && !fromCache) {
 	readCACCertificateFirst(&rawCert, &nextSize, true);
 
         if(CKYBuffer_Size(&rawCert) <= 1) {
@@ -3195,11 +3891,17 @@ Slot::loadCACCert(CKYByte instance)
 						instance, OSTimeNow() - time);
     }
 
-    unsigned short dataVersion = 1;
-    CKYBool needRead = 1;
-
-    /* see if it matches the shared memory */
-    if (shmem.isValid() &&  shmem.getDataVersion() == dataVersion) {
+    if (fromCache) {
+	shmem.readCACCert(&rawCert, instance);
+	needRead = 0;
+	if (CKYBuffer_Size(&rawCert) == 0) {
+	    /* no cert of this type, just return */
+	    CKYBuffer_FreeData(&rawCert);
+	    return false;
+	}
+    /* without an identity, see if it matches the shared memory */
+    } else if (!haveIdentity && instance < MAX_CERT_SLOTS &&
+		shmem.isValid() && shmem.getDataVersion() == dataVersion) {
 	shmem.readCACCert(&shmCert, instance);
 	CKYSize certSize = CKYBuffer_Size(&rawCert);
 	CKYSize shmCertSize = CKYBuffer_Size(&shmCert);
@@ -3219,7 +3921,7 @@ Slot::loadCACCert(CKYByte instance)
 	}
 	if (!needRead && (shmCertSize == 0)) {	
 	    /* no cert of this type, just return */
-	    return;
+	    return false;
 	}
     }
     CKYBuffer_FreeData(&shmCert);
@@ -3230,6 +3932,9 @@ Slot::loadCACCert(CKYByte instance)
 	    shmem.clearValid(0);
 	    shmem.setVersion(SHMEM_VERSION);
 	    shmem.setDataVersion(dataVersion);
+	    if (haveIdentity) {
+		shmem.setCUID(&mCardIdentity);
+	    }
 	} else {
 	    status = readCACCertificateFirst(&rawCert, &nextSize, false);
 	
@@ -3241,7 +3946,7 @@ Slot::loadCACCert(CKYByte instance)
 		     * is now valid */
 		    shmem.setValid();
 		}
-		return;
+		return false;
 	    }
 	}
 
@@ -3262,9 +3967,141 @@ Slot::loadCACCert(CKYByte instance)
 
     log->log("CAC Cert %d: Cert has been read:  %d ms\n",
 						instance, OSTimeNow() - time);
+    CKYBuffer_AppendCopy(rawCertOut, &rawCert);
+    CKYBuffer_FreeData(&rawCert);
+    return true;
+}
+
+//
+// CAC/PIV certs are parsed while the card is still busy with the next one.
+// The thread holding the transaction queues raw certs here as they come
+// off the card, and a worker inflates them and builds the PKCS #11 objects.
+// Without a worker (the application didn't allow threads) add() just does
+// the work inline.
+//
+class CACCertPipeline {
+  private:
+    struct RawCert {
+	CKYByte instance;
+	CKYBuffer data;
+    };
+    OSCondition cond;
+    list<RawCert *> queue;	// protected by cond
+    bool done;			// protected by cond, nothing more to queue
+    OSThread *worker;
+    Log *log;
+    CK_SLOT_ID slotID;
+
+    void parse(CKYByte instance, CKYBuffer *rawCert);
+    void parseQueued(RawCert *raw);
+    static void run(void *arg);
+
+  public:
+    // everything below belongs to the worker until finish() returns
+    ObjectList objects;
+    bool ecc;
+    char *name;		// from the first cert that has one
+    CK_RV error;	// first failure seen by the worker
+    string errorMessage;
+
+    CACCertPipeline(Log *log_, CK_SLOT_ID slotID_) : done(false),
+		worker(NULL), log(log_), slotID(slotID_), ecc(false),
+		name(NULL), error(CKR_OK) {
+	worker = OSThread::start(run, this);
+    }
+    ~CACCertPipeline() {
+	finish();
+	while (!queue.empty()) {
+	    CKYBuffer_FreeData(&queue.front()->data);
+	    delete queue.front();
+	    queue.pop_front();
+	}
+	free(name);
+    }
+    void add(CKYByte instance, const CKYBuffer *rawCert);
+    // wait for the worker to parse everything queued so far and stop it
+    void finish();
+};
+
+void
+CACCertPipeline::add(CKYByte instance, const CKYBuffer *rawCert)
+{
+    RawCert *raw = new RawCert;
+
+    raw->instance = instance;
+    CKYBuffer_InitFromCopy(&raw->data, rawCert);
+    if (!worker) {
+	parseQueued(raw);
+	return;
+    }
+    cond.getLock();
+    queue.push_back(raw);
+    cond.signal();
+    cond.releaseLock();
+}
+
+void
+CACCertPipeline::finish()
+{
+    if (!worker) {
+	return;
+    }
+    cond.getLock();
+    done = true;
+    cond.signal();
+    cond.releaseLock();
+    delete worker;
+    worker = NULL;
+}
+
+void
+CACCertPipeline::run(void *arg)
+{
+    CACCertPipeline *pipeline = (CACCertPipeline *)arg;
+
+    pipeline->cond.getLock();
+    for (;;) {
+	while (pipeline->queue.empty() && !pipeline->done) {
+	    pipeline->cond.wait();
+	}
+	if (pipeline->queue.empty()) {
+	    break;
+	}
+	RawCert *raw = pipeline->queue.front();
+	pipeline->queue.pop_front();
+	pipeline->cond.releaseLock();
+	pipeline->parseQueued(raw);
+	pipeline->cond.getLock();
+    }
+    pipeline->cond.releaseLock();
+}
+
+void
+CACCertPipeline::parseQueued(RawCert *raw)
+{
+    // exceptions can't cross the thread, save the first one for finish()
+    try {
+	if (error == CKR_OK) {
+	    parse(raw->instance, &raw->data);
+	}
+    } catch (PKCS11Exception &e) {
+	error = e.getReturnValue();
+	errorMessage = e.getMessage();
+    }
+    CKYBuffer_FreeData(&raw->data);
+    delete raw;
+}
+
+void
+CACCertPipeline::parse(CKYByte instance, CKYBuffer *rawCert)
+{
+    CKYBuffer cert;
+    OSTime time = OSTimeNow();
+
+    CKYBuffer_InitEmpty(&cert);
     /* new CACs, and old CACs with the high one bit are compressed, 
      * uncompress them */
-    if ((CKYBuffer_GetChar(&rawCert,0) & 0x3) == 1) {
+    if ((CKYBuffer_GetChar(rawCert,0) & 0x3) == 1) {
 	CKYOffset offset = 1;
 	int zret = Z_MEM_ERROR;
 
@@ -3272,24 +4109,24 @@ Slot::loadCACCert(CKYByte instance)
 	/* header_id = 0x1f, 0x8b. CM=8. If we ever support something other
 	 * than CM=8, we need to change the zlib header below. Currently both
 	 * gzip and zlib only support CM=8 (DEFLATE) compression */
-	if ((CKYBuffer_GetChar(&rawCert,1) == 0x1f) &&
-	    (CKYBuffer_GetChar(&rawCert,2) == 0x8b) &&
-	    (CKYBuffer_GetChar(&rawCert,3) == 8)) {
-	    CKYByte flags = CKYBuffer_GetChar(&rawCert,4);
+	if ((CKYBuffer_GetChar(rawCert,1) == 0x1f) &&
+	    (CKYBuffer_GetChar(rawCert,2) == 0x8b) &&
+	    (CKYBuffer_GetChar(rawCert,3) == 8)) {
+	    CKYByte flags = CKYBuffer_GetChar(rawCert,4);
 	    /* this has a gzip header, not raw data. */
 	    offset += 10; /* base size of the gzip header */
 	    if (flags & 4) { /* FEXTRA */
-		CKYSize len = CKYBuffer_GetShortLE(&rawCert,offset);
+		CKYSize len = CKYBuffer_GetShortLE(rawCert,offset);
 		offset += len;
 	    }
 	    if (flags & 8) { /* FNAME */
-		while (CKYBuffer_GetChar(&rawCert,offset) != 0) {
+		while (CKYBuffer_GetChar(rawCert,offset) != 0) {
 		    offset++;
 		}
 		offset++;
 	    }
 	    if (flags & 0x10) { /* FComment */
-		while (CKYBuffer_GetChar(&rawCert,offset) != 0) {
+		while (CKYBuffer_GetChar(rawCert,offset) != 0) {
 		    offset++;
 		}
 		offset++;
@@ -3304,83 +4141,157 @@ Slot::loadCACCert(CKYByte instance)
 	    /* NOTE: the zlib will fail when procssing the trailer. this is
 	     * ok because decompress automatically notices the failure and
 	     * and checks the gzip trailer. */
-	    CKYBuffer_SetChar(&rawCert, offset, 0x78);
-	    CKYBuffer_SetChar(&rawCert, offset+1, 0x9c);
+	    CKYBuffer_SetChar(rawCert, offset, 0x78);
+	    CKYBuffer_SetChar(rawCert, offset+1, 0x9c);
 	}
 	/* uncompress. This expands cert as necessary. */
-	zret = decompress(&cert, &rawCert, offset, 
-					CKYBuffer_Size(&rawCert)-offset);
+	TraceSpan zspan("decompress", slotID);
+	zret = decompress(&cert, rawCert, offset, 
+					CKYBuffer_Size(rawCert)-offset);
 
 	if (zret != Z_OK) {
-	    CKYBuffer_FreeData(&rawCert);
 	    CKYBuffer_FreeData(&cert);
 	    throw PKCS11Exception(CKR_DEVICE_ERROR, 
 				"Corrupted compressed CAC/PIV Cert");
 	}
     } else {
-	CKYBuffer_InitFromBuffer(&cert,&rawCert,1,CKYBuffer_Size(&rawCert)-1);
+	CKYBuffer_InitFromBuffer(&cert,rawCert,1,CKYBuffer_Size(rawCert)-1);
     }
-    CKYBuffer_FreeData(&rawCert);
     log->log("CAC Cert %d: Cert has been uncompressed:  %d ms\n",
 						instance, OSTimeNow() - time);
 
+    TraceSpan parseSpan("parse cert", slotID);
     CACCert certObj(instance, &cert);
+    CKYBuffer_FreeData(&cert);
     CACPrivKey privKey(instance, certObj);
     CACPubKey pubKey(instance, certObj);
-    tokenObjects.push_back(privKey);
-    tokenObjects.push_back(pubKey);
-    tokenObjects.push_back(certObj);
+    objects.push_back(privKey);
+    objects.push_back(pubKey);
+    objects.push_back(certObj);
     if (pubKey.getKeyType() == PKCS11Object::ecc) {
-	mECC = 1;
+	ecc = true;
     }
 
-    if (personName == NULL) {
-	const char *name = certObj.getName();
-	if (name) {
-            personName = strdup(name);
-            fullTokenName = true;
+    if (name == NULL) {
+	const char *certName = certObj.getName();
+	if (certName) {
+            name = strdup(certName);
 	}
     }
 }
 
+//
+// Read all the CAC/PIV certs, releasing the card as soon as the last one
+// is off it. The parse worker may still be catching up at that point.
+//
 void
-Slot::loadObjects()
+Slot::loadCACCerts(Transaction &trans)
 {
-    // throw away all token objects!
+    OSTime time = OSTimeNow();
 
-    Transaction trans;
-    CKYBuffer header;
-    CKYBuffer_InitEmpty(&header);
-    CKYStatus status = trans.begin(conn);
-    if( status != CKYSUCCESS ) {
-        handleConnectionError();
+    /* CACs picked up their identity from the CCC when we connected */
+    if (state & PIV_CARD) {
+	loadPIVIdentity();
+    }
+    /* identity keyed caches are data version 2, see fetchCACCert. A hit
+     * needs no parse worker, so it isn't started until we know */
+    if (CKYBuffer_Size(&mCardIdentity) &&
+				loadObjectSnapshot(&mCardIdentity, 2)) {
+	trans.end();
+	log->log("CAC objects from snapshot: %d ms\n", OSTimeNow() - time);
+	return;
     }
-    OSTime time = OSTimeNow();
 
+    CACCertPipeline pipeline(log, slotID);
+    CKYBuffer rawCert;
 
-    list<ListObjectInfo> objInfoList;
-    std::list<ListObjectInfo>::iterator iter;
+    CKYBuffer_InitEmpty(&rawCert);
+    try {
+	for (CKYByte instance = 0; instance < MAX_CERT_SLOTS; instance++) {
+	    CKYBuffer_Resize(&rawCert, 0);
+	    if (fetchCACCert(instance, &rawCert)) {
+		pipeline.add(instance, &rawCert);
+	    }
+	}
+	if (state & PIV_CARD) {
+	    int retired = getPIVRetiredKeyCount();
 
-    if (state & GOV_CARD) {
-	loadCACCert(0);
-	loadCACCert(1);
-	loadCACCert(2);
-	status = trans.end();
-	loadReaderObject();
-	return;
-    }
-    if (state & P15_CARD) {
-	parseEF_TokenInfo();
-	parseEF_ODF();
-	if (auth[CKU_USER] != NULL) {
-	    /* set need login */
-	    needLogin = true;
+	    for (int i = 0; i < retired; i++) {
+		CKYBuffer_Resize(&rawCert, 0);
+		if (fetchCACCert(PIV_RETIRED_INSTANCE + i, &rawCert)) {
+		    pipeline.add(PIV_RETIRED_INSTANCE + i, &rawCert);
+		}
+	    }
+	    log->log("PIV: %d retired certs: %d ms\n", retired,
+						OSTimeNow() - time);
 	}
-	status = trans.end();
-	loadReaderObject();
-	return;
+    } catch (PKCS11Exception &) {
+	CKYBuffer_FreeData(&rawCert);
+	throw;
+    }
+    CKYBuffer_FreeData(&rawCert);
+    trans.end();
+    log->log("CAC certs off the card: %d ms\n", OSTimeNow() - time);
+
+    pipeline.finish();
+    log->log("CAC certs parsed: %d ms\n", OSTimeNow() - time);
+    if (pipeline.error != CKR_OK) {
+	throw PKCS11Exception(pipeline.error, pipeline.errorMessage);
+    }
+    tokenObjects.splice(tokenObjects.end(), pipeline.objects);
+    if (pipeline.ecc) {
+	mECC = 1;
+    }
+    if (personName == NULL && pipeline.name) {
+	personName = pipeline.name;
+	pipeline.name = NULL;
+	fullTokenName = true;
+    }
+    if (CKYBuffer_Size(&mCardIdentity)) {
+	saveObjectSnapshot(&mCardIdentity, 2);
     }
+}
+
+void
+Slot::loadObjects()
+{
+    // throw away all token objects!
+
+    Transaction trans;
+    CKYStatus status = trans.begin(conn);
+    if( status != CKYSUCCESS ) {
+        handleConnectionError();
+    }
+    OSTime time = OSTimeNow();
+
+    driver->loadObjects(this, trans);
+    log->log("time load objects: %d ms\n", OSTimeNow() - time);
+    loadReaderObject();
+}
+
+void
+Slot::loadP15Objects(Transaction &trans)
+{
+    parseEF_TokenInfo();
+    parseEF_ODF();
+    if (auth[CKU_USER] != NULL) {
+	/* set need login */
+	needLogin = true;
+    }
+    trans.end();
+}
 
+void
+Slot::loadCoolKeyObjects(Transaction &trans)
+{
+    CKYBuffer header;
+    CKYStatus status;
+    OSTime time = OSTimeNow();
+
+    list<ListObjectInfo> objInfoList;
+    std::list<ListObjectInfo>::iterator iter;
+
+    CKYBuffer_InitEmpty(&header);
     selectApplet();
     log->log("time load object: Select Applet (again) %d ms\n",
 						OSTimeNow() - time);
@@ -3395,6 +4306,19 @@ Slot::loadObjects()
         handleConnectionError();
     }
     bool isCombined = (status == CKYSUCCESS) ? true : false;
+    unsigned short dataVersion = 0;
+    if (isCombined) {
+	CKYBuffer_Resize(&mCUID,0);
+	CKYBuffer_AppendBuffer(&mCUID, &header, OBJ_CUID_OFFSET, OBJ_CUID_SIZE);
+	dataVersion = CKYBuffer_GetShort(&header, OBJ_OBJECT_VERSION_OFFSET);
+	if (loadObjectSnapshot(&mCUID, dataVersion)) {
+	    CKYBuffer_FreeData(&header);
+	    trans.end();
+	    log->log("time load object: from snapshot %d ms\n",
+						OSTimeNow() - time);
+	    return;
+	}
+    }
     try {
 	objInfoList = isCombined ? fetchCombinedObjects(&header) 
 						: fetchSeparateObjects();
@@ -3448,8 +4372,139 @@ Slot::loadObjects()
         }
     }
     log->log("time load objects: Process %d ms\n", OSTimeNow() - time);
+    if (isCombined) {
+	saveObjectSnapshot(&mCUID, dataVersion);
+    }
+}
 
-    loadReaderObject();
+//
+// Snapshots of the built token objects ride along with the raw data in the
+// shared memory segment (see SlotMemSegment) and are keyed the same way:
+// the identity in the segment header plus the data version. The snapshot
+// repeats both, so it can't be paired with someone else's data.
+//
+// Caller holds the transaction.
+//
+bool
+Slot::loadObjectSnapshot(const CKYBuffer *identity, unsigned short dataVersion)
+{
+#ifdef USE_SHMEM
+    CKYBuffer snapshot;
+    CKYOffset offset;
+    CKYSize size;
+    const CKYByte *nameData;
+    ObjectList objects;
+    unsigned long count, i;
+    CKYStatus status = CKYSUCCESS;
+    CKYSize idSize = CKYBuffer_Size(identity);
+
+    if (!shmem.isValid() || !shmem.CUIDIsEqual(identity) ||
+			shmem.getDataVersion() != dataVersion) {
+	return false;
+    }
+    CKYBuffer_InitEmpty(&snapshot);
+    shmem.readSnapshot(&snapshot);
+
+    /* version, data version, identity, flags, name length */
+    offset = 2 + 2 + idSize + 1 + 2;
+    size = CKYBuffer_Size(&snapshot);
+    if ((size < offset) ||
+	(CKYBuffer_GetShort(&snapshot, 0) != SHMEM_SNAPSHOT_VERSION) ||
+	(CKYBuffer_GetShort(&snapshot, 2) != dataVersion) ||
+	!CKYBuffer_DataIsEqual(identity, CKYBuffer_Data(&snapshot)+4, idSize)) {
+	CKYBuffer_FreeData(&snapshot);
+	return false;
+    }
+    CKYByte flags = CKYBuffer_GetChar(&snapshot, 4 + idSize);
+    CKYSize nameSize = CKYBuffer_GetShort(&snapshot, 4 + idSize + 1);
+    nameData = CKYBuffer_Data(&snapshot) + offset;
+    if (size < offset + nameSize + 4) {
+	CKYBuffer_FreeData(&snapshot);
+	return false;
+    }
+    offset += nameSize;
+    count = CKYBuffer_GetLong(&snapshot, offset);
+    offset += 4;
+
+    for (i=0; i < count; i++) {
+	PKCS11Object obj(0, generateUnusedObjectHandle());
+
+	status = obj.restoreSnapshot(&snapshot, &offset);
+	if (status != CKYSUCCESS) {
+	    break;
+	}
+	objects.push_back(obj);
+    }
+    if ((status != CKYSUCCESS) || (offset != size)) {
+	log->log("Object snapshot is corrupt, reading the card\n");
+	CKYBuffer_FreeData(&snapshot);
+	return false;
+    }
+
+    tokenObjects.splice(tokenObjects.end(), objects);
+    mECC = (flags & 1) ? true : false;
+    fullTokenName = (flags & 2) ? true : false;
+    if (nameSize) {
+	free(personName);
+	personName = (char *)malloc(nameSize+1);
+	if (personName) {
+	    memcpy(personName, nameData, nameSize);
+	    personName[nameSize] = 0;
+	}
+    }
+    CKYBuffer_FreeData(&snapshot);
+    log->log("Restored %d objects from snapshot\n", count);
+    return true;
+#else
+    return false;
+#endif
+}
+
+//
+// Called once the objects are built. That usually happens after the card
+// was released, so retake the reader to make sure the raw data we'd be
+// describing is still the one in the segment.
+//
+void
+Slot::saveObjectSnapshot(const CKYBuffer *identity, unsigned short dataVersion)
+{
+#ifdef USE_SHMEM
+    Transaction trans;
+    CKYBuffer snapshot;
+    ObjectConstIter iter;
+    CKYStatus status;
+    CKYSize nameSize = personName ? strlen(personName) : 0;
+
+    if (trans.begin(conn) != CKYSUCCESS) {
+	return;
+    }
+    if (!shmem.isValid() || !shmem.CUIDIsEqual(identity) ||
+		shmem.getDataVersion() != dataVersion || nameSize > 0xffff) {
+	return;
+    }
+    CKYBuffer_InitEmpty(&snapshot);
+    status = CKYBuffer_AppendShort(&snapshot, SHMEM_SNAPSHOT_VERSION);
+    if (status == CKYSUCCESS) 
+	status = CKYBuffer_AppendShort(&snapshot, dataVersion);
+    if (status == CKYSUCCESS) status = CKYBuffer_AppendCopy(&snapshot, identity);
+    if (status == CKYSUCCESS) status = CKYBuffer_AppendChar(&snapshot, 
+			(mECC ? 1 : 0) | (fullTokenName ? 2 : 0));
+    if (status == CKYSUCCESS) 
+	status = CKYBuffer_AppendShort(&snapshot, nameSize);
+    if (status == CKYSUCCESS) status = CKYBuffer_AppendData(&snapshot,
+					(const CKYByte *)personName, nameSize);
+    if (status == CKYSUCCESS) 
+	status = CKYBuffer_AppendLong(&snapshot, tokenObjects.size());
+    for (iter = tokenObjects.begin(); 
+		(status == CKYSUCCESS) && (iter != tokenObjects.end()); ++iter) {
+	status = iter->saveSnapshot(&snapshot);
+    }
+    if ((status == CKYSUCCESS) && !shmem.writeSnapshot(&snapshot)) {
+	log->log("Object snapshot (%d bytes) doesn't fit shared memory\n",
+						CKYBuffer_Size(&snapshot));
+    }
+    CKYBuffer_FreeData(&snapshot);
+#endif
 }
 
 void
@@ -3464,6 +4519,10 @@ Slot::loadReaderObject(void)
 void
 Slot::closeAllSessions()
 {
+    SessionIter iter;
+    for( iter = sessions.begin(); iter != sessions.end(); ++iter ) {
+        releaseSessionObjects(*iter);
+    }
     sessions.clear();
     log->log("cleared all sessions\n");
 }
@@ -3494,7 +4553,11 @@ SlotList::getSessionInfo(CK_SESSION_HANDLE hSession,
 
     decomposeSessionHandle(hSession, slotID, suffix);
 
-    slots[slotIDToIndex(slotID)]->getSessionInfo(suffix, pInfo);
+    if( slotID == TOKEN_POOL_SLOT_ID ) {
+        pool->getSessionInfo(suffix, pInfo);
+    } else {
+        slots[slotIDToIndex(slotID)]->getSessionInfo(suffix, pInfo);
+    }
 
     pInfo->slotID = slotID;
 }
@@ -3555,6 +4618,10 @@ SlotList::login(CK_SESSION_HANDLE hSession, CK_USER_TYPE user,
 
     decomposeSessionHandle(hSession, slotID, suffix);
 
+    if( slotID == TOKEN_POOL_SLOT_ID ) {
+        pool->login(suffix, user, pPin, ulPinLen);
+        return;
+    }
     slots[slotIDToIndex(slotID)]->login(suffix, user, pPin, ulPinLen);
 }
 
@@ -3656,13 +4723,7 @@ Slot::login(SessionHandleSuffix handleSuffix, CK_USER_TYPE user,
 
 void
 Slot::attemptLogin(CK_USER_TYPE user, bool flushPin) {
-    if (state & GOV_CARD) {
-	attemptCACLogin();
-    } else if (state & P15_CARD) {
-	attemptP15Login(user);
-    } else {
-	oldAttemptLogin();
-    }
+    driver->attemptLogin(this, user);
     if (flushPin && (user == CKU_CONTEXT_SPECIFIC)) {
 	contextPinCache.clearPin();
     }
@@ -3788,6 +4849,53 @@ Slot::oldAttemptLogin()
     loggedIn = true;
 }
 
+/*
+ * ask the card whether user is still logged in, without presenting the
+ * PIN. Anything we can't interpret counts as logged in, the crypto op
+ * itself will tell us otherwise.
+ */
+bool
+Slot::isCardLoggedIn(CK_USER_TYPE user)
+{
+    return driver->isCardLoggedIn(this, user);
+}
+
+bool
+Slot::pinStatusLoggedIn(CKYStatus status, CKYISOStatus result)
+{
+    if (status == CKYSCARDERR) {
+	handleConnectionError();
+    }
+    /* 0x63Cx is the tries left counter, the PIN isn't verified */
+    return (status == CKYSUCCESS) || ((result & 0xff00) != 0x6300);
+}
+
+/*
+ * if other applications have been logging the card out from under us,
+ * check the login state before the operation and present the cached PIN
+ * up front, rather than after the operation fails. Returns true if the
+ * PIN was presented.
+ */
+bool
+Slot::presentCachedPin(const PKCS11Object *key)
+{
+    CK_USER_TYPE user = key->getUser();
+
+    if (!probeLogin || isVersion1Key || !userPinCache(user)->isValid()) {
+	return false;
+    }
+    if (isCardLoggedIn(user)) {
+	return false;
+    }
+    try {
+	attemptLogin(user, true);
+    } catch(PKCS11Exception& ) {
+	/* see the reauthentication in performRSAOp */
+	throw PKCS11Exception(CKR_DEVICE_ERROR);
+    }
+    return true;
+}
+
 // should already be in a transaction, and applet selected
 void
 Slot::attemptCoolKeyLogin(const char *pin)
@@ -3822,6 +4930,10 @@ SlotList::logout(CK_SESSION_HANDLE hSession)
 
     decomposeSessionHandle(hSession, slotID, suffix);
 
+    if( slotID == TOKEN_POOL_SLOT_ID ) {
+        pool->logout(suffix);
+        return;
+    }
     slots[slotIDToIndex(slotID)]->logout(suffix);
 }
 
@@ -3904,6 +5016,10 @@ SlotList::findObjectsInit(CK_SESSION_HANDLE hSession,
 
     decomposeSessionHandle(hSession, slotID, suffix);
 
+    if( slotID == TOKEN_POOL_SLOT_ID ) {
+        pool->findObjectsInit(suffix, pTemplate, ulCount);
+        return;
+    }
     slots[slotIDToIndex(slotID)]->findObjectsInit(suffix, pTemplate, ulCount);
 }
 
@@ -3928,6 +5044,16 @@ Slot::findObjectsInit(SessionHandleSuffix suffix, CK_ATTRIBUTE_PTR pTemplate,
             session->foundObjects.push_back(iter->getHandle());
         }
     }
+    // session objects are seen by every session of the application
+    SessionConstIter owner;
+    for( owner = sessions.begin(); owner != sessions.end(); ++owner) {
+        for( iter = owner->objects.begin(); iter != owner->objects.end();
+								++iter) {
+            if( iter->matchesTemplate(pTemplate, ulCount) ) {
+                session->foundObjects.push_back(iter->getHandle());
+            }
+        }
+    }
 
     session->curFoundObject = session->foundObjects.begin();
 }
@@ -3941,6 +5067,11 @@ SlotList::findObjects(CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE_PTR phObject,
 
     decomposeSessionHandle(hSession, slotID, suffix);
 
+    if( slotID == TOKEN_POOL_SLOT_ID ) {
+        pool->findObjects(suffix, phObject, ulMaxObjectCount,
+            pulObjectCount);
+        return;
+    }
     slots[slotIDToIndex(slotID)]->findObjects(suffix, phObject,
         ulMaxObjectCount, pulObjectCount);
 }
@@ -3976,6 +5107,10 @@ SlotList::getAttributeValue(CK_SESSION_HANDLE hSession,
 
     decomposeSessionHandle(hSession, slotID, suffix);
 
+    if( slotID == TOKEN_POOL_SLOT_ID ) {
+        pool->getAttributeValue(suffix, hObject, pTemplate, ulCount);
+        return;
+    }
     slots[slotIDToIndex(slotID)]->getAttributeValue(suffix, hObject,
         pTemplate, ulCount);
 }
@@ -3990,14 +5125,62 @@ Slot::getAttributeValue(SessionHandleSuffix suffix,
         throw PKCS11Exception(CKR_SESSION_HANDLE_INVALID);
     }
 
-    ObjectConstIter iter = find_if(tokenObjects.begin(), tokenObjects.end(),
-        ObjectHandleMatch(hObject));
+    const PKCS11Object *object = findObject(hObject);
 
-    if (iter == tokenObjects.end()) {
+    if (object == NULL) {
         throw PKCS11Exception(CKR_OBJECT_HANDLE_INVALID);
     }
 
-    iter->getAttributeValue(pTemplate, ulCount, log);
+    object->getAttributeValue(pTemplate, ulCount, log);
+}
+
+void
+SlotList::destroyObject(CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE hObject)
+{
+    CK_SLOT_ID slotID;
+    SessionHandleSuffix suffix;
+
+    decomposeSessionHandle(hSession, slotID, suffix);
+
+    if( slotID == TOKEN_POOL_SLOT_ID ) {
+        // the pool shows card objects only
+        throw PKCS11Exception(CKR_TOKEN_WRITE_PROTECTED);
+    }
+    slots[slotIDToIndex(slotID)]->destroyObject(suffix, hObject);
+}
+
+void
+Slot::destroyObject(SessionHandleSuffix suffix, CK_OBJECT_HANDLE hObject)
+{
+    refreshTokenState();
+
+    if( ! isValidSession(suffix) ) {
+        throw PKCS11Exception(CKR_SESSION_HANDLE_INVALID);
+    }
+
+    if( ObjectHandleTable::isSessionHandle(hObject) ) {
+        ObjectIter object;
+        SessionHandleSuffix owner;
+        if( !sessionObjectHandles.lookup(hObject, object, owner) ) {
+            throw PKCS11Exception(CKR_OBJECT_HANDLE_INVALID);
+        }
+        SessionIter session = findSession(owner);
+        // handles are released when their session closes
+        assert(session != sessions.end());
+        sessionObjectHandles.release(hObject);
+        session->objects.erase(object);
+        return;
+    }
+
+    ObjectIter iter = find_if(tokenObjects.begin(), tokenObjects.end(),
+        ObjectHandleMatch(hObject));
+    if( iter == tokenObjects.end() ) {
+        throw PKCS11Exception(CKR_OBJECT_HANDLE_INVALID);
+    }
+    if( iter->getClass() != CKO_SECRET_KEY ) {
+        throw PKCS11Exception(CKR_TOKEN_WRITE_PROTECTED);
+    }
+    tokenObjects.erase(iter);
 }
 
 void
@@ -4009,6 +5192,10 @@ SlotList::signInit(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism,
 
     decomposeSessionHandle(hSession, slotID, suffix);
 
+    if( slotID == TOKEN_POOL_SLOT_ID ) {
+        pool->signInit(suffix, pMechanism, hKey);
+        return;
+    }
     slots[slotIDToIndex(slotID)]->signInit(suffix, pMechanism, hKey);
 }
 
@@ -4021,6 +5208,10 @@ SlotList::decryptInit(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism,
 
     decomposeSessionHandle(hSession, slotID, suffix);
 
+    if( slotID == TOKEN_POOL_SLOT_ID ) {
+        pool->decryptInit(suffix, pMechanism, hKey);
+        return;
+    }
     slots[slotIDToIndex(slotID)]->decryptInit(suffix, pMechanism, hKey);
 }
 
@@ -4034,10 +5225,48 @@ SlotList::sign(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pData,
 
     decomposeSessionHandle(hSession, slotID, suffix);
 
+    if( slotID == TOKEN_POOL_SLOT_ID ) {
+        pool->sign(suffix, pData, ulDataLen, pSignature,
+            pulSignatureLen);
+        return;
+    }
     slots[slotIDToIndex(slotID)]->sign(suffix, pData, ulDataLen,
         pSignature, pulSignatureLen);
 }
 
+void
+SlotList::signUpdate(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pPart,
+        CK_ULONG ulPartLen)
+{
+    CK_SLOT_ID slotID;
+    SessionHandleSuffix suffix;
+
+    decomposeSessionHandle(hSession, slotID, suffix);
+
+    if( slotID == TOKEN_POOL_SLOT_ID ) {
+        pool->signUpdate(suffix, pPart, ulPartLen);
+        return;
+    }
+    slots[slotIDToIndex(slotID)]->signUpdate(suffix, pPart, ulPartLen);
+}
+
+void
+SlotList::signFinal(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pSignature,
+        CK_ULONG_PTR pulSignatureLen)
+{
+    CK_SLOT_ID slotID;
+    SessionHandleSuffix suffix;
+
+    decomposeSessionHandle(hSession, slotID, suffix);
+
+    if( slotID == TOKEN_POOL_SLOT_ID ) {
+        pool->signFinal(suffix, pSignature, pulSignatureLen);
+        return;
+    }
+    slots[slotIDToIndex(slotID)]->signFinal(suffix, pSignature,
+        pulSignatureLen);
+}
+
 void
 SlotList::decrypt(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pData,
         CK_ULONG ulDataLen, CK_BYTE_PTR pDecryptedData,
@@ -4048,10 +5277,246 @@ SlotList::decrypt(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pData,
 
     decomposeSessionHandle(hSession, slotID, suffix);
 
+    if( slotID == TOKEN_POOL_SLOT_ID ) {
+        pool->decrypt(suffix, pData, ulDataLen, pDecryptedData,
+            pulDecryptedDataLen);
+        return;
+    }
     slots[slotIDToIndex(slotID)]->decrypt(suffix, pData, ulDataLen,
         pDecryptedData, pulDecryptedDataLen);
 }
 
+// the pool has no secret keys, so no multi part operations
+void
+SlotList::decryptUpdate(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pPart,
+        CK_ULONG ulPartLen, CK_BYTE_PTR pOutput, CK_ULONG_PTR pulOutputLen)
+{
+    CK_SLOT_ID slotID;
+    SessionHandleSuffix suffix;
+
+    decomposeSessionHandle(hSession, slotID, suffix);
+
+    if( slotID == TOKEN_POOL_SLOT_ID ) {
+        throw PKCS11Exception(CKR_OPERATION_NOT_INITIALIZED);
+    }
+    slots[slotIDToIndex(slotID)]->decryptUpdate(suffix, pPart, ulPartLen,
+        pOutput, pulOutputLen);
+}
+
+void
+SlotList::decryptFinal(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pOutput,
+        CK_ULONG_PTR pulOutputLen)
+{
+    CK_SLOT_ID slotID;
+    SessionHandleSuffix suffix;
+
+    decomposeSessionHandle(hSession, slotID, suffix);
+
+    if( slotID == TOKEN_POOL_SLOT_ID ) {
+        throw PKCS11Exception(CKR_OPERATION_NOT_INITIALIZED);
+    }
+    slots[slotIDToIndex(slotID)]->decryptFinal(suffix, pOutput, pulOutputLen);
+}
+
+void
+SlotList::verifyInit(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism,
+        CK_OBJECT_HANDLE hKey)
+{
+    CK_SLOT_ID slotID;
+    SessionHandleSuffix suffix;
+
+    decomposeSessionHandle(hSession, slotID, suffix);
+
+    if( slotID == TOKEN_POOL_SLOT_ID ) {
+        pool->verifyInit(suffix, pMechanism, hKey);
+        return;
+    }
+    slots[slotIDToIndex(slotID)]->verifyInit(suffix, pMechanism, hKey);
+}
+
+void
+SlotList::verify(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pData,
+        CK_ULONG ulDataLen, CK_BYTE_PTR pSignature, CK_ULONG ulSignatureLen)
+{
+    CK_SLOT_ID slotID;
+    SessionHandleSuffix suffix;
+
+    decomposeSessionHandle(hSession, slotID, suffix);
+
+    if( slotID == TOKEN_POOL_SLOT_ID ) {
+        pool->verify(suffix, pData, ulDataLen, pSignature,
+            ulSignatureLen);
+        return;
+    }
+    slots[slotIDToIndex(slotID)]->verify(suffix, pData, ulDataLen, pSignature,
+            ulSignatureLen);
+}
+
+void
+SlotList::encryptInit(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism,
+        CK_OBJECT_HANDLE hKey)
+{
+    CK_SLOT_ID slotID;
+    SessionHandleSuffix suffix;
+
+    decomposeSessionHandle(hSession, slotID, suffix);
+
+    if( slotID == TOKEN_POOL_SLOT_ID ) {
+        pool->encryptInit(suffix, pMechanism, hKey);
+        return;
+    }
+    slots[slotIDToIndex(slotID)]->encryptInit(suffix, pMechanism, hKey);
+}
+
+void
+SlotList::encrypt(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pData,
+        CK_ULONG ulDataLen, CK_BYTE_PTR pEncryptedData,
+        CK_ULONG_PTR pulEncryptedDataLen)
+{
+    CK_SLOT_ID slotID;
+    SessionHandleSuffix suffix;
+
+    decomposeSessionHandle(hSession, slotID, suffix);
+
+    if( slotID == TOKEN_POOL_SLOT_ID ) {
+        pool->encrypt(suffix, pData, ulDataLen, pEncryptedData,
+            pulEncryptedDataLen);
+        return;
+    }
+    slots[slotIDToIndex(slotID)]->encrypt(suffix, pData, ulDataLen, pEncryptedData,
+            pulEncryptedDataLen);
+}
+
+void
+SlotList::encryptUpdate(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pPart,
+        CK_ULONG ulPartLen, CK_BYTE_PTR pOutput, CK_ULONG_PTR pulOutputLen)
+{
+    CK_SLOT_ID slotID;
+    SessionHandleSuffix suffix;
+
+    decomposeSessionHandle(hSession, slotID, suffix);
+
+    if( slotID == TOKEN_POOL_SLOT_ID ) {
+        throw PKCS11Exception(CKR_OPERATION_NOT_INITIALIZED);
+    }
+    slots[slotIDToIndex(slotID)]->encryptUpdate(suffix, pPart, ulPartLen,
+        pOutput, pulOutputLen);
+}
+
+void
+SlotList::encryptFinal(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pOutput,
+        CK_ULONG_PTR pulOutputLen)
+{
+    CK_SLOT_ID slotID;
+    SessionHandleSuffix suffix;
+
+    decomposeSessionHandle(hSession, slotID, suffix);
+
+    if( slotID == TOKEN_POOL_SLOT_ID ) {
+        throw PKCS11Exception(CKR_OPERATION_NOT_INITIALIZED);
+    }
+    slots[slotIDToIndex(slotID)]->encryptFinal(suffix, pOutput, pulOutputLen);
+}
+
+void
+SlotList::verifyRecoverInit(CK_SESSION_HANDLE hSession,
+        CK_MECHANISM_PTR pMechanism, CK_OBJECT_HANDLE hKey)
+{
+    CK_SLOT_ID slotID;
+    SessionHandleSuffix suffix;
+
+    decomposeSessionHandle(hSession, slotID, suffix);
+
+    if( slotID == TOKEN_POOL_SLOT_ID ) {
+        pool->verifyRecoverInit(suffix, pMechanism, hKey);
+        return;
+    }
+    slots[slotIDToIndex(slotID)]->verifyRecoverInit(suffix, pMechanism, hKey);
+}
+
+void
+SlotList::verifyRecover(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pSignature,
+        CK_ULONG ulSignatureLen, CK_BYTE_PTR pData, CK_ULONG_PTR pulDataLen)
+{
+    CK_SLOT_ID slotID;
+    SessionHandleSuffix suffix;
+
+    decomposeSessionHandle(hSession, slotID, suffix);
+
+    if( slotID == TOKEN_POOL_SLOT_ID ) {
+        pool->verifyRecover(suffix, pSignature, ulSignatureLen, pData,
+            pulDataLen);
+        return;
+    }
+    slots[slotIDToIndex(slotID)]->verifyRecover(suffix, pSignature, ulSignatureLen, pData,
+            pulDataLen);
+}
+
+void
+SlotList::digestInit(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism)
+{
+    CK_SLOT_ID slotID;
+    SessionHandleSuffix suffix;
+
+    decomposeSessionHandle(hSession, slotID, suffix);
+
+    if( slotID == TOKEN_POOL_SLOT_ID ) {
+        pool->digestInit(suffix, pMechanism);
+        return;
+    }
+    slots[slotIDToIndex(slotID)]->digestInit(suffix, pMechanism);
+}
+
+void
+SlotList::digest(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pData,
+        CK_ULONG ulDataLen, CK_BYTE_PTR pDigest, CK_ULONG_PTR pulDigestLen)
+{
+    CK_SLOT_ID slotID;
+    SessionHandleSuffix suffix;
+
+    decomposeSessionHandle(hSession, slotID, suffix);
+
+    if( slotID == TOKEN_POOL_SLOT_ID ) {
+        pool->digest(suffix, pData, ulDataLen, pDigest,
+            pulDigestLen);
+        return;
+    }
+    slots[slotIDToIndex(slotID)]->digest(suffix, pData, ulDataLen, pDigest,
+            pulDigestLen);
+}
+
+void
+SlotList::digestUpdate(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pPart,
+        CK_ULONG ulPartLen)
+{
+    CK_SLOT_ID slotID;
+    SessionHandleSuffix suffix;
+
+    decomposeSessionHandle(hSession, slotID, suffix);
+
+    if( slotID == TOKEN_POOL_SLOT_ID ) {
+        pool->digestUpdate(suffix, pPart, ulPartLen);
+        return;
+    }
+    slots[slotIDToIndex(slotID)]->digestUpdate(suffix, pPart, ulPartLen);
+}
+
+void
+SlotList::digestFinal(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pDigest,
+        CK_ULONG_PTR pulDigestLen)
+{
+    CK_SLOT_ID slotID;
+    SessionHandleSuffix suffix;
+
+    decomposeSessionHandle(hSession, slotID, suffix);
+
+    if( slotID == TOKEN_POOL_SLOT_ID ) {
+        pool->digestFinal(suffix, pDigest, pulDigestLen);
+        return;
+    }
+    slots[slotIDToIndex(slotID)]->digestFinal(suffix, pDigest, pulDigestLen);
+}
+
 void
 SlotList::seedRandom(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pData,
         CK_ULONG ulDataLen)
@@ -4061,6 +5526,10 @@ SlotList::seedRandom(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pData,
 
     decomposeSessionHandle(hSession, slotID, suffix);
 
+    if( slotID == TOKEN_POOL_SLOT_ID ) {
+        pool->seedRandom(suffix, pData, ulDataLen);
+        return;
+    }
     slots[slotIDToIndex(slotID)]->seedRandom(suffix, pData, ulDataLen);
 }
 
@@ -4073,6 +5542,10 @@ SlotList::generateRandom(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pData,
 
     decomposeSessionHandle(hSession, slotID, suffix);
 
+    if( slotID == TOKEN_POOL_SLOT_ID ) {
+        pool->generateRandom(suffix, pData, ulDataLen);
+        return;
+    }
     slots[slotIDToIndex(slotID)]->generateRandom(suffix, pData, ulDataLen);
 }
 
@@ -4087,6 +5560,11 @@ SlotList::derive(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism,
 
     decomposeSessionHandle(hSession, slotID, suffix);
 
+    if( slotID == TOKEN_POOL_SLOT_ID ) {
+        // the derived key would live on one member only
+        throw PKCS11Exception(CKR_FUNCTION_NOT_SUPPORTED,
+            "Key derivation is not supported on the token pool\n");
+    }
     slots[slotIDToIndex(slotID)]->derive(suffix, pMechanism, hBaseKey, pTemplate, ulAttributeCount, phKey);
 
 }
@@ -4112,6 +5590,22 @@ Slot::objectToKeyNum(const PKCS11Object *key)
     if( getObjectClass(id) != 'k' ) {
         throw PKCS11Exception(CKR_KEY_HANDLE_INVALID);
     }
+    if (state & GOV_CARD) {
+	// only the private keys name a key on the card, see CACPrivKey
+	int keyID = (id >> 16) & 0xff;
+
+	if (key->getClass() != CKO_PRIVATE_KEY) {
+	    throw PKCS11Exception(CKR_KEY_HANDLE_INVALID);
+	}
+	if (keyID >= '0' && keyID < '0' + MAX_CERT_SLOTS) {
+	    return keyID - '0';
+	}
+	if ((state & PIV_CARD) && keyID >= PIV_RETIRED_KEY_ID &&
+			keyID < PIV_RETIRED_KEY_ID + PIV_RETIRED_KEYS) {
+	    return PIV_RETIRED_INSTANCE + keyID - PIV_RETIRED_KEY_ID;
+	}
+        throw PKCS11Exception(CKR_KEY_HANDLE_INVALID);
+    }
     unsigned short keyNum = getObjectIndex(id);
     if( keyNum > 9 ) {
         throw PKCS11Exception(CKR_KEY_HANDLE_INVALID);
@@ -4147,7 +5641,24 @@ Slot::signInit(SessionHandleSuffix suffix, CK_MECHANISM_PTR pMechanism,
         throw PKCS11Exception(CKR_SESSION_HANDLE_INVALID);
     }
 
-    session->signatureState.initialize(getKeyFromHandle(hKey));
+    if( pMechanism == NULL ) {
+        throw PKCS11Exception(CKR_ARGUMENTS_BAD);
+    }
+    PKCS11Object *key = getKeyFromHandle(hKey);
+    CK_MECHANISM_TYPE rawMech;
+    CK_MECHANISM_TYPE hashMech =
+		HostDigest::getSignDigest(pMechanism->mechanism, &rawMech);
+
+    // the hash and sign mechanisms say which kind of key they want
+    if( hashMech && ((rawMech == CKM_ECDSA) !=
+			(key->getKeyType() == PKCS11Object::ecc)) ) {
+        throw PKCS11Exception(CKR_KEY_TYPE_INCONSISTENT);
+    }
+    session->signatureState.initialize(key, pMechanism->mechanism);
+    if( hashMech ) {
+        session->signatureState.digest.init(hashMech);
+        session->signatureState.hashing = true;
+    }
 }
 
 void
@@ -4160,6 +5671,14 @@ Slot::decryptInit(SessionHandleSuffix suffix, CK_MECHANISM_PTR pMechanism,
         throw PKCS11Exception(CKR_SESSION_HANDLE_INVALID);
     }
 
+    if( pMechanism &&
+		CipherState::isCipherMechanism(pMechanism->mechanism) ) {
+        cipherInit(suffix, pMechanism, hKey, CKA_DECRYPT);
+        return;
+    }
+    if( session->decryptCipher.isActive() ) {
+        throw PKCS11Exception(CKR_OPERATION_ACTIVE);
+    }
     session->decryptionState.initialize(getKeyFromHandle(hKey));
 }
 
@@ -4414,6 +5933,92 @@ Slot::sign(SessionHandleSuffix suffix, CK_BYTE_PTR pData,
         CK_ULONG ulDataLen, CK_BYTE_PTR pSignature,
         CK_ULONG_PTR pulSignatureLen)
 {
+    SessionIter session = findSession(suffix);
+    if( session == sessions.end() ) {
+        throw PKCS11Exception(CKR_SESSION_HANDLE_INVALID);
+    }
+    CryptOpState &opState = session->signatureState;
+
+    if( !opState.hashing ) {
+        signData(suffix, pData, ulDataLen, pSignature, pulSignatureLen);
+        return;
+    }
+    // a result means this is the second call after a length query, the
+    // data has been hashed and signed already
+    if( CKYBuffer_Size(&opState.result) == 0 ) {
+        if( pData == NULL && ulDataLen != 0 ) {
+            opState.hashing = false;
+            throw PKCS11Exception(CKR_ARGUMENTS_BAD);
+        }
+        opState.digest.update(pData, ulDataLen);
+    }
+    signFinal(suffix, pSignature, pulSignatureLen);
+}
+
+void
+Slot::signUpdate(SessionHandleSuffix suffix, CK_BYTE_PTR pPart,
+        CK_ULONG ulPartLen)
+{
+    SessionIter session = findSession(suffix);
+    if( session == sessions.end() ) {
+        throw PKCS11Exception(CKR_SESSION_HANDLE_INVALID);
+    }
+    CryptOpState &opState = session->signatureState;
+
+    if( opState.state != CryptOpState::IN_PROCESS ) {
+        throw PKCS11Exception(CKR_OPERATION_NOT_INITIALIZED);
+    }
+    if( !opState.hashing ) {
+        throw PKCS11Exception(CKR_FUNCTION_NOT_SUPPORTED,
+            "Mechanism 0x%lx signs in one part only\n", opState.mechanism);
+    }
+    if( pPart == NULL && ulPartLen != 0 ) {
+        opState.hashing = false;
+        throw PKCS11Exception(CKR_ARGUMENTS_BAD);
+    }
+    opState.digest.update(pPart, ulPartLen);
+}
+
+void
+Slot::signFinal(SessionHandleSuffix suffix, CK_BYTE_PTR pSignature,
+        CK_ULONG_PTR pulSignatureLen)
+{
+    SessionIter session = findSession(suffix);
+    if( session == sessions.end() ) {
+        throw PKCS11Exception(CKR_SESSION_HANDLE_INVALID);
+    }
+    CryptOpState &opState = session->signatureState;
+
+    if( opState.state != CryptOpState::IN_PROCESS || !opState.hashing ) {
+        throw PKCS11Exception(CKR_OPERATION_NOT_INITIALIZED);
+    }
+
+    CKYByte input[DIGEST_MAX_SIGN_INPUT];
+    CK_ULONG inputLen = 0;
+    if( CKYBuffer_Size(&opState.result) == 0 ) {
+        CK_MECHANISM_TYPE rawMech;
+        HostDigest::getSignDigest(opState.mechanism, &rawMech);
+        inputLen = opState.digest.finalForSign(rawMech, input);
+    }
+    try {
+        signData(suffix, input, inputLen, pSignature, pulSignatureLen);
+    } catch (PKCS11Exception &e) {
+        // the digest is gone, only a short buffer may be tried again
+        if( e.getCRV() != CKR_BUFFER_TOO_SMALL ) {
+            opState.hashing = false;
+        }
+        throw;
+    }
+    if( pSignature != NULL ) {
+        opState.hashing = false;
+    }
+}
+
+void
+Slot::signData(SessionHandleSuffix suffix, CK_BYTE_PTR pData,
+        CK_ULONG ulDataLen, CK_BYTE_PTR pSignature,
+        CK_ULONG_PTR pulSignatureLen)
+{
 
     refreshTokenState();
     SessionIter session = findSession(suffix);
@@ -4453,11 +6058,31 @@ Slot::decrypt(SessionHandleSuffix suffix, CK_BYTE_PTR pData,
         CK_ULONG ulDataLen, CK_BYTE_PTR pDecryptedData,
         CK_ULONG_PTR pulDecryptedDataLen)
 {
+    CipherState &cipher = getCipher(suffix, CKA_DECRYPT);
+    if( cipher.isActive() ) {
+        cipher.cryptAll(pData, ulDataLen, pDecryptedData, pulDecryptedDataLen);
+        return;
+    }
     RSADecryptParams params(CryptParams::DEFAULT_KEY_SIZE);
     cryptRSA(suffix, pData, ulDataLen, pDecryptedData, pulDecryptedDataLen,
         params);
 }
 
+void
+Slot::decryptUpdate(SessionHandleSuffix suffix, CK_BYTE_PTR pPart,
+        CK_ULONG ulPartLen, CK_BYTE_PTR pOutput, CK_ULONG_PTR pulOutputLen)
+{
+    getCipher(suffix, CKA_DECRYPT).update(pPart, ulPartLen, pOutput,
+							pulOutputLen);
+}
+
+void
+Slot::decryptFinal(SessionHandleSuffix suffix, CK_BYTE_PTR pOutput,
+        CK_ULONG_PTR pulOutputLen)
+{
+    getCipher(suffix, CKA_DECRYPT).final(pOutput, pulOutputLen);
+}
+
 void
 Slot::cryptRSA(SessionHandleSuffix suffix, CK_BYTE_PTR pInput,
         CK_ULONG ulInputLen, CK_BYTE_PTR pOutput,
@@ -4485,14 +6110,14 @@ Slot::cryptRSA(SessionHandleSuffix suffix, CK_BYTE_PTR pInput,
         params.setKeySize(keySize);
 
     if( CKYBuffer_Size(result) == 0 ) {
-	unsigned int maxSize = param.getKeySize()/8;
+	unsigned int maxSize = params.getKeySize()/8;
 
         // we haven't already peformed the decryption, so do it now.
         if( pInput == NULL || ulInputLen == 0) {
             throw PKCS11Exception(CKR_DATA_LEN_RANGE);
         }
 	if (ulInputLen > maxSize) {
-	    ulInputlen = maxSize;
+	    ulInputLen = maxSize;
 	}
 	// OK, this is gross. We should get our own C++ like buffer
         // management at this point. This code has nothing to do with
@@ -4537,6 +6162,308 @@ Slot::cryptRSA(SessionHandleSuffix suffix, CK_BYTE_PTR pInput,
     *pulOutputLen = CKYBuffer_Size(result);
 }
 
+//
+// Public key operations. These are answered from the public key objects
+// read when the token was loaded, so unlike the private key operations
+// above they don't refresh the token state or talk to the card at all.
+//
+static CryptOpState &
+publicOpState(Session &session, CK_ATTRIBUTE_TYPE use)
+{
+    switch (use) {
+    case CKA_ENCRYPT:
+	return session.encryptionState;
+    case CKA_VERIFY_RECOVER:
+	return session.verifyRecoverState;
+    }
+    return session.verifyState;
+}
+
+PKCS11Object *
+Slot::getPublicKeyFromHandle(CK_OBJECT_HANDLE hKey, CK_ATTRIBUTE_TYPE use)
+{
+    ObjectIter iter = find_if(tokenObjects.begin(), tokenObjects.end(),
+        ObjectHandleMatch(hKey));
+
+    if( iter == tokenObjects.end() ) {
+         throw PKCS11Exception(CKR_KEY_HANDLE_INVALID);
+    }
+    CK_OBJECT_CLASS objClass = iter->getClass();
+    if( objClass == CKO_PRIVATE_KEY ) {
+         throw PKCS11Exception(CKR_KEY_TYPE_INCONSISTENT);
+    }
+    if( objClass != CKO_PUBLIC_KEY ) {
+         throw PKCS11Exception(CKR_KEY_HANDLE_INVALID);
+    }
+    // keys that don't say are taken to allow it
+    const CKYBuffer *allowed = iter->getAttribute(use);
+    if( allowed && CKYBuffer_Size(allowed) == sizeof(CK_BBOOL) &&
+		CKYBuffer_GetChar(allowed, 0) == FALSE ) {
+         throw PKCS11Exception(CKR_KEY_FUNCTION_NOT_PERMITTED);
+    }
+    return &*iter;
+}
+
+void
+Slot::publicOpInit(SessionHandleSuffix suffix, CK_MECHANISM_PTR pMechanism,
+        CK_OBJECT_HANDLE hKey, CK_ATTRIBUTE_TYPE use)
+{
+    SessionIter session = findSession(suffix);
+    if( session == sessions.end() ) {
+        throw PKCS11Exception(CKR_SESSION_HANDLE_INVALID);
+    }
+    if( pMechanism == NULL ) {
+        throw PKCS11Exception(CKR_ARGUMENTS_BAD);
+    }
+    PKCS11Object *key = getPublicKeyFromHandle(hKey, use);
+
+    HostPublicKey publicKey(key);
+    publicKey.checkMechanism(pMechanism->mechanism, use);
+
+    publicOpState(*session, use).initialize(key, pMechanism->mechanism);
+}
+
+//
+// C_Encrypt and C_VerifyRecover. A NULL output asks for the length and
+// leaves the operation going, as does a buffer that is too small. The
+// length given back for a NULL output is the modulus size, which is
+// never too small.
+//
+void
+Slot::publicOpOutput(SessionHandleSuffix suffix, CK_ATTRIBUTE_TYPE use,
+	CK_BYTE_PTR pInput, CK_ULONG ulInputLen, CK_BYTE_PTR pOutput,
+	CK_ULONG_PTR pulOutputLen)
+{
+    SessionIter session = findSession(suffix);
+    if( session == sessions.end() ) {
+        throw PKCS11Exception(CKR_SESSION_HANDLE_INVALID);
+    }
+    CryptOpState &opState = publicOpState(*session, use);
+    if( opState.state != CryptOpState::IN_PROCESS ) {
+        throw PKCS11Exception(CKR_OPERATION_NOT_INITIALIZED);
+    }
+    if( pulOutputLen == NULL || (pInput == NULL && ulInputLen != 0) ) {
+        opState.state = CryptOpState::NOT_INITIALIZED;
+        throw PKCS11Exception(CKR_ARGUMENTS_BAD);
+    }
+
+    CKYBuffer *result = &opState.result;
+    try {
+	HostPublicKey publicKey(opState.key);
+
+	if( pOutput == NULL ) {
+	    *pulOutputLen = publicKey.getOutputSize();
+	    return;
+	}
+	if( use == CKA_ENCRYPT ) {
+	    publicKey.encrypt(opState.mechanism, pInput, ulInputLen, result);
+	} else {
+	    publicKey.verifyRecover(opState.mechanism, pInput, ulInputLen,
+								result);
+	}
+    } catch (PKCS11Exception &) {
+        opState.state = CryptOpState::NOT_INITIALIZED;
+        CKYBuffer_Resize(result, 0);
+        throw;
+    }
+
+    if( *pulOutputLen < CKYBuffer_Size(result) ) {
+        *pulOutputLen = CKYBuffer_Size(result);
+        CKYBuffer_Resize(result, 0);
+        throw PKCS11Exception(CKR_BUFFER_TOO_SMALL);
+    }
+    memcpy(pOutput, CKYBuffer_Data(result), CKYBuffer_Size(result));
+    *pulOutputLen = CKYBuffer_Size(result);
+    opState.state = CryptOpState::NOT_INITIALIZED;
+    CKYBuffer_Resize(result, 0);
+}
+
+void
+Slot::verifyInit(SessionHandleSuffix suffix, CK_MECHANISM_PTR pMechanism,
+        CK_OBJECT_HANDLE hKey)
+{
+    publicOpInit(suffix, pMechanism, hKey, CKA_VERIFY);
+}
+
+void
+Slot::verify(SessionHandleSuffix suffix, CK_BYTE_PTR pData,
+        CK_ULONG ulDataLen, CK_BYTE_PTR pSignature, CK_ULONG ulSignatureLen)
+{
+    SessionIter session = findSession(suffix);
+    if( session == sessions.end() ) {
+        throw PKCS11Exception(CKR_SESSION_HANDLE_INVALID);
+    }
+    CryptOpState &opState = session->verifyState;
+    if( opState.state != CryptOpState::IN_PROCESS ) {
+        throw PKCS11Exception(CKR_OPERATION_NOT_INITIALIZED);
+    }
+    // good or bad, C_Verify finishes the operation
+    opState.state = CryptOpState::NOT_INITIALIZED;
+    if( pSignature == NULL || (pData == NULL && ulDataLen != 0) ) {
+        throw PKCS11Exception(CKR_ARGUMENTS_BAD);
+    }
+
+    HostPublicKey publicKey(opState.key);
+    publicKey.verify(opState.mechanism, pData, ulDataLen, pSignature,
+							ulSignatureLen);
+}
+
+void
+Slot::encryptInit(SessionHandleSuffix suffix, CK_MECHANISM_PTR pMechanism,
+        CK_OBJECT_HANDLE hKey)
+{
+    if( pMechanism &&
+		CipherState::isCipherMechanism(pMechanism->mechanism) ) {
+        cipherInit(suffix, pMechanism, hKey, CKA_ENCRYPT);
+        return;
+    }
+    if( getCipher(suffix, CKA_ENCRYPT).isActive() ) {
+        throw PKCS11Exception(CKR_OPERATION_ACTIVE);
+    }
+    publicOpInit(suffix, pMechanism, hKey, CKA_ENCRYPT);
+}
+
+void
+Slot::encrypt(SessionHandleSuffix suffix, CK_BYTE_PTR pData,
+        CK_ULONG ulDataLen, CK_BYTE_PTR pEncryptedData,
+        CK_ULONG_PTR pulEncryptedDataLen)
+{
+    CipherState &cipher = getCipher(suffix, CKA_ENCRYPT);
+    if( cipher.isActive() ) {
+        cipher.cryptAll(pData, ulDataLen, pEncryptedData,
+							pulEncryptedDataLen);
+        return;
+    }
+    publicOpOutput(suffix, CKA_ENCRYPT, pData, ulDataLen, pEncryptedData,
+							pulEncryptedDataLen);
+}
+
+void
+Slot::encryptUpdate(SessionHandleSuffix suffix, CK_BYTE_PTR pPart,
+        CK_ULONG ulPartLen, CK_BYTE_PTR pOutput, CK_ULONG_PTR pulOutputLen)
+{
+    getCipher(suffix, CKA_ENCRYPT).update(pPart, ulPartLen, pOutput,
+							pulOutputLen);
+}
+
+void
+Slot::encryptFinal(SessionHandleSuffix suffix, CK_BYTE_PTR pOutput,
+        CK_ULONG_PTR pulOutputLen)
+{
+    getCipher(suffix, CKA_ENCRYPT).final(pOutput, pulOutputLen);
+}
+
+//
+// Secret keys (the ones C_DeriveKey makes) are used on the host. Their
+// values never go near the card.
+//
+CipherState &
+Slot::getCipher(SessionHandleSuffix suffix, CK_ATTRIBUTE_TYPE use)
+{
+    SessionIter session = findSession(suffix);
+    if( session == sessions.end() ) {
+        throw PKCS11Exception(CKR_SESSION_HANDLE_INVALID);
+    }
+    return use == CKA_ENCRYPT ? session->encryptCipher :
+						session->decryptCipher;
+}
+
+void
+Slot::cipherInit(SessionHandleSuffix suffix, CK_MECHANISM_PTR pMechanism,
+        CK_OBJECT_HANDLE hKey, CK_ATTRIBUTE_TYPE use)
+{
+    CipherState &cipher = getCipher(suffix, use);
+    const PKCS11Object *key = findObject(hKey);
+    if( key == NULL ) {
+        throw PKCS11Exception(CKR_KEY_HANDLE_INVALID);
+    }
+    const CKYBuffer *attr = key->getAttribute(CKA_CLASS);
+    CK_ULONG value;
+    if( attr == NULL || CKYBuffer_Size(attr) != sizeof(value) ) {
+        throw PKCS11Exception(CKR_KEY_HANDLE_INVALID);
+    }
+    memcpy(&value, CKYBuffer_Data(attr), sizeof(value));
+    if( value != CKO_SECRET_KEY ) {
+        throw PKCS11Exception(CKR_KEY_TYPE_INCONSISTENT);
+    }
+    attr = key->getAttribute(CKA_KEY_TYPE);
+    if( attr && CKYBuffer_Size(attr) == sizeof(value) ) {
+        memcpy(&value, CKYBuffer_Data(attr), sizeof(value));
+        if( value != CKK_AES && value != CKK_GENERIC_SECRET ) {
+            throw PKCS11Exception(CKR_KEY_TYPE_INCONSISTENT);
+        }
+    }
+    // keys that don't say are taken to allow it
+    attr = key->getAttribute(use);
+    if( attr && CKYBuffer_Size(attr) == sizeof(CK_BBOOL) &&
+		CKYBuffer_GetChar(attr, 0) == FALSE ) {
+        throw PKCS11Exception(CKR_KEY_FUNCTION_NOT_PERMITTED);
+    }
+    attr = key->getAttribute(CKA_VALUE);
+    if( attr == NULL ) {
+        throw PKCS11Exception(CKR_KEY_TYPE_INCONSISTENT);
+    }
+    cipher.init(pMechanism, attr, use == CKA_ENCRYPT);
+}
+
+void
+Slot::verifyRecoverInit(SessionHandleSuffix suffix,
+        CK_MECHANISM_PTR pMechanism, CK_OBJECT_HANDLE hKey)
+{
+    publicOpInit(suffix, pMechanism, hKey, CKA_VERIFY_RECOVER);
+}
+
+void
+Slot::verifyRecover(SessionHandleSuffix suffix, CK_BYTE_PTR pSignature,
+        CK_ULONG ulSignatureLen, CK_BYTE_PTR pData, CK_ULONG_PTR pulDataLen)
+{
+    publicOpOutput(suffix, CKA_VERIFY_RECOVER, pSignature, ulSignatureLen,
+							pData, pulDataLen);
+}
+
+void
+Slot::digestInit(SessionHandleSuffix suffix, CK_MECHANISM_PTR pMechanism)
+{
+    SessionIter session = findSession(suffix);
+    if( session == sessions.end() ) {
+        throw PKCS11Exception(CKR_SESSION_HANDLE_INVALID);
+    }
+    session->digestState.init(pMechanism);
+}
+
+void
+Slot::digest(SessionHandleSuffix suffix, CK_BYTE_PTR pData,
+        CK_ULONG ulDataLen, CK_BYTE_PTR pDigest, CK_ULONG_PTR pulDigestLen)
+{
+    SessionIter session = findSession(suffix);
+    if( session == sessions.end() ) {
+        throw PKCS11Exception(CKR_SESSION_HANDLE_INVALID);
+    }
+    session->digestState.digestAll(pData, ulDataLen, pDigest, pulDigestLen);
+}
+
+void
+Slot::digestUpdate(SessionHandleSuffix suffix, CK_BYTE_PTR pPart,
+        CK_ULONG ulPartLen)
+{
+    SessionIter session = findSession(suffix);
+    if( session == sessions.end() ) {
+        throw PKCS11Exception(CKR_SESSION_HANDLE_INVALID);
+    }
+    session->digestState.update(pPart, ulPartLen);
+}
+
+void
+Slot::digestFinal(SessionHandleSuffix suffix, CK_BYTE_PTR pDigest,
+        CK_ULONG_PTR pulDigestLen)
+{
+    SessionIter session = findSession(suffix);
+    if( session == sessions.end() ) {
+        throw PKCS11Exception(CKR_SESSION_HANDLE_INVALID);
+    }
+    session->digestState.final(pDigest, pulDigestLen);
+}
+
 const CKYBuffer *
 Slot::getNonce()
 {
@@ -4584,6 +6511,10 @@ void Slot::signECC(SessionHandleSuffix suffix, CK_BYTE_PTR pInput,
         if( pInput == NULL || ulInputLen == 0) {
             throw PKCS11Exception(CKR_DATA_LEN_RANGE);
         }
+        // ECDSA uses the leftmost bits of a hash longer than the order
+        if( ulInputLen > (params.getKeySize() + 7)/8 ) {
+            ulInputLen = (params.getKeySize() + 7)/8;
+        }
 
         CKYBuffer input;
         CKYBuffer output;
@@ -4621,17 +6552,7 @@ Slot::selectKey(const PKCS11Object *key, bool retry)
 {
     /* P15 cards need to be reselected on retry because P15 must select
      * on authentication. PIV, CAC and Coolkeys do not */
-    if (retry && ((state & GOV_CARD) || ((state & P15_CARD) == 0))) {
-	return;
-    }
-    if (state & GOV_CARD) {
-	selectCACApplet(objectToKeyNum(key), true);
-    } else if (state & P15_CARD) {
-	selectPath(key->getObjectPath().getPath(), NULL);
-    } else {
-	selectApplet();
-    }
-    return;
+    driver->selectKey(this, key, retry);
 }
 
 void
@@ -4653,20 +6574,13 @@ Slot::performECCSignature(CKYBuffer *output, const CKYBuffer *input,
 
 retry:
     selectKey(key, loginAttempted);
-
-    if (state & PIV_CARD) {
-	status = PIVApplet_SignDecrypt(conn, pivKey, keySize/8, 0, 
-					input, output, &result);
-    } else if (state & CAC_CARD) {
-	status = CACApplet_SignDecrypt(conn, input, output, &result);
-    } else if (state & P15_CARD) {
-	status = P15Applet_SignDecrypt(conn, key->getKeyRef(), keySize/8,
-				CKY_DIR_ENCRYPT, input, output, &result);
-    } else {
-	status = CKYApplet_ComputeECCSignature(conn, objectToKeyNum(key), 
-					input, NULL, output, getNonce(), &result);
+    if (!loginAttempted && presentCachedPin(key)) {
+	loginAttempted = true;
+	goto retry;
     }
 
+    status = driver->eccSign(this, key, keySize, input, output, &result);
+
     if ((result == CKYISO_CONDITION_NOT_SATISFIED) ||
 		(result == CKYISO_SECURITY_NOT_SATISFIED)) {
 	result = (CKYStatus) CKYISO_UNAUTHORIZED;
@@ -4687,7 +6601,8 @@ retry:
         if (!isVersion1Key && !loginAttempted  &&
 		    userPinCache(key->getUser())->isValid() &&
                     (result == CKYISO_UNAUTHORIZED)) {
-            /* try to reauthenticate  */
+            /* try to reauthenticate, and check first from now on */
+            probeLogin = true;
             try {
 		attemptLogin(key->getUser(), true);
             } catch(PKCS11Exception& ) {
@@ -4729,21 +6644,14 @@ Slot::performRSAOp(CKYBuffer *output, const CKYBuffer *input,
 
 retry:
     selectKey(key, loginAttempted);
+    if (!loginAttempted && presentCachedPin(key)) {
+	loginAttempted = true;
+	goto retry;
+    }
 
 
-    if (state & PIV_CARD) {
-        status = PIVApplet_SignDecrypt(conn, pivKey, keySize/8, 0, 
-				input, output, &result);
-    } else if (state & CAC_CARD) {
-        status = CACApplet_SignDecrypt(conn, input, output, &result);
-    } else if (state & P15_CARD) {
-	status = P15Applet_SignDecrypt(conn, key->getKeyRef(), keySize/8,
-				direction, input, output, &result);
-    } else {
-        status = CKYApplet_ComputeCrypt(conn, objectToKeyNum(key), 
-		CKY_RSA_NO_PAD, direction, input, NULL, output, 
-		getNonce(), &result);
-    } 
+    status = driver->rsaCrypt(this, key, keySize, direction, input, output,
+								&result);
 
     /* map the ISO not logged in code to the coolkey one */
     if ((result == CKYISO_CONDITION_NOT_SATISFIED) ||
@@ -4764,7 +6672,8 @@ retry:
 	if (!isVersion1Key && !loginAttempted  && 
 				userPinCache(key->getUser())->isValid() &&
 					(result == CKYISO_UNAUTHORIZED)) {
-	    // try to reauthenticate 
+	    // try to reauthenticate, and check first from now on
+	    probeLogin = true;
 	    try {
 		attemptLogin(key->getUser(), true);
 	    } catch(PKCS11Exception& ) {
@@ -4786,7 +6695,7 @@ void
 Slot::seedRandom(SessionHandleSuffix suffix, CK_BYTE_PTR pData,
         CK_ULONG ulDataLen)
 {
-    if (state & (GOV_CARD|P15_CARD)) {
+    if (!driver->getCapabilities().onCardRNG) {
 	/* should throw unsupported */
 	throw PKCS11Exception(CKR_DEVICE_ERROR);
     }
@@ -4838,7 +6747,7 @@ void
 Slot::generateRandom(SessionHandleSuffix suffix, const CK_BYTE_PTR pData,
         CK_ULONG ulDataLen)
 {
-    if (state & (GOV_CARD|P15_CARD)) {
+    if (!driver->getCapabilities().onCardRNG) {
 	/* should throw unsupported */
 	throw PKCS11Exception(CKR_DEVICE_ERROR);
     }
@@ -5027,15 +6936,13 @@ void Slot::deriveECC(SessionHandleSuffix suffix, CK_MECHANISM_PTR pMechanism,
         throw PKCS11Exception(CKR_HOST_MEMORY);
     }
 
-    PKCS11Object *secret = NULL;
     *phKey = 0;
 
     if( CKYBuffer_Size(result) == 0 ) {
         try {
             performECCKeyAgreement(deriveMech, &publicDataBuffer, 
 			&secretKeyBuffer, opState.key, params.getKeySize());
-            CK_OBJECT_HANDLE keyObjectHandle = generateUnusedObjectHandle();
-            secret = createSecretKeyObject(keyObjectHandle, &secretKeyBuffer, 
+            *phKey = createSecretKeyObject(session, &secretKeyBuffer, 
 			pTemplate, ulAttributeCount);
         } catch(PKCS11Exception& e) {
             CKYBuffer_FreeData(&secretKeyBuffer);
@@ -5046,11 +6953,6 @@ void Slot::deriveECC(SessionHandleSuffix suffix, CK_MECHANISM_PTR pMechanism,
 
    CKYBuffer_FreeData(&secretKeyBuffer);
    CKYBuffer_FreeData(&publicDataBuffer);
-
-   if ( secret ) {
-       *phKey = secret->getHandle();
-        delete secret;
-   }
 }
 
 void
@@ -5072,23 +6974,14 @@ Slot::performECCKeyAgreement(CK_MECHANISM_TYPE deriveMech,
 
 retry:
     selectKey(key, loginAttempted);
-
-    if (state & PIV_CARD) {
-	status = PIVApplet_SignDecrypt(conn, pivKey, keySize/8, 1, 
-			publicDataBuffer, secretKeyBuffer, &result);
-    } else if (state & CAC_CARD) {
-	status = CACApplet_SignDecrypt(conn, publicDataBuffer, 
-			secretKeyBuffer, &result);
-    } else if (state & P15_CARD) {
-	/* status = P15Applet_SignDecrypt(conn, key->getKeyRef(), keySize/8,
-  				publicDataBuffer, secretKeyBuffer, &result); */
-	throw PKCS11Exception(CKR_FUNCTION_NOT_SUPPORTED);
-    } else {
-	status = CKYApplet_ComputeECCKeyAgreement(conn, objectToKeyNum(key),
-			publicDataBuffer , NULL, secretKeyBuffer, 
-			getNonce(), &result);
+    if (!loginAttempted && presentCachedPin(key)) {
+	loginAttempted = true;
+	goto retry;
     }
 
+    status = driver->eccDerive(this, key, keySize, publicDataBuffer,
+					secretKeyBuffer, &result);
+
     /* map the ISO not logged in code to the coolkey one */
     if ((result == CKYISO_CONDITION_NOT_SATISFIED) ||
 	 (result == CKYISO_SECURITY_NOT_SATISFIED)) {
@@ -5106,6 +6999,7 @@ retry:
         if (!isVersion1Key && !loginAttempted  &&
 				userPinCache(key->getUser())->isValid() &&
 					(result == CKYISO_UNAUTHORIZED)) {
+        probeLogin = true;
         try {
 	    attemptLogin(key->getUser(), true);
         } catch(PKCS11Exception& ) {
@@ -25,8 +25,14 @@
 #include "cky_applet.h"
 #include <string.h>
 #include <algorithm>
+#include <vector>
+#include <map>
+#include <string>
 #include "object.h"
 #include "machdep.h"
+#include "digest.h"
+#include "cipher.h"
+#include "carddriver.h"
 #include <assert.h>
 
 using std::list;
@@ -44,7 +50,9 @@ public:
     Transaction() : conn(0) { }
     CKYStatus begin(CKYCardConnection *conn_) {
 	CKYStatus status;
+	CKYCardConnection_Trace(conn_, "Transaction::begin", 1, NULL);
 	status = CKYCardConnection_BeginTransaction(conn_);
+	CKYCardConnection_Trace(conn_, "Transaction::begin", 0, NULL);
 	if (status == CKYSUCCESS) {
 	    conn = conn_;
 	}
@@ -56,7 +64,9 @@ public:
 
 	conn = NULL;
 	if (conn_) {
+	    CKYCardConnection_Trace(conn_, "Transaction::end", 1, NULL);
 	    status = CKYCardConnection_EndTransaction(conn_);
+	    CKYCardConnection_Trace(conn_, "Transaction::end", 0, NULL);
 	}
 	return status;
     }
@@ -65,13 +75,19 @@ public:
 
 #ifdef USE_SHMEM
 
-#define SHMEM_VERSION 0x0100 // 1.0
+#define SHMEM_VERSION 0x0101 // 1.1
+#define SHMEM_SNAPSHOT_VERSION 0x0101 // 1.1
 
 class SlotMemSegment {
 private:
-    char *segmentAddr;
-    int   segmentSize;
-    SHMem *segment;  // machine independed shared memory object
+    mutable char *segmentAddr;
+    mutable int   segmentSize;
+    mutable SHMem *segment;  // machine independed shared memory object
+    char *segName;
+    mutable bool attached;   // set once we've tried to map the segment
+    mutable OSLock attachLock;
+
+    bool attach() const;
 public:
     SlotMemSegment(const char *readerName);
     ~SlotMemSegment();
@@ -92,6 +108,8 @@ public:
     void writeData(const CKYBuffer *data);
     void readCACCert(CKYBuffer *data, CKYByte instance) const;
     void writeCACCert(const CKYBuffer *data, CKYByte instance);
+    void readSnapshot(CKYBuffer *snapshot) const;
+    bool writeSnapshot(const CKYBuffer *snapshot);
     void clearValid(CKYByte instance);
     void setValid();
 };
@@ -198,6 +216,10 @@ inline CK_SLOT_ID slotIndexToID(unsigned int index) {
     return index + 1;
 }
 
+inline CK_SLOT_ID sessionHandleToSlotID(CK_SESSION_HANDLE hSession) {
+    return hSession >> 24;
+}
+
 typedef list<PKCS11Object> ObjectList;
 typedef ObjectList::iterator ObjectIter;
 typedef ObjectList::const_iterator ObjectConstIter;
@@ -205,22 +227,85 @@ typedef ObjectList::const_iterator ObjectConstIter;
 typedef list<CK_OBJECT_HANDLE> ObjectHandleList;
 typedef ObjectHandleList::iterator ObjectHandleIter;
 
+//
+// The part of a PKCS #15 EF read so far, from start on. Objects that
+// share a file are sliced out of the one read.
+//
+class P15CachedFile {
+  private:
+    P15CachedFile &operator=(const P15CachedFile &); // not allowed
+  public:
+    CKYOffset start;
+    CKYBuffer data;
+    bool atEnd;		// data runs to the end of the file
+
+    P15CachedFile() : start(0), atEnd(false) { CKYBuffer_InitEmpty(&data); }
+    P15CachedFile(const P15CachedFile &cpy) : start(cpy.start),
+			atEnd(cpy.atEnd) { CKYBuffer_InitFromCopy(&data, &cpy.data); }
+    ~P15CachedFile() { CKYBuffer_FreeData(&data); }
+};
+
+//
+// State for one PKCS #15 object load: the files read, keyed by path, the
+// EF left selected, and the first certificate and private key seen for
+// each CKA_ID so keys and certs pair up without searching tokenObjects.
+// It goes away with the load, the card may change after.
+//
+class P15LoadCache {
+  private:
+    P15LoadCache(const P15LoadCache &); // not allowed
+    P15LoadCache &operator=(const P15LoadCache &);
+  public:
+    std::map<std::string, P15CachedFile> files;
+    CKYBuffer selected;	// empty if we don't know
+    std::map<std::string, ObjectIter> certs;
+    std::map<std::string, ObjectIter> keys;
+
+    P15LoadCache() { CKYBuffer_InitEmpty(&selected); }
+    ~P15LoadCache() { CKYBuffer_FreeData(&selected); }
+
+    static std::string toKey(const CKYBuffer *buf) {
+	return std::string((const char *)CKYBuffer_Data(buf),
+						CKYBuffer_Size(buf));
+    }
+};
+
+//
+// What we've learned about a kind of card, keyed by its ATR. It lives as
+// long as the Slot, so a card that is pulled and reinserted doesn't have
+// to be relearned.
+//
+struct ATRProfile {
+    CKYByte maxReadChunk;	// largest Le the card answers, 0 if unknown
+    CardType cardType;		// what the card turned out to be last time
+
+    ATRProfile() : maxReadChunk(0), cardType(CARD_TYPE_UNKNOWN) { }
+};
+typedef std::map<std::string, ATRProfile> ATRProfileMap;
+
 class CryptOpState {
   public:
     enum State { NOT_INITIALIZED, IN_PROCESS, FINALIZED };
     State state;
     CKYBuffer result;
     PKCS11Object *key;
+    CK_MECHANISM_TYPE mechanism;
+    bool hashing;		// hash and sign, data goes through digest
+    HostDigest digest;
 
-    CryptOpState() : state(NOT_INITIALIZED), key(NULL)
-				{ CKYBuffer_InitEmpty(&result); }
+    CryptOpState() : state(NOT_INITIALIZED), key(NULL), mechanism(0),
+			hashing(false) { CKYBuffer_InitEmpty(&result); }
     CryptOpState(const CryptOpState &cpy) : 
-				state(cpy.state), key(cpy.key) {
+		state(cpy.state), key(cpy.key), mechanism(cpy.mechanism),
+		hashing(cpy.hashing), digest(cpy.digest) {
 	CKYBuffer_InitFromCopy(&result, &cpy.result);
     }
     CryptOpState &operator=(const CryptOpState &cpy) {
 	state = cpy.state,
 	key = cpy.key;
+	mechanism = cpy.mechanism;
+	hashing = cpy.hashing;
+	digest = cpy.digest;
 	CKYBuffer_Replace(&result, 0, CKYBuffer_Data(&cpy.result),
 				CKYBuffer_Size(&cpy.result));
 	return *this;
@@ -229,8 +314,13 @@ class CryptOpState {
     void initialize(PKCS11Object *theKey) {
         state = IN_PROCESS;
         this->key = theKey;
+        hashing = false;
         CKYBuffer_Resize(&result, 0);
     }
+    void initialize(PKCS11Object *theKey, CK_MECHANISM_TYPE mech) {
+        initialize(theKey);
+        mechanism = mech;
+    }
 };
 
 class Session {
@@ -259,12 +349,62 @@ class Session {
     CryptOpState signatureState;
     CryptOpState decryptionState;
     CryptOpState keyAgreementState;
+    // public key operations, done on the host
+    CryptOpState verifyState;
+    CryptOpState encryptionState;
+    CryptOpState verifyRecoverState;
+    DigestState digestState;
+    // AES with a secret key, also on the host
+    CipherState encryptCipher;
+    CipherState decryptCipher;
+
+    // session objects (CKA_TOKEN false), they go away with the session
+    ObjectList objects;
 };
 
 typedef list<Session> SessionList;
 typedef SessionList::iterator SessionIter;
 typedef SessionList::const_iterator SessionConstIter;
 
+//
+// Handles for session objects. A handle is an index into the table plus
+// a generation count, so allocating, finding and releasing a handle don't
+// depend on how many objects there are, and a stale handle doesn't find
+// whatever object reuses its entry. The top bit keeps session object
+// handles clear of the token object handles.
+//
+#define SESSION_OBJECT_HANDLE_FLAG	0x80000000UL
+#define SESSION_OBJECT_INDEX_BITS	20
+#define SESSION_OBJECT_INDEX_MASK	((1UL << SESSION_OBJECT_INDEX_BITS) - 1)
+#define SESSION_OBJECT_GEN_MASK		0x7ffUL
+
+class ObjectHandleTable {
+  private:
+    struct Entry {
+	ObjectIter object;
+	SessionHandleSuffix owner;
+	unsigned long generation;
+	bool inUse;
+	Entry() : owner(0), generation(0), inUse(false) { }
+    };
+    std::vector<Entry> entries;
+    std::vector<unsigned long> freeEntries;
+
+    const Entry *getEntry(CK_OBJECT_HANDLE handle) const;
+  public:
+    static bool isSessionHandle(CK_OBJECT_HANDLE handle) {
+	return (handle & SESSION_OBJECT_HANDLE_FLAG) != 0;
+    }
+    // reserve a handle for an object the owner is about to create
+    CK_OBJECT_HANDLE allocate(SessionHandleSuffix owner);
+    // point a reserved handle at the object, once it is in its list
+    void bind(CK_OBJECT_HANDLE handle, ObjectIter object);
+    // false if the handle isn't (or is no longer) in use
+    bool lookup(CK_OBJECT_HANDLE handle, ObjectIter &object,
+					SessionHandleSuffix &owner) const;
+    void release(CK_OBJECT_HANDLE handle);
+};
+
 class CryptParams {
   private:
     unsigned int keySize; // in bits
@@ -316,7 +456,14 @@ class Slot {
     static const SlotState GOV_CARD = (SlotState)(CAC_CARD|PIV_CARD);
 
   private:
+    friend class CoolKeyDriver;
+    friend class GovDriver;
+    friend class CACDriver;
+    friend class PIVDriver;
+    friend class P15Driver;
+
     Log *log;
+    CK_SLOT_ID slotID;
     char *readerName;
     char *personName;
     char *manufacturer;
@@ -331,11 +478,16 @@ class Slot {
     PinCache pinCache;
     PinCache contextPinCache;
     bool loggedIn;
+    bool probeLogin; // someone else has logged us out, check before use
+    bool forkRevalidate; // forked, check the card before trusting objects
     bool reverify;
     bool nonceValid;
     CKYBuffer nonce;
     CKYBuffer cardATR;
     CKYBuffer mCUID;
+    CKYBuffer mCardIdentity;	// CAC/PIV cache key, see setCardIdentity
+    ATRProfileMap atrProfiles;
+    const CardDriver *driver;	// chosen in connectToToken
     CKYBuffer cardAID[MAX_CERT_SLOTS];
     unsigned short cardEF[MAX_CERT_SLOTS];
     bool isVersion1Key;
@@ -370,6 +522,9 @@ class Slot {
     ObjectList tokenObjects;
     CK_OBJECT_HANDLE objectHandleCounter;
     CK_OBJECT_HANDLE generateUnusedObjectHandle();
+    ObjectHandleTable sessionObjectHandles;
+    void releaseSessionObjects(Session &session);
+    const PKCS11Object *findObject(CK_OBJECT_HANDLE hObject);
 
     SessionIter findSession(SessionHandleSuffix suffix);
     SessionConstIter findConstSession(SessionHandleSuffix suffix) const;
@@ -379,6 +534,7 @@ class Slot {
     PK15Object *auth[MAX_AUTH_USERS];
 
     bool cardStateMayHaveChanged();
+    bool reattachToToken();
     void connectToToken();
     void refreshTokenState();
     void disconnect();
@@ -415,15 +571,20 @@ class Slot {
 	const CKYBuffer *derCert, CK_OBJECT_HANDLE handle);
     void addObject(list<PKCS11Object>& objectList,
         const ListObjectInfo& info, CK_OBJECT_HANDLE handle);
-    PKCS11Object *createSecretKeyObject(CK_OBJECT_HANDLE handle, CKYBuffer *secretKeyBuffer,CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulAttributeCount);
+    CK_OBJECT_HANDLE createSecretKeyObject(SessionIter session, CKYBuffer *secretKeyBuffer,CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulAttributeCount);
 
     void ensureValidSession(SessionHandleSuffix suffix);
 
+    bool getObjectListBulk(list<ListObjectInfo> &objInfoList);
     list<ListObjectInfo> getObjectList();
     list<ListObjectInfo> fetchCombinedObjects(const CKYBuffer *header);
     list<ListObjectInfo> fetchSeparateObjects();
 
     CKYStatus getCACAid();
+    void applyATRProfile();
+    void saveATRProfile();
+    void setCardIdentity(const CKYBuffer *data);
+    void loadPIVIdentity();
     CKYStatus readCACCertificateFirst(CKYBuffer *cert, CKYSize *nextSize,
                               bool throwException);
     CKYStatus readCACCertificateAppend(CKYBuffer *cert, CKYSize nextSize);
@@ -433,10 +594,23 @@ class Slot {
     void selectCACApplet(CKYByte instance,bool do_disconnect);
     void selectKey(const PKCS11Object *key, bool retry);
     CKYStatus selectPath(const CKYBuffer *path, CKYISOStatus *adpurc);
-    CKYStatus readFromPath(const PK15ObjectPath &obj, CKYBuffer *file);
+    CKYStatus selectCachedPath(P15LoadCache &cache, const CKYBuffer *path,
+				CKYISOStatus *apduRC);
+    CKYStatus fillCachedFile(P15LoadCache &cache, const CKYBuffer *path,
+				P15CachedFile &file, CKYOffset index, CKYSize need);
+    CKYStatus readFromPath(const PK15ObjectPath &obj, CKYBuffer *file,
+				P15LoadCache &cache);
     void unloadObjects();
     void loadCACObjects();
-    void loadCACCert(CKYByte instance);
+    bool fetchCACCert(CKYByte instance, CKYBuffer *rawCert);
+    void loadCACCerts(Transaction &trans);
+    int getPIVRetiredKeyCount();
+    void loadP15Objects(Transaction &trans);
+    void loadCoolKeyObjects(Transaction &trans);
+    bool loadObjectSnapshot(const CKYBuffer *identity,
+					unsigned short dataVersion);
+    void saveObjectSnapshot(const CKYBuffer *identity,
+					unsigned short dataVersion);
     void loadObjects();
     void loadReaderObject();
 
@@ -445,6 +619,9 @@ class Slot {
     void attemptP15Login(CK_USER_TYPE user);
     void attemptCACLogin();
     void oldAttemptLogin();
+    bool isCardLoggedIn(CK_USER_TYPE user);
+    bool pinStatusLoggedIn(CKYStatus status, CKYISOStatus result);
+    bool presentCachedPin(const PKCS11Object *key);
     void oldLogout(void);
     void CACLogout(void);
     PinCache *userPinCache(CK_USER_TYPE user) {
@@ -454,7 +631,7 @@ class Slot {
     void parseEF_ODF(void);
     void parseEF_TokenInfo(void);
     CKYStatus parseEF_Directory(const CKYByte *data, CKYSize size, 
-				PK15ObjectType type);
+				PK15ObjectType type, P15LoadCache &cache);
     unsigned int PK15Instance(void) { return p15Instance++; }
 
     void readMuscleObject(CKYBuffer *obj, unsigned long objID, 
@@ -484,6 +661,21 @@ class Slot {
 
     void processComputeCrypt(CKYBuffer *result, const CKYAPDU *apdu);
 
+    void signData(SessionHandleSuffix suffix, CK_BYTE_PTR pData,
+        CK_ULONG ulDataLen, CK_BYTE_PTR pSignature,
+        CK_ULONG_PTR pulSignatureLen);
+
+    PKCS11Object *getPublicKeyFromHandle(CK_OBJECT_HANDLE hKey,
+						CK_ATTRIBUTE_TYPE use);
+    void publicOpInit(SessionHandleSuffix suffix, CK_MECHANISM_PTR pMechanism,
+	CK_OBJECT_HANDLE hKey, CK_ATTRIBUTE_TYPE use);
+    void publicOpOutput(SessionHandleSuffix suffix, CK_ATTRIBUTE_TYPE use,
+	CK_BYTE_PTR pInput, CK_ULONG ulInputLen, CK_BYTE_PTR pOutput,
+	CK_ULONG_PTR pulOutputLen);
+    void cipherInit(SessionHandleSuffix suffix, CK_MECHANISM_PTR pMechanism,
+	CK_OBJECT_HANDLE hKey, CK_ATTRIBUTE_TYPE use);
+    CipherState &getCipher(SessionHandleSuffix suffix, CK_ATTRIBUTE_TYPE use);
+
     CKYByte objectToKeyNum(const PKCS11Object *key);
     Slot(const Slot &cpy)
 #ifdef USE_SHMEM
@@ -492,7 +684,8 @@ class Slot {
 	{} // not allowed
     Slot  &operator=(const Slot &cpy) { return *this; }  // not allowed
   public:
-    Slot(const char *readerName, Log *log, CKYCardContext* context);
+    Slot(const char *readerName, Log *log, CKYCardContext* context,
+							CK_SLOT_ID slotID);
     ~Slot();
 
     // Returns TRUE if the token is present from the point of view of PKCS #11.
@@ -500,6 +693,11 @@ class Slot {
     // and the applet is in a personalized state.
     bool isTokenPresent();
 
+    // we've been forked. The card handle belongs to the parent, so forget
+    // it and reconnect on next use, keeping the objects if the card is
+    // still the same.
+    void afterFork();
+
     CK_RV getSlotInfo(CK_SLOT_INFO_PTR pSlotInfo);
     CK_RV getTokenInfo(CK_TOKEN_INFO_PTR pTokenInfo);
 
@@ -543,6 +741,10 @@ class Slot {
     void getAttributeValue(SessionHandleSuffix suffix,
         CK_OBJECT_HANDLE hObject, CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount);
 
+    // only session objects and keys derived on the host can be destroyed,
+    // the rest live on the card
+    void destroyObject(SessionHandleSuffix suffix, CK_OBJECT_HANDLE hObject);
+
     void signInit(SessionHandleSuffix suffix, CK_MECHANISM_PTR pMechanism,
         CK_OBJECT_HANDLE hKey);
 
@@ -550,6 +752,14 @@ class Slot {
         CK_ULONG ulDataLen, CK_BYTE_PTR pSignature,
         CK_ULONG_PTR pulSignatureLen);
 
+    // hash and sign mechanisms only. The data is hashed on the host,
+    // the card only sees the digest at signFinal.
+    void signUpdate(SessionHandleSuffix suffix, CK_BYTE_PTR pPart,
+        CK_ULONG ulPartLen);
+
+    void signFinal(SessionHandleSuffix suffix, CK_BYTE_PTR pSignature,
+        CK_ULONG_PTR pulSignatureLen);
+
     void decryptInit(SessionHandleSuffix suffix, CK_MECHANISM_PTR pMechanism,
         CK_OBJECT_HANDLE hKey);
 
@@ -557,6 +767,49 @@ class Slot {
         CK_ULONG ulDataLen, CK_BYTE_PTR pDecryptedData,
         CK_ULONG_PTR pulDecryptedDataLen);
 
+    // multi part decryption is only for the secret key mechanisms
+    void decryptUpdate(SessionHandleSuffix suffix, CK_BYTE_PTR pPart,
+        CK_ULONG ulPartLen, CK_BYTE_PTR pOutput, CK_ULONG_PTR pulOutputLen);
+
+    void decryptFinal(SessionHandleSuffix suffix, CK_BYTE_PTR pOutput,
+        CK_ULONG_PTR pulOutputLen);
+
+    // public key operations never go to the card, the public values
+    // were read with the rest of the objects
+    void verifyInit(SessionHandleSuffix suffix, CK_MECHANISM_PTR pMechanism,
+        CK_OBJECT_HANDLE hKey);
+
+    void verify(SessionHandleSuffix suffix, CK_BYTE_PTR pData,
+        CK_ULONG ulDataLen, CK_BYTE_PTR pSignature, CK_ULONG ulSignatureLen);
+
+    void encryptInit(SessionHandleSuffix suffix, CK_MECHANISM_PTR pMechanism,
+        CK_OBJECT_HANDLE hKey);
+
+    void encrypt(SessionHandleSuffix suffix, CK_BYTE_PTR pData,
+        CK_ULONG ulDataLen, CK_BYTE_PTR pEncryptedData,
+        CK_ULONG_PTR pulEncryptedDataLen);
+
+    void encryptUpdate(SessionHandleSuffix suffix, CK_BYTE_PTR pPart,
+        CK_ULONG ulPartLen, CK_BYTE_PTR pOutput, CK_ULONG_PTR pulOutputLen);
+
+    void encryptFinal(SessionHandleSuffix suffix, CK_BYTE_PTR pOutput,
+        CK_ULONG_PTR pulOutputLen);
+
+    void verifyRecoverInit(SessionHandleSuffix suffix,
+        CK_MECHANISM_PTR pMechanism, CK_OBJECT_HANDLE hKey);
+
+    void verifyRecover(SessionHandleSuffix suffix, CK_BYTE_PTR pSignature,
+        CK_ULONG ulSignatureLen, CK_BYTE_PTR pData, CK_ULONG_PTR pulDataLen);
+
+    // hashing is done on the host
+    void digestInit(SessionHandleSuffix suffix, CK_MECHANISM_PTR pMechanism);
+    void digest(SessionHandleSuffix suffix, CK_BYTE_PTR pData,
+        CK_ULONG ulDataLen, CK_BYTE_PTR pDigest, CK_ULONG_PTR pulDigestLen);
+    void digestUpdate(SessionHandleSuffix suffix, CK_BYTE_PTR pPart,
+        CK_ULONG ulPartLen);
+    void digestFinal(SessionHandleSuffix suffix, CK_BYTE_PTR pDigest,
+        CK_ULONG_PTR pulDigestLen);
+
     void seedRandom(SessionHandleSuffix suffix, CK_BYTE_PTR data,
 	CK_ULONG len);
     void generateRandom(SessionHandleSuffix suffix, CK_BYTE_PTR data,
@@ -571,13 +824,20 @@ class Slot {
        CK_ULONG ulAttributeCount, CK_OBJECT_HANDLE_PTR phKey, CryptParams& params);
 
     bool getIsECC() { return mECC; }
+
+    // the objects loaded from the token, for the token pool to compare
+    const ObjectList &getTokenObjects() const { return tokenObjects; }
 };
 
+class TokenPool;
+
 class SlotList {
 
   private:
     Slot **slots;
     unsigned int numSlots;
+    unsigned int slotCapacity;	// entries allocated in slots
+    TokenPool *pool; // identical tokens behind one slot, NULL if not enabled
     Log *log;
     CKYCardContext *context;
     SCARD_READERSTATE *readerStates;
@@ -605,6 +865,7 @@ class SlotList {
     ~SlotList();
 
     void shutdown(); // close our connection so waits will return.
+    void afterFork(); // we are a forked child, get our own connections
     int getNumSlots() const { return numSlots; }
     Slot* getSlot(unsigned int index) const {
         assert( index >= 0 && index < numSlots );
@@ -612,6 +873,8 @@ class SlotList {
     }
     CK_RV getSlotList(CK_BBOOL tokenPresent, CK_SLOT_ID_PTR pSlotList,
             CK_ULONG_PTR pulCount);
+    // the token pool if slotID is the pool's slot, NULL otherwise
+    TokenPool *getPool(CK_SLOT_ID slotID) const;
     CK_RV getInfo(CK_SLOT_INFO_PTR pSlotInfo) const;
 
     void validateSlotID(CK_SLOT_ID id) const;
@@ -644,6 +907,8 @@ class SlotList {
         CK_OBJECT_HANDLE hObject, CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount)
         const;
 
+    void destroyObject(CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE hObject);
+
     void signInit(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism,
         CK_OBJECT_HANDLE hKey);
 
@@ -651,6 +916,12 @@ class SlotList {
         CK_ULONG ulDataLen, CK_BYTE_PTR pSignature,
         CK_ULONG_PTR pulSignatureLen);
 
+    void signUpdate(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pPart,
+        CK_ULONG ulPartLen);
+
+    void signFinal(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pSignature,
+        CK_ULONG_PTR pulSignatureLen);
+
     void decryptInit(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism,
         CK_OBJECT_HANDLE hKey);
 
@@ -658,6 +929,48 @@ class SlotList {
         CK_ULONG ulDataLen, CK_BYTE_PTR pDecryptedData,
         CK_ULONG_PTR pulDecryptedDataLen);
 
+    void decryptUpdate(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pPart,
+        CK_ULONG ulPartLen, CK_BYTE_PTR pOutput, CK_ULONG_PTR pulOutputLen);
+
+    void decryptFinal(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pOutput,
+        CK_ULONG_PTR pulOutputLen);
+
+    void verifyInit(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism,
+        CK_OBJECT_HANDLE hKey);
+
+    void verify(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pData,
+        CK_ULONG ulDataLen, CK_BYTE_PTR pSignature, CK_ULONG ulSignatureLen);
+
+    void encryptInit(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism,
+        CK_OBJECT_HANDLE hKey);
+
+    void encrypt(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pData,
+        CK_ULONG ulDataLen, CK_BYTE_PTR pEncryptedData,
+        CK_ULONG_PTR pulEncryptedDataLen);
+
+    void encryptUpdate(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pPart,
+        CK_ULONG ulPartLen, CK_BYTE_PTR pOutput, CK_ULONG_PTR pulOutputLen);
+
+    void encryptFinal(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pOutput,
+        CK_ULONG_PTR pulOutputLen);
+
+    void verifyRecoverInit(CK_SESSION_HANDLE hSession,
+        CK_MECHANISM_PTR pMechanism, CK_OBJECT_HANDLE hKey);
+
+    void verifyRecover(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pSignature,
+        CK_ULONG ulSignatureLen, CK_BYTE_PTR pData, CK_ULONG_PTR pulDataLen);
+
+    void digestInit(CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism);
+
+    void digest(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pData,
+        CK_ULONG ulDataLen, CK_BYTE_PTR pDigest, CK_ULONG_PTR pulDigestLen);
+
+    void digestUpdate(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pPart,
+        CK_ULONG ulPartLen);
+
+    void digestFinal(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pDigest,
+        CK_ULONG_PTR pulDigestLen);
+
     void generateRandom(CK_SESSION_HANDLE hSession, CK_BYTE_PTR pData,
         CK_ULONG ulDataLen);
 
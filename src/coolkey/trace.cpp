@@ -0,0 +1,87 @@
+/* ***** BEGIN COPYRIGHT BLOCK *****
+ * Copyright (C) 2005 Red Hat, Inc.
+ * All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation version
+ * 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ * ***** END COPYRIGHT BLOCK *****/
+
+#include <stdio.h>
+#include "mypkcs11.h"
+#include "PKCS11Exception.h"
+#include "trace.h"
+
+FILE *Trace::file = NULL;
+OSLock *Trace::lock = NULL;
+bool Trace::firstEvent = true;
+unsigned long Trace::pid = 0;
+
+void
+Trace::Open(const char *filename)
+{
+    Close();
+    // the lock outlives Close() so a span ending on another thread
+    // (C_WaitForSlotEvent) can't race with C_Finalize. Nothing else
+    // is running here, so it's safe to replace it.
+    delete lock;
+    lock = new OSLock(true);
+    file = fopen(filename, "w");
+    if( file == NULL ) {
+	throw PKCS11Exception(CKR_GENERAL_ERROR, "Failed to open tracefile");
+    }
+    firstEvent = true;
+    pid = OSProcessID();
+    fprintf(file, "[\n");
+    fflush(file);
+}
+
+void
+Trace::Close()
+{
+    if (file) {
+	lock->getLock();
+	fprintf(file, "\n]\n");
+	fclose(file);
+	file = NULL;
+	lock->releaseLock();
+    }
+}
+
+void
+Trace::event(const char *name, char phase, CK_SLOT_ID slotID, 
+							const char *args)
+{
+    OSTimeUsec now = OSTimeNowUsec();
+    unsigned long tid = OSThreadID();
+
+    lock->getLock();
+    if (file) {
+	fprintf(file, "%s{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%llu,"
+		"\"pid\":%lu,\"tid\":%lu,\"args\":{\"slot\":%lu%s%s}}",
+		firstEvent ? "" : ",\n", name, phase, now, pid, tid, 
+		(unsigned long) slotID, args ? "," : "", args ? args : "");
+	fflush(file);
+	firstEvent = false;
+    }
+    lock->releaseLock();
+}
+
+void
+Trace::cardTrace(void *traceArg, const char *name, CKYBool begin,
+							const char *args)
+{
+    if (isEnabled()) {
+	event(name, begin ? 'B' : 'E', (CK_SLOT_ID)(size_t) traceArg, args);
+    }
+}
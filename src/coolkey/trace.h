@@ -0,0 +1,72 @@
+/* ***** BEGIN COPYRIGHT BLOCK *****
+ * Copyright (C) 2005 Red Hat, Inc.
+ * All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation version
+ * 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ * ***** END COPYRIGHT BLOCK *****/
+
+#ifndef COOLKEY_TRACE_H
+#define COOLKEY_TRACE_H
+
+#include <stdio.h>
+#include "mypkcs11.h"
+#include "cky_base.h"
+#include "machdep.h"
+
+//
+// Timeline tracing. When COOL_KEY_TRACE_FILE is set, we write Chrome
+// trace-event JSON (load it in chrome://tracing or ui.perfetto.dev).
+// Spans are written as begin/end pairs tagged with the thread and slot,
+// so nesting falls out of the call stack.
+//
+class Trace {
+  private:
+    static FILE *file;
+    static OSLock *lock;
+    static bool firstEvent;
+    static unsigned long pid;
+
+  public:
+    static void Open(const char *filename);
+    static void Close();
+    static bool isEnabled() { return file != NULL; }
+    static void event(const char *name, char phase, CK_SLOT_ID slotID,
+							const char *args);
+    // CKYTraceFunction for the card connection, traceArg is the slot ID
+    static void cardTrace(void *traceArg, const char *name, CKYBool begin,
+							const char *args);
+};
+
+class TraceSpan {
+  private:
+    const char *name;
+    CK_SLOT_ID slotID;
+
+    // not allowed
+    TraceSpan(const TraceSpan &) { }
+    TraceSpan &operator=(const TraceSpan &) { return *this; }
+
+  public:
+    TraceSpan(const char *name_, CK_SLOT_ID slotID_ = 0,
+				const char *args = NULL) :
+			name(name_), slotID(slotID_) {
+	if (Trace::isEnabled()) Trace::event(name, 'B', slotID, args);
+    }
+    ~TraceSpan() {
+	if (Trace::isEnabled()) Trace::event(name, 'E', slotID, NULL);
+    }
+};
+
+#endif
@@ -199,6 +199,12 @@ CKYAppletFactory_ListObjects(CKYAPDU *apdu, const void *param)
     return CKYAPDUFactory_ListObjects(apdu, *(const CKYByte *)param);
 }
 
+CKYStatus
+CKYAppletFactory_ListObjectsBulk(CKYAPDU *apdu, const void *param)
+{
+    return CKYAPDUFactory_ListObjectsBulk(apdu, *(const CKYByte *)param);
+}
+
 CKYStatus
 CKYAppletFactory_GetStatus(CKYAPDU *apdu, const void *param)
 {
@@ -479,6 +485,9 @@ CKYApplet_HandleAPDU(CKYCardConnection *conn,
     CKYAPDU apdu;
     CKYBuffer response;
     CKYStatus ret;
+    CKYISOStatus rc = CKYISO_NORESPONSE;
+    CKYBool traced = 0;
+    char traceArgs[40];
 
     if (apduRC) {
 	*apduRC = CKYISO_NORESPONSE;
@@ -510,13 +519,16 @@ CKYApplet_HandleAPDU(CKYCardConnection *conn,
     }
 
     /* send it to the card */
+    sprintf(traceArgs, "\"ins\":\"0x%02x\"", CKYAPDU_GetINS(&apdu));
+    CKYCardConnection_Trace(conn, "CKYApplet_HandleAPDU", 1, traceArgs);
+    traced = 1;
     ret = CKYCardConnection_ExchangeAPDU(conn, &apdu, &response);
     if (ret != CKYSUCCESS) {
 	goto done;
     }
 
     /* verify we got the expected response */
-    if (!CKYApplet_VerifyResponse(&response, size, apduRC)) {
+    if (!CKYApplet_VerifyResponse(&response, size, &rc)) {
 	ret = CKYAPDUFAIL;
 	goto done;
     }
@@ -524,6 +536,14 @@ CKYApplet_HandleAPDU(CKYCardConnection *conn,
     /* Fill in our output data structure */
     ret = (*fillFunc)(&response, size, fillArg);
 done:
+    if (apduRC) {
+	*apduRC = rc;
+    }
+    if (traced) {
+	sprintf(traceArgs, "\"ins\":\"0x%02x\",\"sw\":\"0x%04x\"",
+				CKYAPDU_GetINS(&apdu), rc);
+	CKYCardConnection_Trace(conn, "CKYApplet_HandleAPDU", 0, traceArgs);
+    }
     CKYBuffer_FreeData(&response);
     CKYAPDU_FreeData(&apdu);
     return ret;
@@ -1100,6 +1120,13 @@ CACApplet_VerifyPIN(CKYCardConnection *conn, const char *pin, int local,
 }
 
 
+CKYStatus
+CACApplet_GetPINStatus(CKYCardConnection *conn, int local, 
+		    CKYISOStatus *apduRC)
+{
+    return P15Applet_GetPINStatus(conn, 
+				local ? &PIVPinInfo: &CACPinInfo, apduRC);
+}
 
 /*
  * Get a CAC Certificate 
@@ -1131,6 +1158,18 @@ CACApplet_GetCertificate(CKYCardConnection *conn, CKYBuffer *cert,
     return ret;
 }
 
+/*
+ * the chunk size for bulk reads, what we've learned about this card or
+ * the protocol maximum if we haven't learned anything yet
+ */
+static CKYByte
+ckyApplet_ReadChunk(const CKYCardConnection *conn)
+{
+    CKYByte chunk = CKYCardConnection_GetMaxReadChunk(conn);
+
+    return chunk ? chunk : CKY_MAX_READ_CHUNK_SIZE;
+}
+
 /*
  * Read a CAC Tag/Value file 
  */
@@ -1163,7 +1202,7 @@ CACApplet_ReadFile(CKYCardConnection *conn, CKYByte type, CKYBuffer *buffer,
 	return ret;
     }
     size = CKYBuffer_GetShortLE(buffer, 0) + 2 /* include the length itself */;
-    maxtransfer = CKY_MAX_READ_CHUNK_SIZE;
+    maxtransfer = ckyApplet_ReadChunk(conn);
     /* get the rest of the buffer if necessary */
     for (offset = CKYBuffer_Size(buffer); size > offset; 
 				offset = CKYBuffer_Size(buffer)) {
@@ -1179,6 +1218,8 @@ CACApplet_ReadFile(CKYCardConnection *conn, CKYByte type, CKYBuffer *buffer,
 		if (maxtransfer == 0) {
 		    return ret;
 		}
+		/* remember it, so the next file starts at the right size */
+		CKYCardConnection_SetMaxReadChunk(conn, maxtransfer);
 	    } else {
 		return ret;
 	    }
@@ -1271,6 +1312,29 @@ fail:
     return ret;
 }
 
+/*
+ * Ask whether the PIN is currently verified by sending VERIFY with no
+ * data (ISO 7816-4). Returns success if it is, otherwise apduRC holds the
+ * card's answer, normally 0x63Cx (x tries left).
+ */
+CKYStatus
+P15Applet_GetPINStatus(CKYCardConnection *conn, const P15PinInfo *pinInfo, 
+			CKYISOStatus *apduRC)
+{
+    CKYStatus ret;
+    CKYBuffer empty;
+    P15AppletArgVerifyPIN vps;
+
+    CKYBuffer_InitEmpty(&empty);
+    vps.pinRef = pinInfo->pinRef | 
+     ((pinInfo->pinFlags & P15PinLocal) ? ISO_LOGIN_LOCAL : ISO_LOGIN_GLOBAL);
+    vps.pinVal = &empty;
+    ret = CKYApplet_HandleAPDU(conn, P15AppletFactory_VerifyPIN, &vps, NULL, 
+			    0, CKYAppletFill_Null, 
+			    NULL, apduRC);
+    return ret;
+}
+
 
 /*
  * Read Record
@@ -1854,7 +1918,7 @@ CKYApplet_ReadObjectFull(CKYCardConnection *conn, unsigned long objectID,
     rod.objectID = objectID;
     rod.offset = offset;
     do {
-	rod.size = (CKYByte) MIN(size, CKY_MAX_READ_CHUNK_SIZE);
+	rod.size = (CKYByte) MIN(size, ckyApplet_ReadChunk(conn));
 	ret = CKYApplet_HandleAPDU(conn, CKYAppletFactory_ReadObject, &rod,
 	   nonce, rod.size, CKYAppletFill_AppendBuffer, data, apduRC);
 	size -= rod.size;
@@ -1927,6 +1991,56 @@ CKYApplet_ListObjects(CKYCardConnection *conn, CKYByte seq,
 	CKY_SIZE_LIST_OBJECTS, ckyAppletFill_ListObjects, lop, apduRC);
 }
 
+typedef struct _CKYAppletArgListObjectsBulk {
+    CKYAppletRespListObjects *lop;
+    unsigned int *count;
+} CKYAppletArgListObjectsBulk;
+
+static CKYStatus
+ckyAppletFill_ListObjectsBulk(const CKYBuffer *response, CKYSize size,
+								void *param)
+{
+    CKYAppletArgListObjectsBulk *lob = (CKYAppletArgListObjectsBulk *)param;
+    CKYSize len = CKYBuffer_Size(response) - 2;
+    CKYBuffer record;
+    CKYOffset offset;
+    CKYStatus ret = CKYSUCCESS;
+
+    *lob->count = 0;
+    if ((len % CKY_SIZE_LIST_OBJECTS) != 0 ||
+		len > CKY_LIST_OBJECTS_BULK_MAX * CKY_SIZE_LIST_OBJECTS) {
+	return CKYINVALIDDATA;
+    }
+    CKYBuffer_InitEmpty(&record);
+    for (offset = 0; offset < len; offset += CKY_SIZE_LIST_OBJECTS) {
+	CKYBuffer_Resize(&record, 0);
+	ret = CKYBuffer_AppendBuffer(&record, response, offset,
+						CKY_SIZE_LIST_OBJECTS);
+	if (ret != CKYSUCCESS) {
+	    break;
+	}
+	ckyAppletFill_ListObjects(&record, CKY_SIZE_LIST_OBJECTS,
+					&lob->lop[*lob->count]);
+	(*lob->count)++;
+    }
+    CKYBuffer_FreeData(&record);
+    return ret;
+}
+
+CKYStatus
+CKYApplet_ListObjectsBulk(CKYCardConnection *conn, CKYByte seq,
+		CKYAppletRespListObjects *lop, unsigned int *count,
+		CKYISOStatus *apduRC)
+{
+    CKYAppletArgListObjectsBulk lob;
+
+    lob.lop = lop;
+    lob.count = count;
+    *count = 0;
+    return CKYApplet_HandleAPDU(conn, CKYAppletFactory_ListObjectsBulk, &seq,
+	NULL, CKY_SIZE_UNKNOWN, ckyAppletFill_ListObjectsBulk, &lob, apduRC);
+}
+
 /*
  * GetStatus cluster
  */
@@ -42,6 +42,8 @@ typedef unsigned short CKYISOStatus; /* applet return status */
 #define CKYISO_SUCCESS		    0x9000  /* SUCCESS! */
 #define CKYISO_MORE_MASK	    0xff00  /* More data mask */
 #define CKYISO_MORE		    0x6300  /* More data available */
+#define CKYISO_WRONG_LENGTH	    0x6700  /* Lc or Le is more than the
+					     * card will do */
 #define CKYISO_DATA_INVALID	    0x6984
 #define CKYISO_CONDITION_NOT_SATISFIED 0x6985  /* AKA not logged in (CAC)*/
 #define CKYISO_SECURITY_NOT_SATISFIED  0x6982  /* AKA not logged in (PIV)*/
@@ -83,6 +85,14 @@ typedef unsigned short CKYISOStatus; /* applet return status */
 #define CAC_TAG_CERTINFO		0x71
 #define CAC_TLV_APP_PKI			0x04
 
+/* PIV Card Holder Unique Identifier (SP 800-73) */
+#define PIV_CHUID_TAG			0x5fc102
+
+/* PIV Key History object (SP 800-73) */
+#define PIV_KEY_HISTORY_TAG		0x5fc10c
+#define PIV_TAG_KEYS_ON_CARD		0xc1
+#define PIV_TAG_KEYS_OFF_CARD		0xc2
+
 /*
  * Pin Constants as used by our applet
  */
@@ -355,6 +365,7 @@ CKYStatus CKYAppletFactory_DeleteObject(CKYAPDU *apdu, const void *param);
 CKYStatus CKYAppletFactory_ReadObject(CKYAPDU *apdu, const void *param);
 /* param == CKYByte * (pointer to seq) */
 CKYStatus CKYAppletFactory_ListObjects(CKYAPDU *apdu, const void *param);
+CKYStatus CKYAppletFactory_ListObjectsBulk(CKYAPDU *apdu, const void *param);
 /* param == NULL */
 CKYStatus CKYAppletFactory_GetStatus(CKYAPDU *apdu, const void *param);
 /* param == NULL */
@@ -564,6 +575,9 @@ CKYStatus CACApplet_GetCertificateAppend(CKYCardConnection *conn,
 /*CKYStatus CACApplet_GetProperties(); */
 CKYStatus CACApplet_VerifyPIN(CKYCardConnection *conn, const char *pin, 
 				int local, CKYISOStatus *apduRC);
+/* probe the login state without presenting a PIN */
+CKYStatus CACApplet_GetPINStatus(CKYCardConnection *conn, int local, 
+				CKYISOStatus *apduRC);
 
 /* Select a PIV applet  */
 CKYStatus PIVApplet_Select(CKYCardConnection *conn, CKYISOStatus *apduRC);
@@ -588,6 +602,9 @@ CKYStatus P15Applet_ReadBinary(CKYCardConnection *conn, unsigned short offset,
 		CKYISOStatus *apduRC);
 CKYStatus P15Applet_VerifyPIN(CKYCardConnection *conn, const char *pin, 
 			const P15PinInfo *pinInfo, CKYISOStatus *apduRC);
+/* probe the login state without presenting a PIN */
+CKYStatus P15Applet_GetPINStatus(CKYCardConnection *conn, 
+			const P15PinInfo *pinInfo, CKYISOStatus *apduRC);
 
 CKYStatus P15Applet_SignDecrypt(CKYCardConnection *conn, CKYByte key,
 				   unsigned int keySize, CKYByte direction,
@@ -629,6 +646,12 @@ CKYStatus CKYApplet_WriteObjectFull(CKYCardConnection *conn,
 
 CKYStatus CKYApplet_ListObjects(CKYCardConnection *conn, CKYByte seq,
 		CKYAppletRespListObjects *lop, CKYISOStatus *apduRC);
+/* the same records, up to CKY_LIST_OBJECTS_BULK_MAX of them in one APDU.
+ * lop must have room for that many, *count gets the number returned.
+ * Needs protocol 1.2, older applets fail with an unknown INS */
+CKYStatus CKYApplet_ListObjectsBulk(CKYCardConnection *conn, CKYByte seq,
+		CKYAppletRespListObjects *lop, unsigned int *count,
+		CKYISOStatus *apduRC);
 CKYStatus CKYApplet_GetStatus(CKYCardConnection *conn, 
 		CKYAppletRespGetStatus *status, CKYISOStatus *apduRC);
 CKYStatus CKYApplet_Noop(CKYCardConnection *conn, CKYISOStatus *apduRC);
@@ -18,120 +18,17 @@
  * ***** END COPYRIGHT BLOCK ***** */
 
 #include <winscard.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include "cky_basei.h" /* friend class */
 #include "cky_base.h"
 #include "cky_card.h"
 #include "dynlink.h"
-
-#ifndef WINAPI
-#define WINAPI
-typedef SCARD_READERSTATE *LPSCARD_READERSTATE;
-#endif
-
-#ifndef SCARD_E_NO_READERS_AVAILABLE
-#define SCARD_E_NO_READERS_AVAILABLE ((unsigned long)0x8010002EL)
-#endif
+#include "cky_scard.h"
 
 #define NEW(type,count) (type *)malloc((count)*sizeof(type))
 
-/*
- * protect against scard API not being installed.
- */
-
-typedef long (WINAPI * SCardEstablishContextFn) (
-    unsigned long dwScope,
-    const void * pvReserved1,
-    const void * pvReserved2,
-    LPSCARDCONTEXT phContext);
-
-typedef long (WINAPI * SCardReleaseContextFn) (
-    SCARDCONTEXT hContext);
-
-typedef long (WINAPI * SCardBeginTransactionFn) (
-    SCARDHANDLE hCard);
-
-typedef long (WINAPI * SCardEndTransactionFn) (
-    SCARDHANDLE hCard,
-    unsigned long dwDisposition);
-
-typedef long (WINAPI * SCardConnectFn) (
-    SCARDCONTEXT hContext,
-    const char *szReader,
-    unsigned long dwShareMode,
-    unsigned long dwPreferredProtocols,
-    SCARDHANDLE *phCard,
-    unsigned long *pdwActiveProtocol);
-
-typedef long (WINAPI * SCardDisconnectFn) (
-    SCARDHANDLE hCard,
-    unsigned long dwDisposition);
-
-typedef long (WINAPI * SCardTransmitFn) (
-    SCARDHANDLE hCard,
-    LPCSCARD_IO_REQUEST pioSendPci,
-    const unsigned char *pbSendBuffer,
-    unsigned long cbSendLength,
-    LPSCARD_IO_REQUEST pioRecvPci,
-    unsigned char *pbRecvBuffer,
-    unsigned long *pcbRecvLength);
-
-typedef long (WINAPI * SCardReconnectFn) (
-    SCARDHANDLE hCard,
-    unsigned long dwShareMode,
-    unsigned long dwPreferredProtocols,
-    unsigned long dwInitialization,
-    unsigned long *pdwActiveProtocol);
-
-typedef long (WINAPI * SCardListReadersFn) (
-    SCARDCONTEXT hContext,
-    const char *mszGroups,
-    char *mszReaders,
-    unsigned long *pcchReaders);
-
-typedef long (WINAPI * SCardStatusFn) (
-    SCARDHANDLE hCard,
-    char *mszReaderNames,
-    unsigned long *pcchReaderLen,
-    unsigned long *pdwState,
-    unsigned long *pdwProtocol,
-    unsigned char *pbAtr,
-    unsigned long *pcbAtrLen);
-
-typedef long (WINAPI * SCardGetAttribFn) (
-    SCARDHANDLE hCard,
-    unsigned long dwAttId,
-    char *pbAttr,
-    unsigned long *pchAttrLen);
-
-typedef long (WINAPI * SCardGetStatusChangeFn) (
-    SCARDCONTEXT hContext,
-    unsigned long dwTimeout,
-    SCARD_READERSTATE *rgReaderStates,
-    unsigned long cReaders);
-
-typedef long (WINAPI * SCardCancelFn) (
-    SCARDCONTEXT hContext);
-
-typedef struct _SCard {
-    SCardEstablishContextFn SCardEstablishContext;
-    SCardReleaseContextFn SCardReleaseContext;
-    SCardBeginTransactionFn SCardBeginTransaction;
-    SCardEndTransactionFn SCardEndTransaction;
-    SCardConnectFn SCardConnect;
-    SCardDisconnectFn SCardDisconnect;
-    SCardTransmitFn SCardTransmit;
-    SCardReconnectFn SCardReconnect;
-    SCardListReadersFn SCardListReaders;
-    SCardStatusFn SCardStatus;
-    SCardGetAttribFn SCardGetAttrib;
-    SCardGetStatusChangeFn SCardGetStatusChange;
-    SCardCancelFn SCardCancel;
-    SCARD_IO_REQUEST *SCARD_PCI_T0_;
-    SCARD_IO_REQUEST *SCARD_PCI_T1_;
-} SCard;
-
 #define GET_ADDRESS(library, scard, name) \
     status= ckyShLibrary_getAddress(library,  \
 			(void**) &scard->name, MAKE_DLL_SYMBOL(name)); \
@@ -433,7 +330,31 @@ ckyCardContext_init(CKYCardContext *ctx)
     ctx->lastError = 0;
     ctx->context = 0;
     if (!scard) {
-	scard = ckySCard_Init();
+	const char *replayFile = getenv("CKY_APDU_REPLAY_FILE");
+	const char *recordFile = getenv("CKY_APDU_RECORD_FILE");
+
+	if (replayFile) {
+	    /* serve a recorded session instead of talking to PC/SC */
+	    scard = ckySCard_InitReplay(replayFile);
+	} else {
+	    const char *pcscdSocket = getenv("CKY_PCSCD_SOCKET");
+
+	    if (pcscdSocket) {
+		scard = ckySCard_InitPcscd(pcscdSocket);
+	    }
+	    if (!scard) {
+		scard = ckySCard_Init();
+	    }
+	}
+	/* recording a replay is allowed, it's how coolkey-bench counts
+	 * APDUs against an emulated card */
+	if (scard && recordFile) {
+	    SCard *record = ckySCard_InitRecord(scard, recordFile);
+	    /* failing to record isn't fatal, keep the original table */
+	    if (record) {
+		scard = record;
+	    }
+	}
 	if (!scard) {
 	   return CKYNOSCARD;
 	}
@@ -878,6 +799,13 @@ CKYCardContext_Cancel(CKYCardContext *ctx)
     return CKYSUCCESS;
 }
 
+CKYStatus
+CKYCardContext_Abandon(CKYCardContext *ctx)
+{
+    ctx->context = 0;
+    return CKYSUCCESS;
+}
+
 unsigned long 
 CKYCardContext_GetLastError(const CKYCardContext *ctx)
 {
@@ -902,6 +830,9 @@ struct _CKYCardConnection {
     unsigned long    lastError;
     CKYBool           inTransaction;
     unsigned long    protocol;
+    CKYTraceFunction traceFunc;
+    void             *traceArg;
+    CKYByte          maxReadChunk;
 };
 
 static void
@@ -913,6 +844,9 @@ ckyCardConnection_init(CKYCardConnection *conn, const CKYCardContext *ctx)
     conn->lastError = 0;
     conn->inTransaction = 0;
     conn->protocol = SCARD_PROTOCOL_T0;
+    conn->traceFunc = NULL;
+    conn->traceArg = NULL;
+    conn->maxReadChunk = 0;
 }
 
 
@@ -959,6 +893,15 @@ CKYCardConnection_Connect(CKYCardConnection *conn, const char *readerName)
     if (ret != CKYSUCCESS) {
 	return ret;
     }
+    /* the context may have been abandoned, get a new one */
+    if (!conn->ctx->context) {
+	ret = ckyCardContext_establish((CKYCardContext *)conn->ctx, 
+							conn->ctx->scope);
+	if (ret != CKYSUCCESS) {
+	    conn->lastError = conn->ctx->lastError;
+	    return ret;
+	}
+    }
     rv = conn->scard->SCardConnect( conn->ctx->context, readerName,
 	SCARD_SHARE_SHARED, SCARD_PROTOCOL_T0 | SCARD_PROTOCOL_T1, &conn->cardHandle, &conn->protocol);
     if (rv != SCARD_S_SUCCESS) {
@@ -984,6 +927,14 @@ CKYCardConnection_Disconnect(CKYCardConnection *conn)
     return CKYSUCCESS;
 }
 
+CKYStatus
+CKYCardConnection_Abandon(CKYCardConnection *conn)
+{
+    conn->cardHandle = 0;
+    conn->inTransaction = 0;
+    return CKYSUCCESS;
+}
+
 CKYBool 
 CKYCardConnection_IsConnected(const CKYCardConnection *conn)
 {
@@ -1092,6 +1043,7 @@ CKYCardConnection_ExchangeAPDU(CKYCardConnection *conn, CKYAPDU *apdu,
     CKYStatus ret;
     CKYBuffer getResponse;
     CKYSize size = 0;
+    int getResponses = 0;
 
     ret = CKYCardConnection_TransmitAPDU(conn, apdu, response);
     if (ret != CKYSUCCESS) {
@@ -1106,6 +1058,10 @@ CKYCardConnection_ExchangeAPDU(CKYCardConnection *conn, CKYAPDU *apdu,
 	/* get the response */
 	CKYAPDU getResponseAPDU;
 
+	if (conn->traceFunc && !getResponses++) {
+	    (*conn->traceFunc)(conn->traceArg, "GET RESPONSE", 1, NULL);
+	}
+
 	CKYBuffer_Zero(&getResponse);
 	CKYAPDU_Init(&getResponseAPDU);
 	CKYAPDU_SetCLA(&getResponseAPDU, 0x00);
@@ -1122,6 +1078,11 @@ CKYCardConnection_ExchangeAPDU(CKYCardConnection *conn, CKYAPDU *apdu,
 	    CKYBuffer_AppendCopy(response,&getResponse);
 	}
     }
+    if (conn->traceFunc && getResponses) {
+	char args[40];
+	sprintf(args, "\"count\":%d", getResponses);
+	(*conn->traceFunc)(conn->traceArg, "GET RESPONSE", 0, args);
+    }
     CKYBuffer_FreeData(&getResponse);
     return ret;
 }
@@ -1229,3 +1190,32 @@ CKYCardConnection_GetLastError(const CKYCardConnection *conn)
 {
     return conn->lastError;
 }
+
+CKYByte
+CKYCardConnection_GetMaxReadChunk(const CKYCardConnection *conn)
+{
+    return conn->maxReadChunk;
+}
+
+void
+CKYCardConnection_SetMaxReadChunk(CKYCardConnection *conn, CKYByte size)
+{
+    conn->maxReadChunk = size;
+}
+
+void
+CKYCardConnection_SetTrace(CKYCardConnection *conn, 
+				CKYTraceFunction traceFunc, void *traceArg)
+{
+    conn->traceFunc = traceFunc;
+    conn->traceArg = traceArg;
+}
+
+void
+CKYCardConnection_Trace(const CKYCardConnection *conn, const char *name,
+				CKYBool begin, const char *args)
+{
+    if (conn->traceFunc) {
+	(*conn->traceFunc)(conn->traceArg, name, begin, args);
+    }
+}
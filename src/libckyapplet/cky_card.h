@@ -40,6 +40,14 @@ typedef struct _CKYCardConnection CKYCardConnection;
 CKYLIST_DECLARE(CKYReaderName, char *)
 CKYLIST_DECLARE(CKYCardConnection, CKYCardConnection *)
 
+/*
+ * Optional trace hook. If set on a connection, it's called at the
+ * beginning and end of each APDU exchange. args is either NULL or a
+ * preformatted list of JSON members describing the event (INS, SW, etc).
+ */
+typedef void (*CKYTraceFunction)(void *traceArg, const char *name,
+					CKYBool begin, const char *args);
+
 CKY_BEGIN_PROTOS
 void CKYReader_Init(SCARD_READERSTATE *reader);
 void CKYReader_FreeData(SCARD_READERSTATE *reader);
@@ -94,6 +102,10 @@ CKYStatus CKYCardContext_WaitForStatusChange(CKYCardContext *context,
 /* cancel any current operation (such as wait for status change) on this
  * context */
 CKYStatus CKYCardContext_Cancel(CKYCardContext *context);
+/* forget the underlying context without releasing it. Used in a forked
+ * child, where the context still belongs to the parent. The next call
+ * which needs a context establishes a new one */
+CKYStatus CKYCardContext_Abandon(CKYCardContext *context);
 /* get the last underlying Windows SCARD error */
 unsigned long CKYCardContext_GetLastError(const CKYCardContext *context);
 
@@ -116,6 +128,9 @@ CKYStatus CKYCardConnection_ExchangeAPDU(CKYCardConnection *connection,
 CKYStatus CKYCardConnection_Connect(CKYCardConnection *connection, 
 					const char *readerName);
 CKYStatus CKYCardConnection_Disconnect(CKYCardConnection *connection);
+/* forget the card handle without disconnecting, see
+ * CKYCardContext_Abandon() */
+CKYStatus CKYCardConnection_Abandon(CKYCardConnection *connection);
 unsigned long CKYCardConnection_GetProtocol(const CKYCardConnection *conn);
 CKYBool CKYCardConnection_IsConnected(const CKYCardConnection *connection);
 CKYStatus CKYCardConnection_Reconnect(CKYCardConnection *connection);
@@ -126,6 +141,17 @@ CKYStatus CKYCardConnection_GetAttribute(CKYCardConnection *connection,
 CKYStatus CKYCardConnection_Reset(CKYCardConnection *connection);
 const CKYCardContext *CKYCardConnection_GetContext(const CKYCardConnection *cxt);
 unsigned long CKYCardConnection_GetLastError(const CKYCardConnection *context);
+/* the largest Le the card has been seen to answer in one APDU. Zero means
+ * we don't know yet, and callers should use the protocol maximum. */
+CKYByte CKYCardConnection_GetMaxReadChunk(const CKYCardConnection *conn);
+void CKYCardConnection_SetMaxReadChunk(CKYCardConnection *conn, CKYByte size);
+/* install (or with a NULL traceFunc, remove) the trace hook */
+void CKYCardConnection_SetTrace(CKYCardConnection *connection,
+				CKYTraceFunction traceFunc, void *traceArg);
+/* report an event to the connection's trace hook, if any */
+void CKYCardConnection_Trace(const CKYCardConnection *connection,
+				const char *name, CKYBool begin,
+				const char *args);
 
 CKY_END_PROTOS
 
@@ -568,6 +568,17 @@ CKYAPDUFactory_ListObjects(CKYAPDU *apdu, CKYByte sequence)
     return CKYAPDU_SetReceiveLen(apdu, CKY_SIZE_LIST_OBJECTS);
 }
 
+CKYStatus
+CKYAPDUFactory_ListObjectsBulk(CKYAPDU *apdu, CKYByte sequence)
+{
+    CKYAPDU_SetCLA(apdu, CKY_CLASS_COOLKEY);
+    CKYAPDU_SetINS(apdu, CKY_INS_LIST_OBJECTS_BULK);
+    CKYAPDU_SetP1(apdu, sequence);
+    CKYAPDU_SetP2(apdu, 0x00);
+    return CKYAPDU_SetReceiveLen(apdu,
+		CKY_LIST_OBJECTS_BULK_MAX * CKY_SIZE_LIST_OBJECTS);
+}
+
 CKYStatus
 CKYAPDUFactory_GetStatus(CKYAPDU *apdu)
 {
@@ -73,6 +73,7 @@
 /* public */
 #define CKY_INS_VERIFY_PIN	0x42
 #define CKY_INS_LIST_OBJECTS	0x58
+#define CKY_INS_LIST_OBJECTS_BULK 0x59 /* protocol 1.2 and later */
 #define CKY_INS_LIST_KEYS	0x3A
 #define CKY_INS_LIST_PINS	0x48
 #define CKY_INS_GET_STATUS	0x3C
@@ -129,6 +130,8 @@
 #define CKY_SIZE_LIST_KEYS	11
 #define CKY_SIZE_LIST_PINS	2
 #define CKY_SIZE_LIST_OBJECTS	14
+/* as many LIST_OBJECTS records as fit in a short APDU response */
+#define CKY_LIST_OBJECTS_BULK_MAX 18
 #define CKY_SIZE_GET_STATUS	16
 #define CKY_SIZE_GET_LIFE_CYCLE	1
 #define CKY_SIZE_GET_LIFE_CYCLE_V2 4
@@ -255,6 +258,7 @@ CKYStatus CKYAPDUFactory_DeleteObject(CKYAPDU *apdu, unsigned long objectID,
 CKYStatus CKYAPDUFactory_ReadObject(CKYAPDU *apdu, unsigned long objectID, 
 						CKYOffset offset, CKYByte size);
 CKYStatus CKYAPDUFactory_ListObjects(CKYAPDU *apdu, CKYByte sequence);
+CKYStatus CKYAPDUFactory_ListObjectsBulk(CKYAPDU *apdu, CKYByte sequence);
 CKYStatus CKYAPDUFactory_GetStatus(CKYAPDU *apdu);
 CKYStatus CKYAPDUFactory_Noop(CKYAPDU *apdu);
 CKYStatus CKYAPDUFactory_GetBuildID(CKYAPDU *apdu);
@@ -0,0 +1,1107 @@
+/* ***** BEGIN COPYRIGHT BLOCK *****
+ * Copyright (C) 2005 Red Hat, Inc.
+ * All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation version
+ * 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ * ***** END COPYRIGHT BLOCK ***** */
+
+#include <winscard.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cky_basei.h" /* friend class */
+#include "cky_base.h"
+#include "cky_scard.h"
+
+/*
+ * Native pcscd client.
+ *
+ * Speaks pcscd's unix socket protocol directly instead of going through
+ * libpcsclite. Card commands go over the socket of the context that
+ * connected the card, with non-blocking I/O and only that context locked.
+ * Reader state is kept by a single monitor connection: one thread stays
+ * registered for pcscd's reader events and refreshes a shared copy of the
+ * reader table, so SCardStatus, SCardListReaders and
+ * SCardGetStatusChange for every context and reader are answered from
+ * that copy without a round trip. libpcsclite fetches the whole table
+ * from pcscd on each of those calls.
+ *
+ * Only the status waits are multiplexed. Transmits are not funnelled
+ * through an event loop: each one runs on the calling thread over its
+ * context's own socket, so transmits to different readers already go
+ * out in parallel, and handing every APDU to a loop thread and back would
+ * add two thread switches to each card round trip.
+ *
+ * mock-pcscd serves this protocol for pcscd-test.
+ *
+ * Enabled with CKY_PCSCD_SOCKET. An absolute path names pcscd's socket,
+ * any other value uses $PCSCLITE_CSOCK_NAME or the pcsc-lite default.
+ */
+#if !defined(WIN32) && !defined(MAC)
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "cky_pcscd.h"
+
+#define CKY_PCSCD_DEFAULT_SOCKET	"/run/pcscd/pcscd.comm"
+#define CKY_PNP_NOTIFICATION	"\\\\?PnP?\\Notification"
+
+typedef struct _ckyPcscdContext {
+    SCARDCONTEXT hContext;
+    int fd;
+    pthread_mutex_t lock;	/* one request at a time on fd */
+    int cancelled;		/* guarded by pcscdStateLock */
+    struct _ckyPcscdContext *next;
+} ckyPcscdContext;
+
+typedef struct _ckyPcscdCard {
+    SCARDHANDLE hCard;
+    ckyPcscdContext *ctx;
+    char readerName[PCSCD_MAX_READERNAME];
+    struct _ckyPcscdCard *next;
+} ckyPcscdCard;
+
+static char pcscdSocket[sizeof(((struct sockaddr_un *)0)->sun_path)];
+static int pcscdMinor = PCSCD_PROTOCOL_MINOR;
+
+/*
+ * pcscdStateLock guards the context and card lists, the reader table and
+ * the monitor's status. pcscdStateChanged is signalled whenever the
+ * table is refreshed, the monitor dies, or a context is cancelled.
+ */
+static pthread_mutex_t pcscdStateLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pcscdStateChanged = PTHREAD_COND_INITIALIZER;
+static ckyPcscdContext *pcscdContexts;
+static ckyPcscdCard *pcscdCards;
+static struct pcscdReaderState pcscdReaders[PCSCD_MAX_READERS];
+static int pcscdMonitorRunning;
+static int pcscdMonitorFd = -1;
+
+static SCARD_IO_REQUEST pcscdT0Pci = { SCARD_PROTOCOL_T0, 
+					sizeof(SCARD_IO_REQUEST) };
+static SCARD_IO_REQUEST pcscdT1Pci = { SCARD_PROTOCOL_T1, 
+					sizeof(SCARD_IO_REQUEST) };
+
+/*
+ * non-blocking socket I/O. timeout is in milliseconds, -1 waits forever.
+ * Returns SCARD_S_SUCCESS, SCARD_E_TIMEOUT or SCARD_E_NO_SERVICE.
+ */
+static long
+ckyPcscd_wait(int fd, short events, int timeout)
+{
+    struct pollfd pfd;
+    int ret;
+
+    pfd.fd = fd;
+    pfd.events = events;
+    do {
+	ret = poll(&pfd, 1, timeout);
+    } while (ret < 0 && errno == EINTR);
+    if (ret == 0) {
+	return SCARD_E_TIMEOUT;
+    }
+    if (ret < 0 || (pfd.revents & (POLLERR|POLLNVAL)) ||
+	((pfd.revents & POLLHUP) && !(pfd.revents & POLLIN))) {
+	return SCARD_E_NO_SERVICE;
+    }
+    return SCARD_S_SUCCESS;
+}
+
+static long
+ckyPcscd_write(int fd, const void *data, size_t len)
+{
+    const char *buf = (const char *)data;
+
+    while (len) {
+	ssize_t ret = send(fd, buf, len, MSG_NOSIGNAL);
+
+	if (ret < 0) {
+	    if (errno == EINTR) {
+		continue;
+	    }
+	    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+		long rv = ckyPcscd_wait(fd, POLLOUT, -1);
+		if (rv != SCARD_S_SUCCESS) {
+		    return rv;
+		}
+		continue;
+	    }
+	    return SCARD_E_NO_SERVICE;
+	}
+	buf += ret;
+	len -= ret;
+    }
+    return SCARD_S_SUCCESS;
+}
+
+static long
+ckyPcscd_read(int fd, void *data, size_t len)
+{
+    char *buf = (char *)data;
+
+    while (len) {
+	ssize_t ret = recv(fd, buf, len, 0);
+
+	if (ret == 0) {
+	    return SCARD_E_NO_SERVICE;
+	}
+	if (ret < 0) {
+	    if (errno == EINTR) {
+		continue;
+	    }
+	    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+		long rv = ckyPcscd_wait(fd, POLLIN, -1);
+		if (rv != SCARD_S_SUCCESS) {
+		    return rv;
+		}
+		continue;
+	    }
+	    return SCARD_E_NO_SERVICE;
+	}
+	buf += ret;
+	len -= ret;
+    }
+    return SCARD_S_SUCCESS;
+}
+
+/* send a request and read back the same structure */
+static long
+ckyPcscd_call(int fd, uint32_t command, void *request, size_t len)
+{
+    struct pcscdHeader header;
+    long rv;
+
+    header.size = len;
+    header.command = command;
+    rv = ckyPcscd_write(fd, &header, sizeof(header));
+    if (rv == SCARD_S_SUCCESS && len) {
+	rv = ckyPcscd_write(fd, request, len);
+    }
+    if (rv == SCARD_S_SUCCESS && len) {
+	rv = ckyPcscd_read(fd, request, len);
+    }
+    return rv;
+}
+
+/*
+ * open a connection and agree on the protocol version. pcscd insists on
+ * an exact match and reports its own version when refusing, so one retry
+ * with the server's minor version covers the compatible revisions.
+ */
+static int
+ckyPcscd_open(void)
+{
+    struct sockaddr_un addr;
+    struct pcscdVersion version;
+    int attempt;
+
+    for (attempt = 0; attempt < 2; attempt++) {
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+	if (fd < 0) {
+	    return -1;
+	}
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, pcscdSocket);
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+	    close(fd);
+	    return -1;
+	}
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+	version.major = PCSCD_PROTOCOL_MAJOR;
+	version.minor = pcscdMinor;
+	version.rv = SCARD_S_SUCCESS;
+	if (ckyPcscd_call(fd, PCSCD_VERSION, &version, sizeof(version)) 
+							!= SCARD_S_SUCCESS) {
+	    close(fd);
+	    return -1;
+	}
+	if (version.rv == SCARD_S_SUCCESS) {
+	    return fd;
+	}
+	close(fd);
+	if (version.major != PCSCD_PROTOCOL_MAJOR || 
+					version.minor == pcscdMinor) {
+	    return -1;
+	}
+	pcscdMinor = version.minor;
+    }
+    return -1;
+}
+
+/*
+ * ask for the next reader event. pcscd answers with the current reader
+ * table right away and sends a pcscdWait once something changes.
+ */
+static long
+ckyPcscd_register(int fd)
+{
+    struct pcscdReaderState readers[PCSCD_MAX_READERS];
+    long rv;
+
+    rv = ckyPcscd_call(fd, PCSCD_WAIT_READER_STATE_CHANGE, NULL, 0);
+    if (rv == SCARD_S_SUCCESS) {
+	rv = ckyPcscd_read(fd, readers, sizeof(readers));
+    }
+    if (rv == SCARD_S_SUCCESS) {
+	pthread_mutex_lock(&pcscdStateLock);
+	memcpy(pcscdReaders, readers, sizeof(readers));
+	pthread_cond_broadcast(&pcscdStateChanged);
+	pthread_mutex_unlock(&pcscdStateLock);
+    }
+    return rv;
+}
+
+static void *
+ckyPcscd_monitor(void *arg)
+{
+    int fd = pcscdMonitorFd;
+    struct pcscdWait wait;
+
+    for (;;) {
+	if (ckyPcscd_read(fd, &wait, sizeof(wait)) != SCARD_S_SUCCESS) {
+	    break;
+	}
+	if (ckyPcscd_register(fd) != SCARD_S_SUCCESS) {
+	    break;
+	}
+    }
+    pthread_mutex_lock(&pcscdStateLock);
+    close(fd);
+    pcscdMonitorFd = -1;
+    pcscdMonitorRunning = 0;
+    pthread_cond_broadcast(&pcscdStateChanged);
+    pthread_mutex_unlock(&pcscdStateLock);
+    return NULL;
+}
+
+/*
+ * make sure the reader table is being kept up to date. Called with
+ * pcscdStateLock held. The first table is read before returning.
+ */
+static long
+ckyPcscd_startMonitor(void)
+{
+    pthread_attr_t attr;
+    pthread_t thread;
+    int fd;
+
+    if (pcscdMonitorRunning) {
+	return SCARD_S_SUCCESS;
+    }
+    fd = ckyPcscd_open();
+    if (fd < 0) {
+	return SCARD_E_NO_SERVICE;
+    }
+    /* register takes the state lock itself */
+    pthread_mutex_unlock(&pcscdStateLock);
+    if (ckyPcscd_register(fd) != SCARD_S_SUCCESS) {
+	pthread_mutex_lock(&pcscdStateLock);
+	close(fd);
+	return SCARD_E_NO_SERVICE;
+    }
+    pthread_mutex_lock(&pcscdStateLock);
+    if (pcscdMonitorRunning) {
+	/* someone else got there first */
+	close(fd);
+	return SCARD_S_SUCCESS;
+    }
+    pcscdMonitorFd = fd;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&thread, &attr, ckyPcscd_monitor, NULL) != 0) {
+	pthread_attr_destroy(&attr);
+	close(fd);
+	pcscdMonitorFd = -1;
+	return SCARD_E_NO_SERVICE;
+    }
+    pthread_attr_destroy(&attr);
+    pcscdMonitorRunning = 1;
+    return SCARD_S_SUCCESS;
+}
+
+/* lookups, called with pcscdStateLock held */
+static ckyPcscdContext *
+ckyPcscd_findContext(SCARDCONTEXT hContext)
+{
+    ckyPcscdContext *ctx;
+
+    for (ctx = pcscdContexts; ctx; ctx = ctx->next) {
+	if (ctx->hContext == hContext) {
+	    return ctx;
+	}
+    }
+    return NULL;
+}
+
+static ckyPcscdCard *
+ckyPcscd_findCard(SCARDHANDLE hCard)
+{
+    ckyPcscdCard *card;
+
+    for (card = pcscdCards; card; card = card->next) {
+	if (card->hCard == hCard) {
+	    return card;
+	}
+    }
+    return NULL;
+}
+
+static const struct pcscdReaderState *
+ckyPcscd_findReader(const char *name)
+{
+    int i;
+
+    for (i=0; i < PCSCD_MAX_READERS; i++) {
+	if (pcscdReaders[i].readerName[0] && 
+		strncmp(pcscdReaders[i].readerName, name, 
+						PCSCD_MAX_READERNAME) == 0) {
+	    return &pcscdReaders[i];
+	}
+    }
+    return NULL;
+}
+
+/*
+ * find the context a card was connected on. Contexts are only freed by
+ * SCardReleaseContext, after which the caller may not use its cards.
+ */
+static ckyPcscdContext *
+ckyPcscd_cardContext(SCARDHANDLE hCard)
+{
+    ckyPcscdCard *card;
+    ckyPcscdContext *ctx = NULL;
+
+    pthread_mutex_lock(&pcscdStateLock);
+    card = ckyPcscd_findCard(hCard);
+    if (card) {
+	ctx = card->ctx;
+    }
+    pthread_mutex_unlock(&pcscdStateLock);
+    return ctx;
+}
+
+/* do a request on the context's connection */
+static long
+ckyPcscd_contextCall(ckyPcscdContext *ctx, uint32_t command, 
+					void *request, size_t len)
+{
+    long rv;
+
+    pthread_mutex_lock(&ctx->lock);
+    rv = ckyPcscd_call(ctx->fd, command, request, len);
+    pthread_mutex_unlock(&ctx->lock);
+    return rv;
+}
+
+static long
+ckyPcscd_cardCall(SCARDHANDLE hCard, uint32_t command, 
+					void *request, size_t len)
+{
+    ckyPcscdContext *ctx = ckyPcscd_cardContext(hCard);
+
+    if (!ctx) {
+	return SCARD_E_INVALID_HANDLE;
+    }
+    return ckyPcscd_contextCall(ctx, command, request, len);
+}
+
+static long WINAPI
+ckyPcscd_EstablishContext(unsigned long dwScope, const void *pvReserved1,
+	const void *pvReserved2, LPSCARDCONTEXT phContext)
+{
+    struct pcscdEstablish establish;
+    ckyPcscdContext *ctx;
+    long rv;
+
+    ctx = (ckyPcscdContext *)malloc(sizeof(ckyPcscdContext));
+    if (!ctx) {
+	return SCARD_E_NO_MEMORY;
+    }
+    ctx->fd = ckyPcscd_open();
+    if (ctx->fd < 0) {
+	free(ctx);
+	return SCARD_E_NO_SERVICE;
+    }
+    establish.dwScope = dwScope;
+    establish.hContext = 0;
+    establish.rv = SCARD_S_SUCCESS;
+    rv = ckyPcscd_call(ctx->fd, PCSCD_ESTABLISH_CONTEXT, 
+				&establish, sizeof(establish));
+    if (rv == SCARD_S_SUCCESS) {
+	rv = establish.rv;
+    }
+    if (rv != SCARD_S_SUCCESS) {
+	close(ctx->fd);
+	free(ctx);
+	return rv;
+    }
+    pthread_mutex_init(&ctx->lock, NULL);
+    ctx->hContext = establish.hContext;
+    ctx->cancelled = 0;
+
+    pthread_mutex_lock(&pcscdStateLock);
+    /* if this fails the next reader state call retries it */
+    (void) ckyPcscd_startMonitor();
+    ctx->next = pcscdContexts;
+    pcscdContexts = ctx;
+    pthread_mutex_unlock(&pcscdStateLock);
+
+    *phContext = ctx->hContext;
+    return SCARD_S_SUCCESS;
+}
+
+static long WINAPI
+ckyPcscd_ReleaseContext(SCARDCONTEXT hContext)
+{
+    struct pcscdRelease release;
+    ckyPcscdContext *ctx, **prev;
+    ckyPcscdCard *card, **prevCard;
+    long rv;
+
+    pthread_mutex_lock(&pcscdStateLock);
+    for (prev = &pcscdContexts; *prev; prev = &(*prev)->next) {
+	if ((*prev)->hContext == hContext) {
+	    break;
+	}
+    }
+    ctx = *prev;
+    if (!ctx) {
+	pthread_mutex_unlock(&pcscdStateLock);
+	return SCARD_E_INVALID_HANDLE;
+    }
+    *prev = ctx->next;
+    /* pcscd drops the cards with the context */
+    for (prevCard = &pcscdCards; (card = *prevCard) != NULL; ) {
+	if (card->ctx == ctx) {
+	    *prevCard = card->next;
+	    free(card);
+	} else {
+	    prevCard = &card->next;
+	}
+    }
+    pthread_mutex_unlock(&pcscdStateLock);
+
+    release.hContext = hContext;
+    release.rv = SCARD_S_SUCCESS;
+    rv = ckyPcscd_contextCall(ctx, PCSCD_RELEASE_CONTEXT, 
+					&release, sizeof(release));
+    if (rv == SCARD_S_SUCCESS) {
+	rv = release.rv;
+    }
+    close(ctx->fd);
+    pthread_mutex_destroy(&ctx->lock);
+    free(ctx);
+    return rv;
+}
+
+static long WINAPI
+ckyPcscd_Connect(SCARDCONTEXT hContext, const char *szReader,
+	unsigned long dwShareMode, unsigned long dwPreferredProtocols,
+	SCARDHANDLE *phCard, unsigned long *pdwActiveProtocol)
+{
+    struct pcscdConnect request;
+    ckyPcscdContext *ctx;
+    ckyPcscdCard *card;
+    long rv;
+
+    if (strlen(szReader) >= PCSCD_MAX_READERNAME) {
+	return SCARD_E_UNKNOWN_READER;
+    }
+    pthread_mutex_lock(&pcscdStateLock);
+    ctx = ckyPcscd_findContext(hContext);
+    pthread_mutex_unlock(&pcscdStateLock);
+    if (!ctx) {
+	return SCARD_E_INVALID_HANDLE;
+    }
+    card = (ckyPcscdCard *)malloc(sizeof(ckyPcscdCard));
+    if (!card) {
+	return SCARD_E_NO_MEMORY;
+    }
+
+    memset(&request, 0, sizeof(request));
+    request.hContext = hContext;
+    strcpy(request.szReader, szReader);
+    request.dwShareMode = dwShareMode;
+    request.dwPreferredProtocols = dwPreferredProtocols;
+    request.rv = SCARD_S_SUCCESS;
+    rv = ckyPcscd_contextCall(ctx, PCSCD_CONNECT, &request, sizeof(request));
+    if (rv == SCARD_S_SUCCESS) {
+	rv = request.rv;
+    }
+    if (rv != SCARD_S_SUCCESS) {
+	free(card);
+	return rv;
+    }
+
+    card->hCard = request.hCard;
+    card->ctx = ctx;
+    strcpy(card->readerName, szReader);
+    pthread_mutex_lock(&pcscdStateLock);
+    card->next = pcscdCards;
+    pcscdCards = card;
+    pthread_mutex_unlock(&pcscdStateLock);
+
+    *phCard = request.hCard;
+    *pdwActiveProtocol = request.dwActiveProtocol;
+    return SCARD_S_SUCCESS;
+}
+
+static long WINAPI
+ckyPcscd_Reconnect(SCARDHANDLE hCard, unsigned long dwShareMode,
+	unsigned long dwPreferredProtocols, unsigned long dwInitialization,
+	unsigned long *pdwActiveProtocol)
+{
+    struct pcscdReconnect request;
+    long rv;
+
+    request.hCard = hCard;
+    request.dwShareMode = dwShareMode;
+    request.dwPreferredProtocols = dwPreferredProtocols;
+    request.dwInitialization = dwInitialization;
+    request.dwActiveProtocol = 0;
+    request.rv = SCARD_S_SUCCESS;
+    rv = ckyPcscd_cardCall(hCard, PCSCD_RECONNECT, &request, sizeof(request));
+    if (rv == SCARD_S_SUCCESS) {
+	rv = request.rv;
+    }
+    if (rv == SCARD_S_SUCCESS) {
+	*pdwActiveProtocol = request.dwActiveProtocol;
+    }
+    return rv;
+}
+
+static long WINAPI
+ckyPcscd_Disconnect(SCARDHANDLE hCard, unsigned long dwDisposition)
+{
+    struct pcscdDisposition request;
+    ckyPcscdCard *card, **prev;
+    long rv;
+
+    request.hCard = hCard;
+    request.dwDisposition = dwDisposition;
+    request.rv = SCARD_S_SUCCESS;
+    rv = ckyPcscd_cardCall(hCard, PCSCD_DISCONNECT, &request, sizeof(request));
+    if (rv == SCARD_S_SUCCESS) {
+	rv = request.rv;
+    }
+    if (rv == SCARD_E_INVALID_HANDLE) {
+	return rv;
+    }
+    pthread_mutex_lock(&pcscdStateLock);
+    for (prev = &pcscdCards; (card = *prev) != NULL; prev = &card->next) {
+	if (card->hCard == hCard) {
+	    *prev = card->next;
+	    free(card);
+	    break;
+	}
+    }
+    pthread_mutex_unlock(&pcscdStateLock);
+    return rv;
+}
+
+static long WINAPI
+ckyPcscd_BeginTransaction(SCARDHANDLE hCard)
+{
+    struct pcscdCard request;
+    long rv;
+
+    request.hCard = hCard;
+    request.rv = SCARD_S_SUCCESS;
+    rv = ckyPcscd_cardCall(hCard, PCSCD_BEGIN_TRANSACTION, 
+						&request, sizeof(request));
+    return rv == SCARD_S_SUCCESS ? (long)request.rv : rv;
+}
+
+static long WINAPI
+ckyPcscd_EndTransaction(SCARDHANDLE hCard, unsigned long dwDisposition)
+{
+    struct pcscdDisposition request;
+    long rv;
+
+    request.hCard = hCard;
+    request.dwDisposition = dwDisposition;
+    request.rv = SCARD_S_SUCCESS;
+    rv = ckyPcscd_cardCall(hCard, PCSCD_END_TRANSACTION, 
+						&request, sizeof(request));
+    return rv == SCARD_S_SUCCESS ? (long)request.rv : rv;
+}
+
+static long WINAPI
+ckyPcscd_Transmit(SCARDHANDLE hCard, LPCSCARD_IO_REQUEST pioSendPci,
+	const unsigned char *pbSendBuffer, unsigned long cbSendLength,
+	LPSCARD_IO_REQUEST pioRecvPci, unsigned char *pbRecvBuffer,
+	unsigned long *pcbRecvLength)
+{
+    struct pcscdHeader header;
+    struct pcscdTransmit request;
+    ckyPcscdContext *ctx = ckyPcscd_cardContext(hCard);
+    long rv;
+
+    if (!ctx) {
+	return SCARD_E_INVALID_HANDLE;
+    }
+    if (cbSendLength > PCSCD_MAX_BUFFER_SIZE_EXTENDED) {
+	return SCARD_E_INSUFFICIENT_BUFFER;
+    }
+    request.hCard = hCard;
+    request.ioSendPciProtocol = pioSendPci->dwProtocol;
+    request.ioSendPciLength = pioSendPci->cbPciLength;
+    request.cbSendLength = cbSendLength;
+    request.ioRecvPciProtocol = pioRecvPci ? 
+			pioRecvPci->dwProtocol : pioSendPci->dwProtocol;
+    request.ioRecvPciLength = sizeof(SCARD_IO_REQUEST);
+    request.pcbRecvLength = *pcbRecvLength;
+    request.rv = SCARD_S_SUCCESS;
+    header.size = sizeof(request);
+    header.command = PCSCD_TRANSMIT;
+
+    /* the APDU follows the request, the response follows the reply */
+    pthread_mutex_lock(&ctx->lock);
+    rv = ckyPcscd_write(ctx->fd, &header, sizeof(header));
+    if (rv == SCARD_S_SUCCESS) {
+	rv = ckyPcscd_write(ctx->fd, &request, sizeof(request));
+    }
+    if (rv == SCARD_S_SUCCESS) {
+	rv = ckyPcscd_write(ctx->fd, pbSendBuffer, cbSendLength);
+    }
+    if (rv == SCARD_S_SUCCESS) {
+	rv = ckyPcscd_read(ctx->fd, &request, sizeof(request));
+    }
+    if (rv == SCARD_S_SUCCESS && request.rv == SCARD_S_SUCCESS) {
+	if (request.pcbRecvLength > *pcbRecvLength) {
+	    /* can't happen with a sane server, and we've lost sync */
+	    rv = SCARD_F_COMM_ERROR;
+	} else {
+	    rv = ckyPcscd_read(ctx->fd, pbRecvBuffer, request.pcbRecvLength);
+	}
+    }
+    pthread_mutex_unlock(&ctx->lock);
+    if (rv != SCARD_S_SUCCESS) {
+	return rv;
+    }
+    if (request.rv != SCARD_S_SUCCESS) {
+	return request.rv;
+    }
+    if (pioRecvPci) {
+	pioRecvPci->dwProtocol = request.ioRecvPciProtocol;
+	pioRecvPci->cbPciLength = request.ioRecvPciLength;
+    }
+    *pcbRecvLength = request.pcbRecvLength;
+    return SCARD_S_SUCCESS;
+}
+
+static long WINAPI
+ckyPcscd_ListReaders(SCARDCONTEXT hContext, const char *mszGroups,
+	char *mszReaders, unsigned long *pcchReaders)
+{
+    unsigned long len = 0;
+    long rv = SCARD_S_SUCCESS;
+    int i;
+
+    pthread_mutex_lock(&pcscdStateLock);
+    if (!ckyPcscd_findContext(hContext)) {
+	rv = SCARD_E_INVALID_HANDLE;
+	goto done;
+    }
+    if ((rv = ckyPcscd_startMonitor()) != SCARD_S_SUCCESS) {
+	goto done;
+    }
+    for (i=0; i < PCSCD_MAX_READERS; i++) {
+	if (pcscdReaders[i].readerName[0]) {
+	    len += strlen(pcscdReaders[i].readerName) + 1;
+	}
+    }
+    if (len == 0) {
+	rv = SCARD_E_NO_READERS_AVAILABLE;
+	goto done;
+    }
+    len++; /* final NULL */
+    if (mszReaders) {
+	char *next = mszReaders;
+
+	if (*pcchReaders < len) {
+	    rv = SCARD_E_INSUFFICIENT_BUFFER;
+	    goto done;
+	}
+	for (i=0; i < PCSCD_MAX_READERS; i++) {
+	    if (pcscdReaders[i].readerName[0]) {
+		strcpy(next, pcscdReaders[i].readerName);
+		next += strlen(next) + 1;
+	    }
+	}
+	*next = 0;
+    }
+    *pcchReaders = len;
+done:
+    pthread_mutex_unlock(&pcscdStateLock);
+    return rv;
+}
+
+static long WINAPI
+ckyPcscd_Status(SCARDHANDLE hCard, char *mszReaderNames, 
+	unsigned long *pcchReaderLen, unsigned long *pdwState,
+	unsigned long *pdwProtocol, unsigned char *pbAtr, 
+	unsigned long *pcbAtrLen)
+{
+    struct pcscdCard request;
+    const struct pcscdReaderState *reader;
+    ckyPcscdCard *card;
+    unsigned long nameLen;
+    long rv;
+
+    /* pcscd checks the handle is still good, the rest is in our table */
+    request.hCard = hCard;
+    request.rv = SCARD_S_SUCCESS;
+    rv = ckyPcscd_cardCall(hCard, PCSCD_STATUS, &request, sizeof(request));
+    if (rv == SCARD_S_SUCCESS) {
+	rv = request.rv;
+    }
+    if (rv != SCARD_S_SUCCESS) {
+	return rv;
+    }
+
+    pthread_mutex_lock(&pcscdStateLock);
+    card = ckyPcscd_findCard(hCard);
+    reader = card ? ckyPcscd_findReader(card->readerName) : NULL;
+    if (!reader) {
+	rv = card ? SCARD_E_READER_UNAVAILABLE : SCARD_E_INVALID_HANDLE;
+	goto done;
+    }
+    nameLen = strlen(card->readerName) + 2; /* multistring */
+    if (mszReaderNames) {
+	if (*pcchReaderLen < nameLen) {
+	    rv = SCARD_E_INSUFFICIENT_BUFFER;
+	} else {
+	    strcpy(mszReaderNames, card->readerName);
+	    mszReaderNames[nameLen-1] = 0;
+	}
+    }
+    if (pcchReaderLen) {
+	*pcchReaderLen = nameLen;
+    }
+    if (pdwState) {
+	*pdwState = reader->readerState;
+    }
+    if (pdwProtocol) {
+	*pdwProtocol = reader->cardProtocol;
+    }
+    if (pcbAtrLen) {
+	unsigned long atrLen = reader->cardAtrLength;
+
+	if (atrLen > PCSCD_MAX_ATR_SIZE) {
+	    atrLen = PCSCD_MAX_ATR_SIZE;
+	}
+	if (pbAtr) {
+	    if (*pcbAtrLen < atrLen) {
+		rv = SCARD_E_INSUFFICIENT_BUFFER;
+	    } else {
+		memcpy(pbAtr, reader->cardAtr, atrLen);
+	    }
+	}
+	*pcbAtrLen = atrLen;
+    }
+done:
+    pthread_mutex_unlock(&pcscdStateLock);
+    return rv;
+}
+
+static long WINAPI
+ckyPcscd_GetAttrib(SCARDHANDLE hCard, unsigned long dwAttId, 
+	char *pbAttr, unsigned long *pchAttrLen)
+{
+    struct pcscdAttrib request;
+    long rv;
+
+    memset(&request, 0, sizeof(request));
+    request.hCard = hCard;
+    request.dwAttrId = dwAttId;
+    request.cbAttrLen = pbAttr ? *pchAttrLen : sizeof(request.cbAttr);
+    if (request.cbAttrLen > sizeof(request.cbAttr)) {
+	request.cbAttrLen = sizeof(request.cbAttr);
+    }
+    request.rv = SCARD_S_SUCCESS;
+    rv = ckyPcscd_cardCall(hCard, PCSCD_GET_ATTRIB, &request, sizeof(request));
+    if (rv == SCARD_S_SUCCESS) {
+	rv = request.rv;
+    }
+    if (rv != SCARD_S_SUCCESS) {
+	return rv;
+    }
+    if (pbAttr) {
+	if (*pchAttrLen < request.cbAttrLen) {
+	    *pchAttrLen = request.cbAttrLen;
+	    return SCARD_E_INSUFFICIENT_BUFFER;
+	}
+	memcpy(pbAttr, request.cbAttr, request.cbAttrLen);
+    }
+    *pchAttrLen = request.cbAttrLen;
+    return SCARD_S_SUCCESS;
+}
+
+/*
+ * compute the new event state of one reader from the table, the same way
+ * libpcsclite does: the high word carries pcscd's event counter (or the
+ * reader count for the PnP reader). Returns true if it changed. Called
+ * with pcscdStateLock held.
+ */
+static int
+ckyPcscd_readerChanged(SCARD_READERSTATE *state)
+{
+    const struct pcscdReaderState *reader;
+    unsigned long current = state->dwCurrentState;
+    unsigned long event;
+    int i, count;
+
+    if (current & SCARD_STATE_IGNORE) {
+	state->dwEventState = SCARD_STATE_IGNORE;
+	return 0;
+    }
+    if (strcmp(state->szReader, CKY_PNP_NOTIFICATION) == 0) {
+	for (i=0, count=0; i < PCSCD_MAX_READERS; i++) {
+	    if (pcscdReaders[i].readerName[0]) {
+		count++;
+	    }
+	}
+	event = (unsigned long)count << 16;
+	if ((current & 0xffff0000) != event) {
+	    state->dwEventState = event | SCARD_STATE_CHANGED;
+	    return 1;
+	}
+	state->dwEventState = event;
+	return 0;
+    }
+
+    reader = ckyPcscd_findReader(state->szReader);
+    if (!reader) {
+	state->dwEventState = SCARD_STATE_UNKNOWN | SCARD_STATE_UNAVAILABLE;
+	if (!(current & SCARD_STATE_UNKNOWN)) {
+	    state->dwEventState |= SCARD_STATE_CHANGED;
+	    return 1;
+	}
+	return 0;
+    }
+
+    event = (unsigned long)(reader->eventCounter & 0xffff) << 16;
+    if (reader->readerState & SCARD_UNKNOWN) {
+	event |= SCARD_STATE_UNAVAILABLE;
+    } else if (reader->readerState & SCARD_PRESENT) {
+	unsigned long atrLen = reader->cardAtrLength;
+
+	if (atrLen > MAX_ATR_SIZE) {
+	    atrLen = MAX_ATR_SIZE;
+	}
+	event |= SCARD_STATE_PRESENT;
+	memcpy(state->rgbAtr, reader->cardAtr, atrLen);
+	state->cbAtr = atrLen;
+	if (reader->readerSharing == PCSCD_SHARING_EXCLUSIVE) {
+	    event |= SCARD_STATE_EXCLUSIVE;
+	} else if (reader->readerSharing > 0) {
+	    event |= SCARD_STATE_INUSE;
+	}
+	if (!(reader->readerState & SCARD_POWERED)) {
+	    /* present but never answered a reset */
+	    if (reader->readerState & SCARD_SWALLOWED) {
+		event |= SCARD_STATE_MUTE;
+	    }
+	}
+    } else {
+	event |= SCARD_STATE_EMPTY;
+	state->cbAtr = 0;
+    }
+
+    state->dwEventState = event;
+    if (((current ^ event) & (SCARD_STATE_UNAVAILABLE|SCARD_STATE_EMPTY|
+	    SCARD_STATE_PRESENT|SCARD_STATE_EXCLUSIVE|SCARD_STATE_INUSE|
+	    SCARD_STATE_MUTE)) ||
+	((current & 0xffff0000) && ((current ^ event) & 0xffff0000))) {
+	state->dwEventState |= SCARD_STATE_CHANGED;
+	return 1;
+    }
+    return 0;
+}
+
+static long WINAPI
+ckyPcscd_GetStatusChange(SCARDCONTEXT hContext, unsigned long dwTimeout,
+	SCARD_READERSTATE *rgReaderStates, unsigned long cReaders)
+{
+    ckyPcscdContext *ctx;
+    struct timespec deadline;
+    long rv = SCARD_S_SUCCESS;
+
+    if (dwTimeout != INFINITE) {
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	deadline.tv_sec = now.tv_sec + dwTimeout/1000;
+	deadline.tv_nsec = now.tv_usec*1000 + (dwTimeout%1000)*1000000;
+	if (deadline.tv_nsec >= 1000000000) {
+	    deadline.tv_sec++;
+	    deadline.tv_nsec -= 1000000000;
+	}
+    }
+
+    pthread_mutex_lock(&pcscdStateLock);
+    ctx = ckyPcscd_findContext(hContext);
+    if (!ctx) {
+	pthread_mutex_unlock(&pcscdStateLock);
+	return SCARD_E_INVALID_HANDLE;
+    }
+    ctx->cancelled = 0;
+    for (;;) {
+	unsigned long i;
+	int changed = 0;
+
+	if ((rv = ckyPcscd_startMonitor()) != SCARD_S_SUCCESS) {
+	    break;
+	}
+	for (i=0; i < cReaders; i++) {
+	    changed |= ckyPcscd_readerChanged(&rgReaderStates[i]);
+	}
+	if (changed) {
+	    break;
+	}
+	if (ctx->cancelled) {
+	    rv = SCARD_E_CANCELLED;
+	    break;
+	}
+	if (dwTimeout == INFINITE) {
+	    pthread_cond_wait(&pcscdStateChanged, &pcscdStateLock);
+	} else if (pthread_cond_timedwait(&pcscdStateChanged, 
+			&pcscdStateLock, &deadline) == ETIMEDOUT) {
+	    rv = SCARD_E_TIMEOUT;
+	    break;
+	}
+    }
+    ctx->cancelled = 0;
+    pthread_mutex_unlock(&pcscdStateLock);
+    return rv;
+}
+
+static long WINAPI
+ckyPcscd_Cancel(SCARDCONTEXT hContext)
+{
+    ckyPcscdContext *ctx;
+    long rv = SCARD_S_SUCCESS;
+
+    /* status waits are all local, so is cancelling them */
+    pthread_mutex_lock(&pcscdStateLock);
+    ctx = ckyPcscd_findContext(hContext);
+    if (ctx) {
+	ctx->cancelled = 1;
+	pthread_cond_broadcast(&pcscdStateChanged);
+    } else {
+	rv = SCARD_E_INVALID_HANDLE;
+    }
+    pthread_mutex_unlock(&pcscdStateLock);
+    return rv;
+}
+
+/*
+ * in a forked child the sockets and the monitor thread belong to the
+ * parent. Close our copies of the sockets and start over, the card layer
+ * abandons its old handles on its own.
+ */
+static void
+ckyPcscd_afterFork(void)
+{
+    ckyPcscdContext *ctx;
+    ckyPcscdCard *card;
+
+    pthread_mutex_init(&pcscdStateLock, NULL);
+    pthread_cond_init(&pcscdStateChanged, NULL);
+    while ((ctx = pcscdContexts) != NULL) {
+	pcscdContexts = ctx->next;
+	close(ctx->fd);
+	free(ctx);
+    }
+    while ((card = pcscdCards) != NULL) {
+	pcscdCards = card->next;
+	free(card);
+    }
+    if (pcscdMonitorFd >= 0) {
+	close(pcscdMonitorFd);
+    }
+    pcscdMonitorFd = -1;
+    pcscdMonitorRunning = 0;
+}
+
+SCard *
+ckySCard_InitPcscd(const char *socketName)
+{
+    SCard *scard;
+    int fd;
+
+    if (socketName[0] != '/') {
+	socketName = getenv("PCSCLITE_CSOCK_NAME");
+	if (!socketName) {
+	    socketName = CKY_PCSCD_DEFAULT_SOCKET;
+	}
+    }
+    if (strlen(socketName) >= sizeof(pcscdSocket)) {
+	return NULL;
+    }
+    strcpy(pcscdSocket, socketName);
+
+    /* make sure someone is listening, otherwise let the caller fall
+     * back to the PC/SC library */
+    fd = ckyPcscd_open();
+    if (fd < 0) {
+	return NULL;
+    }
+    close(fd);
+    pthread_atfork(NULL, NULL, ckyPcscd_afterFork);
+
+    scard = (SCard *)malloc(sizeof(SCard));
+    if (!scard) {
+	return NULL;
+    }
+    scard->SCardEstablishContext = ckyPcscd_EstablishContext;
+    scard->SCardReleaseContext = ckyPcscd_ReleaseContext;
+    scard->SCardBeginTransaction = ckyPcscd_BeginTransaction;
+    scard->SCardEndTransaction = ckyPcscd_EndTransaction;
+    scard->SCardConnect = ckyPcscd_Connect;
+    scard->SCardDisconnect = ckyPcscd_Disconnect;
+    scard->SCardTransmit = ckyPcscd_Transmit;
+    scard->SCardReconnect = ckyPcscd_Reconnect;
+    scard->SCardListReaders = ckyPcscd_ListReaders;
+    scard->SCardStatus = ckyPcscd_Status;
+    scard->SCardGetAttrib = ckyPcscd_GetAttrib;
+    scard->SCardGetStatusChange = ckyPcscd_GetStatusChange;
+    scard->SCardCancel = ckyPcscd_Cancel;
+    scard->SCARD_PCI_T0_ = &pcscdT0Pci;
+    scard->SCARD_PCI_T1_ = &pcscdT1Pci;
+    return scard;
+}
+
+#else
+
+SCard *
+ckySCard_InitPcscd(const char *socketName)
+{
+    /* pcscd's protocol is private to pcsc-lite platforms */
+    return NULL;
+}
+
+#endif
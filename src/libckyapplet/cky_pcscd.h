@@ -0,0 +1,143 @@
+/* ***** BEGIN COPYRIGHT BLOCK *****
+ * Copyright (C) 2005 Red Hat, Inc.
+ * All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation version
+ * 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ * ***** END COPYRIGHT BLOCK ***** */
+
+/*
+ * the following header file is private to the CoolKey library. It
+ * describes pcscd's unix socket protocol, shared by the native pcscd
+ * client and the mock pcscd the tests run it against.
+ */
+#ifndef CKY_PCSCD_H
+#define CKY_PCSCD_H 1
+
+#include <stdint.h>
+
+/* pcscd's wire protocol, from pcsc-lite's winscard_msg.h */
+#define PCSCD_PROTOCOL_MAJOR		4
+#define PCSCD_PROTOCOL_MINOR		4
+#define PCSCD_MAX_READERNAME		128
+#define PCSCD_MAX_ATR_SIZE		33
+#define PCSCD_MAX_BUFFER_SIZE		264
+#define PCSCD_MAX_BUFFER_SIZE_EXTENDED	(4 + 3 + (1<<16) + 3 + 2)
+#define PCSCD_MAX_READERS		16
+#define PCSCD_SHARING_EXCLUSIVE		-1
+
+enum {
+    PCSCD_ESTABLISH_CONTEXT = 0x01,
+    PCSCD_RELEASE_CONTEXT = 0x02,
+    PCSCD_CONNECT = 0x04,
+    PCSCD_RECONNECT = 0x05,
+    PCSCD_DISCONNECT = 0x06,
+    PCSCD_BEGIN_TRANSACTION = 0x07,
+    PCSCD_END_TRANSACTION = 0x08,
+    PCSCD_TRANSMIT = 0x09,
+    PCSCD_STATUS = 0x0B,
+    PCSCD_GET_ATTRIB = 0x0F,
+    PCSCD_VERSION = 0x11,
+    PCSCD_WAIT_READER_STATE_CHANGE = 0x13
+};
+
+struct pcscdHeader {
+    uint32_t size;
+    uint32_t command;
+};
+
+struct pcscdVersion {
+    int32_t major;
+    int32_t minor;
+    uint32_t rv;
+};
+
+struct pcscdEstablish {
+    uint32_t dwScope;
+    uint32_t hContext;
+    uint32_t rv;
+};
+
+struct pcscdRelease {
+    uint32_t hContext;
+    uint32_t rv;
+};
+
+struct pcscdConnect {
+    uint32_t hContext;
+    char szReader[PCSCD_MAX_READERNAME];
+    uint32_t dwShareMode;
+    uint32_t dwPreferredProtocols;
+    int32_t hCard;
+    uint32_t dwActiveProtocol;
+    uint32_t rv;
+};
+
+struct pcscdReconnect {
+    int32_t hCard;
+    uint32_t dwShareMode;
+    uint32_t dwPreferredProtocols;
+    uint32_t dwInitialization;
+    uint32_t dwActiveProtocol;
+    uint32_t rv;
+};
+
+/* disconnect and end transaction */
+struct pcscdDisposition {
+    int32_t hCard;
+    uint32_t dwDisposition;
+    uint32_t rv;
+};
+
+/* begin transaction and status */
+struct pcscdCard {
+    int32_t hCard;
+    uint32_t rv;
+};
+
+struct pcscdTransmit {
+    int32_t hCard;
+    uint32_t ioSendPciProtocol;
+    uint32_t ioSendPciLength;
+    uint32_t cbSendLength;
+    uint32_t ioRecvPciProtocol;
+    uint32_t ioRecvPciLength;
+    uint32_t pcbRecvLength;
+    uint32_t rv;
+};
+
+struct pcscdAttrib {
+    int32_t hCard;
+    uint32_t dwAttrId;
+    uint8_t cbAttr[PCSCD_MAX_BUFFER_SIZE];
+    uint32_t cbAttrLen;
+    uint32_t rv;
+};
+
+struct pcscdWait {
+    uint32_t timeOut;
+    uint32_t rv;
+};
+
+struct pcscdReaderState {
+    char readerName[PCSCD_MAX_READERNAME];
+    uint32_t eventCounter;
+    uint32_t readerState;
+    int32_t readerSharing;
+    uint8_t cardAtr[PCSCD_MAX_ATR_SIZE];
+    uint32_t cardAtrLength;
+    uint32_t cardProtocol;
+};
+
+#endif /* CKY_PCSCD_H */
@@ -0,0 +1,750 @@
+/* ***** BEGIN COPYRIGHT BLOCK *****
+ * Copyright (C) 2005 Red Hat, Inc.
+ * All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation version
+ * 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ * ***** END COPYRIGHT BLOCK ***** */
+
+#include <winscard.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <sys/time.h>
+#include <unistd.h>
+#endif
+#include "cky_basei.h" /* friend class */
+#include "cky_base.h"
+#include "cky_scard.h"
+
+/*
+ * APDU session recorder and replayer.
+ *
+ * The recorder wraps the real PC/SC entry points and logs every connect,
+ * status and transmit to a compact binary file. The replayer reads such
+ * a file back and stands in for PC/SC entirely, so a session captured
+ * once against a real card can be rerun (with the original or scaled
+ * card latency) without the card.
+ *
+ * File format, all integers little endian:
+ *   header:	"CKYAPDU1"
+ *   record:	type(1) time(4, usec since start) handle(4) then
+ *   'C' connect	protocol(4) nameLen(2) name
+ *   'S' status		state(4) protocol(4) atrLen(2) atr
+ *   'T' transmit	usec(4) rv(4) sendLen(2) send recvLen(2) recv
+ *   'B' begin transaction	rv(4)
+ */
+#define CKY_RECORD_MAGIC	"CKYAPDU1"
+#define CKY_RECORD_MAGIC_LEN	8
+#define CKY_RECORD_HEADER_LEN	9
+#define CKY_RECORD_CONNECT	'C'
+#define CKY_RECORD_STATUS	'S'
+#define CKY_RECORD_TRANSMIT	'T'
+#define CKY_RECORD_BEGIN	'B'
+
+#define CKY_PNP_NOTIFICATION	"\\\\?PnP?\\Notification"
+
+/*
+ * time in usecs relative to the first call. Wraps after an hour or so on
+ * 32 bit platforms, which is plenty for a captured session.
+ */
+static unsigned long
+ckyRecord_now(void)
+{
+#ifdef WIN32
+    static DWORD start;
+    if (!start) {
+	start = GetTickCount();
+    }
+    return (GetTickCount() - start)*1000;
+#else
+    static struct timeval start;
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    if (!start.tv_sec) {
+	start = tv;
+    }
+    return (tv.tv_sec - start.tv_sec)*1000000 + (tv.tv_usec - start.tv_usec);
+#endif
+}
+
+static void
+ckyRecord_sleep(unsigned long usec)
+{
+#ifdef WIN32
+    Sleep(usec/1000);
+#else
+    usleep(usec);
+#endif
+}
+
+/*
+ * The recorder
+ */
+static SCard *recordReal;
+static FILE *recordFile;
+
+static void
+ckyRecord_write(CKYByte type, SCARDHANDLE hCard, const CKYBuffer *body)
+{
+    CKYBuffer record;
+
+    CKYBuffer_InitEmpty(&record);
+    CKYBuffer_Reserve(&record, CKY_RECORD_HEADER_LEN+CKYBuffer_Size(body));
+    CKYBuffer_AppendChar(&record, type);
+    CKYBuffer_AppendLongLE(&record, ckyRecord_now());
+    CKYBuffer_AppendLongLE(&record, (unsigned long)hCard);
+    CKYBuffer_AppendCopy(&record, body);
+    /* one write per record, so records from different threads don't
+     * interleave */
+    fwrite(CKYBuffer_Data(&record), 1, CKYBuffer_Size(&record), recordFile);
+    fflush(recordFile);
+    CKYBuffer_FreeData(&record);
+}
+
+static long WINAPI
+ckyRecord_Connect(SCARDCONTEXT hContext, const char *szReader,
+	unsigned long dwShareMode, unsigned long dwPreferredProtocols,
+	SCARDHANDLE *phCard, unsigned long *pdwActiveProtocol)
+{
+    CKYBuffer body;
+    long rv;
+    unsigned short len = (unsigned short) strlen(szReader);
+
+    rv = recordReal->SCardConnect(hContext, szReader, dwShareMode,
+		dwPreferredProtocols, phCard, pdwActiveProtocol);
+    if (rv != SCARD_S_SUCCESS) {
+	return rv;
+    }
+    CKYBuffer_InitEmpty(&body);
+    CKYBuffer_AppendLongLE(&body, *pdwActiveProtocol);
+    CKYBuffer_AppendShortLE(&body, len);
+    CKYBuffer_AppendData(&body, (const CKYByte *)szReader, len);
+    ckyRecord_write(CKY_RECORD_CONNECT, *phCard, &body);
+    CKYBuffer_FreeData(&body);
+    return rv;
+}
+
+static long WINAPI
+ckyRecord_Status(SCARDHANDLE hCard, char *mszReaderNames,
+	unsigned long *pcchReaderLen, unsigned long *pdwState,
+	unsigned long *pdwProtocol, unsigned char *pbAtr,
+	unsigned long *pcbAtrLen)
+{
+    CKYBuffer body;
+    long rv;
+
+    rv = recordReal->SCardStatus(hCard, mszReaderNames, pcchReaderLen,
+		pdwState, pdwProtocol, pbAtr, pcbAtrLen);
+    /* only the call that actually fetches the ATR is interesting */
+    if ((rv != SCARD_S_SUCCESS) || !pbAtr || !pdwState || !pdwProtocol) {
+	return rv;
+    }
+    CKYBuffer_InitEmpty(&body);
+    CKYBuffer_AppendLongLE(&body, *pdwState);
+    CKYBuffer_AppendLongLE(&body, *pdwProtocol);
+    CKYBuffer_AppendShortLE(&body, (unsigned short)*pcbAtrLen);
+    CKYBuffer_AppendData(&body, pbAtr, *pcbAtrLen);
+    ckyRecord_write(CKY_RECORD_STATUS, hCard, &body);
+    CKYBuffer_FreeData(&body);
+    return rv;
+}
+
+/*
+ * transactions aren't needed for replay, but they are what we count when
+ * checking a session against its budget
+ */
+static long WINAPI
+ckyRecord_BeginTransaction(SCARDHANDLE hCard)
+{
+    CKYBuffer body;
+    long rv;
+
+    rv = recordReal->SCardBeginTransaction(hCard);
+    CKYBuffer_InitEmpty(&body);
+    CKYBuffer_AppendLongLE(&body, (unsigned long)rv);
+    ckyRecord_write(CKY_RECORD_BEGIN, hCard, &body);
+    CKYBuffer_FreeData(&body);
+    return rv;
+}
+
+static long WINAPI
+ckyRecord_Transmit(SCARDHANDLE hCard, LPCSCARD_IO_REQUEST pioSendPci,
+	const unsigned char *pbSendBuffer, unsigned long cbSendLength,
+	LPSCARD_IO_REQUEST pioRecvPci, unsigned char *pbRecvBuffer,
+	unsigned long *pcbRecvLength)
+{
+    CKYBuffer body;
+    long rv;
+    unsigned long start = ckyRecord_now();
+    unsigned long recvLen;
+
+    rv = recordReal->SCardTransmit(hCard, pioSendPci, pbSendBuffer,
+		cbSendLength, pioRecvPci, pbRecvBuffer, pcbRecvLength);
+    recvLen = (rv == SCARD_S_SUCCESS) ? *pcbRecvLength : 0;
+
+    CKYBuffer_InitEmpty(&body);
+    CKYBuffer_AppendLongLE(&body, ckyRecord_now() - start);
+    CKYBuffer_AppendLongLE(&body, (unsigned long)rv);
+    CKYBuffer_AppendShortLE(&body, (unsigned short)cbSendLength);
+    CKYBuffer_AppendData(&body, pbSendBuffer, cbSendLength);
+    CKYBuffer_AppendShortLE(&body, (unsigned short)recvLen);
+    CKYBuffer_AppendData(&body, pbRecvBuffer, recvLen);
+    ckyRecord_write(CKY_RECORD_TRANSMIT, hCard, &body);
+    CKYBuffer_FreeData(&body);
+    return rv;
+}
+
+SCard *
+ckySCard_InitRecord(SCard *real, const char *fileName)
+{
+    SCard *scard;
+
+    recordFile = fopen(fileName, "wb");
+    if (!recordFile) {
+	return NULL;
+    }
+    scard = (SCard *)malloc(sizeof(SCard));
+    if (!scard) {
+	fclose(recordFile);
+	recordFile = NULL;
+	return NULL;
+    }
+    fwrite(CKY_RECORD_MAGIC, 1, CKY_RECORD_MAGIC_LEN, recordFile);
+    fflush(recordFile);
+    ckyRecord_now(); /* start the clock */
+
+    recordReal = real;
+    *scard = *real;
+    scard->SCardConnect = ckyRecord_Connect;
+    scard->SCardStatus = ckyRecord_Status;
+    scard->SCardTransmit = ckyRecord_Transmit;
+    scard->SCardBeginTransaction = ckyRecord_BeginTransaction;
+    return scard;
+}
+
+/*
+ * The replayer
+ *
+ * Every reader that was connected in the recording shows up as a reader
+ * with a card present. Transmits are answered from the recording for that
+ * reader: the next record with an identical command is used, falling back
+ * to the next record in sequence (commands which carry nonces or
+ * challenges won't match byte for byte).
+ */
+typedef struct {
+    char *name;
+    unsigned long protocol;
+    unsigned long state;
+    CKYBuffer atr;
+    unsigned int cursor;	/* next record to consider */
+} ckyReplayReader;
+
+typedef struct {
+    CKYByte type;
+    unsigned int reader;
+    CKYOffset offset;		/* start of the type specific data */
+} ckyReplayRecord;
+
+static CKYBuffer replayData;
+static ckyReplayRecord *replayRecords;
+static unsigned int replayRecordCount;
+static ckyReplayReader *replayReaders;
+static unsigned int replayReaderCount;
+static double replayScale = 1.0;
+static CKYBool replayCancelled;
+static SCARD_IO_REQUEST replayT0Pci = { SCARD_PROTOCOL_T0, 
+						sizeof(SCARD_IO_REQUEST) };
+static SCARD_IO_REQUEST replayT1Pci = { SCARD_PROTOCOL_T1, 
+						sizeof(SCARD_IO_REQUEST) };
+
+static ckyReplayReader *
+ckyReplay_getReader(SCARDHANDLE hCard)
+{
+    if ((hCard < 1) || ((unsigned long)hCard > replayReaderCount)) {
+	return NULL;
+    }
+    return &replayReaders[hCard-1];
+}
+
+static int
+ckyReplay_findReader(const char *name, CKYSize len)
+{
+    unsigned int i;
+
+    for (i=0; i < replayReaderCount; i++) {
+	if ((strlen(replayReaders[i].name) == len) && 
+		(memcmp(replayReaders[i].name, name, len) == 0)) {
+	    return i;
+	}
+    }
+    return -1;
+}
+
+static long WINAPI
+ckyReplay_EstablishContext(unsigned long dwScope, const void *pvReserved1,
+	const void *pvReserved2, LPSCARDCONTEXT phContext)
+{
+    *phContext = 1;
+    return SCARD_S_SUCCESS;
+}
+
+static long WINAPI
+ckyReplay_ReleaseContext(SCARDCONTEXT hContext)
+{
+    return SCARD_S_SUCCESS;
+}
+
+static long WINAPI
+ckyReplay_BeginTransaction(SCARDHANDLE hCard)
+{
+    return ckyReplay_getReader(hCard) ? SCARD_S_SUCCESS : 
+						SCARD_E_INVALID_HANDLE;
+}
+
+static long WINAPI
+ckyReplay_EndTransaction(SCARDHANDLE hCard, unsigned long dwDisposition)
+{
+    return ckyReplay_getReader(hCard) ? SCARD_S_SUCCESS : 
+						SCARD_E_INVALID_HANDLE;
+}
+
+static long WINAPI
+ckyReplay_Connect(SCARDCONTEXT hContext, const char *szReader,
+	unsigned long dwShareMode, unsigned long dwPreferredProtocols,
+	SCARDHANDLE *phCard, unsigned long *pdwActiveProtocol)
+{
+    int i = ckyReplay_findReader(szReader, strlen(szReader));
+
+    if (i < 0) {
+	return SCARD_E_UNKNOWN_READER;
+    }
+    *phCard = i+1;
+    *pdwActiveProtocol = replayReaders[i].protocol;
+    return SCARD_S_SUCCESS;
+}
+
+static long WINAPI
+ckyReplay_Disconnect(SCARDHANDLE hCard, unsigned long dwDisposition)
+{
+    return SCARD_S_SUCCESS;
+}
+
+static long WINAPI
+ckyReplay_Reconnect(SCARDHANDLE hCard, unsigned long dwShareMode,
+	unsigned long dwPreferredProtocols, unsigned long dwInitialization,
+	unsigned long *pdwActiveProtocol)
+{
+    ckyReplayReader *reader = ckyReplay_getReader(hCard);
+
+    if (!reader) {
+	return SCARD_E_INVALID_HANDLE;
+    }
+    *pdwActiveProtocol = reader->protocol;
+    return SCARD_S_SUCCESS;
+}
+
+static long WINAPI
+ckyReplay_ListReaders(SCARDCONTEXT hContext, const char *mszGroups,
+	char *mszReaders, unsigned long *pcchReaders)
+{
+    unsigned long len = 1;
+    unsigned int i;
+
+    if (replayReaderCount == 0) {
+	return SCARD_E_NO_READERS_AVAILABLE;
+    }
+    for (i=0; i < replayReaderCount; i++) {
+	len += strlen(replayReaders[i].name)+1;
+    }
+    if (mszReaders) {
+	if (*pcchReaders < len) {
+	    *pcchReaders = len;
+	    return SCARD_E_INSUFFICIENT_BUFFER;
+	}
+	for (i=0; i < replayReaderCount; i++) {
+	    strcpy(mszReaders, replayReaders[i].name);
+	    mszReaders += strlen(mszReaders)+1;
+	}
+	*mszReaders = 0;
+    }
+    *pcchReaders = len;
+    return SCARD_S_SUCCESS;
+}
+
+static long WINAPI
+ckyReplay_Status(SCARDHANDLE hCard, char *mszReaderNames,
+	unsigned long *pcchReaderLen, unsigned long *pdwState,
+	unsigned long *pdwProtocol, unsigned char *pbAtr,
+	unsigned long *pcbAtrLen)
+{
+    ckyReplayReader *reader = ckyReplay_getReader(hCard);
+    unsigned long nameLen, atrLen;
+
+    if (!reader) {
+	return SCARD_E_INVALID_HANDLE;
+    }
+    nameLen = strlen(reader->name)+2;
+    atrLen = CKYBuffer_Size(&reader->atr);
+    if (mszReaderNames) {
+	if (*pcchReaderLen < nameLen) {
+	    *pcchReaderLen = nameLen;
+	    return SCARD_E_INSUFFICIENT_BUFFER;
+	}
+	strcpy(mszReaderNames, reader->name);
+	mszReaderNames[nameLen-1] = 0;
+    }
+    if (pbAtr) {
+	if (*pcbAtrLen < atrLen) {
+	    *pcbAtrLen = atrLen;
+	    return SCARD_E_INSUFFICIENT_BUFFER;
+	}
+	memcpy(pbAtr, CKYBuffer_Data(&reader->atr), atrLen);
+    }
+    if (pcchReaderLen) {
+	*pcchReaderLen = nameLen;
+    }
+    if (pcbAtrLen) {
+	*pcbAtrLen = atrLen;
+    }
+    if (pdwState) {
+	*pdwState = reader->state;
+    }
+    if (pdwProtocol) {
+	*pdwProtocol = reader->protocol;
+    }
+    return SCARD_S_SUCCESS;
+}
+
+static long WINAPI
+ckyReplay_GetAttrib(SCARDHANDLE hCard, unsigned long dwAttId,
+	char *pbAttr, unsigned long *pchAttrLen)
+{
+    return SCARD_E_UNSUPPORTED_FEATURE;
+}
+
+static long WINAPI
+ckyReplay_GetStatusChange(SCARDCONTEXT hContext, unsigned long dwTimeout,
+	SCARD_READERSTATE *rgReaderStates, unsigned long cReaders)
+{
+    unsigned long i, waited;
+    CKYBool changed = 0;
+
+    for (i=0; i < cReaders; i++) {
+	SCARD_READERSTATE *rs = &rgReaderStates[i];
+	unsigned long known = rs->dwCurrentState & ~SCARD_STATE_CHANGED;
+	int r;
+
+	if (strcmp(rs->szReader, CKY_PNP_NOTIFICATION) == 0) {
+	    /* the reader list never changes */
+	    rs->dwEventState = known;
+	    continue;
+	}
+	r = ckyReplay_findReader(rs->szReader, strlen(rs->szReader));
+	if (r < 0) {
+	    rs->dwEventState = SCARD_STATE_UNKNOWN;
+	} else {
+	    CKYSize atrLen = CKYBuffer_Size(&replayReaders[r].atr);
+
+	    rs->dwEventState = SCARD_STATE_PRESENT;
+	    if (atrLen > sizeof(rs->rgbAtr)) {
+		atrLen = sizeof(rs->rgbAtr);
+	    }
+	    memcpy(rs->rgbAtr, CKYBuffer_Data(&replayReaders[r].atr), atrLen);
+	    rs->cbAtr = atrLen;
+	}
+	if ((known & ~SCARD_STATE_IGNORE) != rs->dwEventState) {
+	    rs->dwEventState |= SCARD_STATE_CHANGED;
+	    changed = 1;
+	}
+    }
+    if (changed) {
+	return SCARD_S_SUCCESS;
+    }
+    /* nothing will ever change, wait out the timeout unless we are
+     * cancelled */
+    for (waited = 0; (dwTimeout == INFINITE) || (waited < dwTimeout); 
+							waited += 100) {
+	if (replayCancelled) {
+	    replayCancelled = 0;
+	    return SCARD_E_CANCELLED;
+	}
+	ckyRecord_sleep(100*1000);
+    }
+    return SCARD_E_TIMEOUT;
+}
+
+static long WINAPI
+ckyReplay_Cancel(SCARDCONTEXT hContext)
+{
+    replayCancelled = 1;
+    return SCARD_S_SUCCESS;
+}
+
+static long WINAPI
+ckyReplay_Transmit(SCARDHANDLE hCard, LPCSCARD_IO_REQUEST pioSendPci,
+	const unsigned char *pbSendBuffer, unsigned long cbSendLength,
+	LPSCARD_IO_REQUEST pioRecvPci, unsigned char *pbRecvBuffer,
+	unsigned long *pcbRecvLength)
+{
+    ckyReplayReader *reader = ckyReplay_getReader(hCard);
+    unsigned int i, found = replayRecordCount, next = replayRecordCount;
+    CKYOffset offset;
+    unsigned long usec, rv;
+    CKYSize sendLen, recvLen;
+
+    if (!reader) {
+	return SCARD_E_INVALID_HANDLE;
+    }
+    for (i = reader->cursor; i < replayRecordCount; i++) {
+	ckyReplayRecord *record = &replayRecords[i];
+
+	if ((record->type != CKY_RECORD_TRANSMIT) ||
+			(&replayReaders[record->reader] != reader)) {
+	    continue;
+	}
+	if (next == replayRecordCount) {
+	    next = i;
+	}
+	offset = record->offset + 8;
+	sendLen = CKYBuffer_GetShortLE(&replayData, offset);
+	if ((sendLen == cbSendLength) && 
+	    (memcmp(CKYBuffer_Data(&replayData)+offset+2, pbSendBuffer, 
+							sendLen) == 0)) {
+	    found = i;
+	    break;
+	}
+    }
+    if (found == replayRecordCount) {
+	found = next;
+    }
+    if (found == replayRecordCount) {
+	/* ran off the end of the recording */
+	return SCARD_E_NOT_TRANSACTED;
+    }
+    reader->cursor = found+1;
+
+    offset = replayRecords[found].offset;
+    usec = CKYBuffer_GetLongLE(&replayData, offset);
+    rv = CKYBuffer_GetLongLE(&replayData, offset+4);
+    offset += 8;
+    offset += 2 + CKYBuffer_GetShortLE(&replayData, offset);
+    recvLen = CKYBuffer_GetShortLE(&replayData, offset);
+    offset += 2;
+
+    if (replayScale > 0) {
+	ckyRecord_sleep((unsigned long)(usec * replayScale));
+    }
+    if (rv != SCARD_S_SUCCESS) {
+	return rv;
+    }
+    if (*pcbRecvLength < recvLen) {
+	return SCARD_E_INSUFFICIENT_BUFFER;
+    }
+    memcpy(pbRecvBuffer, CKYBuffer_Data(&replayData)+offset, recvLen);
+    *pcbRecvLength = recvLen;
+    return SCARD_S_SUCCESS;
+}
+
+/*
+ * index the recording, building the reader list as we go. Recorded card
+ * handles are mapped to the reader they were connected to.
+ */
+static CKYStatus
+ckyReplay_parse(void)
+{
+    CKYSize size = CKYBuffer_Size(&replayData);
+    CKYOffset offset = CKY_RECORD_MAGIC_LEN;
+    unsigned long *handles;
+    unsigned int count = 0;
+    /* worst case size of each table */
+    unsigned int maxRecords = size/CKY_RECORD_HEADER_LEN + 1;
+
+    replayRecords = (ckyReplayRecord *)
+			malloc(maxRecords*sizeof(ckyReplayRecord));
+    replayReaders = (ckyReplayReader *)
+			malloc(maxRecords*sizeof(ckyReplayReader));
+    handles = (unsigned long *)malloc(maxRecords*sizeof(unsigned long));
+    if (!replayRecords || !replayReaders || !handles) {
+	free(handles);
+	return CKYNOMEM;
+    }
+
+    while (offset + CKY_RECORD_HEADER_LEN <= size) {
+	CKYByte type = CKYBuffer_GetChar(&replayData, offset);
+	unsigned long handle = CKYBuffer_GetLongLE(&replayData, offset+5);
+	CKYOffset body = offset + CKY_RECORD_HEADER_LEN;
+	CKYOffset data; /* start of the trailing variable length field */
+	CKYSize len;
+	unsigned int r;
+
+	switch (type) {
+	case CKY_RECORD_CONNECT:
+	    len = CKYBuffer_GetShortLE(&replayData, body+4);
+	    data = body+6;
+	    break;
+	case CKY_RECORD_STATUS:
+	    len = CKYBuffer_GetShortLE(&replayData, body+8);
+	    data = body+10;
+	    break;
+	case CKY_RECORD_TRANSMIT:
+	    data = body + 10 + CKYBuffer_GetShortLE(&replayData, body+8);
+	    len = CKYBuffer_GetShortLE(&replayData, data);
+	    data += 2;
+	    break;
+	case CKY_RECORD_BEGIN:
+	    len = 0;
+	    data = body+4;
+	    break;
+	default:
+	    goto fail;
+	}
+	if (data + len > size) {
+	    goto fail;
+	}
+	offset = data + len;
+
+	if (type == CKY_RECORD_CONNECT) {
+	    int found = ckyReplay_findReader(
+		(const char *)CKYBuffer_Data(&replayData)+data, len);
+
+	    if (found < 0) {
+		ckyReplayReader *reader = &replayReaders[replayReaderCount];
+
+		reader->name = (char *)malloc(len+1);
+		if (!reader->name) {
+		    goto fail;
+		}
+		memcpy(reader->name, CKYBuffer_Data(&replayData)+data, len);
+		reader->name[len] = 0;
+		reader->protocol = CKYBuffer_GetLongLE(&replayData, body);
+		reader->state = SCARD_PRESENT;
+		reader->cursor = 0;
+		CKYBuffer_InitEmpty(&reader->atr);
+		found = replayReaderCount++;
+	    }
+	    /* PC/SC may hand out the same handle again to another reader */
+	    for (r=0; r < replayReaderCount; r++) {
+		if (handles[r] == handle) {
+		    handles[r] = 0;
+		}
+	    }
+	    handles[found] = handle;
+	    r = found;
+	} else {
+	    for (r=0; r < replayReaderCount; r++) {
+		if (handles[r] == handle) {
+		    break;
+		}
+	    }
+	    if (r == replayReaderCount) {
+		/* never saw this handle connected, ignore it */
+		continue;
+	    }
+	    if ((type == CKY_RECORD_STATUS) &&
+			(CKYBuffer_Size(&replayReaders[r].atr) == 0)) {
+		replayReaders[r].state = 
+				CKYBuffer_GetLongLE(&replayData, body);
+		replayReaders[r].protocol = 
+				CKYBuffer_GetLongLE(&replayData, body+4);
+		CKYBuffer_AppendBuffer(&replayReaders[r].atr, &replayData,
+							data, len);
+	    }
+	}
+	replayRecords[count].type = type;
+	replayRecords[count].reader = r;
+	replayRecords[count].offset = body;
+	count++;
+    }
+    replayRecordCount = count;
+    free(handles);
+    return CKYSUCCESS;
+
+fail:
+    free(handles);
+    return CKYINVALIDDATA;
+}
+
+SCard *
+ckySCard_InitReplay(const char *fileName)
+{
+    SCard *scard = NULL;
+    FILE *file;
+    const char *scale;
+    CKYByte buf[1024];
+    size_t len;
+
+    file = fopen(fileName, "rb");
+    if (!file) {
+	return NULL;
+    }
+    CKYBuffer_InitEmpty(&replayData);
+    while ((len = fread(buf, 1, sizeof(buf), file)) > 0) {
+	if (CKYBuffer_AppendData(&replayData, buf, len) != CKYSUCCESS) {
+	    fclose(file);
+	    goto fail;
+	}
+    }
+    fclose(file);
+
+    if ((CKYBuffer_Size(&replayData) < CKY_RECORD_MAGIC_LEN) ||
+	(memcmp(CKYBuffer_Data(&replayData), CKY_RECORD_MAGIC, 
+					CKY_RECORD_MAGIC_LEN) != 0)) {
+	goto fail;
+    }
+    if (ckyReplay_parse() != CKYSUCCESS) {
+	goto fail;
+    }
+
+    /* CKY_APDU_REPLAY_SCALE multiplies the recorded card latency,
+     * 0 replays as fast as possible */
+    scale = getenv("CKY_APDU_REPLAY_SCALE");
+    if (scale) {
+	replayScale = atof(scale);
+    }
+
+    scard = (SCard *)malloc(sizeof(SCard));
+    if (!scard) {
+	goto fail;
+    }
+    scard->SCardEstablishContext = ckyReplay_EstablishContext;
+    scard->SCardReleaseContext = ckyReplay_ReleaseContext;
+    scard->SCardBeginTransaction = ckyReplay_BeginTransaction;
+    scard->SCardEndTransaction = ckyReplay_EndTransaction;
+    scard->SCardConnect = ckyReplay_Connect;
+    scard->SCardDisconnect = ckyReplay_Disconnect;
+    scard->SCardTransmit = ckyReplay_Transmit;
+    scard->SCardReconnect = ckyReplay_Reconnect;
+    scard->SCardListReaders = ckyReplay_ListReaders;
+    scard->SCardStatus = ckyReplay_Status;
+    scard->SCardGetAttrib = ckyReplay_GetAttrib;
+    scard->SCardGetStatusChange = ckyReplay_GetStatusChange;
+    scard->SCardCancel = ckyReplay_Cancel;
+    scard->SCARD_PCI_T0_ = &replayT0Pci;
+    scard->SCARD_PCI_T1_ = &replayT1Pci;
+    return scard;
+
+fail:
+    CKYBuffer_FreeData(&replayData);
+    free(replayRecords);
+    replayRecords = NULL;
+    free(replayReaders);
+    replayReaders = NULL;
+    replayReaderCount = 0;
+    return NULL;
+}
@@ -0,0 +1,144 @@
+/* ***** BEGIN COPYRIGHT BLOCK *****
+ * Copyright (C) 2005 Red Hat, Inc.
+ * All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation version
+ * 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ * ***** END COPYRIGHT BLOCK ***** */
+
+/*
+ * the following header file is private to the CoolKey library. It
+ * describes the table of PC/SC entry points the card layer calls through,
+ * so alternate backends (the APDU recorder and replayer, the native pcscd
+ * client) can stand in for the real PC/SC library.
+ */
+#ifndef CKY_SCARD_H
+#define CKY_SCARD_H 1
+
+#include <winscard.h>
+
+#ifndef WINAPI
+#define WINAPI
+typedef SCARD_READERSTATE *LPSCARD_READERSTATE;
+#endif
+
+#ifndef SCARD_E_NO_READERS_AVAILABLE
+#define SCARD_E_NO_READERS_AVAILABLE ((unsigned long)0x8010002EL)
+#endif
+
+/*
+ * protect against scard API not being installed.
+ */
+
+typedef long (WINAPI * SCardEstablishContextFn) (
+    unsigned long dwScope,
+    const void * pvReserved1,
+    const void * pvReserved2,
+    LPSCARDCONTEXT phContext);
+
+typedef long (WINAPI * SCardReleaseContextFn) (
+    SCARDCONTEXT hContext);
+
+typedef long (WINAPI * SCardBeginTransactionFn) (
+    SCARDHANDLE hCard);
+
+typedef long (WINAPI * SCardEndTransactionFn) (
+    SCARDHANDLE hCard,
+    unsigned long dwDisposition);
+
+typedef long (WINAPI * SCardConnectFn) (
+    SCARDCONTEXT hContext,
+    const char *szReader,
+    unsigned long dwShareMode,
+    unsigned long dwPreferredProtocols,
+    SCARDHANDLE *phCard,
+    unsigned long *pdwActiveProtocol);
+
+typedef long (WINAPI * SCardDisconnectFn) (
+    SCARDHANDLE hCard,
+    unsigned long dwDisposition);
+
+typedef long (WINAPI * SCardTransmitFn) (
+    SCARDHANDLE hCard,
+    LPCSCARD_IO_REQUEST pioSendPci,
+    const unsigned char *pbSendBuffer,
+    unsigned long cbSendLength,
+    LPSCARD_IO_REQUEST pioRecvPci,
+    unsigned char *pbRecvBuffer,
+    unsigned long *pcbRecvLength);
+
+typedef long (WINAPI * SCardReconnectFn) (
+    SCARDHANDLE hCard,
+    unsigned long dwShareMode,
+    unsigned long dwPreferredProtocols,
+    unsigned long dwInitialization,
+    unsigned long *pdwActiveProtocol);
+
+typedef long (WINAPI * SCardListReadersFn) (
+    SCARDCONTEXT hContext,
+    const char *mszGroups,
+    char *mszReaders,
+    unsigned long *pcchReaders);
+
+typedef long (WINAPI * SCardStatusFn) (
+    SCARDHANDLE hCard,
+    char *mszReaderNames,
+    unsigned long *pcchReaderLen,
+    unsigned long *pdwState,
+    unsigned long *pdwProtocol,
+    unsigned char *pbAtr,
+    unsigned long *pcbAtrLen);
+
+typedef long (WINAPI * SCardGetAttribFn) (
+    SCARDHANDLE hCard,
+    unsigned long dwAttId,
+    char *pbAttr,
+    unsigned long *pchAttrLen);
+
+typedef long (WINAPI * SCardGetStatusChangeFn) (
+    SCARDCONTEXT hContext,
+    unsigned long dwTimeout,
+    SCARD_READERSTATE *rgReaderStates,
+    unsigned long cReaders);
+
+typedef long (WINAPI * SCardCancelFn) (
+    SCARDCONTEXT hContext);
+
+typedef struct _SCard {
+    SCardEstablishContextFn SCardEstablishContext;
+    SCardReleaseContextFn SCardReleaseContext;
+    SCardBeginTransactionFn SCardBeginTransaction;
+    SCardEndTransactionFn SCardEndTransaction;
+    SCardConnectFn SCardConnect;
+    SCardDisconnectFn SCardDisconnect;
+    SCardTransmitFn SCardTransmit;
+    SCardReconnectFn SCardReconnect;
+    SCardListReadersFn SCardListReaders;
+    SCardStatusFn SCardStatus;
+    SCardGetAttribFn SCardGetAttrib;
+    SCardGetStatusChangeFn SCardGetStatusChange;
+    SCardCancelFn SCardCancel;
+    SCARD_IO_REQUEST *SCARD_PCI_T0_;
+    SCARD_IO_REQUEST *SCARD_PCI_T1_;
+} SCard;
+
+/* wrap an SCard table so every exchange is written to recordFile */
+SCard *ckySCard_InitRecord(SCard *real, const char *recordFile);
+/* build an SCard table which serves a previously recorded session */
+SCard *ckySCard_InitReplay(const char *replayFile);
+/* build an SCard table which talks to pcscd's socket directly, NULL if
+ * pcscd isn't listening there */
+SCard *ckySCard_InitPcscd(const char *socketName);
+
+#endif /* CKY_SCARD_H */
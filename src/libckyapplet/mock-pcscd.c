@@ -0,0 +1,761 @@
+/* ***** BEGIN COPYRIGHT BLOCK *****
+ * Copyright (C) 2005 Red Hat, Inc.
+ * All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation version
+ * 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ * ***** END COPYRIGHT BLOCK ***** */
+
+/*
+ * mock-pcscd: a stand-in for pcscd, for testing the native pcscd client
+ * (cky_pcscd.c) without readers or the real daemon.
+ *
+ *   mock-pcscd [-m minor] socket reader[=card-file] ...
+ *
+ * One poll() loop serves every client over pcscd's 4.x protocol. Each
+ * reader may hold an emulated card described by a card file:
+ *
+ *   # comment
+ *   atr 3b 8f 80 01 ...
+ *   00 a4 04 00 : 6f 0e ... 90 00
+ *
+ * An APDU is answered from the first line whose command is a prefix of
+ * it, anything else gets 6d 00. Responses longer than 256 bytes are
+ * handed out in pieces with 61 xx and GET RESPONSE, like a T=0 card.
+ *
+ * SIGUSR1 pulls the card out of the first reader, or puts it back.
+ * -m makes the server speak an older protocol minor version, so clients
+ * have to retry the version exchange.
+ */
+#include <winscard.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "cky_pcscd.h"
+
+#define MOCK_MAX_CLIENTS	64
+#define MOCK_MAX_CARDS		256
+#define MOCK_SHORT_RESPONSE	256
+
+typedef struct {
+    unsigned char *command;
+    size_t commandLen;
+    unsigned char *response;
+    size_t responseLen;
+} MockEntry;
+
+typedef struct {
+    const char *file;
+    int inserted;
+    MockEntry *entries;
+    int entryCount;
+    unsigned char *pending;	/* left for GET RESPONSE */
+    size_t pendingLen;
+} MockCard;
+
+typedef struct {
+    int fd;
+    unsigned char *in;
+    size_t inLen;
+    int waiting;		/* registered for reader events */
+} MockClient;
+
+typedef struct {
+    int32_t hCard;
+    int client;
+    int reader;
+    uint32_t eventCounter;	/* when it was connected */
+} MockHandle;
+
+static struct pcscdReaderState readers[PCSCD_MAX_READERS];
+static MockCard cards[PCSCD_MAX_READERS];
+static int readerCount;
+static MockClient clients[MOCK_MAX_CLIENTS];
+static MockHandle handles[MOCK_MAX_CARDS];
+static uint32_t nextContext = 0x1000;
+static int32_t nextCard = 0x2000;
+static int serverMinor = PCSCD_PROTOCOL_MINOR;
+static int signalPipe[2];
+
+static void
+fatal(const char *what)
+{
+    perror(what);
+    exit(1);
+}
+
+/* parse hex digits up to end, skipping white space. Returns the length */
+static size_t
+parseHex(const char *cp, const char *end, unsigned char **out)
+{
+    size_t len = 0;
+    int nibble = -1;
+
+    *out = (unsigned char *)malloc(strlen(cp)/2 + 1);
+    if (!*out) {
+	fatal("malloc");
+    }
+    for (; cp < end && *cp; cp++) {
+	int value;
+
+	if (*cp >= '0' && *cp <= '9') {
+	    value = *cp - '0';
+	} else if (*cp >= 'a' && *cp <= 'f') {
+	    value = *cp - 'a' + 10;
+	} else if (*cp >= 'A' && *cp <= 'F') {
+	    value = *cp - 'A' + 10;
+	} else {
+	    continue;
+	}
+	if (nibble < 0) {
+	    nibble = value;
+	} else {
+	    (*out)[len++] = (nibble << 4) | value;
+	    nibble = -1;
+	}
+    }
+    return len;
+}
+
+static void
+loadCard(int reader, const char *fileName)
+{
+    FILE *file = fopen(fileName, "r");
+    MockCard *card = &cards[reader];
+    char *line = NULL;
+    size_t size = 0;
+
+    if (!file) {
+	fatal(fileName);
+    }
+    card->file = fileName;
+    card->inserted = 1;
+    while (getline(&line, &size, file) > 0) {
+	char *comment = strchr(line, '#');
+	char *colon;
+	MockEntry *entry;
+
+	if (comment) {
+	    *comment = 0;
+	}
+	colon = strchr(line, ':');
+	if (strncmp(line, "atr", 3) == 0) {
+	    unsigned char *atr;
+	    size_t atrLen = parseHex(line+3, line+strlen(line), &atr);
+
+	    if (atrLen > PCSCD_MAX_ATR_SIZE) {
+		atrLen = PCSCD_MAX_ATR_SIZE;
+	    }
+	    memcpy(readers[reader].cardAtr, atr, atrLen);
+	    readers[reader].cardAtrLength = atrLen;
+	    free(atr);
+	    continue;
+	}
+	if (!colon) {
+	    continue;
+	}
+	card->entries = (MockEntry *)realloc(card->entries, 
+			(card->entryCount+1)*sizeof(MockEntry));
+	if (!card->entries) {
+	    fatal("realloc");
+	}
+	entry = &card->entries[card->entryCount++];
+	entry->commandLen = parseHex(line, colon, &entry->command);
+	entry->responseLen = parseHex(colon+1, colon+strlen(colon), 
+							&entry->response);
+    }
+    free(line);
+    fclose(file);
+}
+
+static void
+setReaderState(int reader)
+{
+    struct pcscdReaderState *state = &readers[reader];
+
+    if (cards[reader].inserted) {
+	state->readerState = SCARD_PRESENT|SCARD_POWERED|SCARD_SPECIFIC;
+	state->cardProtocol = SCARD_PROTOCOL_T1;
+    } else {
+	state->readerState = SCARD_ABSENT;
+	state->cardProtocol = 0;
+    }
+}
+
+static int
+writeAll(int fd, const void *data, size_t len)
+{
+    const char *buf = (const char *)data;
+
+    while (len) {
+	ssize_t ret = send(fd, buf, len, MSG_NOSIGNAL);
+
+	if (ret < 0) {
+	    struct pollfd pfd;
+
+	    if (errno == EINTR) {
+		continue;
+	    }
+	    if (errno != EAGAIN && errno != EWOULDBLOCK) {
+		return 0;
+	    }
+	    pfd.fd = fd;
+	    pfd.events = POLLOUT;
+	    poll(&pfd, 1, -1);
+	    continue;
+	}
+	buf += ret;
+	len -= ret;
+    }
+    return 1;
+}
+
+static void
+dropClient(int i)
+{
+    int h;
+
+    for (h = 0; h < MOCK_MAX_CARDS; h++) {
+	if (handles[h].hCard && handles[h].client == i) {
+	    readers[handles[h].reader].readerSharing--;
+	    handles[h].hCard = 0;
+	}
+    }
+    close(clients[i].fd);
+    free(clients[i].in);
+    memset(&clients[i], 0, sizeof(clients[i]));
+    clients[i].fd = -1;
+}
+
+/* tell the registered clients the reader table changed */
+static void
+notifyClients(void)
+{
+    struct pcscdWait wait;
+    int i;
+
+    wait.timeOut = 0;
+    wait.rv = SCARD_S_SUCCESS;
+    for (i = 0; i < MOCK_MAX_CLIENTS; i++) {
+	if (clients[i].fd >= 0 && clients[i].waiting) {
+	    clients[i].waiting = 0;
+	    if (!writeAll(clients[i].fd, &wait, sizeof(wait))) {
+		dropClient(i);
+	    }
+	}
+    }
+}
+
+static void
+toggleCard(int reader)
+{
+    cards[reader].inserted = !cards[reader].inserted;
+    free(cards[reader].pending);
+    cards[reader].pending = NULL;
+    cards[reader].pendingLen = 0;
+    readers[reader].eventCounter++;
+    setReaderState(reader);
+    notifyClients();
+}
+
+static int
+findReader(const char *name)
+{
+    int i;
+
+    for (i = 0; i < readerCount; i++) {
+	if (strncmp(readers[i].readerName, name, PCSCD_MAX_READERNAME) == 0) {
+	    return i;
+	}
+    }
+    return -1;
+}
+
+/*
+ * look up a card handle. Returns the rv for the request, and the handle's
+ * slot in *index.
+ */
+static uint32_t
+findHandle(int32_t hCard, int *index)
+{
+    int h;
+
+    for (h = 0; h < MOCK_MAX_CARDS; h++) {
+	if (handles[h].hCard && handles[h].hCard == hCard) {
+	    int reader = handles[h].reader;
+
+	    *index = h;
+	    if (!cards[reader].inserted || 
+		handles[h].eventCounter != readers[reader].eventCounter) {
+		return SCARD_W_REMOVED_CARD;
+	    }
+	    return SCARD_S_SUCCESS;
+	}
+    }
+    return SCARD_E_INVALID_HANDLE;
+}
+
+/* hand out up to 256 bytes of data, and say how much is left */
+static size_t
+chunkResponse(MockCard *card, const unsigned char *data, size_t len,
+						unsigned char *out)
+{
+    size_t chunk = len > MOCK_SHORT_RESPONSE ? MOCK_SHORT_RESPONSE : len;
+    size_t left = len - chunk;
+
+    memcpy(out, data, chunk);
+    free(card->pending);
+    card->pending = NULL;
+    card->pendingLen = 0;
+    if (left == 0) {
+	out[chunk] = 0x90;
+	out[chunk+1] = 0x00;
+	return chunk + 2;
+    }
+    card->pending = (unsigned char *)malloc(left);
+    if (!card->pending) {
+	fatal("malloc");
+    }
+    memcpy(card->pending, data + chunk, left);
+    card->pendingLen = left;
+    out[chunk] = 0x61;
+    out[chunk+1] = left >= MOCK_SHORT_RESPONSE ? 0 : left;
+    return chunk + 2;
+}
+
+static size_t
+cardResponse(MockCard *card, const unsigned char *apdu, size_t len,
+						unsigned char *out)
+{
+    int i;
+
+    if (len >= 4 && apdu[0] == 0x00 && apdu[1] == 0xc0 && card->pending) {
+	unsigned char *pending = card->pending;
+	size_t pendingLen = card->pendingLen;
+
+	card->pending = NULL;
+	len = chunkResponse(card, pending, pendingLen, out);
+	free(pending);
+	return len;
+    }
+    free(card->pending);
+    card->pending = NULL;
+    card->pendingLen = 0;
+    for (i = 0; i < card->entryCount; i++) {
+	const MockEntry *entry = &card->entries[i];
+
+	if (entry->commandLen <= len && 
+		memcmp(entry->command, apdu, entry->commandLen) == 0) {
+	    /* status words are the last two bytes, the rest is data */
+	    if (entry->responseLen > MOCK_SHORT_RESPONSE + 2) {
+		return chunkResponse(card, entry->response, 
+						entry->responseLen - 2, out);
+	    }
+	    memcpy(out, entry->response, entry->responseLen);
+	    return entry->responseLen;
+	}
+    }
+    out[0] = 0x6d;
+    out[1] = 0x00;
+    return 2;
+}
+
+/*
+ * answer one request. Returns the number of bytes of the client's input
+ * it used, 0 if the request isn't all there yet, or -1 to drop the client.
+ */
+static long
+handleRequest(int i)
+{
+    MockClient *client = &clients[i];
+    struct pcscdHeader header;
+    unsigned char *body;
+    size_t need;
+    int h, reader;
+
+    if (client->inLen < sizeof(header)) {
+	return 0;
+    }
+    memcpy(&header, client->in, sizeof(header));
+    need = sizeof(header) + header.size;
+    if (header.command == PCSCD_TRANSMIT && 
+			header.size == sizeof(struct pcscdTransmit)) {
+	struct pcscdTransmit transmit;
+
+	if (client->inLen < need) {
+	    return 0;
+	}
+	memcpy(&transmit, client->in + sizeof(header), sizeof(transmit));
+	if (transmit.cbSendLength > PCSCD_MAX_BUFFER_SIZE_EXTENDED) {
+	    return -1;
+	}
+	need += transmit.cbSendLength;
+    }
+    if (client->inLen < need) {
+	return 0;
+    }
+    body = client->in + sizeof(header);
+
+    switch (header.command) {
+    case PCSCD_VERSION:
+	{
+	    struct pcscdVersion *version = (struct pcscdVersion *)body;
+
+	    if (header.size != sizeof(*version)) {
+		return -1;
+	    }
+	    if (version->major == PCSCD_PROTOCOL_MAJOR && 
+					version->minor == serverMinor) {
+		version->rv = SCARD_S_SUCCESS;
+	    } else {
+		version->major = PCSCD_PROTOCOL_MAJOR;
+		version->minor = serverMinor;
+		version->rv = SCARD_E_NO_SERVICE;
+	    }
+	}
+	break;
+    case PCSCD_ESTABLISH_CONTEXT:
+	{
+	    struct pcscdEstablish *establish = (struct pcscdEstablish *)body;
+
+	    if (header.size != sizeof(*establish)) {
+		return -1;
+	    }
+	    establish->hContext = nextContext++;
+	    establish->rv = SCARD_S_SUCCESS;
+	}
+	break;
+    case PCSCD_RELEASE_CONTEXT:
+	{
+	    struct pcscdRelease *release = (struct pcscdRelease *)body;
+
+	    if (header.size != sizeof(*release)) {
+		return -1;
+	    }
+	    release->rv = SCARD_S_SUCCESS;
+	}
+	break;
+    case PCSCD_CONNECT:
+	{
+	    struct pcscdConnect *connect = (struct pcscdConnect *)body;
+
+	    if (header.size != sizeof(*connect)) {
+		return -1;
+	    }
+	    connect->szReader[PCSCD_MAX_READERNAME-1] = 0;
+	    reader = findReader(connect->szReader);
+	    for (h = 0; h < MOCK_MAX_CARDS && handles[h].hCard; h++)
+		;
+	    if (reader < 0) {
+		connect->rv = SCARD_E_UNKNOWN_READER;
+	    } else if (!cards[reader].inserted) {
+		connect->rv = SCARD_E_NO_SMARTCARD;
+	    } else if (h == MOCK_MAX_CARDS) {
+		connect->rv = SCARD_E_NO_MEMORY;
+	    } else {
+		handles[h].hCard = nextCard++;
+		handles[h].client = i;
+		handles[h].reader = reader;
+		handles[h].eventCounter = readers[reader].eventCounter;
+		readers[reader].readerSharing++;
+		connect->hCard = handles[h].hCard;
+		connect->dwActiveProtocol = SCARD_PROTOCOL_T1;
+		connect->rv = SCARD_S_SUCCESS;
+	    }
+	}
+	break;
+    case PCSCD_RECONNECT:
+	{
+	    struct pcscdReconnect *reconnect = (struct pcscdReconnect *)body;
+
+	    if (header.size != sizeof(*reconnect)) {
+		return -1;
+	    }
+	    reconnect->rv = findHandle(reconnect->hCard, &h);
+	    if (reconnect->rv == SCARD_W_REMOVED_CARD && 
+				cards[handles[h].reader].inserted) {
+		/* a new card is in, pick it up */
+		handles[h].eventCounter = 
+				readers[handles[h].reader].eventCounter;
+		reconnect->rv = SCARD_S_SUCCESS;
+	    } else if (reconnect->rv == SCARD_W_REMOVED_CARD) {
+		reconnect->rv = SCARD_E_NO_SMARTCARD;
+	    }
+	    reconnect->dwActiveProtocol = SCARD_PROTOCOL_T1;
+	}
+	break;
+    case PCSCD_DISCONNECT:
+	{
+	    struct pcscdDisposition *disconnect = 
+				(struct pcscdDisposition *)body;
+
+	    if (header.size != sizeof(*disconnect)) {
+		return -1;
+	    }
+	    disconnect->rv = findHandle(disconnect->hCard, &h);
+	    if (disconnect->rv != SCARD_E_INVALID_HANDLE) {
+		readers[handles[h].reader].readerSharing--;
+		handles[h].hCard = 0;
+		disconnect->rv = SCARD_S_SUCCESS;
+	    }
+	}
+	break;
+    case PCSCD_BEGIN_TRANSACTION:
+    case PCSCD_STATUS:
+	{
+	    struct pcscdCard *card = (struct pcscdCard *)body;
+
+	    if (header.size != sizeof(*card)) {
+		return -1;
+	    }
+	    card->rv = findHandle(card->hCard, &h);
+	}
+	break;
+    case PCSCD_END_TRANSACTION:
+	{
+	    struct pcscdDisposition *end = (struct pcscdDisposition *)body;
+
+	    if (header.size != sizeof(*end)) {
+		return -1;
+	    }
+	    end->rv = findHandle(end->hCard, &h);
+	}
+	break;
+    case PCSCD_GET_ATTRIB:
+	{
+	    struct pcscdAttrib *attrib = (struct pcscdAttrib *)body;
+
+	    if (header.size != sizeof(*attrib)) {
+		return -1;
+	    }
+	    attrib->rv = findHandle(attrib->hCard, &h);
+	    if (attrib->rv == SCARD_S_SUCCESS) {
+		attrib->rv = SCARD_E_UNSUPPORTED_FEATURE;
+	    }
+	}
+	break;
+    case PCSCD_TRANSMIT:
+	{
+	    struct pcscdTransmit transmit;
+	    unsigned char response[MOCK_SHORT_RESPONSE + 2];
+	    size_t responseLen = 0;
+
+	    if (header.size != sizeof(transmit)) {
+		return -1;
+	    }
+	    memcpy(&transmit, body, sizeof(transmit));
+	    transmit.rv = findHandle(transmit.hCard, &h);
+	    if (transmit.rv == SCARD_S_SUCCESS) {
+		responseLen = cardResponse(&cards[handles[h].reader],
+			body + sizeof(transmit), transmit.cbSendLength, 
+								response);
+		if (responseLen > transmit.pcbRecvLength) {
+		    transmit.rv = SCARD_E_INSUFFICIENT_BUFFER;
+		}
+	    }
+	    transmit.pcbRecvLength = responseLen;
+	    if (!writeAll(client->fd, &transmit, sizeof(transmit))) {
+		return -1;
+	    }
+	    if (transmit.rv == SCARD_S_SUCCESS &&
+			!writeAll(client->fd, response, responseLen)) {
+		return -1;
+	    }
+	}
+	return need;
+    case PCSCD_WAIT_READER_STATE_CHANGE:
+	/* the table now, a pcscdWait when it changes */
+	if (!writeAll(client->fd, readers, sizeof(readers))) {
+	    return -1;
+	}
+	client->waiting = 1;
+	return need;
+    default:
+	return -1;
+    }
+    if (!writeAll(client->fd, body, header.size)) {
+	return -1;
+    }
+    return need;
+}
+
+static void
+readClient(int i)
+{
+    MockClient *client = &clients[i];
+    unsigned char buf[4096];
+    ssize_t len;
+    long used;
+
+    len = recv(client->fd, buf, sizeof(buf), 0);
+    if (len < 0 && (errno == EINTR || errno == EAGAIN)) {
+	return;
+    }
+    if (len <= 0) {
+	dropClient(i);
+	return;
+    }
+    client->in = (unsigned char *)realloc(client->in, client->inLen + len);
+    if (!client->in) {
+	fatal("realloc");
+    }
+    memcpy(client->in + client->inLen, buf, len);
+    client->inLen += len;
+    while ((used = handleRequest(i)) > 0) {
+	client->inLen -= used;
+	memmove(client->in, client->in + used, client->inLen);
+    }
+    if (used < 0) {
+	dropClient(i);
+    }
+}
+
+static void
+onSignal(int sig)
+{
+    char c = (char)sig;
+
+    (void) write(signalPipe[1], &c, 1);
+}
+
+int
+main(int argc, char **argv)
+{
+    struct sockaddr_un addr;
+    struct sigaction action;
+    const char *socketName;
+    int listenFd, c, i;
+
+    while ((c = getopt(argc, argv, "m:")) != -1) {
+	switch (c) {
+	case 'm': serverMinor = atoi(optarg); break;
+	default: goto usage;
+	}
+    }
+    if (optind + 2 > argc || argc - optind - 1 > PCSCD_MAX_READERS) {
+	goto usage;
+    }
+    socketName = argv[optind++];
+    if (strlen(socketName) >= sizeof(addr.sun_path)) {
+	goto usage;
+    }
+    for (; optind < argc; optind++, readerCount++) {
+	char *equals = strchr(argv[optind], '=');
+	struct pcscdReaderState *state = &readers[readerCount];
+
+	if (equals) {
+	    *equals = 0;
+	    loadCard(readerCount, equals+1);
+	}
+	strncpy(state->readerName, argv[optind], PCSCD_MAX_READERNAME-1);
+	setReaderState(readerCount);
+    }
+    for (i = 0; i < MOCK_MAX_CLIENTS; i++) {
+	clients[i].fd = -1;
+    }
+
+    if (pipe(signalPipe) < 0) {
+	fatal("pipe");
+    }
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = onSignal;
+    sigaction(SIGUSR1, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    sigaction(SIGINT, &action, NULL);
+
+    listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listenFd < 0) {
+	fatal("socket");
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socketName);
+    unlink(socketName);
+    if (bind(listenFd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+					listen(listenFd, 16) < 0) {
+	fatal(socketName);
+    }
+
+    for (;;) {
+	struct pollfd pfds[MOCK_MAX_CLIENTS + 2];
+	int map[MOCK_MAX_CLIENTS + 2];
+	int count = 0, n;
+
+	pfds[count].fd = listenFd;
+	pfds[count++].events = POLLIN;
+	pfds[count].fd = signalPipe[0];
+	pfds[count++].events = POLLIN;
+	for (i = 0; i < MOCK_MAX_CLIENTS; i++) {
+	    if (clients[i].fd >= 0) {
+		map[count] = i;
+		pfds[count].fd = clients[i].fd;
+		pfds[count++].events = POLLIN;
+	    }
+	}
+	n = poll(pfds, count, -1);
+	if (n < 0) {
+	    if (errno == EINTR) {
+		continue;
+	    }
+	    fatal("poll");
+	}
+	if (pfds[1].revents & POLLIN) {
+	    char sig;
+
+	    if (read(signalPipe[0], &sig, 1) == 1) {
+		if (sig != SIGUSR1) {
+		    break;
+		}
+		if (readerCount) {
+		    toggleCard(0);
+		}
+	    }
+	}
+	if (pfds[0].revents & POLLIN) {
+	    int fd = accept(listenFd, NULL, NULL);
+
+	    for (i = 0; fd >= 0 && i < MOCK_MAX_CLIENTS; i++) {
+		if (clients[i].fd < 0) {
+		    clients[i].fd = fd;
+		    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+		    break;
+		}
+	    }
+	    if (fd >= 0 && i == MOCK_MAX_CLIENTS) {
+		close(fd);
+	    }
+	}
+	for (i = 2; i < count; i++) {
+	    /* an earlier client's event may have dropped this one */
+	    if (pfds[i].revents && clients[map[i]].fd == pfds[i].fd) {
+		readClient(map[i]);
+	    }
+	}
+    }
+    close(listenFd);
+    unlink(socketName);
+    return 0;
+
+usage:
+    fprintf(stderr, "usage: %s [-m minor] socket reader[=card-file] ...\n",
+								argv[0]);
+    return 2;
+}
@@ -0,0 +1,368 @@
+/* ***** BEGIN COPYRIGHT BLOCK *****
+ * Copyright (C) 2005 Red Hat, Inc.
+ * All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation version
+ * 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ * ***** END COPYRIGHT BLOCK ***** */
+
+/*
+ * pcscd-test: run the native pcscd client (cky_pcscd.c) against
+ * mock-pcscd through the public card API. Run by make check.
+ *
+ *   pcscd-test [mock-pcscd]
+ *
+ * The mock serves two readers holding the same small emulated card, and
+ * only speaks an older protocol minor version so the client has to retry
+ * the version exchange.
+ */
+#include <winscard.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include "cky_card.h"
+
+#define READER0 "Mock Reader 0"
+#define READER1 "Mock Reader 1"
+#define LONG_RESPONSE 300
+#define THREAD_EXCHANGES 200
+
+static int failures;
+
+#define CHECK(cond) \
+    do { if (!(cond)) { \
+	fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond);\
+	failures++; } } while (0)
+
+static const CKYByte atr[] = { 0x3b, 0x02, 0x14, 0x50 };
+
+static int
+writeCard(const char *fileName)
+{
+    FILE *file = fopen(fileName, "w");
+    int i;
+
+    if (!file) {
+	return 0;
+    }
+    fprintf(file, "# two commands and a response that needs GET RESPONSE\n");
+    fprintf(file, "atr 3b 02 14 50\n");
+    fprintf(file, "00 a4 04 00 : 90 00\n");
+    fprintf(file, "80 ca 01 00 :");
+    for (i = 0; i < LONG_RESPONSE; i++) {
+	fprintf(file, " %02x", i & 0xff);
+    }
+    fprintf(file, " 90 00\n");
+    fclose(file);
+    return 1;
+}
+
+/* wait for the mock to listen */
+static int
+waitForServer(const char *socketName)
+{
+    struct sockaddr_un addr;
+    int i;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socketName);
+    for (i = 0; i < 250; i++) {
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+	if (fd < 0) {
+	    return 0;
+	}
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+	    close(fd);
+	    return 1;
+	}
+	close(fd);
+	usleep(20000);
+    }
+    return 0;
+}
+
+static CKYStatus
+exchange(CKYCardConnection *conn, CKYByte cla, CKYByte ins, CKYByte p1, 
+							CKYBuffer *response)
+{
+    CKYAPDU apdu;
+    CKYStatus status;
+
+    CKYAPDU_Init(&apdu);
+    CKYAPDU_SetCLA(&apdu, cla);
+    CKYAPDU_SetINS(&apdu, ins);
+    CKYAPDU_SetP1(&apdu, p1);
+    CKYAPDU_SetP2(&apdu, 0);
+    CKYAPDU_SetReceiveLen(&apdu, 0);
+    status = CKYCardConnection_ExchangeAPDU(conn, &apdu, response);
+    CKYAPDU_FreeData(&apdu);
+    return status;
+}
+
+static int
+isSuccess(const CKYBuffer *response)
+{
+    CKYSize size = CKYBuffer_Size(response);
+
+    return size >= 2 && CKYBuffer_GetChar(response, size-2) == 0x90 &&
+			CKYBuffer_GetChar(response, size-1) == 0x00;
+}
+
+/*
+ * transmits to different readers go out on their own contexts at the
+ * same time, see the notes in cky_pcscd.c
+ */
+static void *
+exchangeThread(void *arg)
+{
+    const char *reader = (const char *)arg;
+    CKYCardContext *ctx = CKYCardContext_Create(SCARD_SCOPE_USER);
+    CKYCardConnection *conn = NULL;
+    CKYBuffer response;
+    long errors = 0;
+    int i;
+
+    CKYBuffer_InitEmpty(&response);
+    if (ctx) {
+	conn = CKYCardConnection_Create(ctx);
+    }
+    if (!conn || CKYCardConnection_Connect(conn, reader) != CKYSUCCESS) {
+	errors = THREAD_EXCHANGES;
+    }
+    for (i = 0; conn && !errors && i < THREAD_EXCHANGES; i++) {
+	if (exchange(conn, 0x80, 0xca, 0x01, &response) != CKYSUCCESS ||
+		CKYBuffer_Size(&response) != LONG_RESPONSE + 2) {
+	    errors++;
+	}
+    }
+    CKYBuffer_FreeData(&response);
+    if (conn) {
+	CKYCardConnection_Destroy(conn);
+    }
+    if (ctx) {
+	CKYCardContext_Destroy(ctx);
+    }
+    return (void *)errors;
+}
+
+static void
+checkReaders(CKYCardContext *ctx)
+{
+    CKYReaderNameList names = NULL;
+
+    CHECK(CKYCardContext_ListReaders(ctx, &names) == CKYSUCCESS);
+    if (!names) {
+	return;
+    }
+    CHECK(CKYReaderNameList_GetCount(names) == 2);
+    if (CKYReaderNameList_GetCount(names) == 2) {
+	CHECK(strcmp(CKYReaderNameList_GetValue(names, 0), READER0) == 0);
+	CHECK(strcmp(CKYReaderNameList_GetValue(names, 1), READER1) == 0);
+    }
+    CKYReaderNameList_Destroy(names);
+}
+
+static void
+checkCard(CKYCardConnection *conn)
+{
+    CKYBuffer response, cardATR;
+    unsigned long state = 0;
+    CKYSize i;
+
+    CKYBuffer_InitEmpty(&response);
+    CKYBuffer_InitEmpty(&cardATR);
+    CHECK(CKYCardConnection_GetStatus(conn, &state, &cardATR) == CKYSUCCESS);
+    CHECK(state & SCARD_PRESENT);
+    CHECK(CKYBuffer_DataIsEqual(&cardATR, atr, sizeof(atr)));
+
+    CHECK(exchange(conn, 0x00, 0xa4, 0x04, &response) == CKYSUCCESS);
+    CHECK(CKYBuffer_Size(&response) == 2 && isSuccess(&response));
+
+    /* more than a short APDU can carry, comes back in two pieces */
+    CHECK(exchange(conn, 0x80, 0xca, 0x01, &response) == CKYSUCCESS);
+    CHECK(CKYBuffer_Size(&response) == LONG_RESPONSE + 2);
+    CHECK(isSuccess(&response));
+    for (i = 0; i < LONG_RESPONSE && i < CKYBuffer_Size(&response); i++) {
+	if (CKYBuffer_GetChar(&response, i) != (i & 0xff)) {
+	    CHECK(CKYBuffer_GetChar(&response, i) == (i & 0xff));
+	    break;
+	}
+    }
+
+    CHECK(exchange(conn, 0x80, 0x99, 0x00, &response) == CKYSUCCESS);
+    CHECK(CKYBuffer_Size(&response) == 2 && 
+			CKYBuffer_GetChar(&response, 0) == 0x6d);
+    CKYBuffer_FreeData(&response);
+    CKYBuffer_FreeData(&cardATR);
+}
+
+static void
+checkThreads(void)
+{
+    pthread_t threads[2];
+    void *errors[2];
+
+    pthread_create(&threads[0], NULL, exchangeThread, (void *)READER0);
+    pthread_create(&threads[1], NULL, exchangeThread, (void *)READER1);
+    pthread_join(threads[0], &errors[0]);
+    pthread_join(threads[1], &errors[1]);
+    CHECK(errors[0] == NULL);
+    CHECK(errors[1] == NULL);
+}
+
+/* take the state the last wait saw as known */
+static void
+acceptState(SCARD_READERSTATE *readers, int count)
+{
+    int i;
+
+    for (i = 0; i < count; i++) {
+	CKYReader_SetKnownState(&readers[i], 
+		CKYReader_GetEventState(&readers[i]) & ~SCARD_STATE_CHANGED);
+    }
+}
+
+/*
+ * status waits: nothing happening times out, then pulling the card from
+ * reader 0 and putting it back both wake the wait
+ */
+static void
+checkEvents(CKYCardContext *ctx, CKYCardConnection *conn, pid_t server)
+{
+    SCARD_READERSTATE readers[2];
+    CKYBuffer response;
+
+    CKYBuffer_InitEmpty(&response);
+    CKYReader_Init(&readers[0]);
+    CKYReader_Init(&readers[1]);
+    CKYReader_SetReaderName(&readers[0], READER0);
+    CKYReader_SetReaderName(&readers[1], READER1);
+
+    /* we knew nothing, so that's a change */
+    CHECK(CKYCardContext_WaitForStatusChange(ctx, readers, 2, 0) 
+								== CKYSUCCESS);
+    CHECK(CKYReader_GetEventState(&readers[0]) & SCARD_STATE_PRESENT);
+    CHECK(CKYReader_GetEventState(&readers[1]) & SCARD_STATE_PRESENT);
+    acceptState(readers, 2);
+
+    CHECK(CKYCardContext_WaitForStatusChange(ctx, readers, 2, 100) 
+								== CKYSCARDERR);
+    CHECK(CKYCardContext_GetLastError(ctx) == SCARD_E_TIMEOUT);
+
+    kill(server, SIGUSR1);
+    CHECK(CKYCardContext_WaitForStatusChange(ctx, readers, 2, 5000) 
+								== CKYSUCCESS);
+    CHECK(CKYReader_GetEventState(&readers[0]) & SCARD_STATE_EMPTY);
+    CHECK(CKYReader_GetEventState(&readers[0]) & SCARD_STATE_CHANGED);
+    CHECK(!(CKYReader_GetEventState(&readers[1]) & SCARD_STATE_CHANGED));
+    CHECK(exchange(conn, 0x00, 0xa4, 0x04, &response) == CKYSCARDERR);
+    CHECK(CKYCardConnection_GetLastError(conn) == SCARD_W_REMOVED_CARD);
+    acceptState(readers, 2);
+
+    kill(server, SIGUSR1);
+    CHECK(CKYCardContext_WaitForStatusChange(ctx, readers, 2, 5000) 
+								== CKYSUCCESS);
+    CHECK(CKYReader_GetEventState(&readers[0]) & SCARD_STATE_PRESENT);
+    CHECK(CKYCardConnection_Reconnect(conn) == CKYSUCCESS);
+    CHECK(exchange(conn, 0x00, 0xa4, 0x04, &response) == CKYSUCCESS);
+    CHECK(isSuccess(&response));
+
+    CKYReader_FreeData(&readers[0]);
+    CKYReader_FreeData(&readers[1]);
+    CKYBuffer_FreeData(&response);
+}
+
+int
+main(int argc, char **argv)
+{
+    const char *mock = argc > 1 ? argv[1] : "./mock-pcscd";
+    char dir[] = "/tmp/pcscd-test-XXXXXX";
+    char socketName[64], cardName[64], reader0[96], reader1[96];
+    CKYCardContext *ctx;
+    CKYCardConnection *conn;
+    pid_t server;
+    int status;
+
+    if (!mkdtemp(dir)) {
+	perror("mkdtemp");
+	return 1;
+    }
+    sprintf(socketName, "%s/pcscd.comm", dir);
+    sprintf(cardName, "%s/card", dir);
+    sprintf(reader0, READER0 "=%s", cardName);
+    sprintf(reader1, READER1 "=%s", cardName);
+    if (!writeCard(cardName)) {
+	perror(cardName);
+	return 1;
+    }
+
+    server = fork();
+    if (server < 0) {
+	perror("fork");
+	return 1;
+    }
+    if (server == 0) {
+	execl(mock, mock, "-m", "2", socketName, reader0, reader1, 
+							(char *)NULL);
+	perror(mock);
+	_exit(127);
+    }
+    if (!waitForServer(socketName)) {
+	fprintf(stderr, "pcscd-test: %s didn't start\n", mock);
+	kill(server, SIGTERM);
+	return 1;
+    }
+
+    setenv("CKY_PCSCD_SOCKET", socketName, 1);
+    unsetenv("CKY_APDU_REPLAY_FILE");
+    unsetenv("CKY_APDU_RECORD_FILE");
+
+    ctx = CKYCardContext_Create(SCARD_SCOPE_USER);
+    CHECK(ctx != NULL);
+    if (ctx) {
+	checkReaders(ctx);
+	conn = CKYCardConnection_Create(ctx);
+	CHECK(conn != NULL);
+	if (conn) {
+	    CHECK(CKYCardConnection_Connect(conn, READER0) == CKYSUCCESS);
+	    checkCard(conn);
+	    checkThreads();
+	    checkEvents(ctx, conn, server);
+	    CKYCardConnection_Destroy(conn);
+	}
+	CKYCardContext_Destroy(ctx);
+    }
+
+    kill(server, SIGTERM);
+    waitpid(server, &status, 0);
+    unlink(cardName);
+    unlink(socketName);
+    rmdir(dir);
+
+    if (failures) {
+	fprintf(stderr, "pcscd-test: %d failures\n", failures);
+	return 1;
+    }
+    printf("pcscd-test: ok\n");
+    return 0;
+}